@@ -0,0 +1,15 @@
+QT += core network
+QT -= gui
+CONFIG += c++11 console
+CONFIG -= app_bundle
+TEMPLATE = app
+TARGET = parserbench
+
+# 与服务器共用协议实现
+COMMON_DIR = $$PWD/../server/common
+include($$COMMON_DIR/common.pri)
+
+INCLUDEPATH += $$PWD/src
+
+SOURCES += \
+    src/main.cpp
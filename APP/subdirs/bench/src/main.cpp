@@ -0,0 +1,175 @@
+// drainPackets 吞吐微基准：对比逐包 left()/remove(0,n) 的旧解析与当前读游标解析
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include "protocol.h"
+
+namespace {
+
+const int kLenFieldSize = 4;
+const int kTypeSize     = 2;
+const int kJsonSizeSize = 4;
+
+// 读游标改造前的实现（原样保留作对照）：每包 left() 拷出、remove(0,n) 搬移剩余缓冲、QDataStream 解头
+bool legacyDrainPackets(QByteArray& buffer, QVector<Packet>& out)
+{
+    bool produced = false;
+
+    for (;;) {
+        if (buffer.size() < kLenFieldSize) break;
+
+        quint32 length = 0;
+        {
+            QDataStream peek(buffer.left(kLenFieldSize));
+            peek.setByteOrder(QDataStream::BigEndian);
+            peek >> length;
+        }
+
+        if (length < static_cast<quint32>(kTypeSize + kJsonSizeSize) ||
+            length > kMaxPacketLen) {
+            buffer.clear();
+            break;
+        }
+
+        const int totalNeed = kLenFieldSize + static_cast<int>(length);
+        if (buffer.size() < totalNeed) break;
+
+        QByteArray block = buffer.left(totalNeed);
+        buffer.remove(0, totalNeed);
+
+        QDataStream ds(block);
+        ds.setByteOrder(QDataStream::BigEndian);
+
+        quint32 lenField = 0; ds >> lenField; Q_UNUSED(lenField);
+        quint16 type = 0;     ds >> type;
+        quint32 jsonSize = 0; ds >> jsonSize;
+
+        const int payloadBytes = totalNeed - kLenFieldSize - kTypeSize - kJsonSizeSize;
+        if (jsonSize > static_cast<quint32>(payloadBytes) || jsonSize > kMaxJsonLen) {
+            continue;
+        }
+
+        QByteArray jsonBytes(jsonSize, Qt::Uninitialized);
+        if (jsonSize > 0) {
+            ds.readRawData(jsonBytes.data(), jsonBytes.size());
+        }
+        QByteArray bin;
+        const int binSize = payloadBytes - static_cast<int>(jsonSize);
+        if (binSize > 0) {
+            bin = block.right(binSize);
+        }
+
+        Packet pkt;
+        pkt.type = type;
+        pkt.json = fromJsonBytes(jsonBytes);
+        pkt.bin  = bin;
+        out.push_back(std::move(pkt));
+        produced = true;
+    }
+
+    return produced;
+}
+
+// 摄像头帧与 20ms 音频帧交错，模拟一个发送者积压在 ClientCtx::buffer 里的流
+QByteArray makeStream(int backlogBytes, int frameBytes)
+{
+    QByteArray jpeg(frameBytes, '\xAB');
+    QByteArray pcm(160, '\x7F');
+    QByteArray out;
+    out.reserve(backlogBytes + frameBytes);
+    quint32 seq = 0;
+    while (out.size() < backlogBytes) {
+        out += buildPacket(MSG_VIDEO_FRAME, QJsonObject{{"kind","camera"},{"seq",qint64(seq)},{"w",640},{"h",360}}, jpeg);
+        for (int k = 0; k < 3; ++k)
+            out += buildPacket(MSG_AUDIO_FRAME, QJsonObject{{"seq",qint64(seq * 3 + k)}}, pcm);
+        ++seq;
+    }
+    return out;
+}
+
+enum class Parser { Legacy, Cursor, CursorLazyJson };
+
+const char* parserName(Parser p)
+{
+    switch (p) {
+    case Parser::Legacy:         return "legacy left/remove";
+    case Parser::Cursor:         return "cursor, parse json";
+    case Parser::CursorLazyJson: return "cursor, lazy json";
+    }
+    return "";
+}
+
+// readBytes <= 0：整段积压一次到达；否则按每次 readyRead 读到 readBytes 字节追加后解析
+qint64 runOnce(Parser parser, const QByteArray& stream, int readBytes)
+{
+    QByteArray buffer;
+    QVector<Packet> pkts;
+    qint64 count = 0;
+    auto drain = [&]() {
+        pkts.clear();
+        if (parser == Parser::Legacy) legacyDrainPackets(buffer, pkts);
+        else drainPackets(buffer, pkts, parser == Parser::Cursor);
+        count += pkts.size();
+    };
+    if (readBytes <= 0) {
+        buffer = stream;
+        buffer.detach();
+        drain();
+        return count;
+    }
+    for (int pos = 0; pos < stream.size(); pos += readBytes) {
+        buffer.append(stream.constData() + pos, qMin(readBytes, stream.size() - pos));
+        drain();
+    }
+    return count;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("rt-meeting-parserbench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("drainPackets throughput: legacy per-packet remove(0,n) vs read cursor");
+    parser.addHelpOption();
+    QCommandLineOption backlogOpt("backlog", "Bytes of queued packets per run.", "bytes", QString::number(3 * 1024 * 1024));
+    QCommandLineOption frameOpt("frame", "Camera JPEG payload bytes.", "bytes", QString::number(48 * 1024));
+    QCommandLineOption readOpt("read", "Bytes per simulated socket read in the streaming case.", "bytes", QString::number(64 * 1024));
+    QCommandLineOption secOpt("sec", "Minimum seconds per case.", "sec", "1");
+    parser.addOptions({backlogOpt, frameOpt, readOpt, secOpt});
+    parser.process(app);
+
+    const int backlog = qMax(1024, parser.value(backlogOpt).toInt());
+    const int frame   = qMax(1, parser.value(frameOpt).toInt());
+    const int read    = qMax(kLenFieldSize, parser.value(readOpt).toInt());
+    const qint64 minMs = qMax(1, parser.value(secOpt).toInt()) * 1000;
+
+    const QByteArray stream = makeStream(backlog, frame);
+    QTextStream outStream(stdout);
+    outStream << "stream " << stream.size() << " bytes, camera payload " << frame
+              << " bytes, streaming reads of " << read << " bytes\n";
+
+    for (int readBytes : {0, read}) {
+        for (Parser p : {Parser::Legacy, Parser::Cursor, Parser::CursorLazyJson}) {
+            qint64 packets = 0, runs = 0;
+            QElapsedTimer t;
+            t.start();
+            while (t.elapsed() < minMs) {
+                packets += runOnce(p, stream, readBytes);
+                ++runs;
+            }
+            const double sec = t.nsecsElapsed() / 1e9;
+            outStream << QString("%1  %2  %3 pkt/s  %4 MB/s\n")
+                         .arg(readBytes <= 0 ? QStringLiteral("backlog  ") : QStringLiteral("streaming"))
+                         .arg(QString::fromLatin1(parserName(p)), -20)
+                         .arg(packets / sec, 12, 'f', 0)
+                         .arg(runs * double(stream.size()) / sec / (1024 * 1024), 8, 'f', 1);
+            outStream.flush();
+        }
+    }
+    return 0;
+}
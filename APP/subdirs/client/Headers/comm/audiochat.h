@@ -4,12 +4,18 @@
 #include "clientconn.h"
 #include "protocol.h"
 
+class UdpMediaClient;
+
+// 语音：20ms µ-law 帧，优先走 UDP 媒体通道，UDP 未注册时退回 TCP MSG_AUDIO_FRAME（两路共用 seq）
+// 接收端每个发送者一个自适应抖动缓冲：按 seq 排序，目标深度随到达抖动伸缩，
+// 缺帧用上一帧衰减重复掩盖，积压超出目标时丢帧追回延迟
 class AudioChat : public QObject {
     Q_OBJECT
 public:
     explicit AudioChat(ClientConn* conn, QObject* parent = nullptr);
 
     void setIdentity(const QString& roomId, const QString& sender);
+    void setUdpClient(UdpMediaClient* udp);
 
     void setEnabled(bool on);
     bool isEnabled() const { return enabled_; }
@@ -22,13 +28,17 @@ public:
 
     void setPeerGain(const QString& sender, float g) { peerGain_[sender] = qBound(0.0f, g, 2.0f); }
     float peerGain(const QString& sender) const { return peerGain_.value(sender, 1.0f); }
-    void dropPeer(const QString& sender) { rxQueues_.remove(sender); peerGain_.remove(sender); }
+    void dropPeer(const QString& sender) { peers_.remove(sender); peerGain_.remove(sender); }
 
 public slots:
     void onPacket(Packet p);
+    void onUdpAudio(const QString& sender, QByteArray payload, quint8 codec, quint32 seq, qint64 ts);
 
 signals:
     void micStateChanged(bool on);
+    // 一帧写进输出设备；ts 为发送端采集时刻（服务器时钟，未同步为 0），
+    // 已按输出设备里排在它前面的时长折算，可直接与本端服务器时钟比较得到口到耳延迟
+    void framePlayed(const QString& sender, qint64 ts);
 
 private:
     static constexpr int   kSampleRate      = 8000;
@@ -37,7 +47,29 @@ private:
     static constexpr int   kFrameSamples    = kSampleRate * kFrameMs / 1000;
     static constexpr int   kPcmBytesPerFrm  = kFrameSamples * 2;
     static constexpr int   kUlawBytesPerFrm = kFrameSamples;
-    static constexpr int   kMaxQueueFrames  = 50;
+    static constexpr int   kMinDepthFrames  = 2;   // 抖动缓冲目标深度下限（40ms）
+    static constexpr int   kMaxDepthFrames  = 6;   // 上限（120ms），再抖也不多等
+    static constexpr int   kMaxConcealFrames = 5;  // 连续掩盖这么多帧仍无数据则停播重新缓冲
+    static constexpr int   kOutLeadFrames   = 3;   // 输出设备里最多预写的帧数
+    static constexpr int   kResetFrames     = 250; // seq 跳变超过 5s 视为对端重启
+
+    struct Frame {
+        QByteArray pcm;
+        qint64 ts = 0;
+    };
+    // 每个发送者的抖动缓冲
+    struct PeerBuffer {
+        QMap<quint32, Frame> frames;  // seq -> 一帧 PCM；seq 回绕前 QMap 顺序即播放顺序
+        bool    playing = false;      // 已缓冲到目标深度、正在出帧
+        quint32 nextSeq = 0;
+        QByteArray lastPcm;           // 掩盖用：上一帧（逐次衰减）
+        int     concealRun = 0;
+        int     targetFrames = kMinDepthFrames;
+        double  jitterMs = 0;         // 到达抖动（RFC 3550 式平滑），媒体时间按 seq * 20ms
+        quint32 lastSeq = 0;
+        qint64  lastArrivalMs = 0;
+        quint64 late = 0, concealed = 0, dropped = 0;
+    };
 
     static quint8  linearToUlaw(qint16 pcm);
     static qint16  ulawToLinear(quint8 ul);
@@ -48,9 +80,13 @@ private:
     void onMicReadyRead();
     void mixTick();
 
-    void shrinkQueueIfNeeded(QByteArray& q);
+    void push(const QString& sender, quint32 seq, qint64 ts, QByteArray pcm);
+    // 取该发送者下一帧（可能是掩盖帧）；false = 这一拍静音
+    bool pop(PeerBuffer& b, QByteArray* pcm, qint64* ts);
+    QByteArray decode(quint8 codec, const QByteArray& bin) const;
 
     ClientConn* conn_ = nullptr;
+    UdpMediaClient* udp_ = nullptr;
     QString roomId_;
     QString sender_;
     quint32 seq_ = 0;
@@ -62,7 +98,7 @@ private:
     QIODevice*    outDev_   = nullptr;
     QAudioFormat  outFmt_;
     QTimer        mixTimer_;
-    QHash<QString, QByteArray> rxQueues_;
+    QHash<QString, PeerBuffer> peers_;
     bool  enabled_       = false;
     float playbackGain_  = 1.0f;
     float micGain_       = 1.0f;
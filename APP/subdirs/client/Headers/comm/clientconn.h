@@ -9,12 +9,35 @@ public:
     explicit ClientConn(QObject* parent=nullptr);
     void connectTo(const QString& host, quint16 port);
     void send(quint16 type, const QJsonObject& json, const QByteArray& bin = QByteArray());
+    // 二进制媒体头发送（仅在 mediaHeaderEnabled() 时使用）
+    void sendMedia(quint16 type, const MediaHeader& mh, const QByteArray& bin);
 
     // 新增：主动断开与服务器的连接
     void disconnectFromServer();
 
     bool isConnected() const { return sock_.state() == QAbstractSocket::ConnectedState; }
-    qint64 bytesToWrite() const { return sock_.bytesToWrite(); }
+    // 含各优先级通道里尚未交给 socket 的字节
+    qint64 bytesToWrite() const { return sock_.bytesToWrite() + queued_; }
+
+    // 入会 ack 协商结果：服务器支持时媒体帧改用二进制定长头
+    bool mediaHeaderEnabled() const { return protoVer_ >= 2 && streamId_ != 0; }
+    quint32 streamId() const { return streamId_; }
+    QString userForStream(quint32 id) const { return streamUsers_.value(id); }
+    // 最近一次成员快照里的房间成员（含自己）
+    QStringList roomMembers() const { return members_; }
+    // 协议版本 >= 3：大包按分片发送，可被音频/控制插队
+    bool fragmentsEnabled() const { return protoVer_ >= 3; }
+    // 协议版本 >= 4：服务器按 MSG_SUBSCRIBE 过滤转发给本端的视频
+    bool subscriptionsEnabled() const { return protoVer_ >= 4; }
+    // 协议版本 >= 5：摄像头按多层联播发送，服务器替接收者选层
+    bool simulcastEnabled() const { return protoVer_ >= 5 && mediaHeaderEnabled(); }
+
+    // 协议版本 >= 6：与服务器做时钟同步，本地时钟 + offset = 服务器时钟
+    // 同步后 sendMedia 发出的 ts 换算成服务器时钟，并带上时间戳扩展由服务器写入转发耗时
+    bool clockSynced() const { return clockSynced_; }
+    qint64 hubNowMs() const { return QDateTime::currentMSecsSinceEpoch() + clockOffsetMs_; }
+    qint64 clockOffsetMs() const { return clockOffsetMs_; }
+    qint64 clockRttMs() const { return clockRttMs_; }
 
 signals:
     void connected();
@@ -26,8 +49,50 @@ private slots:
     void onConnected();
     void onDisconnected();
     void onError(QAbstractSocket::SocketError);
+    void pump();
+    void sendClockSync();
 
 private:
+    void trackServerEvent(const Packet& p);
+    void onClockSync(const Packet& p);
+    void resetClock();
+    void enqueue(const QByteArray& wire);
+    void clearLanes();
+
+    // 出站优先级通道：control > audio > annotation > video > file
+    struct OutItem {
+        QByteArray wire;
+        int staged = 0;     // 已交给 socket 的字节
+        quint32 fragId = 0; // 0 = 未分片
+    };
+
     QTcpSocket sock_;
     QByteArray buf_;
+    int     protoVer_{1};
+    quint32 streamId_{0};
+    QHash<quint32, QString> streamUsers_;
+    QStringList members_;
+    QQueue<OutItem> lanes_[LANE_COUNT];
+    qint64  queued_{0};
+    quint32 nextFragId_{1};
+    FragmentAssembler frags_;
+
+    // 时钟同步：保留最近几次采样，取往返最短的一次（排队最少，偏移估计最准）
+    struct ClockSample {
+        qint64 rtt = 0;
+        qint64 offset = 0;
+    };
+    QTimer  clockTimer_;
+    QVector<ClockSample> clockSamples_;
+    int     clockProbes_{0};
+    qint64  clockOffsetMs_{0};
+    qint64  clockRttMs_{-1};
+    bool    clockSynced_{false};
+
+    // socket 写缓冲低于该值才继续出队；越小，插队的音频等得越短
+    static constexpr qint64 kWriteLowWater = 32 * 1024;
+    static constexpr int kClockSamples     = 8;
+    static constexpr int kClockFastProbes  = 5;     // 入会后先快速探测几次
+    static constexpr int kClockFastMs      = 500;
+    static constexpr int kClockSlowMs      = 10000;
 };
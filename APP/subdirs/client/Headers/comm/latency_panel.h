@@ -0,0 +1,33 @@
+#pragma once
+
+#include <QWidget>
+
+class LatencyStats;
+class ClientConn;
+class QLabel;
+class QTableWidget;
+class QTimer;
+
+// 延迟统计面板：按画面/阶段显示 p50/p95/p99，可清零、导出 CSV/JSON
+class LatencyPanel : public QWidget
+{
+    Q_OBJECT
+public:
+    LatencyPanel(LatencyStats* stats, const ClientConn* conn, QWidget* parent = nullptr);
+
+public slots:
+    void refresh();
+
+protected:
+    void showEvent(QShowEvent* ev) override;
+    void hideEvent(QHideEvent* ev) override;
+
+private:
+    void onExport();
+
+    LatencyStats*     stats_{nullptr};
+    const ClientConn* conn_{nullptr};
+    QLabel*       clockLabel_{nullptr};
+    QTableWidget* table_{nullptr};
+    QTimer*       timer_{nullptr};
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include <QtCore>
+
+// ===============================================
+// 端到端媒体延迟统计（客户端，按远端画面分别统计）
+// 各阶段单独一张直方图：
+// - uplink  : 采集 -> 服务器收到（发送端编码、排队与上行网络）
+// - hub     : 服务器收到 -> 交给内核（扇出排队）
+// - downlink: 服务器发出 -> 本端显示（下行网络、解码与绘制）
+// - total   : 采集 -> 本端显示（glass-to-glass）
+// 时刻统一换算到服务器时钟（ClientConn 时钟同步），发送端未同步的帧不计入
+// 语音按 发送者/audio 单独一项，只记 total（采集 -> 写入输出设备并折算设备缓冲，即口到耳）
+// ===============================================
+enum LatencyStage { LAT_UPLINK = 0, LAT_HUB, LAT_DOWNLINK, LAT_TOTAL, LAT_STAGE_COUNT };
+
+class LatencyHistogram {
+public:
+    void add(qint64 ms);
+    void clear();
+
+    quint64 count() const { return count_; }
+    qint64 maxMs() const { return max_; }
+    double meanMs() const { return count_ ? double(sum_) / double(count_) : 0.0; }
+    // p: 0~100，返回所在档的上界
+    qint64 percentile(double p) const;
+
+    QJsonObject toJson() const;
+
+private:
+    // 0~199 ms 每 1 ms 一档，200 ms~2 s 每 10 ms 一档，更大的计入最后一档
+    static constexpr int kFine    = 200;
+    static constexpr int kCoarse  = 180;
+    static constexpr int kBuckets = kFine + kCoarse + 1;
+    static int bucketOf(qint64 ms);
+    static qint64 bucketUpper(int b);
+
+    quint32 buckets_[kBuckets] = {};
+    quint64 count_ = 0;
+    qint64  sum_ = 0;
+    qint64  max_ = 0;
+};
+
+class LatencyStats {
+public:
+    // TCP 媒体帧：ts/displayMs 为服务器时钟；hubTimes 为 false 时只记 total
+    void addFrame(const QString& tile, qint64 ts, qint32 hubInMs, qint32 hubQueueMs,
+                  qint64 displayMs, bool hubTimes);
+
+    QStringList tiles() const { return tiles_.keys(); }
+    const LatencyHistogram& histogram(const QString& tile, LatencyStage stage) const;
+    void removeTile(const QString& tile) { tiles_.remove(tile); }
+    void clear() { tiles_.clear(); }
+
+    QJsonObject toJson() const;
+    QString toCsv() const;
+
+    static const char* stageName(LatencyStage stage);
+
+    // 画面 key：发送者 + 媒体类型
+    static QString tileKey(const QString& sender, const QString& media) { return sender + QLatin1Char('/') + media; }
+
+private:
+    struct Tile {
+        LatencyHistogram h[LAT_STAGE_COUNT];
+    };
+    QMap<QString, Tile> tiles_;
+};
@@ -15,8 +15,10 @@
 #include "clientconn.h"
 #include "audiochat.h"
 #include "screenshare.h"
+#include "latencystats.h"
 
 class AnnotCanvas;
+class QCheckBox;
 class QComboBox;
 class QColorDialog;
 class QLineEdit;
@@ -32,6 +34,7 @@ class UdpMediaClient;
 
 // [KB] 前向声明：避免在头文件里包含 knowledge_panel.h
 class KnowledgePanel;
+class LatencyPanel;
 
 struct VideoTile {
     QWidget* box = nullptr;
@@ -84,6 +87,9 @@ private slots:
     // [KB] 新增：打开“企业知识库”面板
     void onOpenKnowledge();
 
+    // 端到端延迟统计面板
+    void onOpenLatency();
+
 private:
     QToolButton *btnAnnotOn_{};
         QComboBox   *cbAnnotTool_{};
@@ -108,6 +114,9 @@ private:
     QImage makeImageFromFrame(const QVideoFrame &frame);
     void updateLocalPreview(const QImage& img);
     void sendImage(const QImage& img);
+    void sendCameraLayer(const QImage& scaled, int quality, int layer, bool simulcast);
+    // 经 UDP 发一帧；UDP 还没注册时返回 false，由调用方走 TCP
+    bool sendCameraUdp(const QImage& scaled);
 
     enum class ViewMode { Grid, Focus };
     ViewMode currentMode() const;
@@ -132,8 +141,14 @@ private:
 
     void applyAdaptiveByMembers(int members);
 
+    // 按当前布局（主画面/缩略图/可见性）向服务器更新视频订阅，内容不变时不重发
+    void updateSubscriptions();
+
     void applyShareQualityPreset();
 
+    // 远端画面刚显示：ts 为服务器时钟的采集时刻，按画面记一次端到端延迟
+    void recordDisplayLatency(const QString& sender, const QString& media, const Packet* p, qint64 ts);
+
 private:
     QLineEdit *edHost{};
     QLineEdit *edPort{};
@@ -145,6 +160,7 @@ private:
     QPushButton *btnMic_{};
     QPushButton *btnShare_{};
     QComboBox  *cbShareQ_{};
+    QCheckBox  *cbCamUdp_{};   // 摄像头走 UDP 媒体通道（未注册时仍走 TCP）
     QPushButton *btnLeave_{};  // 新增：退出房间按钮
 
     QStackedWidget* centerStack_{};
@@ -176,12 +192,23 @@ private:
     int jpegQuality_{60};
     QSize sendSize_{640, 480};
     QElapsedTimer lastSend_;
+    quint32 camSeq_{0};
+    QByteArray lastSubs_;
+    static constexpr int kThumbCamFps    = 3; // 专注模式下缩略图的摄像头帧率上限
+    static constexpr int kThumbScreenFps = 1;
+    // 联播低两层的尺寸/质量；最高层使用 sendSize_/jpegQuality_
+    static QSize simulcastSize(int layer) { return layer == LAYER_THUMB ? QSize(160, 120) : QSize(320, 240); }
+    static int simulcastQuality(int layer) { return layer == LAYER_THUMB ? 45 : 55; }
     QVideoFrame::PixelFormat lastLoggedFormat_{QVideoFrame::Format_Invalid};
 
     QHash<QString, QImage> screenBack_;
+    QHash<QString, quint32> screenFid_; // 背板当前对应的发送端帧号；0 = 背板不可信，等关键帧
 
     // [KB] 新增：知识库面板（防止重复创建）
     QPointer<KnowledgePanel> kbPanel_;
+
+    LatencyStats latency_;
+    QPointer<LatencyPanel> latencyPanel_;
 };
 
 #endif // MAINWINDOW_H
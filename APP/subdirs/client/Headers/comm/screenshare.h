@@ -13,11 +13,12 @@ public:
     explicit ScreenShare(ClientConn* conn, QObject* parent=nullptr);
 
     void setIdentity(const QString& roomId, const QString& sender);
-    void setUdpClient(UdpMediaClient* udp) { udp_ = udp; }
+    void setUdpClient(UdpMediaClient* udp);
 
     void setEnabled(bool on);
     bool isEnabled() const { return enabled_; }
 
+    // 用户预设是上限；拥塞时按带宽估计逐档降低分辨率、帧率、质量并拉长关键帧间隔
     void setParams(const QSize& sendBaseSize, int baseFps, int jpegQuality);
 
 signals:
@@ -26,12 +27,28 @@ signals:
 private slots:
     void onTick();
     void onEncodedKeyframe(QByteArray jpeg, QSize wh, qint64 encodeMs);
+    void onSendBudget(int kbps);
+    // 接收端缺基准帧：下一拍直接发关键帧
+    void onKeyframeRequested();
 
 private:
     void sendControl(const char* state);
     void scheduleNext();
     QSize clampMin720p(const QSize& in) const;
-    QByteArray buildDeltaBlob(const QImage& prev, const QImage& curr, int block) const;
+    QByteArray buildDeltaBlob(const QImage& prev, const QImage& curr, int block, quint32 baseFid) const;
+    // 按档位从预设算出实际的帧间隔、质量、发送尺寸与关键帧间隔
+    void applyLevel(int level);
+
+    // 降档表：带宽估计不低于 minKbps 时可用该档
+    struct Level {
+        int minKbps;
+        int scalePct;      // 相对预设尺寸
+        int fps;           // 帧率上限
+        int qualityDrop;   // 相对预设质量
+        int keyIntervalMs;
+    };
+    static const Level kLevels[];
+    static const int kLevelCount;
 
     ClientConn*     conn_{};
     UdpMediaClient* udp_{nullptr};
@@ -41,13 +58,20 @@ private:
     int     intervalMs_{33};
     QSize   baseSendSize_{1280, 720};
     int     baseQuality_{50};
+    int     presetIntervalMs_{33};   // setParams 给的上限
+    int     presetQuality_{50};
+    QSize   sendSize_{1280, 720};    // 当前档位的发送尺寸
+    int     level_{0};
+    qint64  levelMs_{0};
     QThread worker_;
     class KeyEncoder* encoder_{nullptr};
     QAtomicInt keyBusy_{0};
     bool    enabled_{false};
     qint64  lastKeyMs_{0};
-    int     keyIntervalMs_{1000};
+    int     keyIntervalMs_{10000};
     QImage  prevFrame_;
+    quint32 prevFid_{0};       // prevFrame_ 发出时的帧号，即下一个增量帧的基准
+    bool    forceKey_{false};
 };
 
 class KeyEncoder : public QObject {
@@ -3,48 +3,158 @@
 #include <QtNetwork>
 #include <algorithm>
 
+class ClientConn;
+
+// 屏幕共享 UDP 通道（格式见服务器 udprelay.h，v3）
+// - 注册后中继回一个 32 位流 id，分片只带流 id 与固定 29B 头
+// - 中继下发 流 id -> 用户名 的成员表，收到的分片按 (流 id, 帧号) 重组
+// - 缺片/缺帧向中继发 NACK，中继从重传缓存补发；同一发送者的帧按帧号顺序交付，
+//   增量帧不会越过还在补洞的前一帧
+// - 前向纠错：每帧按交错分组追加 XOR 校验片，每组可就地恢复一片；
+//   冗余度由各接收端每秒上报的丢片率（取最差者）决定，高 RTT 链路上不必等重传
+// - 发送节奏：屏幕分片进令牌桶队列，按目标码率匀速发出（单帧最迟在一个帧间隔内发完），
+//   不再把整个关键帧一次性灌进路由器/中继的缓冲；注册、NACK、报告等控制包不排队
+// - 拥塞控制：接收报告带丢片率、到达抖动、排队时延与实收码率；发送端每秒按最差的接收端
+//   调整估计带宽（丢包/时延上升则乘性下降，干净则缓慢上探），用作节拍码率并通知 ScreenShare 降档
+// - 关键帧请求：接收端缺了增量帧的基准帧时经中继通知发送端，发送端立即补关键帧
+// - 音频：每 20ms 一帧单个数据报，不排进令牌桶、不补洞；抖动与丢包交给 AudioChat 的抖动缓冲
+// - 摄像头：与屏幕同样分片（codec CAMERA，独立帧号序列），但只按帧取舍：不 NACK、不排序，
+//   收齐一帧即交付并丢弃更旧的残帧；发送端新帧入队时撤下还没发完的旧帧
 class UdpMediaClient : public QObject {
     Q_OBJECT
 public:
-    enum Codec : quint8 { JPEG = 0, DELTA = 1 };
+    enum Codec : quint8 { JPEG = 0, DELTA = 1, CAMERA = 2 };
 
     explicit UdpMediaClient(QObject* parent=nullptr);
 
     void configureServer(const QString& host, quint16 port);
     void setIdentity(const QString& roomId, const QString& user);
     void stop();
+    // 时钟同步来源：同步后发出的 ts 换算成服务器时钟，并在头部保留字段置 kFlagHubClock
+    void setClock(const ClientConn* conn) { clock_ = conn; }
 
-    void sendScreenJpeg(const QByteArray& jpeg, int w, int h, qint64 tsMs = 0);
-    void sendScreenDelta(const QByteArray& blob, int w, int h, qint64 tsMs = 0);
+    // 返回该帧的帧号（增量帧的基准即引用它）；没有流 id 未发出时返回 0
+    quint32 sendScreenJpeg(const QByteArray& jpeg, int w, int h, qint64 tsMs = 0);
+    quint32 sendScreenDelta(const QByteArray& blob, int w, int h, qint64 tsMs = 0);
+    // 摄像头 JPEG；没有流 id 未发出时返回 0，调用方改走 TCP
+    quint32 sendCameraJpeg(const QByteArray& jpeg, int w, int h, qint64 tsMs = 0);
+    // 请 sender 立即发一个关键帧（同一发送者限频）
+    void requestKeyframe(const QString& sender);
+    // 音频帧直接发出；还没有流 id 时返回 false，调用方改走 TCP
+    bool sendAudio(quint32 seq, quint8 codec, const QByteArray& payload, qint64 tsMs);
+    // 已注册且 users（除 self 外）都在中继成员表里：此时只走 UDP 也不会漏掉接收者
+    bool reachesAll(const QStringList& users, const QString& self) const;
+    // 屏幕分片的目标发送码率（kbps）；队列积压超过一个帧间隔时自动提速。
+    // 有接收报告后由带宽估计接管
+    void setTargetBitrate(int kbps) { targetKbps_ = qBound<int>(kMinKbps, kbps, kMaxKbps); }
+    int targetBitrate() const { return targetKbps_; }
 
 signals:
-    void udpScreenFrame(const QString& sender, QByteArray jpeg, int w, int h, qint64 ts);
-    void udpScreenDeltaFrame(const QString& sender, QByteArray blob, int w, int h, qint64 ts);
+    // ts 为发送端换算后的服务器时钟；发送端未做时钟同步时为 0；fid 为发送端帧号
+    void udpScreenFrame(const QString& sender, QByteArray jpeg, int w, int h, qint64 ts, quint32 fid);
+    void udpScreenDeltaFrame(const QString& sender, QByteArray blob, int w, int h, qint64 ts, quint32 fid);
+    // 摄像头：只交付比上一次更新的完整帧
+    void udpCameraFrame(const QString& sender, QByteArray jpeg, int w, int h, qint64 ts);
+    void udpAudioFrame(const QString& sender, QByteArray payload, quint8 codec, quint32 seq, qint64 ts);
+    // 有接收端要关键帧
+    void keyframeRequested();
+    // 带宽估计变化超过 5% 时发出
+    void sendBudgetChanged(int kbps);
 
 private slots:
     void onReadyRead();
     void onHeartbeat();
+    // 补洞（NACK）与超时放弃
     void onCleanup();
+    // 按令牌发出排队的分片
+    void onPace();
 
 private:
     struct Assembly {
         quint8  codec = 0;
         int     w=0, h=0;
-        int     chunkCnt=0;
+        int     chunkCnt=0;     // 0 = 一片都没收到（由帧号缺口推断出的整帧丢失）
         qint64  ts=0;
         qint64  startMs=0;
+        qint64  lastMs=0;       // 最近一片到达时间
         QVector<QByteArray> parts;
         int     received=0;
+        int     highIdx=-1;     // 已收到的最大分片序号
+        int     nacks=0;
+        qint64  lastNackMs=0;
+        int     orig=0;         // 首次 NACK 之前收到的数据片，用于统计丢片率
+        bool    complete=false; // 已收齐，等更早的帧交付
+        QVector<QByteArray> parity; // 按组号
+    };
+    // 每个发送者的交付进度
+    struct StreamRx {
+        quint32 highFid = 0;    // 见过的最大帧号
+        quint32 doneFid = 0;    // 已交付或已放弃的最大帧号；更旧的分片（重复的重传）直接丢弃
+        quint32 expected = 0;   // 本报告周期出队的帧应有的数据片
+        quint32 got = 0;        // 其中原样到达的（不含 FEC 恢复与重传）
+        qint64  bytes = 0;      // 本周期收到的分片字节（含重传与校验片）
+        double  jitter = 0;     // 帧到达抖动（RFC 3550 式平滑，毫秒）
+        qint64  lastTransit = 0;
+        bool    haveTransit = false;
+        qint64  delaySum = 0;   // 本周期各帧单程时延之和（双方时钟都已同步时）
+        int     delayN = 0;
+    };
+    // 每个发送者的摄像头帧：各帧独立，残帧在更新的帧收齐或超时后丢弃
+    struct CameraRx {
+        quint32 shownFid = 0;   // 已交付的最新帧号
+        QHash<quint32, Assembly> partial;
+    };
+    // 某个接收端最近一次的报告
+    struct PeerReport {
+        int permille = 0;
+        int jitterMs = 0;
+        int rateKbps = 0;       // 0 = 对端未上报
+        int delayMs = -1;       // -1 = 未知
+        int minDelayMs = -1;    // 该接收端见过的最小时延，作为无排队基线
+        qint64 ms = 0;
     };
 
     void sendRegister();
     void parseDatagram(const QByteArray& dgram, const QHostAddress& from, quint16 port);
+    void parseRoster(const QByteArray& dgram);
+    quint32 sendChunks(const QByteArray& blob, quint8 codec, int w, int h, qint64 tsMs);
+    // 交错分组的 XOR 校验片，跟在数据片后入队
+    void sendParity(const QByteArray& blob, quint32 fid, int total, quint8 codec,
+                    int w, int h, qint64 ts, quint16 flags);
+    void enqueuePaced(const QByteArray& d);
+    // 一帧入队后按积压重算速率并启动节拍
+    void startPacer(qint64 now, bool camera);
+    void clearPacer();
+    // 收到不认识的流 id：借注册拿一份成员表（限频）
+    void requestRoster();
+    void resetStreams();
+    void onChunk(const QByteArray& dgram, quint16 flags);
+    void onAudio(const QByteArray& dgram, quint16 flags);
+    void onCameraChunk(const QByteArray& dgram, quint16 flags);
+    // 撤下令牌桶里还没发出的摄像头分片
+    void dropQueuedCamera();
+    // 组内只缺一片时用校验片恢复
+    void recoverFec(Assembly& as);
+    void sendReports(qint64 now);
+    void onReport(const QByteArray& dgram, qint64 now);
+    void updateFec(qint64 now);
+    // 按最新一轮报告调整 targetKbps_
+    void updateEstimate(qint64 now);
+    static void account(StreamRx& rx, const Assembly& as);
+    // 按帧号顺序交付该发送者已收齐的帧；dropThrough 非 0 时，不晚于它的未收齐帧一并放弃
+    void releaseFrames(quint32 stream, quint32 dropThrough = 0);
+    void sendNack(quint32 stream, quint32 fid, const QVector<quint16>& missing);
+    qint64 nackRetryMs() const;
+    static quint64 frameKey(quint32 stream, quint32 fid) { return (quint64(stream) << 32) | fid; }
 
     static QByteArray buildRegister(const QString& roomId, const QString& user);
-    static QByteArray buildVideoChunk(const QString& roomId, const QString& sender,
-                                      quint32 frameId, quint16 idx, quint16 cnt,
-                                      quint8 codec, int w, int h, qint64 ts,
+    static QByteArray buildVideoChunk(quint32 stream, quint32 frameId, quint16 idx, quint16 cnt,
+                                      quint8 codec, int w, int h, qint64 ts, quint16 flags,
                                       const char* payload, int len);
+    // 发出的 ts 与头部标志
+    qint64 wireTs(qint64 tsMs, quint16* flags) const;
+    // 头部只带毫秒时间戳的低 32 位：取与 nearMs 最接近的完整时刻
+    static qint64 unwrapTs(quint32 lo, qint64 nearMs);
 
     QUdpSocket sock_;
     QHostAddress serverAddr_{QHostAddress::LocalHost};
@@ -54,7 +164,62 @@ private:
     QTimer heartbeat_;
     QTimer cleanup_;
     quint32 frameSeq_{0};
-    QHash<QString, Assembly> reassem_;
+    quint32 streamId_{0};               // 中继分配；0 = 尚未收到注册应答，不发分片
+    QHash<quint32, QString> streamNames_; // 流 id -> 用户名
+    qint64 lastRosterAskMs_{0};
+    const ClientConn* clock_{nullptr};
+    QMap<quint64, Assembly> reassem_;   // (流 id << 32 | 帧号) -> 重组进度；有序，同一发送者的帧相邻
+    QHash<quint32, StreamRx> rx_;
+    QHash<quint32, CameraRx> cam_;      // 流 id -> 摄像头收帧
+    quint32 camFrameSeq_{0};
+    qint64 lastReportMs_{0};
+    QHash<quint32, PeerReport> peers_;  // 上报者流 id -> 最近报告
+    QHash<quint32, qint64> keyReqMs_;   // 流 id -> 上次请求关键帧的时间
+    int fecGroup_{0};                   // 每组数据片数；0 = 不发校验片
+    QQueue<QByteArray> paceQueue_;      // 待发的屏幕分片（含校验片），按帧顺序
+    qint64 paceQueueBytes_{0};
+    QTimer pacer_;
+    QElapsedTimer paceClock_;
+    qint64 lastPaceNs_{0};
+    double tokens_{0};                  // 字节
+    double paceRate_{0};                // 字节/秒
+    int targetKbps_{kStartKbps};
+    int announcedKbps_{kStartKbps};
+    qint64 lastFrameMs_{0};
+    int frameGapMs_{33};                // 相邻两个屏幕帧入队间隔（平滑）
+    qint64 camLastFrameMs_{0};
+    int camFrameGapMs_{83};             // 摄像头帧间隔（默认 12fps）
     enum { kChunkPayload = 1200 };
     static constexpr quint32 kMagic = 0x55444D31;
+    enum : quint8 { kVersion = 3 };
+    enum : quint8 { kRegister = 1, kChunk = 2, kRegisterAck = 3, kRoster = 4, kUnknownStream = 5,
+                    kNack = 6, kReport = 7, kKeyRequest = 8, kAudio = 9 };
+    enum { kHeaderSize = 8, kChunkHeaderSize = 29, kAudioHeaderSize = 21 };
+    static constexpr quint16 kFlagHubClock = 0x0001; // 头部保留字段：ts 为服务器时钟
+    static constexpr quint16 kFlagParity = 0x0002;   // 校验片：idx 为组号，负载 = 组描述 + XOR
+    enum { kParityHeader = 8 };                      // first u16 | stride u16 | count u16 | lenXor u16
+    enum {
+        kCleanupMs    = 20,   // 补洞检查间隔
+        kTailWaitMs   = 60,   // 帧尾缺片：最后一片之后等这么久仍没到才算丢
+        kMinNackRetryMs = 80, // 同一帧两次 NACK 的最小间隔（未同步时钟、不知 RTT 时用它）
+        kMaxNacks     = 3,
+        kGiveUpMs     = 1000, // 超过该时长仍未收齐的帧放弃
+        kMaxGapFrames = 16,   // 帧号缺口最多补这么多帧
+        kMaxNackIdx   = 512,
+        kReportMs     = 1000, // 接收报告周期
+        kMinReportChunks = 20,
+        kReportMaxAgeMs = 5000,
+        kPaceTickMs   = 2,    // 节拍；每拍最多发出约两拍的令牌
+        kPaceBurstBytes = 4 * (kChunkHeaderSize + kChunkPayload), // 空闲后允许的最小突发
+        kMaxFrameGapMs = 200,
+        kReportSize   = kHeaderSize + 18, // stream | reporter | loss u16 | jitter u16 | rate u32 | delay u16
+        kMinKbps      = 300,
+        kStartKbps    = 8000,
+        kMaxKbps      = 30000,
+        kQueueDelayMs = 80,   // 时延比基线高出这么多视为链路在排队
+        kJitterMs     = 40,
+        kKeyRequestMs = 500,  // 同一发送者两次关键帧请求的最小间隔
+        kCameraPartials = 4,  // 每个发送者最多同时拼这么多个摄像头帧
+        kCameraRestart = 1000 // 摄像头帧号倒退超过这么多视为对端重新编号
+    };
 };
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "audiochat.h"
+#include "udpmedia.h"
 
 static inline qint16 clamp16(int v) {
     if (v > 32767) return 32767;
@@ -32,8 +33,9 @@ qint16 AudioChat::ulawToLinear(quint8 u) {
 AudioChat::AudioChat(ClientConn* conn, QObject* parent)
     : QObject(parent), conn_(conn)
 {
-    // 混音定时器：按帧长输出
-    mixTimer_.setInterval(kFrameMs);
+    // 混音定时器：输出设备里只预写 kOutLeadFrames 帧，按半帧长补写，免得定时器抖一下就断音
+    mixTimer_.setTimerType(Qt::PreciseTimer);
+    mixTimer_.setInterval(kFrameMs / 2);
     connect(&mixTimer_, &QTimer::timeout, this, &AudioChat::mixTick);
     mixTimer_.start();
 
@@ -46,6 +48,12 @@ void AudioChat::setIdentity(const QString& roomId, const QString& sender) {
     sender_ = sender;
 }
 
+void AudioChat::setUdpClient(UdpMediaClient* udp) {
+    if (udp_) disconnect(udp_, nullptr, this, nullptr);
+    udp_ = udp;
+    if (udp_) connect(udp_, &UdpMediaClient::udpAudioFrame, this, &AudioChat::onUdpAudio);
+}
+
 void AudioChat::setEnabled(bool on) {
     if (enabled_ == on) return;
     enabled_ = on;
@@ -145,90 +153,222 @@ void AudioChat::onMicReadyRead() {
             ulaw[i] = static_cast<char>(linearToUlaw(s[i]));
         }
 
-        // 组包并发送
+        // 房间里其他人都在 UDP 中继上才只走 UDP：丢一帧只是一帧，不会像 TCP 重传那样拖住后面所有帧。
+        // 有人不在中继成员表里（UDP 被墙、还没注册上、旧客户端）就仍走 TCP，否则他们听不到
+        const quint32 seq = seq_++;
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        if (udp_ && conn_ && udp_->reachesAll(conn_->roomMembers(), sender_)
+            && udp_->sendAudio(seq, AUDIO_MULAW, ulaw, now)) continue;
+
+        // 组包并发送：协商过二进制媒体头时不再为每 20ms 帧构造 JSON
+        if (conn_ && conn_->mediaHeaderEnabled()) {
+            MediaHeader mh;
+            mh.kind     = MEDIA_AUDIO;
+            mh.codec    = AUDIO_MULAW;
+            mh.streamId = conn_->streamId();
+            mh.seq      = seq;
+            mh.ts       = quint64(now);
+            mh.w        = quint16(kSampleRate);
+            mh.h        = quint16(kChannels);
+            conn_->sendMedia(MSG_AUDIO_FRAME, mh, ulaw);
+            continue;
+        }
         QJsonObject j{
             {"roomId", roomId_},
             {"sender", sender_},
             {"codec",  "mulaw"},
             {"sr",     kSampleRate},
             {"ch",     kChannels},
-            {"seq",    static_cast<int>(seq_++)},
-            {"ts",     QDateTime::currentMSecsSinceEpoch()}
+            {"seq",    static_cast<qint64>(seq)},
+            {"ts",     now}
         };
         if (conn_) conn_->send(MSG_AUDIO_FRAME, j, ulaw);
     }
 }
 
-void AudioChat::shrinkQueueIfNeeded(QByteArray& q) {
-    const int maxBytes = kMaxQueueFrames * kPcmBytesPerFrm;
-    if (q.size() > maxBytes) {
-        q.remove(0, q.size() - maxBytes);
+QByteArray AudioChat::decode(quint8 codec, const QByteArray& bin) const {
+    // 一律整理成一帧 PCM16；长度不对的补零或截断，抖动缓冲按帧计数
+    QByteArray pcm(kPcmBytesPerFrm, '\0');
+    qint16* d = reinterpret_cast<qint16*>(pcm.data());
+    if (codec == AUDIO_MULAW) {
+        const int n = qMin(bin.size(), kFrameSamples);
+        const uchar* u = reinterpret_cast<const uchar*>(bin.constData());
+        for (int i = 0; i < n; ++i) d[i] = ulawToLinear(u[i]);
+    } else if (codec == AUDIO_PCM16) {
+        memcpy(d, bin.constData(), size_t(qMin(bin.size(), kPcmBytesPerFrm)));
+    } else {
+        return QByteArray();
     }
+    return pcm;
 }
 
 void AudioChat::onPacket(Packet p) {
     if (p.type != MSG_AUDIO_FRAME) return;
 
-    const QString roomId = p.json.value("roomId").toString();
-    const QString sender = p.json.value("sender").toString();
-    if (roomId.isEmpty() || sender.isEmpty()) return;
-    if (!roomId_.isEmpty() && roomId != roomId_) return;
+    QString sender;
+    quint8 codec = AUDIO_MULAW;
+    int sr = kSampleRate, ch = kChannels;
+    quint32 seq = 0;
+    qint64 ts = 0;
+    if (p.hasMedia) {
+        // 二进制媒体头：服务器只在本房间内转发，无需再比对 roomId
+        if (!conn_ || p.media.kind != MEDIA_AUDIO) return;
+        sender = conn_->userForStream(p.media.streamId);
+        codec  = p.media.codec;
+        sr = p.media.w;
+        ch = p.media.h;
+        seq = p.media.seq;
+        if (p.media.flags & kMediaFlagTiming) ts = qint64(p.media.ts);
+        if (sender.isEmpty()) return;
+    } else {
+        const QString roomId = p.json.value("roomId").toString();
+        sender = p.json.value("sender").toString();
+        if (roomId.isEmpty() || sender.isEmpty()) return;
+        if (!roomId_.isEmpty() && roomId != roomId_) return;
+        const QString c = p.json.value("codec").toString("mulaw").toLower();
+        if (c == "mulaw")      codec = AUDIO_MULAW;
+        else if (c == "pcm16") codec = AUDIO_PCM16;
+        else return;
+        sr = p.json.value("sr").toInt(kSampleRate);
+        ch = p.json.value("ch").toInt(kChannels);
+        seq = quint32(p.json.value("seq").toDouble());
+    }
     if (!sender_.isEmpty() && sender == sender_) return;
 
-    const QString codec = p.json.value("codec").toString("mulaw").toLower();
-    const int sr = p.json.value("sr").toInt(kSampleRate);
-    const int ch = p.json.value("ch").toInt(kChannels);
     if (sr != kSampleRate || ch != kChannels) {
         return;
     }
+    if (p.bin.isEmpty()) return;
 
-    QByteArray& q = rxQueues_[sender];
-    if (codec == "mulaw") {
-        const int n = p.bin.size();
-        if (n <= 0) return;
-        const uchar* u = reinterpret_cast<const uchar*>(p.bin.constData());
-        QByteArray pcm; pcm.resize(n * 2);
-        qint16* d = reinterpret_cast<qint16*>(pcm.data());
-        for (int i = 0; i < n; ++i) d[i] = ulawToLinear(u[i]);
-        q.append(pcm);
-    } else if (codec == "pcm16") {
-        q.append(p.bin);
-    } else {
-        return;
+    QByteArray pcm = decode(codec, p.bin);
+    if (!pcm.isEmpty()) push(sender, seq, ts, pcm);
+}
+
+void AudioChat::onUdpAudio(const QString& sender, QByteArray payload, quint8 codec, quint32 seq, qint64 ts) {
+    if (!sender_.isEmpty() && sender == sender_) return;
+    QByteArray pcm = decode(codec, payload);
+    if (!pcm.isEmpty()) push(sender, seq, ts, pcm);
+}
+
+void AudioChat::push(const QString& sender, quint32 seq, qint64 ts, QByteArray pcm) {
+    PeerBuffer& b = peers_[sender];
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    // 到达抖动：相邻两次到达的间隔与其 seq 差对应的采集间隔之差，发送端时钟不参与
+    const qint32 step = qint32(seq - b.lastSeq);
+    if (b.lastArrivalMs != 0 && qAbs(step) < kResetFrames) {
+        const qint64 d = (now - b.lastArrivalMs) - qint64(step) * kFrameMs;
+        b.jitterMs += (double(qAbs(d)) - b.jitterMs) / 16.0;
+    }
+    b.lastSeq = seq;
+    b.lastArrivalMs = now;
+    b.targetFrames = qBound(kMinDepthFrames, int(2.0 * b.jitterMs / kFrameMs) + 1, kMaxDepthFrames);
+
+    if (b.playing) {
+        const qint32 ahead = qint32(seq - b.nextSeq);
+        if (qAbs(ahead) >= kResetFrames) {
+            // 对端重启或长时间中断：从头缓冲
+            b.frames.clear();
+            b.playing = false;
+            b.lastPcm.clear();
+        } else if (ahead < 0) {
+            ++b.late; // 已经播过（或掩盖过）这一帧
+            return;
+        }
+    }
+    b.frames.insert(seq, Frame{pcm, ts}); // TCP/UDP 切换时同一 seq 可能各到一份，后到的覆盖
+
+    // 卡顿后一拥而上：远超上限的部分直接丢最旧的
+    while (b.frames.size() > kMaxDepthFrames + kMaxConcealFrames) {
+        auto first = b.frames.begin();
+        if (b.playing) b.nextSeq = first.key() + 1;
+        b.frames.erase(first);
+        ++b.dropped;
     }
-    shrinkQueueIfNeeded(q);
+}
+
+bool AudioChat::pop(PeerBuffer& b, QByteArray* pcm, qint64* ts) {
+    if (!b.playing) {
+        if (b.frames.size() < b.targetFrames) return false;
+        b.playing = true;
+        b.nextSeq = b.frames.firstKey();
+        b.concealRun = 0;
+    }
+    // 积压比目标多出两帧：丢最旧的一帧，每拍最多一帧，把播放延迟慢慢收回到目标
+    if (b.frames.size() > b.targetFrames + 2) {
+        auto first = b.frames.begin();
+        b.nextSeq = first.key() + 1;
+        b.frames.erase(first);
+        ++b.dropped;
+    }
+    // 缺口比能掩盖的还长：直接接到下一帧
+    if (!b.frames.isEmpty() && qint32(b.frames.firstKey() - b.nextSeq) > kMaxConcealFrames) {
+        b.nextSeq = b.frames.firstKey();
+    }
+
+    auto it = b.frames.find(b.nextSeq);
+    ++b.nextSeq;
+    if (it != b.frames.end()) {
+        *pcm = it->pcm;
+        *ts = it->ts;
+        b.lastPcm = it->pcm;
+        b.concealRun = 0;
+        b.frames.erase(it);
+        return true;
+    }
+
+    // 这一帧丢了或还没到
+    if (b.concealRun >= kMaxConcealFrames || b.lastPcm.isEmpty()) {
+        if (b.frames.isEmpty()) {
+            // 断流：停播，等重新攒够目标深度
+            b.playing = false;
+            b.lastPcm.clear();
+        }
+        return false;
+    }
+    // 重复上一帧并逐次减半，连续丢包时淡出而不是循环同一段声音
+    qint16* s = reinterpret_cast<qint16*>(b.lastPcm.data());
+    for (int i = 0; i < kFrameSamples; ++i) s[i] = qint16(s[i] / 2);
+    ++b.concealRun;
+    ++b.concealed;
+    *pcm = b.lastPcm;
+    *ts = 0;
+    return true;
 }
 
 void AudioChat::mixTick() {
     if (!audioOut_ || !outDev_) return;
 
+    // 设备里已排队的字节；只补到 kOutLeadFrames 帧，其余延迟都留给抖动缓冲按需伸缩
+    int queued = audioOut_->bufferSize() - audioOut_->bytesFree();
     int bytesFree = audioOut_->bytesFree();
-    while (bytesFree >= kPcmBytesPerFrm) {
+    while (bytesFree >= kPcmBytesPerFrm && queued + kPcmBytesPerFrm <= kOutLeadFrames * kPcmBytesPerFrm) {
         QByteArray out; out.resize(kPcmBytesPerFrm);
         qint16* outS = reinterpret_cast<qint16*>(out.data());
         for (int i = 0; i < kFrameSamples; ++i) outS[i] = 0;
+        const qint64 aheadMs = qint64(queued) * kFrameMs / kPcmBytesPerFrm;
 
-        // 逐路读取并按各自增益混合
-        for (auto it = rxQueues_.begin(); it != rxQueues_.end(); ++it) {
+        // 逐路取帧并按各自增益混合
+        for (auto it = peers_.begin(); it != peers_.end(); ++it) {
             const QString sender = it.key();
             const float   gain   = peerGain_.value(sender, 1.0f);
-            QByteArray&   q      = it.value();
-
-            if (q.size() >= kPcmBytesPerFrm) {
-                const qint16* inS = reinterpret_cast<const qint16*>(q.constData());
-                if (gain == 1.0f) {
-                    for (int i = 0; i < kFrameSamples; ++i) {
-                        int acc = static_cast<int>(outS[i]) + static_cast<int>(inS[i]);
-                        outS[i] = clamp16(acc);
-                    }
-                } else if (gain > 0.0f) {
-                    for (int i = 0; i < kFrameSamples; ++i) {
-                        int acc = static_cast<int>(outS[i]) + static_cast<int>(inS[i] * gain);
-                        outS[i] = clamp16(acc);
-                    }
-                } // gain==0 静音：跳过
-                q.remove(0, kPcmBytesPerFrm);
-            }
+            QByteArray pcm;
+            qint64 ts = 0;
+            if (!pop(it.value(), &pcm, &ts)) continue;
+
+            const qint16* inS = reinterpret_cast<const qint16*>(pcm.constData());
+            if (gain == 1.0f) {
+                for (int i = 0; i < kFrameSamples; ++i) {
+                    int acc = static_cast<int>(outS[i]) + static_cast<int>(inS[i]);
+                    outS[i] = clamp16(acc);
+                }
+            } else if (gain > 0.0f) {
+                for (int i = 0; i < kFrameSamples; ++i) {
+                    int acc = static_cast<int>(outS[i]) + static_cast<int>(inS[i] * gain);
+                    outS[i] = clamp16(acc);
+                }
+            } // gain==0 静音：跳过
+            if (ts > 0) emit framePlayed(sender, ts - aheadMs);
         }
 
         // 应用整体播放增益
@@ -242,5 +382,6 @@ void AudioChat::mixTick() {
         qint64 w = outDev_->write(out);
         if (w <= 0) break;
         bytesFree -= static_cast<int>(w);
+        queued += static_cast<int>(w);
     }
 }
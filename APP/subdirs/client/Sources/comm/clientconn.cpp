@@ -6,6 +6,8 @@ ClientConn::ClientConn(QObject* parent) : QObject(parent) {
     connect(&sock_, &QTcpSocket::disconnected,this, &ClientConn::onDisconnected);
     connect(&sock_, SIGNAL(error(QAbstractSocket::SocketError)),
             this,   SLOT(onError(QAbstractSocket::SocketError)));
+    connect(&sock_, &QTcpSocket::bytesWritten, this, &ClientConn::pump);
+    connect(&clockTimer_, &QTimer::timeout, this, &ClientConn::sendClockSync);
 }
 
 void ClientConn::connectTo(const QString& host, quint16 port) {
@@ -14,10 +16,62 @@ void ClientConn::connectTo(const QString& host, quint16 port) {
 
 void ClientConn::send(quint16 type, const QJsonObject& json, const QByteArray& bin) {
     if (sock_.state() == QAbstractSocket::ConnectedState) {
-        sock_.write(buildPacket(type, json, bin));
+        enqueue(buildPacket(type, json, bin));
     }
 }
 
+void ClientConn::sendMedia(quint16 type, const MediaHeader& mh, const QByteArray& bin) {
+    if (sock_.state() != QAbstractSocket::ConnectedState) return;
+    if (!clockSynced_) {
+        enqueue(buildMediaPacket(type, mh, bin));
+        return;
+    }
+    // 调用方按本地时钟打 ts；同步后统一换算成服务器时钟，接收端才能与自己的时钟比较
+    MediaHeader h = mh;
+    h.ts = quint64(qint64(mh.ts) + clockOffsetMs_);
+    h.flags |= kMediaFlagTiming;
+    enqueue(buildMediaPacket(type, h, bin));
+}
+
+void ClientConn::enqueue(const QByteArray& wire) {
+    OutItem it;
+    it.wire = wire;
+    lanes_[laneForWire(wire)].enqueue(it);
+    queued_ += wire.size();
+    pump();
+}
+
+void ClientConn::pump() {
+    // 只在 socket 写缓冲较空时出队，排队留在通道里，后到的高优先级帧才能插到前面
+    while (sock_.state() == QAbstractSocket::ConnectedState && sock_.bytesToWrite() < kWriteLowWater) {
+        int lane = 0;
+        while (lane < LANE_COUNT && lanes_[lane].isEmpty()) ++lane;
+        if (lane == LANE_COUNT) return;
+
+        OutItem& it = lanes_[lane].head();
+        const int size = it.wire.size();
+        int len = size - it.staged;
+        // 已开始分片的帧必须分片发完，重新入会协商出的版本只影响之后的帧
+        if ((fragmentsEnabled() && size > kFragmentThreshold) || it.fragId != 0) {
+            if (it.fragId == 0) {
+                if (nextFragId_ == 0) nextFragId_ = 1;
+                it.fragId = nextFragId_++;
+            }
+            len = qMin(kFragmentChunk, len);
+            sock_.write(buildFragmentHeader(it.fragId, quint32(it.staged), quint32(size), len));
+        }
+        sock_.write(it.wire.constData() + it.staged, len);
+        it.staged += len;
+        queued_ -= len;
+        if (it.staged >= size) lanes_[lane].dequeue();
+    }
+}
+
+void ClientConn::clearLanes() {
+    for (auto& q : lanes_) q.clear();
+    queued_ = 0;
+}
+
 // 新增：主动断开
 void ClientConn::disconnectFromServer() {
     if (sock_.state() == QAbstractSocket::ConnectedState ||
@@ -28,16 +82,106 @@ void ClientConn::disconnectFromServer() {
 }
 
 void ClientConn::onConnected()    { emit connected(); }
-void ClientConn::onDisconnected() { emit disconnected(); }
+void ClientConn::onDisconnected() {
+    protoVer_ = 1;
+    streamId_ = 0;
+    streamUsers_.clear();
+    members_.clear();
+    clearLanes();
+    frags_.clear();
+    resetClock();
+    emit disconnected();
+}
 
 void ClientConn::onReadyRead() {
     buf_.append(sock_.readAll());
     QVector<Packet> pkts;
     if (drainPackets(buf_, pkts)) {
-        for (auto& p : pkts) emit packetArrived(p);
+        for (auto& p : pkts) {
+            if (p.type == MSG_FRAGMENT) {
+                // 分片拼完后按普通线上帧再解析
+                QByteArray whole;
+                if (!frags_.feed(p, whole)) continue;
+                QVector<Packet> inner;
+                if (!drainPackets(whole, inner)) continue;
+                for (auto& q : inner) {
+                    if (q.type == MSG_FRAGMENT) continue;
+                    if (q.type == MSG_CLOCK_SYNC) { onClockSync(q); continue; }
+                    if (q.type == MSG_SERVER_EVENT) trackServerEvent(q);
+                    emit packetArrived(q);
+                }
+                continue;
+            }
+            if (p.type == MSG_CLOCK_SYNC) { onClockSync(p); continue; }
+            if (p.type == MSG_SERVER_EVENT) trackServerEvent(p);
+            emit packetArrived(p);
+        }
+    }
+}
+
+void ClientConn::trackServerEvent(const Packet& p) {
+    // 入会 ack：记录协商的协议版本与自己的 streamId
+    if (p.json.value("message").toString() == QLatin1String("joined")) {
+        protoVer_ = p.json.value("protoVer").toInt(1);
+        streamId_ = quint32(p.json.value("streamId").toVariant().toLongLong());
+        resetClock();
+        if (protoVer_ >= kTimingProtoVersion) {
+            sendClockSync();
+            clockTimer_.start(kClockFastMs);
+        }
+        return;
+    }
+    if (p.json.value("kind").toString() == QLatin1String("room") && p.json.contains("members")) {
+        members_.clear();
+        for (const QJsonValue& v : p.json.value("members").toArray()) members_ << v.toString();
+    }
+    // 成员事件：刷新 streamId -> user 映射
+    if (p.json.value("kind").toString() == QLatin1String("room") && p.json.contains("streams")) {
+        streamUsers_.clear();
+        const QJsonObject streams = p.json.value("streams").toObject();
+        for (auto it = streams.begin(); it != streams.end(); ++it) {
+            streamUsers_.insert(quint32(it.value().toVariant().toLongLong()), it.key());
+        }
     }
 }
 
+void ClientConn::sendClockSync() {
+    if (++clockProbes_ == kClockFastProbes) clockTimer_.setInterval(kClockSlowMs);
+    send(MSG_CLOCK_SYNC, QJsonObject{{"t0", QDateTime::currentMSecsSinceEpoch()}});
+}
+
+void ClientConn::onClockSync(const Packet& p) {
+    const qint64 t3 = QDateTime::currentMSecsSinceEpoch();
+    const qint64 t0 = p.json.value("t0").toVariant().toLongLong();
+    const qint64 t1 = p.json.value("t1").toVariant().toLongLong();
+    const qint64 t2 = p.json.value("t2").toVariant().toLongLong();
+    if (t0 <= 0 || t1 <= 0 || t3 < t0) return;
+
+    // NTP 式估计：假设上下行对称
+    ClockSample s;
+    s.rtt    = (t3 - t0) - (t2 - t1);
+    s.offset = ((t1 - t0) + (t2 - t3)) / 2;
+    clockSamples_.append(s);
+    if (clockSamples_.size() > kClockSamples) clockSamples_.removeFirst();
+
+    const ClockSample* best = &clockSamples_.first();
+    for (const ClockSample& c : clockSamples_) {
+        if (c.rtt < best->rtt) best = &c;
+    }
+    clockOffsetMs_ = best->offset;
+    clockRttMs_    = best->rtt;
+    clockSynced_   = true;
+}
+
+void ClientConn::resetClock() {
+    clockTimer_.stop();
+    clockSamples_.clear();
+    clockProbes_   = 0;
+    clockOffsetMs_ = 0;
+    clockRttMs_    = -1;
+    clockSynced_   = false;
+}
+
 void ClientConn::onError(QAbstractSocket::SocketError) {
     // 可在 UI 层读取 sock_.errorString() 打印
 }
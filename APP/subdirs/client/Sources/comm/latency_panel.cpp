@@ -0,0 +1,116 @@
+#include "latency_panel.h"
+#include "latencystats.h"
+#include "clientconn.h"
+
+#include <QFile>
+#include <QFileDialog>
+#include <QFileInfo>
+#include <QHBoxLayout>
+#include <QHeaderView>
+#include <QJsonDocument>
+#include <QLabel>
+#include <QMessageBox>
+#include <QPushButton>
+#include <QTableWidget>
+#include <QTimer>
+#include <QVBoxLayout>
+
+LatencyPanel::LatencyPanel(LatencyStats* stats, const ClientConn* conn, QWidget* parent)
+    : QWidget(parent, Qt::Window), stats_(stats), conn_(conn)
+{
+    setWindowTitle(QStringLiteral("端到端延迟"));
+    resize(720, 420);
+
+    clockLabel_ = new QLabel(this);
+    auto* btnClear  = new QPushButton(QStringLiteral("清零"), this);
+    auto* btnExport = new QPushButton(QStringLiteral("导出..."), this);
+
+    auto* top = new QHBoxLayout;
+    top->addWidget(clockLabel_, 1);
+    top->addWidget(btnClear);
+    top->addWidget(btnExport);
+
+    table_ = new QTableWidget(this);
+    table_->setColumnCount(8);
+    table_->setHorizontalHeaderLabels({QStringLiteral("画面"), QStringLiteral("阶段"), QStringLiteral("帧数"),
+                                       QStringLiteral("平均"), QStringLiteral("p50"), QStringLiteral("p95"),
+                                       QStringLiteral("p99"), QStringLiteral("最大")});
+    table_->horizontalHeader()->setSectionResizeMode(QHeaderView::ResizeToContents);
+    table_->horizontalHeader()->setStretchLastSection(true);
+    table_->verticalHeader()->setVisible(false);
+    table_->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    table_->setSelectionBehavior(QAbstractItemView::SelectRows);
+
+    auto* lay = new QVBoxLayout(this);
+    lay->addLayout(top);
+    lay->addWidget(table_, 1);
+
+    timer_ = new QTimer(this);
+    timer_->setInterval(1000);
+    connect(timer_, &QTimer::timeout, this, &LatencyPanel::refresh);
+    connect(btnClear, &QPushButton::clicked, this, [this]{ stats_->clear(); refresh(); });
+    connect(btnExport, &QPushButton::clicked, this, &LatencyPanel::onExport);
+}
+
+void LatencyPanel::showEvent(QShowEvent* ev)
+{
+    QWidget::showEvent(ev);
+    refresh();
+    timer_->start();
+}
+
+void LatencyPanel::hideEvent(QHideEvent* ev)
+{
+    timer_->stop();
+    QWidget::hideEvent(ev);
+}
+
+void LatencyPanel::refresh()
+{
+    if (conn_ && conn_->clockSynced()) {
+        clockLabel_->setText(QStringLiteral("时钟已同步：偏移 %1 ms，往返 %2 ms")
+                                 .arg(conn_->clockOffsetMs()).arg(conn_->clockRttMs()));
+    } else {
+        clockLabel_->setText(QStringLiteral("时钟未同步（服务器不支持或尚未入会），不统计延迟"));
+    }
+
+    table_->setRowCount(0);
+    for (const QString& tile : stats_->tiles()) {
+        for (int s = 0; s < LAT_STAGE_COUNT; ++s) {
+            const LatencyHistogram& h = stats_->histogram(tile, LatencyStage(s));
+            if (h.count() == 0) continue;
+            const int row = table_->rowCount();
+            table_->insertRow(row);
+            const QStringList cells{
+                tile,
+                QString::fromLatin1(LatencyStats::stageName(LatencyStage(s))),
+                QString::number(h.count()),
+                QString::number(h.meanMs(), 'f', 1),
+                QString::number(h.percentile(50)),
+                QString::number(h.percentile(95)),
+                QString::number(h.percentile(99)),
+                QString::number(h.maxMs())
+            };
+            for (int c = 0; c < cells.size(); ++c) table_->setItem(row, c, new QTableWidgetItem(cells[c]));
+        }
+    }
+}
+
+void LatencyPanel::onExport()
+{
+    const QString path = QFileDialog::getSaveFileName(this, QStringLiteral("导出延迟统计"),
+                                                      QStringLiteral("latency.csv"),
+                                                      QStringLiteral("CSV (*.csv);;JSON (*.json)"));
+    if (path.isEmpty()) return;
+    QFile f(path);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        QMessageBox::warning(this, QStringLiteral("导出失败"), f.errorString());
+        return;
+    }
+    // JSON 含完整直方图，便于离线汇总；CSV 只有分位数
+    if (QFileInfo(path).suffix().compare(QLatin1String("json"), Qt::CaseInsensitive) == 0) {
+        f.write(QJsonDocument(stats_->toJson()).toJson(QJsonDocument::Indented));
+    } else {
+        f.write(stats_->toCsv().toUtf8());
+    }
+}
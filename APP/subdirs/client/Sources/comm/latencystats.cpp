@@ -0,0 +1,129 @@
+#include "latencystats.h"
+
+// ========== LatencyHistogram ==========
+int LatencyHistogram::bucketOf(qint64 ms)
+{
+    if (ms < kFine) return int(qMax<qint64>(ms, 0));
+    const qint64 b = kFine + (ms - kFine) / 10;
+    return int(qMin<qint64>(b, kBuckets - 1));
+}
+
+qint64 LatencyHistogram::bucketUpper(int b)
+{
+    if (b < kFine) return b;
+    return kFine + qint64(b - kFine + 1) * 10;
+}
+
+void LatencyHistogram::add(qint64 ms)
+{
+    // 时钟同步误差可能让极小的值算成负数，按 0 计
+    if (ms < 0) ms = 0;
+    ++buckets_[bucketOf(ms)];
+    ++count_;
+    sum_ += ms;
+    max_ = qMax(max_, ms);
+}
+
+void LatencyHistogram::clear()
+{
+    memset(buckets_, 0, sizeof(buckets_));
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+}
+
+qint64 LatencyHistogram::percentile(double p) const
+{
+    if (count_ == 0) return 0;
+    const quint64 want = qMax<quint64>(1, quint64(qCeil(double(count_) * p / 100.0)));
+    quint64 seen = 0;
+    for (int b = 0; b < kBuckets; ++b) {
+        seen += buckets_[b];
+        if (seen >= want) return qMin(bucketUpper(b), max_);
+    }
+    return max_;
+}
+
+QJsonObject LatencyHistogram::toJson() const
+{
+    // 只导出非空档，[上界 ms, 帧数]
+    QJsonArray buckets;
+    for (int b = 0; b < kBuckets; ++b) {
+        if (buckets_[b]) buckets.append(QJsonArray{bucketUpper(b), qint64(buckets_[b])});
+    }
+    return QJsonObject{
+        {"count", qint64(count_)},
+        {"mean",  meanMs()},
+        {"p50",   percentile(50)},
+        {"p95",   percentile(95)},
+        {"p99",   percentile(99)},
+        {"max",   max_},
+        {"buckets", buckets}
+    };
+}
+
+// ========== LatencyStats ==========
+void LatencyStats::addFrame(const QString& tile, qint64 ts, qint32 hubInMs, qint32 hubQueueMs,
+                            qint64 displayMs, bool hubTimes)
+{
+    Tile& t = tiles_[tile];
+    t.h[LAT_TOTAL].add(displayMs - ts);
+    if (!hubTimes) return;
+    t.h[LAT_UPLINK].add(hubInMs);
+    t.h[LAT_HUB].add(hubQueueMs);
+    t.h[LAT_DOWNLINK].add(displayMs - (ts + hubInMs + hubQueueMs));
+}
+
+const LatencyHistogram& LatencyStats::histogram(const QString& tile, LatencyStage stage) const
+{
+    static const LatencyHistogram kEmpty;
+    auto it = tiles_.constFind(tile);
+    return it == tiles_.constEnd() ? kEmpty : it->h[stage];
+}
+
+const char* LatencyStats::stageName(LatencyStage stage)
+{
+    switch (stage) {
+    case LAT_UPLINK:   return "uplink";
+    case LAT_HUB:      return "hub";
+    case LAT_DOWNLINK: return "downlink";
+    case LAT_TOTAL:    return "total";
+    default:           return "?";
+    }
+}
+
+QJsonObject LatencyStats::toJson() const
+{
+    QJsonObject tiles;
+    for (auto it = tiles_.constBegin(); it != tiles_.constEnd(); ++it) {
+        QJsonObject stages;
+        for (int s = 0; s < LAT_STAGE_COUNT; ++s) {
+            stages.insert(QLatin1String(stageName(LatencyStage(s))), it->h[s].toJson());
+        }
+        tiles.insert(it.key(), stages);
+    }
+    return QJsonObject{
+        {"ts", QDateTime::currentMSecsSinceEpoch()},
+        {"tiles", tiles}
+    };
+}
+
+QString LatencyStats::toCsv() const
+{
+    QString out = QStringLiteral("tile,stage,count,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+    for (auto it = tiles_.constBegin(); it != tiles_.constEnd(); ++it) {
+        for (int s = 0; s < LAT_STAGE_COUNT; ++s) {
+            const LatencyHistogram& h = it->h[s];
+            if (h.count() == 0) continue;
+            out += QStringLiteral("%1,%2,%3,%4,%5,%6,%7,%8\n")
+                       .arg(it.key(), QLatin1String(stageName(LatencyStage(s))))
+                       .arg(h.count())
+                       .arg(h.meanMs(), 0, 'f', 1)
+                       .arg(h.percentile(50))
+                       .arg(h.percentile(95))
+                       .arg(h.percentile(99))
+                       .arg(h.maxMs());
+        }
+    }
+    return out;
+}
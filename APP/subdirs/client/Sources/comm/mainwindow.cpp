@@ -4,6 +4,7 @@
 #include <QCamera>
 #include <QCameraInfo>
 #include <QCameraViewfinderSettings>
+#include <QCheckBox>
 
 #include <QComboBox>
 #include <QCoreApplication>
@@ -55,6 +56,7 @@
 #include "protocol.h"
 #include "udpmedia.h"
 #include "volume_popup.h"
+#include "latency_panel.h"
 
 // ---------------------------- 小部件与帮助函数（聊天预览） ----------------------------
 
@@ -434,6 +436,11 @@ MainWindow::MainWindow(QWidget *parent)
     cbShareQ_->addItem(QStringLiteral("高清 (1600x900 @8fps q55)"));
     cbShareQ_->setCurrentIndex(1);
 
+    cbCamUdp_ = new QCheckBox(QStringLiteral("摄像头走 UDP"), this);
+    cbCamUdp_->setToolTip(QStringLiteral("只显示最新的完整帧，拥塞时丢帧而不是排队；"
+                                         "不经过订阅帧率、联播选层和迟到缓存"));
+    cbCamUdp_->setChecked(false);   // 默认走 TCP：订阅/联播/迟到缓存都只在 TCP 路径上生效
+
     auto* rowBtn = new QHBoxLayout;
     rowBtn->addWidget(btnCamera_);
     rowBtn->addWidget(btnMic_);
@@ -441,9 +448,12 @@ MainWindow::MainWindow(QWidget *parent)
     rowBtn->addSpacing(12);
     rowBtn->addWidget(new QLabel(QStringLiteral("共享画质:")));
     rowBtn->addWidget(cbShareQ_);
+    rowBtn->addWidget(cbCamUdp_);
     // [KB] 新增“企业知识库”按钮
     QPushButton* btnKb = new QPushButton(QStringLiteral("企业知识库"));
     rowBtn->addWidget(btnKb);
+    QPushButton* btnLatency = new QPushButton(QStringLiteral("延迟统计"));
+    rowBtn->addWidget(btnLatency);
     rowBtn->addStretch(1);
     left->addLayout(rowBtn);
 
@@ -582,6 +592,11 @@ MainWindow::MainWindow(QWidget *parent)
     connect(&conn_, &ClientConn::packetArrived, audio_, &AudioChat::onPacket);
 
     udp_ = new UdpMediaClient(this);
+    udp_->setClock(&conn_);
+    audio_->setUdpClient(udp_);
+    connect(audio_, &AudioChat::framePlayed, this, [this](const QString& sender, qint64 ts){
+        recordDisplayLatency(sender, QStringLiteral("audio"), nullptr, ts);
+    });
 
     share_ = new ScreenShare(&conn_, this);
     share_->setUdpClient(udp_);
@@ -598,6 +613,7 @@ MainWindow::MainWindow(QWidget *parent)
     connect(btnCamera_,&QPushButton::clicked, this, &MainWindow::onToggleCamera);
     connect(btnShare_, &QPushButton::clicked, this, &MainWindow::onToggleShare);
     connect(btnKb, &QPushButton::clicked, this, &MainWindow::onOpenKnowledge);  // [KB]
+    connect(btnLatency, &QPushButton::clicked, this, &MainWindow::onOpenLatency);
     connect(&conn_,    &ClientConn::packetArrived, this, &MainWindow::onPkt);
     connect(&conn_,    &ClientConn::disconnected, this, [this]{
         btnLeave_->setEnabled(false);
@@ -618,7 +634,7 @@ MainWindow::MainWindow(QWidget *parent)
 
     // UDP 收帧（整帧 JPEG 屏幕）
     connect(udp_, &UdpMediaClient::udpScreenFrame, this,
-        [this](const QString& sender, const QByteArray& jpeg, int /*w*/, int /*h*/, qint64){
+        [this](const QString& sender, const QByteArray& jpeg, int /*w*/, int /*h*/, qint64 ts, quint32 fid){
             if (sender.isEmpty() || sender == edUser->text()) return;
             VideoTile* t = ensureRemoteTile(sender);
             QBuffer buf(const_cast<QByteArray*>(&jpeg));
@@ -628,42 +644,69 @@ MainWindow::MainWindow(QWidget *parent)
             QImage img = reader.read().convertToFormat(QImage::Format_RGB32);
             if (!img.isNull()) {
                 screenBack_[sender] = img; // 同步背板
+                screenFid_[sender] = fid;
                 t->lastScreen = img;
                 kickRemoteAlive(t);
                 refreshTilePixmap(t);
                 if (mainKey_ == sender) updateMainFromTile(t);
+                recordDisplayLatency(sender, QStringLiteral("screen"), nullptr, ts);
             }
         });
 
+    // UDP 收帧（摄像头，只会是比上一次更新的完整帧）
+    connect(udp_, &UdpMediaClient::udpCameraFrame, this,
+        [this](const QString& sender, const QByteArray& jpeg, int /*w*/, int /*h*/, qint64 ts){
+            if (sender.isEmpty() || sender == edUser->text()) return;
+            VideoTile* t = ensureRemoteTile(sender);
+            QBuffer buf(const_cast<QByteArray*>(&jpeg));
+            buf.open(QIODevice::ReadOnly);
+            QImageReader reader(&buf, "jpeg");
+            reader.setAutoTransform(true);
+            QImage img = reader.read();
+            if (img.isNull()) return;
+            t->lastCam = img;
+            kickRemoteAlive(t);
+            refreshTilePixmap(t);
+            if (mainKey_ == sender) updateMainFromTile(t);
+            recordDisplayLatency(sender, QStringLiteral("camera"), nullptr, ts);
+        });
+
     // UDP 收帧（增量 DELTA 屏幕）
     connect(udp_, &UdpMediaClient::udpScreenDeltaFrame, this,
-        [this](const QString& sender, const QByteArray& blob, int w, int h, qint64){
+        [this](const QString& sender, const QByteArray& blob, int w, int h, qint64 ts, quint32 fid){
             if (sender.isEmpty() || sender == edUser->text()) return;
             VideoTile* t = ensureRemoteTile(sender);
 
-            // 准备/校正背板尺寸
-            QImage& back = screenBack_[sender];
-            if (back.isNull() || back.size() != QSize(w, h)) {
-                back = QImage(w, h, QImage::Format_RGB32);
-                back.fill(Qt::black);
-            }
-
-            // 解析 DS01
+            // 解析 DS02：基准帧不是背板当前那一帧（中间丢了帧、刚入会还没关键帧）就不能叠加，
+            // 丢弃并请求关键帧，否则错误会一直留到下一个周期关键帧
             QDataStream ds(blob);
             ds.setByteOrder(QDataStream::BigEndian);
-            quint32 magic=0; quint16 rectCount=0;
-            ds >> magic >> rectCount;
-            if (magic != 0x44533031) return; // 'DS01'
+            quint32 magic=0, baseFid=0; quint16 rectCount=0;
+            ds >> magic >> baseFid >> rectCount;
+            if (magic != 0x44533032) return; // 'DS02'
+            QImage& back = screenBack_[sender];
+            const quint32 have = screenFid_.value(sender, 0);
+            if (have == 0 || baseFid != have || back.size() != QSize(w, h)) {
+                screenFid_[sender] = 0;
+                udp_->requestKeyframe(sender);
+                return;
+            }
+            // 中途解析失败时背板已被改了一部分：作废，等关键帧
+            auto corrupt = [this, &sender]{
+                screenFid_[sender] = 0;
+                udp_->requestKeyframe(sender);
+            };
 
             for (int i = 0; i < rectCount; ++i) {
                 quint16 x=0,y=0,rw=0,rh=0; quint32 clen=0;
                 ds >> x >> y >> rw >> rh >> clen;
-                if (ds.status()!=QDataStream::Ok) return;
-                if (int(ds.device()->bytesAvailable()) < int(clen)) return;
+                if (ds.status()!=QDataStream::Ok) { corrupt(); return; }
+                if (int(ds.device()->bytesAvailable()) < int(clen)) { corrupt(); return; }
                 QByteArray comp; comp.resize(int(clen));
                 ds.readRawData(comp.data(), clen);
                 QByteArray raw = qUncompress(comp);
                 if (raw.size() != int(rw) * int(rh) * 4) continue;
+                if (x + rw > w || y + rh > h) continue;
 
                 // 写回到背板
                 const char* src = raw.constData();
@@ -673,11 +716,14 @@ MainWindow::MainWindow(QWidget *parent)
                 }
             }
 
+            screenFid_[sender] = fid;
+
             // 显示更新
             t->lastScreen = back;
             kickRemoteAlive(t);
             refreshTilePixmap(t);
             if (mainKey_ == sender) updateMainFromTile(t);
+            recordDisplayLatency(sender, QStringLiteral("screen"), nullptr, ts);
         });
 
     lastSend_.start();
@@ -847,8 +893,9 @@ void MainWindow::onConnect()
 
 void MainWindow::onJoin()
 {
-    QJsonObject j{{"roomId", edRoom->text()}, {"user", edUser->text()}};
+    QJsonObject j{{"roomId", edRoom->text()}, {"user", edUser->text()}, {"protoVer", kProtoVersion}};
     conn_.send(MSG_JOIN_WORKORDER, j);
+    lastSubs_.clear(); // 入会后按新布局重新订阅
     localTile_.name->setText(QString("我（%1）").arg(edUser->text()));
 
     audio_->setIdentity(edRoom->text(), edUser->text());
@@ -880,6 +927,7 @@ void MainWindow::onLeave()
         it = remoteTiles_.begin();
     }
     screenBack_.clear();
+    screenFid_.clear();
 
     // 清空标注
     for (auto* m : annotModels_) delete m;
@@ -1011,7 +1059,8 @@ void MainWindow::onSendFile()
 /* ---------- 自适应/协议处理 ---------- */
 void MainWindow::applyAdaptiveByMembers(int members)
 {
-    if (members <= 2) { sendSize_ = QSize(640,480); targetFps_ = 12; jpegQuality_ = 60; }
+    // 联播时低层由服务器按接收者选择，最高层保持完整画质
+    if (members <= 2 || conn_.simulcastEnabled()) { sendSize_ = QSize(640,480); targetFps_ = 12; jpegQuality_ = 60; }
     else if (members <= 4) { sendSize_ = QSize(480,360); targetFps_ = 10; jpegQuality_ = 55; }
     else { sendSize_ = QSize(320,240); targetFps_ = 8;  jpegQuality_ = 50; }
 
@@ -1050,7 +1099,8 @@ void MainWindow::onPkt(Packet p)
 
     case MSG_VIDEO_FRAME:
     {
-        const QString sender = p.json.value("sender").toString();
+        const QString sender = p.hasMedia ? conn_.userForStream(p.media.streamId)
+                                          : p.json.value("sender").toString();
         if (sender.isEmpty() || sender == edUser->text()) break;
 
         VideoTile* t = ensureRemoteTile(sender);
@@ -1061,13 +1111,16 @@ void MainWindow::onPkt(Packet p)
         reader.setAutoTransform(true);
         QImage img = reader.read();
 
-        const QString media = p.json.value("media").toString("camera");
+        const QString media = p.hasMedia ? (p.media.kind == MEDIA_SCREEN ? QStringLiteral("screen") : QStringLiteral("camera"))
+                                         : p.json.value("media").toString("camera");
         if (!img.isNull()) {
             if (media == "screen") t->lastScreen = img;
             else                    t->lastCam    = img;
             kickRemoteAlive(t);
             refreshTilePixmap(t);
             if (mainKey_ == sender) updateMainFromTile(t);
+            if (p.hasMedia && (p.media.flags & kMediaFlagTiming))
+                recordDisplayLatency(sender, media, &p, qint64(p.media.ts));
         }
         break;
     }
@@ -1173,7 +1226,8 @@ void MainWindow::onPkt(Packet p)
             if (filename.isEmpty()) {
                 filename = QString("%1_%2.bin").arg(sender).arg(QDateTime::currentMSecsSinceEpoch());
             }
-            chatAddFile(sender, filename, mime, p.bin, /*outgoing*/false);
+            // 文件数据会被聊天项长期持有，需脱离接收缓冲
+            chatAddFile(sender, filename, mime, p.ownedBin(), /*outgoing*/false);
         }
         break;
     }
@@ -1398,17 +1452,68 @@ void MainWindow::sendImage(const QImage& img)
 
     const QImage scaled = img.scaled(sendSize_, Qt::KeepAspectRatio, Qt::SmoothTransformation);
 
+    // UDP：一层，新帧到了就撤下没发完的旧帧；中继不做联播选层
+    if (cbCamUdp_->isChecked() && sendCameraUdp(scaled)) return;
+
+    if (!conn_.simulcastEnabled()) {
+        sendCameraLayer(scaled, jpegQuality_, LAYER_FULL, false);
+        return;
+    }
+
+    // 联播：同一帧由小到大编码三层，服务器按接收者订阅与积压只转发其中一层
+    const QImage medium = scaled.scaled(simulcastSize(LAYER_MEDIUM), Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    const QImage thumb  = medium.scaled(simulcastSize(LAYER_THUMB), Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    sendCameraLayer(thumb,  simulcastQuality(LAYER_THUMB),  LAYER_THUMB,  true);
+    sendCameraLayer(medium, simulcastQuality(LAYER_MEDIUM), LAYER_MEDIUM, true);
+    sendCameraLayer(scaled, jpegQuality_,                   LAYER_FULL,   true);
+    ++camSeq_;
+}
+
+bool MainWindow::sendCameraUdp(const QImage& scaled)
+{
     QByteArray jpeg;
     QBuffer buffer(&jpeg);
     buffer.open(QIODevice::WriteOnly);
     QImageWriter writer(&buffer, "jpeg");
     writer.setQuality(jpegQuality_);
     writer.setOptimizedWrite(true);
+    if (!writer.write(scaled)) {
+        return true; // 编码失败：这一帧作废，TCP 也发不了
+    }
+    buffer.close();
+    return udp_->sendCameraJpeg(jpeg, scaled.width(), scaled.height(),
+                                QDateTime::currentMSecsSinceEpoch()) != 0;
+}
+
+void MainWindow::sendCameraLayer(const QImage& scaled, int quality, int layer, bool simulcast)
+{
+    QByteArray jpeg;
+    QBuffer buffer(&jpeg);
+    buffer.open(QIODevice::WriteOnly);
+    QImageWriter writer(&buffer, "jpeg");
+    writer.setQuality(quality);
+    writer.setOptimizedWrite(true);
     if (!writer.write(scaled)) {
         return;
     }
     buffer.close();
 
+    if (conn_.mediaHeaderEnabled()) {
+        MediaHeader mh;
+        mh.kind     = MEDIA_CAMERA;
+        mh.streamId = conn_.streamId();
+        mh.seq      = simulcast ? camSeq_ : camSeq_++; // 联播各层同一帧共用序号
+        mh.ts       = quint64(QDateTime::currentMSecsSinceEpoch());
+        mh.w        = quint16(scaled.width());
+        mh.h        = quint16(scaled.height());
+        if (simulcast) {
+            mh.flags = kMediaFlagSimulcast;
+            mh.layer = quint8(layer);
+        }
+        conn_.sendMedia(MSG_VIDEO_FRAME, mh, jpeg);
+        return;
+    }
+
     QJsonObject j{{"roomId", edRoom->text()},
                   {"sender", edUser->text()},
                   {"media",  "camera"},
@@ -1513,6 +1618,7 @@ void MainWindow::refreshGridOnly()
 
     centerStack_->setCurrentWidget(gridPage_);
     updateAllThumbFitted();
+    updateSubscriptions();
 }
 
 void MainWindow::refreshFocusThumbs()
@@ -1551,6 +1657,38 @@ void MainWindow::refreshFocusThumbs()
     centerStack_->setCurrentWidget(focusPage_);
     updateAllThumbFitted();
     updateMainFitted();
+    updateSubscriptions();
+}
+
+void MainWindow::updateSubscriptions()
+{
+    if (!conn_.isConnected() || !conn_.subscriptionsEnabled()) return;
+
+    // 宫格：全部满帧率；专注：主画面满帧率，可见缩略图降帧，不可见的不收
+    const bool focus = (currentMode() == ViewMode::Focus);
+    // 联播层：主画面要最高层；宫格按格子数选层；缩略图只要最低层
+    const int n = remoteTiles_.size();
+    const int gridLayer = n <= 1 ? LAYER_FULL : (n <= 4 ? LAYER_MEDIUM : LAYER_THUMB);
+    QJsonArray subs;
+    for (auto* t : remoteTiles_) {
+        int cam = -1, scr = -1;
+        int layer = focus ? LAYER_FULL : gridLayer;
+        if (focus && t->key != mainKey_) {
+            const bool visible = t->box->isVisible();
+            cam = visible ? kThumbCamFps : 0;
+            scr = visible ? kThumbScreenFps : 0;
+            layer = LAYER_THUMB;
+        }
+        subs.append(QJsonObject{{"sender", t->key}, {"camera", cam}, {"screen", scr}, {"layer", layer}});
+    }
+    QJsonObject j{{"roomId", edRoom->text()}, {"sender", edUser->text()},
+                  {"subs", subs}, {"defaultFps", focus ? kThumbCamFps : -1},
+                  {"defaultLayer", focus ? int(LAYER_THUMB) : gridLayer}};
+
+    const QByteArray key = toJsonBytes(j);
+    if (key == lastSubs_) return;
+    lastSubs_ = key;
+    conn_.send(MSG_SUBSCRIBE, j);
 }
 
 void MainWindow::setTileWaiting(VideoTile* t, const QString& text)
@@ -1610,6 +1748,7 @@ void MainWindow::setMainKey(const QString& key)
     annotCanvas_->setGeometry(mainVideo_->rect());
     annotCanvas_->setVisible(true);
     annotCanvas_->setEnabledDrawing(btnAnnotOn_->isChecked() && !mainKey_.isEmpty());
+    updateSubscriptions();
 }
 
 void MainWindow::updateMainFromTile(VideoTile* t)
@@ -1804,3 +1943,21 @@ void MainWindow::sendDeviceControlBroadcast(const QString& device,
     // 本端立即回显（服务器通常不回发自己）
     emit deviceControlMessage(device, command, edUser->text(), ts);
 }
+
+void MainWindow::recordDisplayLatency(const QString& sender, const QString& media, const Packet* p, qint64 ts)
+{
+    // 发送端未同步时 ts 不是服务器时钟，本端未同步时无法换算显示时刻，两种情况都不计
+    if (ts <= 0 || !conn_.clockSynced()) return;
+    const bool hubTimes = p && (p->media.flags & kMediaFlagTiming);
+    latency_.addFrame(LatencyStats::tileKey(sender, media), ts,
+                      hubTimes ? p->media.hubInMs : 0, hubTimes ? p->media.hubQueueMs : 0,
+                      conn_.hubNowMs(), hubTimes);
+}
+
+void MainWindow::onOpenLatency()
+{
+    if (!latencyPanel_) latencyPanel_ = new LatencyPanel(&latency_, &conn_, this);
+    latencyPanel_->show();
+    latencyPanel_->raise();
+    latencyPanel_->activateWindow();
+}
@@ -1,6 +1,17 @@
 #include "screenshare.h"
 #include "udpmedia.h"
 
+// 档位 0 即用户预设；往下每档约减半所需码率。
+// 丢了增量帧的接收端会请求关键帧，周期关键帧只为兜底，间隔可以放得很长
+const ScreenShare::Level ScreenShare::kLevels[] = {
+    {6000, 100, 30,  0, 10000},
+    {3500, 100, 20, 10, 15000},
+    {2000,  75, 15, 15, 20000},
+    {1000,  60, 10, 20, 30000},
+    {   0,  50,  5, 25, 30000},
+};
+const int ScreenShare::kLevelCount = int(sizeof(kLevels) / sizeof(kLevels[0]));
+
 ScreenShare::ScreenShare(ClientConn* conn, QObject* parent)
     : QObject(parent), conn_(conn)
 {
@@ -19,12 +30,57 @@ void ScreenShare::setIdentity(const QString& roomId, const QString& sender) {
     roomId_ = roomId; sender_ = sender;
 }
 
+void ScreenShare::setUdpClient(UdpMediaClient* udp) {
+    if (udp_) disconnect(udp_, nullptr, this, nullptr);
+    udp_ = udp;
+    if (!udp_) return;
+    connect(udp_, &UdpMediaClient::sendBudgetChanged, this, &ScreenShare::onSendBudget);
+    connect(udp_, &UdpMediaClient::keyframeRequested, this, &ScreenShare::onKeyframeRequested);
+}
+
+void ScreenShare::onKeyframeRequested() {
+    // 多个接收端同时丢帧会各请求一次；刚发过或正在编码的关键帧已能满足它们
+    if (!enabled_ || keyBusy_.loadAcquire() != 0) return;
+    if (QDateTime::currentMSecsSinceEpoch() - lastKeyMs_ < 300) return;
+    forceKey_ = true;
+}
+
 void ScreenShare::setParams(const QSize& sendBaseSize, int baseFps, int jpegQuality) {
     QSize s = sendBaseSize.isValid() ? sendBaseSize : baseSendSize_;
-    baseSendSize_ = clampMin720p(s);              // 强制不低于 1280x720
-    intervalMs_   = qMax(5, 1000 / qMax(30, baseFps)); // 强制不低于 30fps
-    baseQuality_  = qBound(35, jpegQuality, 75);  // 关键帧质量下限 35，避免糊成一片
-    QMetaObject::invokeMethod(encoder_, [this]{ static_cast<KeyEncoder*>(encoder_)->setQuality(baseQuality_); }, Qt::QueuedConnection);
+    baseSendSize_     = clampMin720p(s);              // 预设不低于 1280x720
+    presetIntervalMs_ = qMax(5, 1000 / qMax(30, baseFps)); // 预设不低于 30fps
+    presetQuality_    = qBound(35, jpegQuality, 75);  // 预设质量下限 35
+    applyLevel(level_);
+}
+
+void ScreenShare::applyLevel(int level) {
+    level_ = qBound(0, level, kLevelCount - 1);
+    levelMs_ = QDateTime::currentMSecsSinceEpoch();
+    const Level& L = kLevels[level_];
+    intervalMs_ = qMax(presetIntervalMs_, 1000 / L.fps);
+    keyIntervalMs_ = L.keyIntervalMs;
+    // 降档时允许低于预设的 720p / 质量 35 下限：拥塞链路上能看比卡死强
+    sendSize_ = QSize(qMax(2, baseSendSize_.width() * L.scalePct / 100) & ~1,
+                      qMax(2, baseSendSize_.height() * L.scalePct / 100) & ~1);
+    const int q = qMax(20, presetQuality_ - L.qualityDrop);
+    if (q != baseQuality_) {
+        baseQuality_ = q;
+        QMetaObject::invokeMethod(encoder_, [this, q]{ static_cast<KeyEncoder*>(encoder_)->setQuality(q); }, Qt::QueuedConnection);
+    }
+}
+
+void ScreenShare::onSendBudget(int kbps) {
+    int want = 0;
+    while (want < kLevelCount - 1 && kbps < kLevels[want].minKbps) ++want;
+    if (want > level_) {
+        applyLevel(want); // 降档立即生效
+        return;
+    }
+    // 升档一次一档，且带宽要比上一档门槛多出 20%、本档已稳定 5 秒，避免来回抖
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (want < level_ && kbps >= kLevels[level_ - 1].minKbps * 6 / 5 && now - levelMs_ >= 5000) {
+        applyLevel(level_ - 1);
+    }
 }
 
 void ScreenShare::setEnabled(bool on) {
@@ -34,6 +90,7 @@ void ScreenShare::setEnabled(bool on) {
         sendControl("on");
         lastKeyMs_ = 0;
         prevFrame_ = QImage();
+        prevFid_ = 0;
         scheduleNext();
     } else {
         timer_.stop();
@@ -80,7 +137,7 @@ void ScreenShare::onTick() {
     QPixmap pix = scr->grabWindow(0);
     if (pix.isNull()) { scheduleNext(); return; }
 
-    QSize target = clampMin720p(baseSendSize_);
+    const QSize target = sendSize_;
     QPixmap scaledPix = pix.scaled(target, Qt::KeepAspectRatio, Qt::FastTransformation);
     QImage img = scaledPix.toImage().convertToFormat(QImage::Format_RGB32);
     if (img.isNull()) { scheduleNext(); return; }
@@ -89,13 +146,16 @@ void ScreenShare::onTick() {
     emit localFrameReady(img);
 
     const qint64 now = QDateTime::currentMSecsSinceEpoch();
-    bool needKey = (now - lastKeyMs_ >= keyIntervalMs_) || prevFrame_.isNull();
+    // 关键帧还在编码：参考帧已经是它，但它还没发出去，此时的增量帧接收端没有基准，跳过这一拍
+    if (keyBusy_.loadAcquire() != 0) { scheduleNext(); return; }
+
+    bool needKey = forceKey_ || (now - lastKeyMs_ >= keyIntervalMs_) || prevFrame_.isNull() || prevFid_ == 0;
 
     if (!needKey && !prevFrame_.isNull()) {
-        // 尝试增量帧：按块比较，生成 DS01 blob
-        QByteArray blob = buildDeltaBlob(prevFrame_, img, /*block*/32);
+        // 尝试增量帧：按块比较，生成 DS02 blob
+        QByteArray blob = buildDeltaBlob(prevFrame_, img, /*block*/32, prevFid_);
         if (!blob.isEmpty() && udp_) {
-            udp_->sendScreenDelta(blob, img.width(), img.height(), now);
+            prevFid_ = udp_->sendScreenDelta(blob, img.width(), img.height(), now);
             prevFrame_ = img;
             scheduleNext();
             return;
@@ -105,8 +165,9 @@ void ScreenShare::onTick() {
     }
 
     // 发关键帧（JPEG），编码异步
-    if (udp_ && keyBusy_.loadAcquire() == 0) {
+    if (udp_) {
         keyBusy_.storeRelease(1);
+        forceKey_ = false;
         QMetaObject::invokeMethod(encoder_, "encode", Qt::QueuedConnection, Q_ARG(QImage, img));
         prevFrame_ = img; // 同步更新参考帧
     }
@@ -118,16 +179,18 @@ void ScreenShare::onEncodedKeyframe(QByteArray jpeg, QSize wh, qint64 /*encodeMs
     if (!enabled_) return;
     const qint64 now = QDateTime::currentMSecsSinceEpoch();
     if (udp_ && !jpeg.isEmpty()) {
-        udp_->sendScreenJpeg(jpeg, wh.width(), wh.height(), now);
+        prevFid_ = udp_->sendScreenJpeg(jpeg, wh.width(), wh.height(), now);
         lastKeyMs_ = now;
+    } else {
+        prevFid_ = 0; // 编码失败：参考帧没发出去，下一拍重发关键帧
     }
 }
 
-// DS01 blob：BigEndian
-// u32 magic='DS01', u16 rectCount,
+// DS02 blob：BigEndian
+// u32 magic='DS02', u32 baseFid（所基于的帧号，接收端没有它就丢弃本帧并请求关键帧）, u16 rectCount,
 // [rectLoop] u16 x, u16 y, u16 w, u16 h, u32 compLen, [compData...]
 // compData 是 QImage::Format_RGB32 的原始像素区域逐行拼接后 qCompress 得到
-QByteArray ScreenShare::buildDeltaBlob(const QImage& prev, const QImage& curr, int block) const
+QByteArray ScreenShare::buildDeltaBlob(const QImage& prev, const QImage& curr, int block, quint32 baseFid) const
 {
     if (prev.size() != curr.size()) return QByteArray();
 
@@ -161,7 +224,7 @@ QByteArray ScreenShare::buildDeltaBlob(const QImage& prev, const QImage& curr, i
         QByteArray blob;
         QDataStream ds(&blob, QIODevice::WriteOnly);
         ds.setByteOrder(QDataStream::BigEndian);
-        ds << (quint32)0x44533031 /*'DS01'*/ << (quint16)0;
+        ds << (quint32)0x44533032 /*'DS02'*/ << baseFid << (quint16)0;
         return blob;
     }
 
@@ -186,12 +249,12 @@ QByteArray ScreenShare::buildDeltaBlob(const QImage& prev, const QImage& curr, i
     const int maxRects = 120;
     if (merged.size() > maxRects) return QByteArray();
 
-    // 打包 DS01
+    // 打包 DS02
     QByteArray blob;
     blob.reserve(merged.size() * 128);
     QDataStream ds(&blob, QIODevice::WriteOnly);
     ds.setByteOrder(QDataStream::BigEndian);
-    ds << (quint32)0x44533031 /*'DS01'*/ << (quint16)merged.size();
+    ds << (quint32)0x44533032 /*'DS02'*/ << baseFid << (quint16)merged.size();
 
     for (const QRect& r : merged) {
         // 提取原始像素（逐行拼接）
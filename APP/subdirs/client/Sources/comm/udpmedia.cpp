@@ -1,4 +1,5 @@
 #include "udpmedia.h"
+#include "clientconn.h"
 #include <QtGlobal>   // 为 qMin 提供声明
 
 UdpMediaClient::UdpMediaClient(QObject* parent) : QObject(parent)
@@ -6,8 +7,12 @@ UdpMediaClient::UdpMediaClient(QObject* parent) : QObject(parent)
     connect(&sock_, &QUdpSocket::readyRead, this, &UdpMediaClient::onReadyRead);
     heartbeat_.setInterval(3000);
     connect(&heartbeat_, &QTimer::timeout, this, &UdpMediaClient::onHeartbeat);
-    cleanup_.setInterval(1000);
+    cleanup_.setInterval(kCleanupMs);
     connect(&cleanup_, &QTimer::timeout, this, &UdpMediaClient::onCleanup);
+    pacer_.setTimerType(Qt::PreciseTimer);
+    pacer_.setInterval(kPaceTickMs);
+    connect(&pacer_, &QTimer::timeout, this, &UdpMediaClient::onPace);
+    paceClock_.start();
 }
 
 void UdpMediaClient::configureServer(const QString& host, quint16 port) {
@@ -20,6 +25,8 @@ void UdpMediaClient::configureServer(const QString& host, quint16 port) {
 }
 
 void UdpMediaClient::setIdentity(const QString& roomId, const QString& user) {
+    // 换房间/身份：旧的流 id 与成员表作废，等新的注册应答
+    if (roomId != roomId_ || user != user_) resetStreams();
     roomId_ = roomId;
     user_ = user;
     if (serverPort_ != 0) sendRegister();
@@ -30,7 +37,17 @@ void UdpMediaClient::setIdentity(const QString& roomId, const QString& user) {
 void UdpMediaClient::stop() {
     heartbeat_.stop();
     cleanup_.stop();
+    resetStreams();
+}
+
+void UdpMediaClient::resetStreams() {
+    clearPacer(); // 排队的分片带着旧流 id
+    streamId_ = 0;
+    streamNames_.clear();
     reassem_.clear();
+    rx_.clear();
+    cam_.clear();
+    keyReqMs_.clear();
 }
 
 void UdpMediaClient::sendRegister() {
@@ -42,72 +59,459 @@ QByteArray UdpMediaClient::buildRegister(const QString& roomId, const QString& u
     QByteArray d;
     QDataStream ds(&d, QIODevice::WriteOnly);
     ds.setByteOrder(QDataStream::BigEndian);
-    ds << (quint32)kMagic << (quint8)2 /*ver*/ << (quint8)1 /*type*/ << (quint16)0;
+    ds << (quint32)kMagic << (quint8)kVersion << (quint8)kRegister << (quint16)0;
     ds << roomId << user;
     return d;
 }
 
-QByteArray UdpMediaClient::buildVideoChunk(const QString& roomId, const QString& sender,
-                                           quint32 frameId, quint16 idx, quint16 cnt,
-                                           quint8 codec, int w, int h, qint64 ts,
+QByteArray UdpMediaClient::buildVideoChunk(quint32 stream, quint32 frameId, quint16 idx, quint16 cnt,
+                                           quint8 codec, int w, int h, qint64 ts, quint16 flags,
                                            const char* payload, int len) {
-    QByteArray d;
-    d.reserve(64 + len);
-    QDataStream ds(&d, QIODevice::WriteOnly);
-    ds.setByteOrder(QDataStream::BigEndian);
-    ds << (quint32)kMagic << (quint8)2 /*ver*/ << (quint8)2 /*type*/ << (quint16)0;
-    ds << roomId << sender;
-    ds << (quint32)frameId << (quint16)idx << (quint16)cnt;
-    ds << (quint8)codec;
-    ds << (quint16)w << (quint16)h;
-    ds << (quint64)ts;
-    ds << (quint32)len;
-    ds.writeRawData(payload, len);
+    // 固定头直接按偏移写，不经 QDataStream
+    QByteArray d(kChunkHeaderSize + len, Qt::Uninitialized);
+    uchar* p = reinterpret_cast<uchar*>(d.data());
+    qToBigEndian<quint32>(kMagic, p);
+    p[4] = kVersion;
+    p[5] = kChunk;
+    qToBigEndian<quint16>(flags, p + 6);
+    qToBigEndian<quint32>(stream, p + 8);
+    qToBigEndian<quint32>(frameId, p + 12);
+    qToBigEndian<quint16>(idx, p + 16);
+    qToBigEndian<quint16>(cnt, p + 18);
+    p[20] = codec;
+    qToBigEndian<quint16>(quint16(w), p + 21);
+    qToBigEndian<quint16>(quint16(h), p + 23);
+    qToBigEndian<quint32>(quint32(ts), p + 25);
+    memcpy(p + kChunkHeaderSize, payload, size_t(len));
     return d;
 }
 
-void UdpMediaClient::sendScreenJpeg(const QByteArray& jpeg, int w, int h, qint64 tsMs) {
-    if (serverPort_ == 0 || roomId_.isEmpty() || user_.isEmpty() || jpeg.isEmpty()) return;
-    const quint32 fid = ++frameSeq_;
-    const int total = int((jpeg.size() + kChunkPayload - 1) / kChunkPayload); // 都转成 int
-    const char* base = jpeg.constData();
-    for (int i = 0; i < total; ++i) {
-        const int off = i * kChunkPayload;
-        const int remaining = int(jpeg.size()) - off;
-        const int len = qMin<int>(kChunkPayload, remaining);      // 显式模板参数，避免类型不一致
-        QByteArray d = buildVideoChunk(roomId_, user_, fid, (quint16)i, (quint16)total,
-                                       (quint8)JPEG, w, h, tsMs, base + off, len);
-        sock_.writeDatagram(d, serverAddr_, serverPort_);
+qint64 UdpMediaClient::unwrapTs(quint32 lo, qint64 nearMs) {
+    const qint64 span = qint64(1) << 32;
+    qint64 t = (nearMs & ~(span - 1)) | qint64(lo);
+    if (t - nearMs > span / 2) t -= span;
+    else if (nearMs - t > span / 2) t += span;
+    return t;
+}
+
+qint64 UdpMediaClient::wireTs(qint64 tsMs, quint16* flags) const {
+    *flags = 0;
+    if (!clock_ || !clock_->clockSynced()) return tsMs;
+    *flags = kFlagHubClock;
+    return tsMs + clock_->clockOffsetMs();
+}
+
+quint32 UdpMediaClient::sendScreenJpeg(const QByteArray& jpeg, int w, int h, qint64 tsMs) {
+    return sendChunks(jpeg, (quint8)JPEG, w, h, tsMs);
+}
+
+quint32 UdpMediaClient::sendScreenDelta(const QByteArray& blob, int w, int h, qint64 tsMs) {
+    return sendChunks(blob, (quint8)DELTA, w, h, tsMs);
+}
+
+void UdpMediaClient::requestKeyframe(const QString& sender) {
+    if (serverPort_ == 0 || streamId_ == 0) return;
+    const quint32 stream = streamNames_.key(sender, 0);
+    if (stream == 0) return;
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64& last = keyReqMs_[stream];
+    if (now - last < kKeyRequestMs) return; // 上一个请求的关键帧可能还在路上
+    last = now;
+    QByteArray d(kHeaderSize + 8, Qt::Uninitialized);
+    uchar* p = reinterpret_cast<uchar*>(d.data());
+    qToBigEndian<quint32>(kMagic, p);
+    p[4] = kVersion;
+    p[5] = kKeyRequest;
+    qToBigEndian<quint16>(0, p + 6);
+    qToBigEndian<quint32>(stream, p + 8);
+    qToBigEndian<quint32>(streamId_, p + 12); // 中继会改写为核实过的流 id
+    sock_.writeDatagram(d, serverAddr_, serverPort_);
+}
+
+quint32 UdpMediaClient::sendCameraJpeg(const QByteArray& jpeg, int w, int h, qint64 tsMs) {
+    if (serverPort_ == 0 || streamId_ == 0 || jpeg.isEmpty()) return 0;
+    // 旧帧还没发完就来了新帧：旧帧的剩余分片发出去也拼不成帧，让位给新帧
+    dropQueuedCamera();
+    return sendChunks(jpeg, (quint8)CAMERA, w, h, tsMs);
+}
+
+void UdpMediaClient::dropQueuedCamera() {
+    for (auto it = paceQueue_.begin(); it != paceQueue_.end();) {
+        const uchar* p = reinterpret_cast<const uchar*>(it->constData());
+        if (p[5] == kChunk && p[20] == CAMERA) {
+            paceQueueBytes_ -= it->size();
+            it = paceQueue_.erase(it);
+        } else {
+            ++it;
+        }
     }
 }
 
-void UdpMediaClient::sendScreenDelta(const QByteArray& blob, int w, int h, qint64 tsMs) {
-    if (serverPort_ == 0 || roomId_.isEmpty() || user_.isEmpty() || blob.isEmpty()) return;
-    const quint32 fid = ++frameSeq_;
-    const int total = int((blob.size() + kChunkPayload - 1) / kChunkPayload);
+bool UdpMediaClient::reachesAll(const QStringList& users, const QString& self) const {
+    if (serverPort_ == 0 || streamId_ == 0 || users.isEmpty()) return false;
+    for (const QString& u : users) {
+        if (u != self && streamNames_.key(u, 0) == 0) return false;
+    }
+    return true;
+}
+
+bool UdpMediaClient::sendAudio(quint32 seq, quint8 codec, const QByteArray& payload, qint64 tsMs) {
+    if (serverPort_ == 0 || streamId_ == 0 || payload.isEmpty()) return false;
+    quint16 flags = 0;
+    const qint64 ts = wireTs(tsMs, &flags);
+    QByteArray d(kAudioHeaderSize + payload.size(), Qt::Uninitialized);
+    uchar* p = reinterpret_cast<uchar*>(d.data());
+    qToBigEndian<quint32>(kMagic, p);
+    p[4] = kVersion;
+    p[5] = kAudio;
+    qToBigEndian<quint16>(flags, p + 6);
+    qToBigEndian<quint32>(streamId_, p + 8);
+    qToBigEndian<quint32>(seq, p + 12);
+    qToBigEndian<quint32>(quint32(ts), p + 16);
+    p[20] = codec;
+    memcpy(p + kAudioHeaderSize, payload.constData(), size_t(payload.size()));
+    // 160 字节一帧，排在屏幕分片后面只会白等：绕过令牌桶
+    sock_.writeDatagram(d, serverAddr_, serverPort_);
+    return true;
+}
+
+quint32 UdpMediaClient::sendChunks(const QByteArray& blob, quint8 codec, int w, int h, qint64 tsMs) {
+    // 还没收到注册应答（没有流 id）时中继无法路由，直接丢弃
+    if (serverPort_ == 0 || streamId_ == 0 || blob.isEmpty()) return 0;
+    quint16 flags = 0;
+    const qint64 ts = wireTs(tsMs, &flags);
+    // 摄像头帧单独编号：屏幕帧号要连续，接收端才能按缺口判断丢帧
+    const quint32 fid = codec == CAMERA ? ++camFrameSeq_ : ++frameSeq_;
+    const int total = int((blob.size() + kChunkPayload - 1) / kChunkPayload); // 都转成 int
     const char* base = blob.constData();
     for (int i = 0; i < total; ++i) {
         const int off = i * kChunkPayload;
         const int remaining = int(blob.size()) - off;
-        const int len = qMin<int>(kChunkPayload, remaining);
-        QByteArray d = buildVideoChunk(roomId_, user_, fid, (quint16)i, (quint16)total,
-                                       (quint8)DELTA, w, h, tsMs, base + off, len);
+        const int len = qMin<int>(kChunkPayload, remaining);      // 显式模板参数，避免类型不一致
+        QByteArray d = buildVideoChunk(streamId_, fid, (quint16)i, (quint16)total,
+                                       codec, w, h, ts, flags, base + off, len);
+        enqueuePaced(d);
+    }
+    if (fecGroup_ > 0) sendParity(blob, fid, total, codec, w, h, ts, flags);
+    startPacer(QDateTime::currentMSecsSinceEpoch(), codec == CAMERA);
+    return fid;
+}
+
+void UdpMediaClient::sendParity(const QByteArray& blob, quint32 fid, int total, quint8 codec,
+                                int w, int h, qint64 ts, quint16 flags) {
+    const char* base = blob.constData();
+    // 交错分组：组 g = {g, g+G, g+2G, ...}，连续丢的几片落在不同组里，各自都能恢复
+    const int groups = (total + fecGroup_ - 1) / fecGroup_;
+    for (int g = 0; g < groups; ++g) {
+        QByteArray payload(kParityHeader + kChunkPayload, '\0');
+        uchar* x = reinterpret_cast<uchar*>(payload.data()) + kParityHeader;
+        quint16 lenXor = 0;
+        int count = 0, maxLen = 0;
+        for (int i = g; i < total; i += groups) {
+            const int off = i * kChunkPayload;
+            const int len = qMin<int>(kChunkPayload, int(blob.size()) - off);
+            const uchar* src = reinterpret_cast<const uchar*>(base + off);
+            for (int b = 0; b < len; ++b) x[b] ^= src[b];
+            lenXor ^= quint16(len);
+            maxLen = qMax(maxLen, len);
+            ++count;
+        }
+        uchar* h8 = reinterpret_cast<uchar*>(payload.data());
+        qToBigEndian<quint16>(quint16(g), h8);
+        qToBigEndian<quint16>(quint16(groups), h8 + 2);
+        qToBigEndian<quint16>(quint16(count), h8 + 4);
+        qToBigEndian<quint16>(lenXor, h8 + 6);
+        QByteArray d = buildVideoChunk(streamId_, fid, (quint16)g, (quint16)total, codec, w, h, ts,
+                                       quint16(flags | kFlagParity), payload.constData(), kParityHeader + maxLen);
+        enqueuePaced(d);
+    }
+}
+
+void UdpMediaClient::enqueuePaced(const QByteArray& d) {
+    paceQueue_.enqueue(d);
+    paceQueueBytes_ += d.size();
+}
+
+void UdpMediaClient::startPacer(qint64 now, bool camera) {
+    // 屏幕与摄像头各记各的帧间隔：混在一起既会把间隔算短，也会让只开摄像头时
+    // updateEstimate 以为屏幕还在发
+    qint64& last = camera ? camLastFrameMs_ : lastFrameMs_;
+    int& gapMs = camera ? camFrameGapMs_ : frameGapMs_;
+    if (last != 0) {
+        const int gap = int(qBound<qint64>(1, now - last, kMaxFrameGapMs));
+        gapMs = (gapMs * 7 + gap) / 8;
+    }
+    last = now;
+    // 平时按目标码率；积压超过一个帧间隔能发完的量时提速，避免队列越排越长、延迟越拖越大。
+    // 屏幕在发时按屏幕的帧间隔，只有摄像头时按摄像头的
+    const bool screenActive = lastFrameMs_ != 0 && now - lastFrameMs_ <= 2 * kMaxFrameGapMs;
+    const int drainMs = screenActive ? frameGapMs_ : camFrameGapMs_;
+    const double target = double(targetKbps_) * 125.0;
+    paceRate_ = qMax(target, double(paceQueueBytes_) * 1000.0 / qMax(1, drainMs));
+    if (!pacer_.isActive()) {
+        lastPaceNs_ = paceClock_.nsecsElapsed();
+        tokens_ = kPaceBurstBytes; // 链路空闲过，先放一小撮
+        pacer_.start();
+    }
+    onPace();
+}
+
+void UdpMediaClient::onPace() {
+    const qint64 ns = paceClock_.nsecsElapsed();
+    const double cap = qMax(double(kPaceBurstBytes), paceRate_ * kPaceTickMs * 2 / 1000.0);
+    tokens_ = qMin(cap, tokens_ + paceRate_ * double(ns - lastPaceNs_) / 1e9);
+    lastPaceNs_ = ns;
+    while (!paceQueue_.isEmpty() && tokens_ >= paceQueue_.head().size()) {
+        const QByteArray d = paceQueue_.dequeue();
+        tokens_ -= d.size();
+        paceQueueBytes_ -= d.size();
+        sock_.writeDatagram(d, serverAddr_, serverPort_);
+    }
+    if (paceQueue_.isEmpty()) pacer_.stop();
+}
+
+void UdpMediaClient::clearPacer() {
+    pacer_.stop();
+    paceQueue_.clear();
+    paceQueueBytes_ = 0;
+    lastFrameMs_ = 0;
+    camLastFrameMs_ = 0;
+}
+
+void UdpMediaClient::account(StreamRx& rx, const Assembly& as) {
+    if (as.chunkCnt <= 0) return; // 整帧丢失的占位不知道片数，不计
+    rx.expected += quint32(as.chunkCnt);
+    rx.got += quint32(as.orig);
+}
+
+void UdpMediaClient::recoverFec(Assembly& as) {
+    for (const QByteArray& par : as.parity) {
+        if (par.size() < kParityHeader) continue;
+        const uchar* h8 = reinterpret_cast<const uchar*>(par.constData());
+        const int first = qFromBigEndian<quint16>(h8);
+        const int stride = qFromBigEndian<quint16>(h8 + 2);
+        const int count = qFromBigEndian<quint16>(h8 + 4);
+        quint16 len = qFromBigEndian<quint16>(h8 + 6);
+        if (stride <= 0 || count <= 0 || first + (count - 1) * stride >= as.chunkCnt) continue;
+        int missing = -1, nMissing = 0;
+        for (int k = 0; k < count; ++k) {
+            const int i = first + k * stride;
+            if (as.parts.at(i).isEmpty()) { missing = i; ++nMissing; }
+        }
+        if (nMissing != 1) continue;
+        // 缺的那片 = 校验 XOR 组内其余各片，长度同理
+        QByteArray rec = par.mid(kParityHeader);
+        uchar* x = reinterpret_cast<uchar*>(rec.data());
+        for (int k = 0; k < count; ++k) {
+            const int i = first + k * stride;
+            if (i == missing) continue;
+            const QByteArray& part = as.parts.at(i);
+            const uchar* src = reinterpret_cast<const uchar*>(part.constData());
+            const int n = qMin(part.size(), rec.size());
+            for (int b = 0; b < n; ++b) x[b] ^= src[b];
+            len ^= quint16(part.size());
+        }
+        if (len == 0 || len > rec.size()) continue;
+        rec.truncate(len);
+        as.parts[missing] = rec;
+        as.received++;
+        as.highIdx = qMax(as.highIdx, missing);
+    }
+}
+
+void UdpMediaClient::sendReports(qint64 now) {
+    const qint64 period = lastReportMs_ != 0 ? qMax<qint64>(1, now - lastReportMs_) : qint64(kReportMs);
+    lastReportMs_ = now;
+    for (auto it = rx_.begin(); it != rx_.end(); ++it) {
+        StreamRx& rx = it.value();
+        if (rx.bytes == 0) continue;
+        // 片数太少时丢片率没有意义，按 0 报
+        quint16 permille = 0;
+        if (rx.expected >= quint32(kMinReportChunks)) {
+            const quint32 lost = rx.expected > rx.got ? rx.expected - rx.got : 0;
+            permille = quint16(qMin<quint32>(1000, lost * 1000 / rx.expected));
+        }
+        const quint32 kbps = quint32(rx.bytes * 8 / period);
+        const quint16 delay = rx.delayN > 0 ? quint16(qBound<qint64>(0, rx.delaySum / rx.delayN, 0xFFFE)) : 0xFFFF;
+        rx.expected = 0;
+        rx.got = 0;
+        rx.bytes = 0;
+        rx.delaySum = 0;
+        rx.delayN = 0;
+        QByteArray d(kReportSize, Qt::Uninitialized);
+        uchar* p = reinterpret_cast<uchar*>(d.data());
+        qToBigEndian<quint32>(kMagic, p);
+        p[4] = kVersion;
+        p[5] = kReport;
+        qToBigEndian<quint16>(0, p + 6);
+        qToBigEndian<quint32>(it.key(), p + 8);
+        qToBigEndian<quint32>(streamId_, p + 12); // 中继会改写为核实过的流 id
+        qToBigEndian<quint16>(permille, p + 16);
+        qToBigEndian<quint16>(quint16(qMin(rx.jitter, 65535.0)), p + 18);
+        qToBigEndian<quint32>(kbps, p + 20);
+        qToBigEndian<quint16>(delay, p + 24);
         sock_.writeDatagram(d, serverAddr_, serverPort_);
     }
 }
 
+void UdpMediaClient::onReport(const QByteArray& dgram, qint64 now) {
+    if (dgram.size() < kHeaderSize + 10) return;
+    const uchar* p = reinterpret_cast<const uchar*>(dgram.constData());
+    if (qFromBigEndian<quint32>(p + 8) != streamId_ || streamId_ == 0) return;
+    PeerReport& pr = peers_[qFromBigEndian<quint32>(p + 12)];
+    pr.permille = qFromBigEndian<quint16>(p + 16);
+    pr.ms = now;
+    if (dgram.size() >= kReportSize) {
+        pr.jitterMs = qFromBigEndian<quint16>(p + 18);
+        pr.rateKbps = int(qMin<quint32>(qFromBigEndian<quint32>(p + 20), 1000000));
+        const quint16 delay = qFromBigEndian<quint16>(p + 24);
+        pr.delayMs = delay == 0xFFFF ? -1 : int(delay);
+        if (pr.delayMs >= 0) {
+            // 基线每次报告上浮 1ms，路由变化后能慢慢跟上新的最小值
+            if (pr.minDelayMs < 0 || pr.delayMs < pr.minDelayMs) pr.minDelayMs = pr.delayMs;
+            else pr.minDelayMs++;
+        }
+    }
+    updateFec(now);
+}
+
+void UdpMediaClient::updateEstimate(qint64 now) {
+    // 最近没在发屏幕：没有可用的反馈，保持现值
+    if (lastFrameMs_ == 0 || now - lastFrameMs_ > 2 * kReportMs) return;
+    int loss = 0, jitter = 0, queue = 0, delivered = 0;
+    bool any = false;
+    for (const PeerReport& pr : peers_) {
+        if (now - pr.ms > 2 * kReportMs) continue; // 只看本轮的报告
+        any = true;
+        loss = qMax(loss, pr.permille);
+        jitter = qMax(jitter, pr.jitterMs);
+        if (pr.delayMs >= 0 && pr.minDelayMs >= 0) queue = qMax(queue, pr.delayMs - pr.minDelayMs);
+        if (pr.rateKbps > 0) delivered = delivered == 0 ? pr.rateKbps : qMin(delivered, pr.rateKbps);
+    }
+    if (!any) return;
+
+    double est = targetKbps_;
+    if (loss > 100) {
+        // 重度丢包：直接退到实际送达量以下
+        est = delivered > 0 ? qMin(est * 0.7, delivered * 0.9) : est * 0.7;
+    } else if (loss > 20 || queue > kQueueDelayMs) {
+        est *= 0.85;
+    } else if (queue > kQueueDelayMs / 2 || jitter > kJitterMs) {
+        // 时延开始抬头：不再上探
+    } else {
+        est = est * 1.08 + 50;
+    }
+    targetKbps_ = qBound<int>(kMinKbps, int(est), kMaxKbps);
+    if (qAbs(targetKbps_ - announcedKbps_) * 20 > announcedKbps_) {
+        announcedKbps_ = targetKbps_;
+        emit sendBudgetChanged(targetKbps_);
+    }
+}
+
+void UdpMediaClient::updateFec(qint64 now) {
+    // 按最差的接收端定冗余度；XOR 每组只能补一片，丢得越多组越小
+    int worst = 0;
+    for (auto it = peers_.begin(); it != peers_.end();) {
+        if (now - it->ms > kReportMaxAgeMs) { it = peers_.erase(it); continue; }
+        worst = qMax(worst, it->permille);
+        ++it;
+    }
+    if (worst < 5)        fecGroup_ = 0;
+    else if (worst < 20)  fecGroup_ = 10;
+    else if (worst < 50)  fecGroup_ = 5;
+    else if (worst < 100) fecGroup_ = 3;
+    else                  fecGroup_ = 2;
+}
+
+void UdpMediaClient::requestRoster() {
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (now - lastRosterAskMs_ < 1000 || serverPort_ == 0 || roomId_.isEmpty() || user_.isEmpty()) return;
+    lastRosterAskMs_ = now;
+    sendRegister();
+}
+
 void UdpMediaClient::onHeartbeat() {
     if (serverPort_ == 0 || roomId_.isEmpty() || user_.isEmpty()) return;
     sendRegister();
 }
 
+qint64 UdpMediaClient::nackRetryMs() const {
+    // 至少隔一个往返再要同一帧，否则重传还在路上就又要一次
+    const qint64 rtt = clock_ ? clock_->clockRttMs() : -1;
+    return rtt > 0 ? qMax<qint64>(kMinNackRetryMs, rtt * 3 / 2 + 20) : qint64(kMinNackRetryMs);
+}
+
+void UdpMediaClient::sendNack(quint32 stream, quint32 fid, const QVector<quint16>& missing) {
+    const int n = qMin(missing.size(), int(kMaxNackIdx));
+    QByteArray d(kHeaderSize + 10 + 2 * n, Qt::Uninitialized);
+    uchar* p = reinterpret_cast<uchar*>(d.data());
+    qToBigEndian<quint32>(kMagic, p);
+    p[4] = kVersion;
+    p[5] = kNack;
+    qToBigEndian<quint16>(0, p + 6);
+    qToBigEndian<quint32>(stream, p + 8);
+    qToBigEndian<quint32>(fid, p + 12);
+    qToBigEndian<quint16>(quint16(n), p + 16);
+    for (int i = 0; i < n; ++i) qToBigEndian<quint16>(missing.at(i), p + 18 + 2 * i);
+    sock_.writeDatagram(d, serverAddr_, serverPort_);
+}
+
 void UdpMediaClient::onCleanup() {
+    if (serverPort_ == 0) return;
     const qint64 now = QDateTime::currentMSecsSinceEpoch();
-    QStringList rm;
-    for (auto it = reassem_.begin(); it != reassem_.end(); ++it) {
-        if (now - it->startMs > 2000) rm << it.key();
+    if (now - lastReportMs_ >= kReportMs) {
+        sendReports(now);
+        updateFec(now); // 上报停了（接收端离开）就逐步撤掉冗余
+        updateEstimate(now);
+    }
+    for (auto c = cam_.begin(); c != cam_.end(); ++c) {
+        QHash<quint32, Assembly>& partial = c->partial;
+        for (auto it = partial.begin(); it != partial.end();) {
+            if (now - it->startMs > kGiveUpMs) it = partial.erase(it);
+            else ++it;
+        }
+    }
+    if (reassem_.isEmpty()) return;
+    const qint64 retry = nackRetryMs();
+    QHash<quint32, quint32> giveUp; // 流 id -> 放弃到哪一帧
+    for (auto it = reassem_.begin(); it != reassem_.end();) {
+        const quint32 stream = quint32(it.key() >> 32);
+        const quint32 fid = quint32(it.key());
+        Assembly& as = it.value();
+        if (as.complete) { ++it; continue; }
+
+        const bool exhausted = as.nacks >= kMaxNacks && now - as.lastNackMs >= retry;
+        if (now - as.startMs > kGiveUpMs || exhausted) {
+            // 放弃：它和更早的未收齐帧一起出队，后面已收齐的帧不再等
+            giveUp.insert(stream, fid);
+            ++it;
+            continue;
+        }
+
+        if (as.nacks < kMaxNacks && now - as.lastNackMs >= retry) {
+            // 同一发送者已有更新的帧，或帧尾安静了 kTailWaitMs：尾部缺片也算丢
+            auto next = it + 1;
+            const bool newer = next != reassem_.end() && quint32(next.key() >> 32) == stream;
+            QVector<quint16> missing;
+            bool ask = false;
+            if (as.chunkCnt == 0) {
+                ask = true; // 整帧丢失
+            } else {
+                const int upto = (newer || now - as.lastMs >= kTailWaitMs) ? as.chunkCnt : as.highIdx;
+                for (int i = 0; i < upto; ++i) {
+                    if (as.parts.at(i).isEmpty()) missing.append(quint16(i));
+                }
+                ask = !missing.isEmpty();
+            }
+            if (ask) {
+                sendNack(stream, fid, missing);
+                ++as.nacks;
+                as.lastNackMs = now;
+            }
+        }
+        ++it;
     }
-    for (const auto& k : rm) reassem_.remove(k);
+    for (auto it = giveUp.cbegin(); it != giveUp.cend(); ++it) releaseFrames(it.key(), it.value());
 }
 
 void UdpMediaClient::onReadyRead() {
@@ -121,52 +525,249 @@ void UdpMediaClient::onReadyRead() {
 }
 
 void UdpMediaClient::parseDatagram(const QByteArray& dgram, const QHostAddress&, quint16) {
-    QDataStream ds(dgram);
-    ds.setByteOrder(QDataStream::BigEndian);
-    quint32 magic=0; quint8 ver=0; quint8 type=0; quint16 reserved=0;
-    ds >> magic >> ver >> type >> reserved;
-    if (magic != kMagic || (ver != 1 && ver != 2)) return;
-
-    if (type == 2) {
-        QString room, sender;
-        quint32 fid=0; quint16 idx=0, cnt=0; quint16 w=0, h=0; quint64 ts=0; quint32 len=0;
-        quint8 codec = 0; // 默认 JPEG
-        ds >> room >> sender >> fid >> idx >> cnt;
-        if (ver >= 2) {
-            ds >> codec;
-        }
-        ds >> w >> h >> ts >> len;
-        if (roomId_.isEmpty() || room != roomId_) return;
-        if (ds.status() != QDataStream::Ok || int(dgram.size()) < ds.device()->pos() + (qint64)len) return;
-
-        QByteArray payload;
-        payload.resize(int(len));
-        ds.readRawData(payload.data(), len);
-
-        const QString key = sender + '|' + QString::number(fid);
-        auto& as = reassem_[key];
-        if (as.startMs == 0) {
-            as.startMs = QDateTime::currentMSecsSinceEpoch();
-            as.codec = codec;
-            as.chunkCnt = cnt;
-            as.w = w; as.h = h; as.ts = (qint64)ts;
-            as.parts.resize(cnt);
-            as.received = 0;
-        }
-        if (idx < as.parts.size() && as.parts[int(idx)].isEmpty()) {
-            as.parts[int(idx)] = std::move(payload);
-            as.received++;
-        }
-        if (as.received == as.chunkCnt) {
-            QByteArray blob;
-            blob.reserve(int(as.chunkCnt) * 1000);
-            for (int i = 0; i < as.chunkCnt; ++i) blob.append(as.parts[i]);
-            if (as.codec == DELTA) {
-                emit udpScreenDeltaFrame(sender, blob, as.w, as.h, as.ts);
-            } else {
-                emit udpScreenFrame(sender, blob, as.w, as.h, as.ts);
+    if (dgram.size() < kHeaderSize) return;
+    const uchar* p = reinterpret_cast<const uchar*>(dgram.constData());
+    const quint32 magic = qFromBigEndian<quint32>(p);
+    const quint8 ver = p[4];
+    const quint8 type = p[5];
+    const quint16 flags = qFromBigEndian<quint16>(p + 6);
+    if (magic != kMagic || ver != kVersion) return;
+
+    switch (type) {
+    case kRegisterAck:
+        if (dgram.size() >= kHeaderSize + 4) streamId_ = qFromBigEndian<quint32>(p + kHeaderSize);
+        return;
+    case kRoster:
+        parseRoster(dgram);
+        return;
+    case kReport:
+        onReport(dgram, QDateTime::currentMSecsSinceEpoch());
+        return;
+    case kKeyRequest:
+        if (dgram.size() >= kHeaderSize + 8 && streamId_ != 0 && qFromBigEndian<quint32>(p + 8) == streamId_) {
+            emit keyframeRequested();
+        }
+        return;
+    case kUnknownStream:
+        // 中继重启或注册已过期：停发分片并立即重新注册
+        if (dgram.size() >= kHeaderSize + 4 && qFromBigEndian<quint32>(p + kHeaderSize) == streamId_) {
+            streamId_ = 0;
+            if (serverPort_ != 0 && !roomId_.isEmpty() && !user_.isEmpty()) sendRegister();
+        }
+        return;
+    case kAudio:
+        onAudio(dgram, flags);
+        return;
+    case kChunk:
+        break;
+    default:
+        return;
+    }
+
+    onChunk(dgram, flags);
+}
+
+void UdpMediaClient::onAudio(const QByteArray& dgram, quint16 flags) {
+    if (dgram.size() <= kAudioHeaderSize) return;
+    const uchar* p = reinterpret_cast<const uchar*>(dgram.constData());
+    const quint32 stream = qFromBigEndian<quint32>(p + 8);
+    const QString sender = streamNames_.value(stream);
+    if (sender.isEmpty()) { requestRoster(); return; }
+    const qint64 ts = (flags & kFlagHubClock)
+        ? unwrapTs(qFromBigEndian<quint32>(p + 16), QDateTime::currentMSecsSinceEpoch()) : 0;
+    emit udpAudioFrame(sender, dgram.mid(kAudioHeaderSize), p[20], qFromBigEndian<quint32>(p + 12), ts);
+}
+
+void UdpMediaClient::onChunk(const QByteArray& dgram, quint16 flags) {
+    if (dgram.size() < kChunkHeaderSize) return;
+    const uchar* p = reinterpret_cast<const uchar*>(dgram.constData());
+    const quint32 stream = qFromBigEndian<quint32>(p + 8);
+    const quint32 fid = qFromBigEndian<quint32>(p + 12);
+    const quint16 idx = qFromBigEndian<quint16>(p + 16);
+    const quint16 cnt = qFromBigEndian<quint16>(p + 18);
+    if (cnt == 0 || idx >= cnt) return;
+    if (p[20] == CAMERA) { onCameraChunk(dgram, flags); return; }
+
+    StreamRx& rx = rx_[stream];
+    if (rx.doneFid != 0 && qint32(fid - rx.doneFid) <= 0) return; // 已交付/已放弃帧的重复分片
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (rx.highFid != 0 && qint32(fid - rx.highFid) > 1) {
+        // 帧号跳了：中间的帧一片都没到，先占位，由 onCleanup 整帧 NACK
+        quint32 first = rx.highFid + 1;
+        if (fid - first > quint32(kMaxGapFrames)) first = fid - quint32(kMaxGapFrames);
+        for (quint32 f = first; f != fid; ++f) {
+            Assembly& gap = reassem_[frameKey(stream, f)];
+            if (gap.startMs == 0) gap.startMs = gap.lastMs = now;
+        }
+    }
+    if (rx.highFid == 0 || qint32(fid - rx.highFid) > 0) rx.highFid = fid;
+
+    const quint64 key = frameKey(stream, fid);
+    Assembly& as = reassem_[key];
+    if (as.chunkCnt == 0) {
+        if (as.startMs == 0) as.startMs = now;
+        as.codec = p[20];
+        as.chunkCnt = cnt;
+        as.w = qFromBigEndian<quint16>(p + 21);
+        as.h = qFromBigEndian<quint16>(p + 23);
+        as.ts = (flags & kFlagHubClock) ? unwrapTs(qFromBigEndian<quint32>(p + 25), now) : 0;
+        as.parts.resize(cnt);
+        as.received = 0;
+        if (as.ts != 0) {
+            // 以每帧第一片的到达为准；ts 是发送端的服务器时钟，差值里的固定偏移不影响抖动
+            const qint64 transit = now - as.ts;
+            if (rx.haveTransit) rx.jitter += (qAbs(transit - rx.lastTransit) - rx.jitter) / 16.0;
+            rx.lastTransit = transit;
+            rx.haveTransit = true;
+            if (clock_ && clock_->clockSynced()) {
+                rx.delaySum += qMax<qint64>(0, now + clock_->clockOffsetMs() - as.ts);
+                rx.delayN++;
             }
-            reassem_.remove(key);
+        }
+    }
+    rx.bytes += dgram.size();
+    if (as.complete || cnt != as.chunkCnt) return;
+    as.lastMs = now;
+    if (flags & kFlagParity) {
+        if (as.parity.isEmpty()) as.parity.resize(as.chunkCnt);
+        if (as.parity.at(idx).isEmpty()) as.parity[int(idx)] = dgram.mid(kChunkHeaderSize);
+    } else if (as.parts.at(idx).isEmpty()) {
+        as.parts[int(idx)] = dgram.mid(kChunkHeaderSize);
+        as.received++;
+        as.highIdx = qMax(as.highIdx, int(idx));
+        if (as.nacks == 0) as.orig++;
+    }
+    if (!as.parity.isEmpty() && as.received < as.chunkCnt) recoverFec(as);
+    if (as.received < as.chunkCnt) return;
+    as.complete = true;
+    if (as.codec == JPEG) {
+        // 关键帧不依赖前面的帧：还在补洞的旧帧不必再等
+        auto it = reassem_.lowerBound(frameKey(stream, 0));
+        while (it != reassem_.end() && it.key() < key) {
+            account(rx, it.value());
+            it = reassem_.erase(it);
+        }
+    }
+    releaseFrames(stream);
+}
+
+void UdpMediaClient::onCameraChunk(const QByteArray& dgram, quint16 flags) {
+    const uchar* p = reinterpret_cast<const uchar*>(dgram.constData());
+    const quint32 stream = qFromBigEndian<quint32>(p + 8);
+    const quint32 fid = qFromBigEndian<quint32>(p + 12);
+    const quint16 idx = qFromBigEndian<quint16>(p + 16);
+    const quint16 cnt = qFromBigEndian<quint16>(p + 18);
+    rx_[stream].bytes += dgram.size(); // 计入实收码率，拥塞控制看的是整条链路
+
+    CameraRx& cam = cam_[stream];
+    // 已有更新的帧上屏；帧号倒退很多是对端重新开始编号，照常收
+    const qint32 behind = qint32(cam.shownFid - fid);
+    if (cam.shownFid != 0 && behind >= 0 && behind < kCameraRestart) return;
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (!cam.partial.contains(fid) && cam.partial.size() >= kCameraPartials) {
+        // 同时在拼的帧太多：最旧的残帧已没有机会交付
+        auto oldest = cam.partial.begin();
+        for (auto it = cam.partial.begin(); it != cam.partial.end(); ++it) {
+            if (qint32(it.key() - oldest.key()) < 0) oldest = it;
+        }
+        if (qint32(fid - oldest.key()) < 0) return;
+        cam.partial.erase(oldest);
+    }
+    Assembly& as = cam.partial[fid];
+    if (as.chunkCnt == 0) {
+        as.startMs = now;
+        as.chunkCnt = cnt;
+        as.w = qFromBigEndian<quint16>(p + 21);
+        as.h = qFromBigEndian<quint16>(p + 23);
+        as.ts = (flags & kFlagHubClock) ? unwrapTs(qFromBigEndian<quint32>(p + 25), now) : 0;
+        as.parts.resize(cnt);
+    }
+    if (cnt != as.chunkCnt) return;
+    if (flags & kFlagParity) {
+        if (as.parity.isEmpty()) as.parity.resize(as.chunkCnt);
+        if (as.parity.at(idx).isEmpty()) as.parity[int(idx)] = dgram.mid(kChunkHeaderSize);
+    } else if (as.parts.at(idx).isEmpty()) {
+        as.parts[int(idx)] = dgram.mid(kChunkHeaderSize);
+        as.received++;
+    }
+    if (!as.parity.isEmpty() && as.received < as.chunkCnt) recoverFec(as);
+    if (as.received < as.chunkCnt) return;
+
+    const QString sender = streamNames_.value(stream);
+    if (sender.isEmpty()) {
+        requestRoster();
+        cam.partial.remove(fid);
+        return;
+    }
+    QByteArray jpeg;
+    jpeg.reserve(int(as.chunkCnt) * kChunkPayload);
+    for (int i = 0; i < as.chunkCnt; ++i) jpeg.append(as.parts.at(i));
+    const int w = as.w, h = as.h;
+    const qint64 ts = as.ts;
+    // 这一帧上屏后，更旧的残帧即使收齐也不再显示
+    cam.shownFid = fid;
+    for (auto it = cam.partial.begin(); it != cam.partial.end();) {
+        if (qint32(it.key() - fid) <= 0) it = cam.partial.erase(it);
+        else ++it;
+    }
+    emit udpCameraFrame(sender, jpeg, w, h, ts);
+}
+
+void UdpMediaClient::releaseFrames(quint32 stream, quint32 dropThrough) {
+    struct Ready {
+        quint8 codec;
+        QByteArray blob;
+        int w, h;
+        qint64 ts;
+        quint32 fid;
+    };
+    QVector<Ready> ready;
+    StreamRx& rx = rx_[stream];
+    auto it = reassem_.lowerBound(frameKey(stream, 0));
+    while (it != reassem_.end() && quint32(it.key() >> 32) == stream) {
+        const quint32 fid = quint32(it.key());
+        if (!it->complete && (dropThrough == 0 || qint32(fid - dropThrough) > 0)) {
+            break; // 队头还在补洞
+        }
+        account(rx, it.value());
+        if (it->complete) {
+            QByteArray blob;
+            blob.reserve(int(it->chunkCnt) * kChunkPayload);
+            for (int i = 0; i < it->chunkCnt; ++i) blob.append(it->parts.at(i));
+            ready.append(Ready{it->codec, blob, it->w, it->h, it->ts, fid});
+        }
+        // 已交付或已放弃：之后再到的分片（迟到的重传）直接丢弃
+        rx.doneFid = fid;
+        it = reassem_.erase(it);
+    }
+    if (ready.isEmpty()) return;
+    const QString sender = streamNames_.value(stream);
+    if (sender.isEmpty()) {
+        // 成员表还没到：这些帧丢弃，顺带要一份成员表
+        requestRoster();
+        return;
+    }
+    // 收齐的帧先全部出队再发信号，槽函数里重入也不会碰到迭代中的 reassem_
+    for (const Ready& r : ready) {
+        if (r.codec == DELTA) {
+            emit udpScreenDeltaFrame(sender, r.blob, r.w, r.h, r.ts, r.fid);
+        } else {
+            emit udpScreenFrame(sender, r.blob, r.w, r.h, r.ts, r.fid);
         }
     }
 }
+
+void UdpMediaClient::parseRoster(const QByteArray& dgram) {
+    QDataStream ds(dgram);
+    ds.setByteOrder(QDataStream::BigEndian);
+    ds.skipRawData(kHeaderSize);
+    quint16 n = 0;
+    ds >> n;
+    for (int i = 0; i < n; ++i) {
+        quint32 stream = 0;
+        QString user;
+        ds >> stream >> user;
+        if (ds.status() != QDataStream::Ok) return;
+        streamNames_.insert(stream, user);
+    }
+}
\ No newline at end of file
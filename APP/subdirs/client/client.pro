@@ -31,6 +31,8 @@ HEADERS += \
     Headers/comm/annotcanvas.h \
     Headers/comm/audiochat.h \
     Headers/comm/clientconn.h \
+    Headers/comm/latencystats.h \
+    Headers/comm/latency_panel.h \
     Headers/comm/screenshare.h \
     Headers/comm/udpmedia.h \
     Headers/comm/volume_popup.h
@@ -52,6 +54,8 @@ SOURCES += \
     Sources/comm/annotcanvas.cpp \
     Sources/comm/audiochat.cpp \
     Sources/comm/clientconn.cpp \
+    Sources/comm/latencystats.cpp \
+    Sources/comm/latency_panel.cpp \
     Sources/comm/screenshare.cpp \
     Sources/comm/udpmedia.cpp \
     Sources/comm/volume_popup.cpp
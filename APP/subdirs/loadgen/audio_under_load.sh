@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+# 视频打满链路时的音频单向延迟：同一负载分别用直接写 socket 与 ClientConn（优先级通道）发送
+# 输出按 [load raw] / [load lanes] 标签区分，看 audio 一行的 p50/p99/max
+# 用法: ./audio_under_load.sh [loadgen 参数...]   例如: ./audio_under_load.sh -n 8 -d 30
+set -e
+cd "$(dirname "$0")"
+SERVER=${SERVER:-../server/server}
+PORT=${PORT:-9000}
+# 默认负载：4 人一个房间，720p 高质量 JPEG 每秒 30 帧，足以让每个接收者的下行排队
+LOAD=(-n 4 -m 1 --fps 30 --size 1280x720 --quality 95 -d 30)
+
+for mode in raw lanes; do
+    extra=()
+    [ "$mode" = lanes ] && extra=(--client-conn)
+    "$SERVER" --port "$PORT" > "server-$mode.log" 2>&1 &
+    pid=$!
+    sleep 1
+    ./loadgen --port "$PORT" --label "$mode" "${LOAD[@]}" "${extra[@]}" "$@" || true
+    kill "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+done
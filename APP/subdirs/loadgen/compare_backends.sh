@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+# 同一负载分别压 qt / epoll 两种 RoomHub 后端，顺序运行，输出按 [load <backend>] 标签区分
+# 用法: ./compare_backends.sh [loadgen 参数...]   例如: ./compare_backends.sh -n 200 -m 20 -d 30
+set -e
+cd "$(dirname "$0")"
+SERVER=${SERVER:-../server/server}
+PORT=${PORT:-9000}
+
+for backend in qt epoll; do
+    "$SERVER" --backend "$backend" --port "$PORT" > "server-$backend.log" 2>&1 &
+    pid=$!
+    sleep 1
+    ./loadgen --port "$PORT" --label "$backend" "$@" || true
+    kill "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+done
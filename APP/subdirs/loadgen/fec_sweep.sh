@@ -0,0 +1,25 @@
+#!/usr/bin/env bash
+# UDP 屏幕 FEC 对比：中继按 1/2/5% 丢出向数据报，loadgen 分别不发校验片与按 --screen-fec 分组发送
+# loadgen 不做 NACK，屏幕帧 2 秒未收齐即计丢失；输出按 [load drop=..% fec=..] 标签区分，看 screen 一行
+# 用法: ./fec_sweep.sh [loadgen 参数...]   例如: ./fec_sweep.sh -d 30
+# 环境变量: DROPS="1 2 5"  FECS="0 10 5"  BURST=1（>1 时中继成串丢包，见 --udp-drop-burst）
+set -e
+cd "$(dirname "$0")"
+SERVER=${SERVER:-../server/server}
+PORT=${PORT:-9000}
+DROPS=${DROPS:-"1 2 5"}
+FECS=${FECS:-"0 10 5"}
+BURST=${BURST:-1}
+# 默认负载：4 人一个房间，其中 1 人共享屏幕，不发摄像头和音频
+LOAD=(-n 4 -m 1 --senders 0 --no-audio --screen-senders 1 --screen-fps 5 -d 30)
+
+for drop in $DROPS; do
+    for fec in $FECS; do
+        "$SERVER" --port "$PORT" --udp-drop "$drop" --udp-drop-burst "$BURST" > "server-drop$drop-fec$fec.log" 2>&1 &
+        pid=$!
+        sleep 1
+        ./loadgen --port "$PORT" --label "drop=$drop% fec=$fec" --screen-fec "$fec" "${LOAD[@]}" "$@" || true
+        kill "$pid" 2>/dev/null || true
+        wait "$pid" 2>/dev/null || true
+    done
+done
@@ -0,0 +1,24 @@
+QT += core gui network
+QT -= widgets
+CONFIG += c++11 console
+CONFIG -= app_bundle
+TEMPLATE = app
+TARGET = loadgen
+
+# 与服务器共用协议实现
+COMMON_DIR = $$PWD/../server/common
+include($$COMMON_DIR/common.pri)
+
+# --client-conn 复用客户端的出站调度（只依赖 protocol.h）
+CLIENT_DIR = $$PWD/../client
+
+INCLUDEPATH += $$PWD/src $$CLIENT_DIR/Headers/comm
+
+SOURCES += \
+    src/main.cpp \
+    src/loadgen.cpp \
+    $$CLIENT_DIR/Sources/comm/clientconn.cpp
+
+HEADERS += \
+    src/loadgen.h \
+    $$CLIENT_DIR/Headers/comm/clientconn.h
@@ -0,0 +1,593 @@
+#include "loadgen.h"
+#include <QImage>
+#include <QImageWriter>
+#include <QBuffer>
+#include <cmath>
+
+// ========== LatencyHist ==========
+void LatencyHist::add(qint64 ms)
+{
+    const int v = int(qBound<qint64>(0, ms, kBuckets - 1));
+    ++buckets_[v];
+    ++count_;
+    max_ = qMax(max_, int(qMin<qint64>(ms, INT_MAX)));
+}
+
+void LatencyHist::merge(const LatencyHist& o)
+{
+    for (int i = 0; i < kBuckets; ++i) buckets_[i] += o.buckets_[i];
+    count_ += o.count_;
+    max_ = qMax(max_, o.max_);
+}
+
+void LatencyHist::reset()
+{
+    buckets_.fill(0);
+    count_ = 0;
+    max_ = 0;
+}
+
+int LatencyHist::percentile(double p) const
+{
+    if (count_ == 0) return -1;
+    const quint64 target = qMax<quint64>(1, quint64(std::ceil(p * double(count_))));
+    quint64 acc = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        acc += buckets_[i];
+        if (acc >= target) return i;
+    }
+    return kBuckets - 1;
+}
+
+QString LatencyHist::summary() const
+{
+    if (count_ == 0) return QStringLiteral("n=0");
+    return QString("n=%1 p50=%2 p90=%3 p99=%4 max=%5ms")
+        .arg(count_).arg(percentile(0.5)).arg(percentile(0.9)).arg(percentile(0.99)).arg(max_);
+}
+
+// ========== RecvStats ==========
+void RecvStats::merge(const RecvStats& o)
+{
+    video.merge(o.video);
+    audio.merge(o.audio);
+    screen.merge(o.screen);
+    videoFrames += o.videoFrames;   videoLost += o.videoLost;
+    audioFrames += o.audioFrames;   audioLost += o.audioLost;
+    screenFrames += o.screenFrames; screenLost += o.screenLost;
+    screenRecovered += o.screenRecovered;
+    rxBytes += o.rxBytes;
+    txBytes += o.txBytes;
+    txSkipped += o.txSkipped;
+}
+
+void RecvStats::reset()
+{
+    *this = RecvStats();
+}
+
+static double lossPct(quint64 got, quint64 lost)
+{
+    const quint64 all = got + lost;
+    return all ? 100.0 * double(lost) / double(all) : 0.0;
+}
+
+static double mbps(quint64 bytes, qint64 ms)
+{
+    return ms > 0 ? double(bytes) * 8.0 / (double(ms) * 1000.0) : 0.0;
+}
+
+// ========== SyntheticMedia ==========
+// 渐变底 + 移动色块 + 少量噪声：JPEG 大小接近真实画面，且相邻帧不同
+static QByteArray synthJpeg(const QSize& size, int frame, int quality)
+{
+    QImage img(size, QImage::Format_RGB32);
+    const int w = size.width(), h = size.height();
+    const int bx = (frame * w / 16) % qMax(1, w), by = h / 3, bs = qMax(8, h / 4);
+    quint32 noise = 0x9E3779B9u * quint32(frame + 1);
+    for (int y = 0; y < h; ++y) {
+        QRgb* line = reinterpret_cast<QRgb*>(img.scanLine(y));
+        for (int x = 0; x < w; ++x) {
+            noise = noise * 1664525u + 1013904223u;
+            const int n = int(noise >> 28);
+            const bool box = x >= bx && x < bx + bs && y >= by && y < by + bs;
+            line[x] = box ? qRgb(230, 60 + n, 40)
+                          : qRgb((x * 255 / w + n) & 0xFF, (y * 255 / h + n) & 0xFF, (frame * 8 + n) & 0xFF);
+        }
+    }
+    QByteArray jpg;
+    QBuffer buf(&jpg);
+    buf.open(QIODevice::WriteOnly);
+    QImageWriter wr(&buf, "jpeg");
+    wr.setQuality(quality);
+    wr.write(img);
+    return jpg;
+}
+
+static quint8 linearToUlaw(qint16 pcm)
+{
+    const int BIAS = 0x84;
+    const int CLIP = 32635;
+    int v = pcm;
+    const int sign = (v >> 8) & 0x80;
+    if (sign) v = -v;
+    if (v > CLIP) v = CLIP;
+    v += BIAS;
+    int exponent = 7;
+    for (int expMask = 0x4000; (v & expMask) == 0 && exponent > 0; expMask >>= 1) --exponent;
+    const int mantissa = (v >> (exponent + 3)) & 0x0F;
+    return quint8(~(sign | (exponent << 4) | mantissa));
+}
+
+void SyntheticMedia::build(const LoadGenConfig& cfg)
+{
+    static constexpr int kVariants = 8;
+    for (int i = 0; i < kVariants; ++i) cameraJpegs << synthJpeg(cfg.frameSize, i, cfg.jpegQuality);
+    if (cfg.screenSenders > 0) {
+        for (int i = 0; i < kVariants; ++i) screenJpegs << synthJpeg(cfg.screenSize, i, cfg.jpegQuality);
+    }
+    // 20ms @ 8kHz 的 440Hz 正弦
+    ulawFrame.resize(160);
+    for (int i = 0; i < ulawFrame.size(); ++i) {
+        const double s = std::sin(2.0 * M_PI * 440.0 * i / 8000.0);
+        ulawFrame[i] = char(linearToUlaw(qint16(s * 8000.0)));
+    }
+}
+
+// ========== SimClient ==========
+SimClient::SimClient(int index, const QString& roomId, bool camera, bool screen,
+                     const LoadGenConfig& cfg, const SyntheticMedia& media, QObject* parent)
+    : QObject(parent), user_(QString("lg%1").arg(index)), roomId_(roomId),
+      camera_(camera), screen_(screen), cfg_(cfg), media_(media), serverAddr_(cfg.host)
+{
+    if (cfg_.clientConn) {
+        conn_ = new ClientConn(this);
+        connect(conn_, &ClientConn::connected, this, &SimClient::onConnected);
+        connect(conn_, &ClientConn::packetArrived, this, [this](Packet p) {
+            interval_.rxBytes += quint64(p.raw.size());
+            handlePacket(p);
+        });
+    } else {
+        connect(&sock_, &QTcpSocket::connected, this, &SimClient::onConnected);
+        connect(&sock_, &QTcpSocket::readyRead, this, &SimClient::onReadyRead);
+    }
+    connect(&udp_, &QUdpSocket::readyRead, this, &SimClient::onUdpReadyRead);
+
+    camTimer_.setTimerType(Qt::PreciseTimer);
+    camTimer_.setInterval(1000 / qMax(1, cfg_.fps));
+    connect(&camTimer_, &QTimer::timeout, this, &SimClient::sendCamera);
+    audioTimer_.setTimerType(Qt::PreciseTimer);
+    audioTimer_.setInterval(20);
+    connect(&audioTimer_, &QTimer::timeout, this, &SimClient::sendAudio);
+    screenTimer_.setInterval(1000 / qMax(1, cfg_.screenFps));
+    connect(&screenTimer_, &QTimer::timeout, this, &SimClient::sendScreen);
+    houseTimer_.setInterval(1000);
+    connect(&houseTimer_, &QTimer::timeout, this, &SimClient::onHousekeeping);
+}
+
+void SimClient::start()
+{
+    if (conn_) {
+        conn_->connectTo(cfg_.host, cfg_.port);
+    } else {
+        sock_.connectToHost(cfg_.host, cfg_.port);
+        sock_.setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    }
+    udp_.bind(QHostAddress::AnyIPv4, 0);
+    sendUdpRegister();
+    houseTimer_.start();
+}
+
+void SimClient::onConnected()
+{
+    QJsonObject j{{"roomId", roomId_}, {"user", user_}, {"protoVer", kProtoVersion}};
+    if (conn_) conn_->send(MSG_JOIN_WORKORDER, j);
+    else       writeTcp(buildPacket(MSG_JOIN_WORKORDER, j));
+}
+
+bool SimClient::writeTcp(const QByteArray& bytes)
+{
+    // 本地积压过多说明瓶颈在压测机这一侧，跳过而不是堆内存
+    if (sock_.bytesToWrite() > kMaxLocalBacklog) {
+        ++interval_.txSkipped;
+        return false;
+    }
+    sock_.write(bytes);
+    interval_.txBytes += quint64(bytes.size());
+    return true;
+}
+
+bool SimClient::sendMedia(quint16 type, const MediaHeader& mh, const QByteArray& bin)
+{
+    if (!conn_) return writeTcp(buildMediaPacket(type, mh, bin));
+    // ClientConn 的积压含各通道里排队未交给 socket 的字节
+    const qint64 before = conn_->bytesToWrite();
+    if (before > kMaxLocalBacklog) {
+        ++interval_.txSkipped;
+        return false;
+    }
+    conn_->sendMedia(type, mh, bin);
+    interval_.txBytes += quint64(qMax<qint64>(0, conn_->bytesToWrite() - before));
+    return true;
+}
+
+qint64 SimClient::nowMs() const
+{
+    // ClientConn 时钟同步后发出的 ts 是服务器时钟，接收端也换算过去再比较
+    return conn_ ? conn_->hubNowMs() : QDateTime::currentMSecsSinceEpoch();
+}
+
+void SimClient::onReadyRead()
+{
+    const QByteArray in = sock_.readAll();
+    interval_.rxBytes += quint64(in.size());
+    buffer_.append(in);
+    QVector<Packet> pkts;
+    if (!drainPackets(buffer_, pkts, false)) return;
+    for (Packet& p : pkts) {
+        if (p.type == MSG_FRAGMENT) {
+            QByteArray whole;
+            if (!frags_.feed(p, whole)) continue;
+            QVector<Packet> inner;
+            if (!drainPackets(whole, inner, false)) continue;
+            for (Packet& q : inner) {
+                if (q.type != MSG_FRAGMENT) handlePacket(q);
+            }
+            continue;
+        }
+        handlePacket(p);
+    }
+}
+
+void SimClient::handlePacket(Packet& p)
+{
+    if (p.hasMedia) {
+        onMedia(p, nowMs());
+        return;
+    }
+    if (p.type != MSG_SERVER_EVENT || streamId_ != 0) return;
+    const QJsonObject& j = p.ensureJson();
+    if (j.value("message").toString() != QLatin1String("joined")) return;
+
+    // 入会成功：各路发送按随机相位启动，避免所有连接同一时刻突发
+    streamId_ = quint32(j.value("streamId").toVariant().toLongLong());
+    backend_ = j.value("backend").toString();
+    if (camera_) {
+        QTimer::singleShot(qrand() % camTimer_.interval(), this, [this]{ camTimer_.start(); });
+    }
+    if (cfg_.audio) {
+        QTimer::singleShot(qrand() % audioTimer_.interval(), this, [this]{ audioTimer_.start(); });
+    }
+    if (screen_ && !media_.screenJpegs.isEmpty()) {
+        QTimer::singleShot(qrand() % screenTimer_.interval(), this, [this]{ screenTimer_.start(); });
+    }
+}
+
+void SimClient::onMedia(const Packet& p, qint64 now)
+{
+    const MediaHeader& mh = p.media;
+    const quint64 key = (quint64(mh.streamId) << 8) | mh.kind;
+    auto it = lastSeq_.find(key);
+    quint64 lost = 0;
+    if (it == lastSeq_.end()) {
+        lastSeq_.insert(key, mh.seq);
+    } else {
+        if (mh.seq > it.value() + 1) lost = mh.seq - it.value() - 1;
+        if (mh.seq > it.value()) it.value() = mh.seq;
+    }
+    const qint64 lat = now - qint64(mh.ts);
+    if (mh.kind == MEDIA_AUDIO) {
+        interval_.audio.add(lat);
+        ++interval_.audioFrames;
+        interval_.audioLost += lost;
+    } else {
+        interval_.video.add(lat);
+        ++interval_.videoFrames;
+        interval_.videoLost += lost;
+    }
+}
+
+void SimClient::sendCamera()
+{
+    if (!streamId_ || media_.cameraJpegs.isEmpty()) return;
+    MediaHeader mh;
+    mh.kind     = MEDIA_CAMERA;
+    mh.codec    = 0;
+    mh.streamId = streamId_;
+    mh.seq      = camSeq_++;
+    mh.ts       = quint64(QDateTime::currentMSecsSinceEpoch());
+    mh.w        = quint16(cfg_.frameSize.width());
+    mh.h        = quint16(cfg_.frameSize.height());
+    const QByteArray& jpg = media_.cameraJpegs.at(camFrame_++ % media_.cameraJpegs.size());
+    sendMedia(MSG_VIDEO_FRAME, mh, jpg);
+}
+
+void SimClient::sendAudio()
+{
+    if (!streamId_) return;
+    MediaHeader mh;
+    mh.kind     = MEDIA_AUDIO;
+    mh.codec    = AUDIO_MULAW;
+    mh.streamId = streamId_;
+    mh.seq      = audioSeq_++;
+    mh.ts       = quint64(QDateTime::currentMSecsSinceEpoch());
+    mh.w        = 8000;
+    mh.h        = 1;
+    sendMedia(MSG_AUDIO_FRAME, mh, media_.ulawFrame);
+}
+
+// UdpMediaClient 格式（v3）：[magic][ver][type][flags] + 各类型字段
+void SimClient::sendUdpRegister()
+{
+    QByteArray d;
+    QDataStream ds(&d, QIODevice::WriteOnly);
+    ds.setByteOrder(QDataStream::BigEndian);
+    ds << kUdpMagic << kUdpVersion << quint8(1) << quint16(0);
+    ds << roomId_ << user_;
+    udp_.writeDatagram(d, serverAddr_, quint16(cfg_.port + 1));
+}
+
+void SimClient::sendScreen()
+{
+    if (udpStream_ == 0) return; // 还没收到注册应答
+    const QByteArray& jpg = media_.screenJpegs.at(screenFrame_++ % media_.screenJpegs.size());
+    const quint32 fid = ++screenFid_;
+    const int cnt = (jpg.size() + kUdpChunk - 1) / kUdpChunk;
+    const quint32 ts = quint32(QDateTime::currentMSecsSinceEpoch());
+    for (int i = 0; i < cnt; ++i) {
+        const int off = i * kUdpChunk;
+        writeScreenChunk(fid, i, cnt, ts, 0, jpg.constData() + off, qMin(int(kUdpChunk), jpg.size() - off));
+    }
+    if (cfg_.screenFec <= 0) return;
+    // 与 UdpMediaClient::sendParity 相同的交错分组：组 g = {g, g+G, ...}，负载 = 8B 组描述 + XOR
+    const int groups = (cnt + cfg_.screenFec - 1) / cfg_.screenFec;
+    for (int g = 0; g < groups; ++g) {
+        QByteArray payload(kParityHeader + kUdpChunk, '\0');
+        uchar* x = reinterpret_cast<uchar*>(payload.data()) + kParityHeader;
+        quint16 lenXor = 0;
+        int count = 0, maxLen = 0;
+        for (int i = g; i < cnt; i += groups) {
+            const int off = i * kUdpChunk;
+            const int len = qMin(int(kUdpChunk), jpg.size() - off);
+            const uchar* src = reinterpret_cast<const uchar*>(jpg.constData() + off);
+            for (int b = 0; b < len; ++b) x[b] ^= src[b];
+            lenXor ^= quint16(len);
+            maxLen = qMax(maxLen, len);
+            ++count;
+        }
+        uchar* h8 = reinterpret_cast<uchar*>(payload.data());
+        qToBigEndian<quint16>(quint16(g), h8);
+        qToBigEndian<quint16>(quint16(groups), h8 + 2);
+        qToBigEndian<quint16>(quint16(count), h8 + 4);
+        qToBigEndian<quint16>(lenXor, h8 + 6);
+        writeScreenChunk(fid, g, cnt, ts, kUdpFlagParity, payload.constData(), kParityHeader + maxLen);
+    }
+}
+
+void SimClient::writeScreenChunk(quint32 fid, int idx, int cnt, quint32 ts, quint16 flags, const char* payload, int len)
+{
+    // 固定 29B 头：stream | fid | idx | cnt | codec | w | h | ts 低 32 位
+    QByteArray d(kUdpChunkHeader + len, Qt::Uninitialized);
+    uchar* p = reinterpret_cast<uchar*>(d.data());
+    qToBigEndian<quint32>(kUdpMagic, p);
+    p[4] = kUdpVersion;
+    p[5] = 2;
+    qToBigEndian<quint16>(flags, p + 6);
+    qToBigEndian<quint32>(udpStream_, p + 8);
+    qToBigEndian<quint32>(fid, p + 12);
+    qToBigEndian<quint16>(quint16(idx), p + 16);
+    qToBigEndian<quint16>(quint16(cnt), p + 18);
+    p[20] = 0; // JPEG
+    qToBigEndian<quint16>(quint16(cfg_.screenSize.width()), p + 21);
+    qToBigEndian<quint16>(quint16(cfg_.screenSize.height()), p + 23);
+    qToBigEndian<quint32>(ts, p + 25);
+    memcpy(p + kUdpChunkHeader, payload, size_t(len));
+    if (udp_.writeDatagram(d, serverAddr_, quint16(cfg_.port + 1)) > 0) {
+        interval_.txBytes += quint64(d.size());
+    }
+}
+
+void SimClient::onUdpReadyRead()
+{
+    while (udp_.hasPendingDatagrams()) {
+        QByteArray d;
+        d.resize(int(udp_.pendingDatagramSize()));
+        udp_.readDatagram(d.data(), d.size());
+        interval_.rxBytes += quint64(d.size());
+        onScreenChunk(d, QDateTime::currentMSecsSinceEpoch());
+    }
+}
+
+void SimClient::onScreenChunk(const QByteArray& d, qint64 now)
+{
+    if (d.size() < 8) return;
+    const uchar* p = reinterpret_cast<const uchar*>(d.constData());
+    if (qFromBigEndian<quint32>(p) != kUdpMagic || p[4] != kUdpVersion) return;
+    const quint8 type = p[5];
+    if (type == 3 /*注册应答*/ && d.size() >= 12) { udpStream_ = qFromBigEndian<quint32>(p + 8); return; }
+    if (type == 5 /*未知流*/) { udpStream_ = 0; sendUdpRegister(); return; }
+    if (type != 2 || d.size() < kUdpChunkHeader) return;
+    const bool parity = qFromBigEndian<quint16>(p + 6) & kUdpFlagParity;
+    const quint32 stream = qFromBigEndian<quint32>(p + 8);
+    const quint32 fid = qFromBigEndian<quint32>(p + 12);
+    const quint16 idx = qFromBigEndian<quint16>(p + 16);
+    const quint16 cnt = qFromBigEndian<quint16>(p + 18);
+    const quint32 ts = qFromBigEndian<quint32>(p + 25);
+    if (cnt == 0) return;
+
+    const quint64 key = (quint64(stream) << 32) | fid;
+    if (screenDone_.contains(key)) return;
+    ScreenAsm& as = screenAsm_[key];
+    if (as.cnt == 0) { as.cnt = cnt; as.firstMs = now; as.have.resize(cnt); }
+    if (cnt != as.cnt) return;
+    if (parity) {
+        if (d.size() < kUdpChunkHeader + kParityHeader) return;
+        const uchar* h8 = p + kUdpChunkHeader;
+        const int first = qFromBigEndian<quint16>(h8);
+        const int stride = qFromBigEndian<quint16>(h8 + 2);
+        const int count = qFromBigEndian<quint16>(h8 + 4);
+        if (stride <= 0 || count <= 0 || first != idx || first + (count - 1) * stride >= cnt) return;
+        as.groups = stride;
+        as.parity.append(qMakePair(first, count));
+    } else {
+        if (idx >= cnt || as.have.testBit(idx)) return;
+        as.have.setBit(idx);
+        ++as.got;
+    }
+    if (as.got < as.cnt && !recoverScreen(as)) return;
+    // 最后一片到达即整帧可解码：以此计延迟（头里只有毫秒低 32 位，按无符号差回绕）
+    interval_.screen.add(qint64(qint32(quint32(now) - ts)));
+    ++interval_.screenFrames;
+    screenAsm_.remove(key);
+    screenDone_.insert(key, now);
+}
+
+bool SimClient::recoverScreen(ScreenAsm& as)
+{
+    for (const QPair<int,int>& g : as.parity) {
+        int missing = -1, nMissing = 0;
+        for (int k = 0; k < g.second; ++k) {
+            const int i = g.first + k * as.groups;
+            if (!as.have.testBit(i)) { missing = i; ++nMissing; }
+        }
+        if (nMissing != 1) continue;
+        as.have.setBit(missing);
+        ++as.got;
+        ++interval_.screenRecovered;
+    }
+    return as.got >= as.cnt;
+}
+
+void SimClient::onHousekeeping()
+{
+    // 2 秒还没收齐的屏幕帧按丢失计
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (auto it = screenAsm_.begin(); it != screenAsm_.end();) {
+        if (now - it->firstMs > 2000) {
+            ++interval_.screenLost;
+            it = screenAsm_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = screenDone_.begin(); it != screenDone_.end();) {
+        if (now - it.value() > 2000) it = screenDone_.erase(it);
+        else ++it;
+    }
+    // 与 UdpMediaClient 一致：3 秒一次注册心跳
+    static constexpr int kRegisterEvery = 3;
+    if (++houseTicks_ % kRegisterEvery == 0) sendUdpRegister();
+}
+
+void SimClient::rollInterval()
+{
+    total_.merge(interval_);
+    interval_.reset();
+}
+
+// ========== LoadGen ==========
+LoadGen::LoadGen(const LoadGenConfig& cfg, QObject* parent)
+    : QObject(parent), cfg_(cfg)
+{
+    reportTimer_.setInterval(qMax(1, cfg_.reportSec) * 1000);
+    connect(&reportTimer_, &QTimer::timeout, this, &LoadGen::onReport);
+}
+
+void LoadGen::start()
+{
+    media_.build(cfg_);
+    qInfo().noquote() << QString("[load] camera jpeg ~%1 B, screen jpeg ~%2 B")
+        .arg(media_.cameraJpegs.value(0).size()).arg(media_.screenJpegs.value(0).size());
+
+    const int rooms = qMax(1, cfg_.rooms);
+    QVector<int> perRoom(rooms, 0);
+    for (int i = 0; i < cfg_.conns; ++i) {
+        const int r = i % rooms;
+        const int nth = perRoom[r]++;
+        const bool camera = cfg_.senders < 0 || nth < cfg_.senders;
+        const bool screen = nth < cfg_.screenSenders;
+        auto* c = new SimClient(i, QString("load-%1").arg(r), camera, screen, cfg_, media_, this);
+        clients_ << c;
+        // 错开建连，避免瞬间 SYN 洪峰
+        QTimer::singleShot(i * 5, c, &SimClient::start);
+    }
+
+    clock_.start();
+    reportTimer_.start();
+    if (cfg_.durationSec > 0) {
+        QTimer::singleShot(cfg_.durationSec * 1000, this, &LoadGen::onFinished);
+    }
+}
+
+void LoadGen::onReport()
+{
+    const qint64 now = clock_.elapsed();
+    const qint64 span = now - lastReportMs_;
+    lastReportMs_ = now;
+
+    RecvStats agg;
+    int joined = 0;
+    for (SimClient* c : clients_) {
+        if (c->joined()) ++joined;
+        agg.merge(c->interval());
+        c->rollInterval();
+    }
+    qInfo().noquote() << QString("%1 t=%2s joined=%3/%4 tx=%5 Mbps rx=%6 Mbps skipped=%7")
+        .arg(tag()).arg(now / 1000).arg(joined).arg(clients_.size())
+        .arg(mbps(agg.txBytes, span), 0, 'f', 1).arg(mbps(agg.rxBytes, span), 0, 'f', 1)
+        .arg(agg.txSkipped);
+    qInfo().noquote() << QString("  video  %1 lost=%2%").arg(agg.video.summary()).arg(lossPct(agg.videoFrames, agg.videoLost), 0, 'f', 2);
+    if (cfg_.audio) {
+        qInfo().noquote() << QString("  audio  %1 lost=%2%").arg(agg.audio.summary()).arg(lossPct(agg.audioFrames, agg.audioLost), 0, 'f', 2);
+    }
+    if (cfg_.screenSenders > 0) {
+        qInfo().noquote() << QString("  screen %1 lost=%2% fec_recovered=%3").arg(agg.screen.summary())
+            .arg(lossPct(agg.screenFrames, agg.screenLost), 0, 'f', 2).arg(agg.screenRecovered);
+    }
+}
+
+void LoadGen::onFinished()
+{
+    onReport();
+    printFinal();
+    QCoreApplication::quit();
+}
+
+void LoadGen::printFinal()
+{
+    const qint64 ms = clock_.elapsed();
+    qInfo().noquote() << tag() << "per receiver (latency ms p50/p99, loss %):";
+    qInfo().noquote() << QString("%1 %2 %3 %4 %5 %6")
+        .arg("user", -8).arg("room", -10).arg("rx Mbps", 8)
+        .arg("video", 20).arg("audio", 20).arg("screen", 20);
+    auto col = [](const LatencyHist& h, quint64 got, quint64 lost) {
+        if (got + lost == 0) return QStringLiteral("-");
+        return QString("%1/%2 %3%").arg(h.percentile(0.5)).arg(h.percentile(0.99))
+            .arg(lossPct(got, lost), 0, 'f', 1);
+    };
+    RecvStats all;
+    for (SimClient* c : clients_) {
+        const RecvStats& t = c->total();
+        all.merge(t);
+        qInfo().noquote() << QString("%1 %2 %3 %4 %5 %6")
+            .arg(c->user(), -8).arg(c->roomId(), -10).arg(mbps(t.rxBytes, ms), 8, 'f', 2)
+            .arg(col(t.video, t.videoFrames, t.videoLost), 20)
+            .arg(col(t.audio, t.audioFrames, t.audioLost), 20)
+            .arg(col(t.screen, t.screenFrames, t.screenLost), 20);
+    }
+    qInfo().noquote() << QString("%1 total video %2 | audio %3 | screen %4")
+        .arg(tag(), all.video.summary(), all.audio.summary(), all.screen.summary());
+}
+
+QString LoadGen::tag() const
+{
+    // [load label backend=...]：同一命令行对不同后端各跑一次，按标签对比
+    QString backend;
+    for (SimClient* c : clients_) {
+        if (!c->backend().isEmpty()) { backend = c->backend(); break; }
+    }
+    QString t = QStringLiteral("[load");
+    if (!cfg_.label.isEmpty()) t += ' ' + cfg_.label;
+    if (!backend.isEmpty()) t += QStringLiteral(" backend=") + backend;
+    return t + ']';
+}
@@ -0,0 +1,188 @@
+#pragma once
+#include <QtCore>
+#include <QtNetwork>
+#include "protocol.h"
+#include "clientconn.h"
+
+// ===============================================
+// 无界面压测客户端
+// - N 条连接按轮询分到 M 个房间，以 MSG_JOIN_WORKORDER 入会（协商最新 protoVer）
+// - 摄像头：预先编码好的合成 JPEG，按 fps 走二进制媒体头发送
+// - 音频：每 20ms 一帧 µ-law（8kHz 单声道，160B）
+// - 屏幕：UdpMediaClient 格式的 UDP 分片（每片 1200B），可按固定组大小附带 XOR 校验片
+// - 接收端按媒体头/分片里的发送时间戳统计扇出延迟（压测机与发送端同一时钟），
+//   按 seq 缺口统计丢帧，按字节统计吞吐
+// - --client-conn：TCP 收发改走客户端的 ClientConn（优先级通道 + 分片插队），
+//   用来测视频打满链路时音频的单向延迟
+// ===============================================
+
+struct LoadGenConfig {
+    QString host = QStringLiteral("127.0.0.1");
+    quint16 port = 9000;
+    int conns = 10;
+    int rooms = 1;
+    int senders = -1;        // 每个房间发摄像头的连接数，-1 = 全部
+    int fps = 12;
+    QSize frameSize{640, 360};
+    int jpegQuality = 70;
+    bool audio = true;
+    int screenSenders = 0;   // 每个房间发 UDP 屏幕的连接数
+    int screenFps = 5;
+    QSize screenSize{1280, 720};
+    int screenFec = 0;       // 每组数据片数（同 UdpMediaClient::fecGroup_）；0 = 不发校验片
+    int durationSec = 60;    // 0 = 一直跑
+    int reportSec = 5;
+    QString label;           // 输出里的标签，便于对比多次运行（如不同后端）
+    bool clientConn = false; // TCP 走 ClientConn 而不是直接写 socket
+};
+
+// 1ms 一档的延迟直方图，便于按区间/按接收者合并
+class LatencyHist {
+public:
+    void add(qint64 ms);
+    void merge(const LatencyHist& o);
+    void reset();
+    quint64 count() const { return count_; }
+    int percentile(double p) const; // p ∈ (0,1]；无样本返回 -1
+    int max() const { return max_; }
+    QString summary() const;        // "n=.. p50=.. p90=.. p99=.. max=.."
+
+private:
+    static constexpr int kBuckets = 2000; // 最后一档收 >= 1999ms
+    QVector<quint32> buckets_ = QVector<quint32>(kBuckets, 0);
+    quint64 count_ = 0;
+    int max_ = 0;
+};
+
+// 单个接收者的统计
+struct RecvStats {
+    LatencyHist video, audio, screen;
+    quint64 videoFrames = 0, videoLost = 0;
+    quint64 audioFrames = 0, audioLost = 0;
+    quint64 screenFrames = 0, screenLost = 0;
+    quint64 screenRecovered = 0; // 靠校验片补齐的数据片
+    quint64 rxBytes = 0;
+    quint64 txBytes = 0;
+    quint64 txSkipped = 0; // 本地 socket 积压过多而未发出的帧
+
+    void merge(const RecvStats& o);
+    void reset();
+};
+
+// 预生成的合成媒体，所有连接共享
+struct SyntheticMedia {
+    QVector<QByteArray> cameraJpegs;
+    QVector<QByteArray> screenJpegs;
+    QByteArray ulawFrame;
+
+    void build(const LoadGenConfig& cfg);
+};
+
+class SimClient : public QObject {
+    Q_OBJECT
+public:
+    SimClient(int index, const QString& roomId, bool camera, bool screen,
+              const LoadGenConfig& cfg, const SyntheticMedia& media, QObject* parent = nullptr);
+
+    void start();
+
+    const QString& user() const { return user_; }
+    const QString& roomId() const { return roomId_; }
+    bool joined() const { return streamId_ != 0; }
+    const QString& backend() const { return backend_; } // 服务器在入会 ack 里报告的网络后端
+    const RecvStats& interval() const { return interval_; }
+    const RecvStats& total() const { return total_; }
+    // 区间统计并入累计并清零（每次汇报后调用）
+    void rollInterval();
+
+private slots:
+    void onConnected();
+    void onReadyRead();
+    void onUdpReadyRead();
+    void sendCamera();
+    void sendAudio();
+    void sendScreen();
+    void onHousekeeping();
+
+private:
+    void handlePacket(Packet& p);
+    void onMedia(const Packet& p, qint64 now);
+    void onScreenChunk(const QByteArray& d, qint64 now);
+    void sendUdpRegister();
+    void writeScreenChunk(quint32 fid, int idx, int cnt, quint32 ts, quint16 flags, const char* payload, int len);
+    bool writeTcp(const QByteArray& bytes);
+    bool sendMedia(quint16 type, const MediaHeader& mh, const QByteArray& bin);
+    qint64 nowMs() const;
+
+    QString user_;
+    QString roomId_;
+    bool camera_;
+    bool screen_;
+    const LoadGenConfig& cfg_;
+    const SyntheticMedia& media_;
+
+    QTcpSocket sock_;
+    ClientConn* conn_{nullptr}; // --client-conn 时代替 sock_
+    QUdpSocket udp_;
+    QHostAddress serverAddr_;
+    QByteArray buffer_;
+    FragmentAssembler frags_;
+    quint32 streamId_{0};
+    QString backend_;
+
+    QTimer camTimer_, audioTimer_, screenTimer_, houseTimer_;
+    quint32 camSeq_{0}, audioSeq_{0}, screenFid_{0};
+    int camFrame_{0}, screenFrame_{0};
+    int houseTicks_{0};
+
+    // (streamId << 8 | kind) -> 上一个 seq，用于统计丢帧
+    QHash<quint64, quint32> lastSeq_;
+    // UDP 屏幕帧重组进度：(流 id << 32 | fid) -> 已到的数据片/校验组、首片到达时间
+    // 合成内容不解码，只按 UdpMediaClient::recoverFec 的条件（组内恰好缺一片）记为恢复
+    struct ScreenAsm {
+        int got = 0;
+        int cnt = 0;
+        qint64 firstMs = 0;
+        QBitArray have;                     // 数据片
+        QVector<QPair<int,int>> parity;     // 已到校验组的 (first, count)，stride = groups
+        int groups = 0;
+    };
+    bool recoverScreen(ScreenAsm& as);
+    QHash<quint64, qint64> screenDone_; // 刚收齐的帧 -> 完成时间；之后迟到的校验片/重复片直接丢弃
+    QHash<quint64, ScreenAsm> screenAsm_;
+    quint32 udpStream_{0}; // 中继在注册应答里分配；0 = 尚未注册成功
+
+    RecvStats interval_;
+    RecvStats total_;
+
+    static constexpr qint64 kMaxLocalBacklog = 2 * 1024 * 1024;
+    static constexpr int kUdpChunk = 1200;
+    static constexpr quint32 kUdpMagic = 0x55444D31; // 'UDM1'
+    static constexpr quint8 kUdpVersion = 3;
+    static constexpr int kUdpChunkHeader = 29;
+    static constexpr quint16 kUdpFlagParity = 0x0002; // 校验片：idx 为组号
+    static constexpr int kParityHeader = 8;           // first u16 | stride u16 | count u16 | lenXor u16
+};
+
+class LoadGen : public QObject {
+    Q_OBJECT
+public:
+    explicit LoadGen(const LoadGenConfig& cfg, QObject* parent = nullptr);
+
+    void start();
+
+private slots:
+    void onReport();
+    void onFinished();
+
+private:
+    void printFinal();
+    QString tag() const;
+
+    LoadGenConfig cfg_;
+    SyntheticMedia media_;
+    QVector<SimClient*> clients_;
+    QTimer reportTimer_;
+    QElapsedTimer clock_;
+    qint64 lastReportMs_{0};
+};
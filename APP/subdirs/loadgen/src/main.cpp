@@ -0,0 +1,71 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include "loadgen.h"
+
+static QSize parseSize(const QString& s, const QSize& fallback)
+{
+    const QStringList wh = s.toLower().split('x');
+    if (wh.size() != 2) return fallback;
+    const int w = wh.at(0).toInt(), h = wh.at(1).toInt();
+    return (w > 0 && h > 0) ? QSize(w, h) : fallback;
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("rt-meeting-loadgen");
+    QCoreApplication::setApplicationVersion("1.0");
+
+    LoadGenConfig cfg;
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless synthetic load generator for the meeting server");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    QCommandLineOption hostOpt("host", "Server host.", "addr", cfg.host);
+    QCommandLineOption portOpt(QStringList() << "p" << "port", "Server TCP port (UDP relay = port + 1).", "port", QString::number(cfg.port));
+    QCommandLineOption connsOpt(QStringList() << "n" << "conns", "Number of connections.", "n", QString::number(cfg.conns));
+    QCommandLineOption roomsOpt(QStringList() << "m" << "rooms", "Number of rooms (connections assigned round-robin).", "m", QString::number(cfg.rooms));
+    QCommandLineOption sendersOpt("senders", "Camera senders per room (-1 = every connection).", "n", QString::number(cfg.senders));
+    QCommandLineOption fpsOpt("fps", "Camera frames per second.", "fps", QString::number(cfg.fps));
+    QCommandLineOption sizeOpt("size", "Camera frame size.", "WxH", "640x360");
+    QCommandLineOption qualityOpt("quality", "JPEG quality (1-100).", "q", QString::number(cfg.jpegQuality));
+    QCommandLineOption noAudioOpt("no-audio", "Do not send 20 ms mu-law audio frames.");
+    QCommandLineOption screenOpt("screen-senders", "UDP screen senders per room.", "n", QString::number(cfg.screenSenders));
+    QCommandLineOption screenFpsOpt("screen-fps", "UDP screen frames per second.", "fps", QString::number(cfg.screenFps));
+    QCommandLineOption screenSizeOpt("screen-size", "UDP screen frame size.", "WxH", "1280x720");
+    QCommandLineOption screenFecOpt("screen-fec", "Data chunks per XOR parity group on UDP screen frames (0 = no parity).",
+                                    "n", QString::number(cfg.screenFec));
+    QCommandLineOption durationOpt(QStringList() << "d" << "duration", "Run time in seconds (0 = until killed).", "sec", QString::number(cfg.durationSec));
+    QCommandLineOption reportOpt("report", "Report interval in seconds.", "sec", QString::number(cfg.reportSec));
+    QCommandLineOption labelOpt("label", "Tag printed on every report line (e.g. to compare server backends).", "text");
+    QCommandLineOption clientConnOpt("client-conn", "Send and receive TCP through the client's ClientConn "
+                                     "(priority lanes, interleaved fragments) instead of raw socket writes.");
+    parser.addOptions({hostOpt, portOpt, connsOpt, roomsOpt, sendersOpt, fpsOpt, sizeOpt, qualityOpt,
+                       noAudioOpt, screenOpt, screenFpsOpt, screenSizeOpt, screenFecOpt, durationOpt, reportOpt, labelOpt,
+                       clientConnOpt});
+    parser.process(app);
+
+    cfg.host          = parser.value(hostOpt);
+    cfg.port          = quint16(parser.value(portOpt).toUInt());
+    cfg.conns         = qMax(1, parser.value(connsOpt).toInt());
+    cfg.rooms         = qMax(1, parser.value(roomsOpt).toInt());
+    cfg.senders       = parser.value(sendersOpt).toInt();
+    cfg.fps           = qBound(1, parser.value(fpsOpt).toInt(), 60);
+    cfg.frameSize     = parseSize(parser.value(sizeOpt), cfg.frameSize);
+    cfg.jpegQuality   = qBound(1, parser.value(qualityOpt).toInt(), 100);
+    cfg.audio         = !parser.isSet(noAudioOpt);
+    cfg.screenSenders = qMax(0, parser.value(screenOpt).toInt());
+    cfg.screenFps     = qBound(1, parser.value(screenFpsOpt).toInt(), 30);
+    cfg.screenSize    = parseSize(parser.value(screenSizeOpt), cfg.screenSize);
+    cfg.screenFec     = qMax(0, parser.value(screenFecOpt).toInt());
+    cfg.durationSec   = qMax(0, parser.value(durationOpt).toInt());
+    cfg.reportSec     = qMax(1, parser.value(reportOpt).toInt());
+    cfg.label         = parser.value(labelOpt);
+    cfg.clientConn    = parser.isSet(clientConnOpt);
+
+    qsrand(uint(QDateTime::currentMSecsSinceEpoch()));
+
+    LoadGen gen(cfg);
+    gen.start();
+    return app.exec();
+}
@@ -1,10 +1,12 @@
 TEMPLATE = subdirs
 CONFIG += ordered
 
-SUBDIRS += client server
+SUBDIRS += client server loadgen bench
 
 client.file = client/client.pro
 server.file = server/server.pro
+loadgen.file = loadgen/loadgen.pro
+bench.file = bench/bench.pro
 
 # 如果存在先后依赖（一般不需要），可启用：
 # server.depends =
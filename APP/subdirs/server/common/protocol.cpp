@@ -29,61 +29,282 @@ QByteArray buildPacket(quint16 type,
     return out;
 }
 
-bool drainPackets(QByteArray& buffer, QVector<Packet>& out)
+QByteArray buildMediaPacket(quint16 type,
+                            const MediaHeader& mh,
+                            const QByteArray& bin)
 {
-    bool produced = false;
+    const int ext = (mh.flags & kMediaFlagTiming) ? kMediaTimingSize : 0;
+    const quint32 length = static_cast<quint32>(kTypeSize + kMediaHeaderSize + ext + bin.size());
 
-    for (;;) {
-        if (buffer.size() < kLenFieldSize) break;
+    QByteArray out(kLenFieldSize + int(length), Qt::Uninitialized);
+    uchar* d = reinterpret_cast<uchar*>(out.data());
+    qToBigEndian<quint32>(length, d);
+    qToBigEndian<quint16>(quint16(type | kMediaHdrFlag), d + 4);
+    uchar* mp = d + kLenFieldSize + kTypeSize;
+    mp[0] = mh.kind;
+    mp[1] = mh.codec;
+    mp[2] = mh.flags;
+    mp[3] = mh.layer;
+    qToBigEndian<quint32>(mh.streamId, mp + 4);
+    qToBigEndian<quint32>(mh.seq,      mp + 8);
+    qToBigEndian<quint64>(mh.ts,       mp + 12);
+    qToBigEndian<quint16>(mh.w,        mp + 20);
+    qToBigEndian<quint16>(mh.h,        mp + 22);
+    if (ext) {
+        qToBigEndian<qint32>(mh.hubInMs,    mp + kMediaHeaderSize);
+        qToBigEndian<qint32>(mh.hubQueueMs, mp + kMediaHeaderSize + 4);
+    }
+    if (!bin.isEmpty())
+        memcpy(mp + kMediaHeaderSize + ext, bin.constData(), size_t(bin.size()));
+    return out;
+}
 
-        quint32 length = 0;
-        {
-            QDataStream peek(buffer.left(kLenFieldSize));
-            peek.setByteOrder(QDataStream::BigEndian);
-            peek >> length;
+QByteArray buildFragmentHeader(quint32 fragId, quint32 offset, quint32 total, int chunkLen)
+{
+    QByteArray out(kFragmentHeaderSize, Qt::Uninitialized);
+    uchar* d = reinterpret_cast<uchar*>(out.data());
+    qToBigEndian<quint32>(quint32(kFragmentHeaderSize - kLenFieldSize + chunkLen), d);
+    qToBigEndian<quint16>(quint16(MSG_FRAGMENT), d + 4);
+    qToBigEndian<quint32>(fragId, d + 6);
+    qToBigEndian<quint32>(offset, d + 10);
+    qToBigEndian<quint32>(total,  d + 14);
+    return out;
+}
+
+bool FragmentAssembler::feed(const Packet& frag, QByteArray& whole)
+{
+    if (frag.fragTotal == 0 || frag.fragTotal > kMaxPacketLen + kLenFieldSize) return false;
+
+    if (frag.fragOffset == 0) {
+        if (!parts_.contains(frag.fragId) && parts_.size() >= kMaxPartials) {
+            auto oldest = parts_.begin();
+            for (auto o = parts_.begin(); o != parts_.end(); ++o) {
+                if (o->order < oldest->order) oldest = o;
+            }
+            parts_.erase(oldest);
         }
+        // 不按对端声称的总长预留：缓冲随实际到达的分片增长
+        Part& part = parts_[frag.fragId];
+        part.buf.clear();
+        part.order = nextOrder_++;
+    }
+    auto it = parts_.find(frag.fragId);
+    if (it == parts_.end()) return false;
+    QByteArray& buf = it->buf;
+    // 分片必须按序、且不超出总长，否则丢弃整条
+    if (quint32(buf.size()) != frag.fragOffset ||
+        quint64(frag.fragOffset) + quint64(frag.bin.size()) > frag.fragTotal) {
+        parts_.erase(it);
+        return false;
+    }
+    buf.append(frag.bin.constData(), frag.bin.size());
+    if (quint32(buf.size()) < frag.fragTotal) return false;
+
+    whole = buf;
+    parts_.erase(it);
+    return true;
+}
+
+QJsonObject mediaHeaderToJson(const MediaHeader& mh, const QString& roomId, const QString& sender)
+{
+    if (mh.kind == MEDIA_AUDIO) {
+        return QJsonObject{
+            {"roomId", roomId},
+            {"sender", sender},
+            {"codec",  mh.codec == AUDIO_PCM16 ? "pcm16" : "mulaw"},
+            {"sr",     int(mh.w)},
+            {"ch",     int(mh.h)},
+            {"seq",    static_cast<int>(mh.seq)},
+            {"ts",     static_cast<qint64>(mh.ts)}
+        };
+    }
+    QJsonObject j{
+        {"roomId", roomId},
+        {"sender", sender},
+        {"media",  mh.kind == MEDIA_SCREEN ? "screen" : "camera"},
+        {"w",      int(mh.w)},
+        {"h",      int(mh.h)},
+        {"seq",    static_cast<int>(mh.seq)},
+        {"ts",     static_cast<qint64>(mh.ts)}
+    };
+    if (mh.flags & kMediaFlagSimulcast) j.insert("layer", int(mh.layer));
+    return j;
+}
+
+bool drainPackets(QByteArray& buffer, QVector<Packet>& out, bool parseJson)
+{
+    static const int kHeaderSize = kLenFieldSize + kTypeSize + kJsonSizeSize;
+
+    const int avail = buffer.size();
+    if (avail < kLenFieldSize) return false;
+
+    // 读游标解析：整段缓冲只在末尾压缩一次，避免逐包 remove(0,n) 的整体搬移
+    // store 与 buffer 隐式共享同一块内存，bin 作为它的只读切片交给上层
+    const QByteArray store = buffer;
+    const uchar* base = reinterpret_cast<const uchar*>(store.constData());
+    int pos = 0;
+    bool produced = false;
+
+    while (avail - pos >= kLenFieldSize) {
+        const quint32 length = qFromBigEndian<quint32>(base + pos);
 
         if (length < static_cast<quint32>(kTypeSize + kJsonSizeSize) ||
             length > kMaxPacketLen) {
             buffer.clear();
-            break;
+            return produced;
         }
 
         const int totalNeed = kLenFieldSize + static_cast<int>(length);
-        if (buffer.size() < totalNeed) break;
+        if (avail - pos < totalNeed) break;
 
-        QByteArray block = buffer.left(totalNeed);
-        buffer.remove(0, totalNeed);
+        const uchar* hdr = base + pos;
+        pos += totalNeed;
 
-        QDataStream ds(block);
-        ds.setByteOrder(QDataStream::BigEndian);
+        const quint16 type = qFromBigEndian<quint16>(hdr + kLenFieldSize);
 
-        quint32 lenField = 0; ds >> lenField; Q_UNUSED(lenField);
-        quint16 type = 0;     ds >> type;
-        quint32 jsonSize = 0; ds >> jsonSize;
+        if (type == MSG_FRAGMENT) {
+            if (length < static_cast<quint32>(kFragmentHeaderSize - kLenFieldSize)) continue;
+            const uchar* fp = hdr + kLenFieldSize + kTypeSize;
+            Packet pkt;
+            pkt.type       = MSG_FRAGMENT;
+            pkt.store      = store;
+            pkt.raw        = QByteArray::fromRawData(reinterpret_cast<const char*>(hdr), totalNeed);
+            pkt.jsonParsed = true;
+            pkt.fragId     = qFromBigEndian<quint32>(fp);
+            pkt.fragOffset = qFromBigEndian<quint32>(fp + 4);
+            pkt.fragTotal  = qFromBigEndian<quint32>(fp + 8);
+            pkt.bin        = QByteArray::fromRawData(reinterpret_cast<const char*>(hdr + kFragmentHeaderSize),
+                                                     totalNeed - kFragmentHeaderSize);
+            out.push_back(std::move(pkt));
+            produced = true;
+            continue;
+        }
 
-        const int payloadBytes = totalNeed - kLenFieldSize - kTypeSize - kJsonSizeSize;
-        if (jsonSize > static_cast<quint32>(payloadBytes) || jsonSize > kMaxJsonLen) {
+        if (type & kMediaHdrFlag) {
+            if (length < static_cast<quint32>(kTypeSize + kMediaHeaderSize)) continue;
+            const uchar* mp = hdr + kLenFieldSize + kTypeSize;
+            Packet pkt;
+            pkt.type     = type & ~kMediaHdrFlag;
+            pkt.store    = store;
+            pkt.raw      = QByteArray::fromRawData(reinterpret_cast<const char*>(hdr), totalNeed);
+            pkt.hasMedia = true;
+            pkt.jsonParsed = true;
+            pkt.media.kind     = mp[0];
+            pkt.media.codec    = mp[1];
+            pkt.media.flags    = mp[2];
+            pkt.media.layer    = mp[3];
+            pkt.media.streamId = qFromBigEndian<quint32>(mp + 4);
+            pkt.media.seq      = qFromBigEndian<quint32>(mp + 8);
+            pkt.media.ts       = qFromBigEndian<quint64>(mp + 12);
+            pkt.media.w        = qFromBigEndian<quint16>(mp + 20);
+            pkt.media.h        = qFromBigEndian<quint16>(mp + 22);
+            int ext = 0;
+            if (pkt.media.flags & kMediaFlagTiming) {
+                if (length < static_cast<quint32>(kTypeSize + kMediaHeaderSize + kMediaTimingSize)) continue;
+                pkt.media.hubInMs    = qFromBigEndian<qint32>(mp + kMediaHeaderSize);
+                pkt.media.hubQueueMs = qFromBigEndian<qint32>(mp + kMediaHeaderSize + 4);
+                ext = kMediaTimingSize;
+            }
+            const int binSize = totalNeed - kLenFieldSize - kTypeSize - kMediaHeaderSize - ext;
+            if (binSize > 0) {
+                pkt.bin = QByteArray::fromRawData(reinterpret_cast<const char*>(mp + kMediaHeaderSize + ext), binSize);
+            }
+            out.push_back(std::move(pkt));
+            produced = true;
             continue;
         }
 
-        QByteArray jsonBytes(jsonSize, Qt::Uninitialized);
-        if (jsonSize > 0) {
-            ds.readRawData(jsonBytes.data(), jsonBytes.size());
+        const quint32 jsonSize = qFromBigEndian<quint32>(hdr + kLenFieldSize + kTypeSize);
+
+        const int payloadBytes = totalNeed - kHeaderSize;
+        if (jsonSize > static_cast<quint32>(payloadBytes) || jsonSize > kMaxJsonLen) {
+            continue;
         }
-        QByteArray bin;
+
+        const char* jsonPtr = reinterpret_cast<const char*>(hdr + kHeaderSize);
+
+        Packet pkt;
+        pkt.type      = type;
+        pkt.store     = store;
+        pkt.raw       = QByteArray::fromRawData(reinterpret_cast<const char*>(hdr), totalNeed);
+        pkt.jsonBytes = QByteArray::fromRawData(jsonPtr, static_cast<int>(jsonSize));
+        if (parseJson) pkt.ensureJson();
         const int binSize = payloadBytes - static_cast<int>(jsonSize);
         if (binSize > 0) {
-            bin = block.right(binSize);
+            pkt.bin = QByteArray::fromRawData(jsonPtr + jsonSize, binSize);
         }
-
-        Packet pkt;
-        pkt.type = type;
-        pkt.json = fromJsonBytes(jsonBytes);
-        pkt.bin  = bin;
         out.push_back(std::move(pkt));
         produced = true;
     }
 
+    if (pos >= avail) buffer.clear();
+    else if (pos > 0) buffer.remove(0, pos);
+
     return produced;
 }
+
+QString peekJsonString(const QByteArray& jsonBytes, const char* key)
+{
+    const char* p   = jsonBytes.constData();
+    const char* end = p + jsonBytes.size();
+    const int keyLen = int(qstrlen(key));
+
+    auto skipWs = [&]{ while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p; };
+    // 跳过一个字符串（p 指向起始引号），返回内容区间及是否含转义
+    auto skipString = [&](const char*& b, const char*& e, bool& escaped) -> bool {
+        ++p; b = p; escaped = false;
+        while (p < end && *p != '"') {
+            if (*p == '\\') { escaped = true; ++p; }
+            ++p;
+        }
+        if (p >= end) return false;
+        e = p++;
+        return true;
+    };
+
+    skipWs();
+    if (p >= end || *p != '{') return QString();
+    ++p;
+
+    for (;;) {
+        skipWs();
+        if (p >= end || *p != '"') return QString();
+        const char *kb = nullptr, *ke = nullptr; bool kesc = false;
+        if (!skipString(kb, ke, kesc)) return QString();
+        skipWs();
+        if (p >= end || *p != ':') return QString();
+        ++p;
+        skipWs();
+        if (p >= end) return QString();
+
+        const bool match = !kesc && int(ke - kb) == keyLen && memcmp(kb, key, size_t(keyLen)) == 0;
+        if (*p == '"') {
+            const char *vb = nullptr, *ve = nullptr; bool vesc = false;
+            if (!skipString(vb, ve, vesc)) return QString();
+            if (match) {
+                if (vesc) return fromJsonBytes(jsonBytes).value(QLatin1String(key)).toString();
+                return QString::fromUtf8(vb, int(ve - vb));
+            }
+        } else {
+            if (match) return QString();
+            // 跳过数字/布尔/null/嵌套对象与数组
+            int depth = 0;
+            while (p < end) {
+                const char ch = *p;
+                if (ch == '"') {
+                    const char *b = nullptr, *e = nullptr; bool esc = false;
+                    if (!skipString(b, e, esc)) return QString();
+                    continue;
+                }
+                if (ch == '{' || ch == '[') ++depth;
+                else if (ch == '}' || ch == ']') { if (depth == 0) break; --depth; }
+                else if (ch == ',' && depth == 0) break;
+                ++p;
+            }
+        }
+        skipWs();
+        if (p >= end || *p != ',') return QString();
+        ++p;
+    }
+}
+
@@ -23,6 +23,9 @@ enum MsgType : quint16 {
     MSG_VIDEO_FRAME      = 30,  // bin: JPEG
     MSG_AUDIO_FRAME      = 40,  // 预留
     MSG_CONTROL          = 50,  // 控制/状态，如 {kind:"video", state:"on/off"}
+    MSG_FRAGMENT         = 70,  // 大包分片（协议版本 >= 3），见下方分片说明
+    MSG_SUBSCRIBE        = 80,  // 选择性订阅（协议版本 >= 4）：{subs:[{sender,camera,screen}],defaultFps}，fps<0 不限，0 不收
+    MSG_CLOCK_SYNC       = 85,  // 时钟同步（协议版本 >= 6）：客户端 {t0}，服务器原样带回并附 {t1,t2}
 
     MSG_SERVER_EVENT     = 90,  // 服务器事件，如房间成员列表
     MSG_FILE             = 60,  // 文件/图片传输（bin 载荷）
@@ -36,13 +39,91 @@ static const quint16 MSG_ANNOT = 1206;
 constexpr quint32 kMaxPacketLen = 8u * 1024u * 1024u; // 8MB
 constexpr quint32 kMaxJsonLen   = 1u * 1024u * 1024u; // 1MB
 
-// 一条完整消息
-struct Packet {
-    quint16 type = 0;
-    QJsonObject json;
-    QByteArray bin; // 可为空
+// ===============================================
+// 媒体帧二进制定长头（协议版本 >= 2，由 MSG_JOIN_WORKORDER 的 protoVer 协商）
+// 结构: [uint32 length][uint16 type|kMediaHdrFlag][MediaHeader 24B][bin...]
+// 仅用于 MSG_VIDEO_FRAME / MSG_AUDIO_FRAME，控制类消息仍走 JSON
+// ===============================================
+// 协议版本：2 = 媒体帧二进制头；3 = 大包分片交错（MSG_FRAGMENT）；4 = 选择性订阅（MSG_SUBSCRIBE）；
+//           5 = 摄像头联播（同一帧多层，服务器按接收者选层）；
+//           6 = 时钟同步（MSG_CLOCK_SYNC）+ 媒体时间戳扩展（kMediaFlagTiming）
+constexpr int     kProtoVersion    = 6;
+constexpr quint16 kMediaHdrFlag    = 0x8000;
+constexpr int     kMediaHeaderSize = 24;
+
+enum MediaKind : quint8 { MEDIA_CAMERA = 0, MEDIA_SCREEN = 1, MEDIA_AUDIO = 2 };
+enum AudioCodec : quint8 { AUDIO_MULAW = 0, AUDIO_PCM16 = 1 };
+
+// 摄像头联播：发送端每帧编码多层，服务器只把接收者需要的那一层转发给它
+enum SimulcastLayer { LAYER_THUMB = 0, LAYER_MEDIUM = 1, LAYER_FULL = 2, LAYER_COUNT = 3 };
+constexpr quint8 kMediaFlagSimulcast = 0x01;
+
+// 媒体时间戳扩展（协议版本 >= 6）：flags 含 kMediaFlagTiming 时媒体头后紧跟 8 字节
+//   [int32 hubInMs][int32 hubQueueMs]，发送端填 0，服务器在转发时写入
+// - 此时 ts 为发送端按时钟同步换算后的服务器时钟
+// - hubInMs   : 服务器收到该帧的时刻 - ts（采集、编码、发送排队与上行网络）
+// - hubQueueMs: 服务器把该帧交给内核的时刻 - 收到时刻（扇出排队）
+constexpr quint8 kMediaFlagTiming  = 0x02;
+constexpr int    kMediaTimingSize  = 8;
+constexpr int    kTimingProtoVersion = 6;
+
+struct MediaHeader {
+    quint8  kind     = MEDIA_CAMERA;
+    quint8  codec    = 0;  // 视频: 0=JPEG；音频: AudioCodec
+    quint8  flags    = 0;  // kMediaFlag*
+    quint8  layer    = 0;  // 联播层（flags 含 kMediaFlagSimulcast 时有效）
+    quint32 streamId = 0;  // 服务器在入会 ack 中分配的发送者数字 id
+    quint32 seq      = 0;
+    quint64 ts       = 0;  // 发送端毫秒时间戳
+    quint16 w        = 0;  // 视频宽；音频为采样率
+    quint16 h        = 0;  // 视频高；音频为声道数
+    qint32  hubInMs    = 0; // 以下两项仅 flags 含 kMediaFlagTiming 时在线上出现
+    qint32  hubQueueMs = 0;
 };
 
+// ===============================================
+// 出站优先级通道：control > audio > annotation > video > file
+// 大包（视频/文件）按 kFragmentChunk 拆成 MSG_FRAGMENT 分片，与高优先级消息交错发送
+// 分片结构: [uint32 length][uint16 MSG_FRAGMENT][uint32 fragId][uint32 offset][uint32 total][chunk...]
+// - 分片负载拼起来是一条完整的原始线上帧（含它自己的 length/type 头）
+// - 同一 fragId 的分片在同一条 TCP 上按序到达，接收端顺序拼接即可
+// ===============================================
+enum Lane { LANE_CONTROL = 0, LANE_AUDIO, LANE_ANNOT, LANE_VIDEO, LANE_FILE, LANE_COUNT };
+
+constexpr int kFragmentHeaderSize = 4 + 2 + 12;
+constexpr int kFragmentThreshold  = 24 * 1024; // 超过该大小的线上帧才分片
+constexpr int kFragmentChunk      = 16 * 1024;
+
+inline int laneForType(quint16 type) {
+    switch (type) {
+    case MSG_AUDIO_FRAME: return LANE_AUDIO;
+    case MSG_ANNOT:       return LANE_ANNOT;
+    case MSG_VIDEO_FRAME: return LANE_VIDEO;
+    case MSG_FILE:        return LANE_FILE;
+    default:              return LANE_CONTROL;
+    }
+}
+
+// 已编码线上帧的 type 字段（含媒体头标志位）；长度不足时返回 0
+inline quint16 wireType(const QByteArray& wire) {
+    if (wire.size() < 6) return 0;
+    return qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(wire.constData()) + 4);
+}
+
+// 已编码线上帧带媒体时间戳扩展时返回扩展在帧内的偏移，否则返回 -1
+inline int mediaTimingOffset(const char* wire, int size) {
+    const int off = 4 + 2 + kMediaHeaderSize;
+    if (size < off + kMediaTimingSize) return -1;
+    const quint16 type = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(wire) + 4);
+    if (!(type & kMediaHdrFlag) || !(quint8(wire[6 + 2]) & kMediaFlagTiming)) return -1;
+    return off;
+}
+
+// 已编码线上帧所属通道（忽略媒体头标志位）
+inline int laneForWire(const QByteArray& wire) {
+    return laneForType(quint16(wireType(wire) & ~kMediaHdrFlag));
+}
+
 inline QByteArray toJsonBytes(const QJsonObject& j) {
     return QJsonDocument(j).toJson(QJsonDocument::Compact);
 }
@@ -51,8 +132,61 @@ inline QJsonObject fromJsonBytes(const QByteArray& b) {
     return doc.isObject() ? doc.object() : QJsonObject{};
 }
 
+// 一条完整消息
+struct Packet {
+    quint16 type = 0;
+    QJsonObject json; // drainPackets(parseJson=false) 时为空，按需调用 ensureJson()
+    QByteArray bin; // 可为空；接收端为 store 的只读切片，勿脱离 Packet 长期持有
+    QByteArray jsonBytes; // 原始 JSON 字节（store 的切片）
+    QByteArray raw;   // 完整线上帧 [len][type][jsonSize][json][bin]（store 的切片），可原样转发
+    QByteArray store; // 以上切片所引用的接收缓冲（隐式共享，保证切片有效）
+                      // 注意：切片写入 socket 请用 write(constData(), size())，Qt 可能浅持有 QByteArray
+    bool jsonParsed = false;
+    bool hasMedia = false; // 二进制媒体头格式（此时 json/jsonBytes 为空）
+    MediaHeader media;
+    quint32 fragId = 0, fragOffset = 0, fragTotal = 0; // type == MSG_FRAGMENT 时有效，bin 为分片数据
+
+    const QJsonObject& ensureJson() {
+        if (!jsonParsed) { json = fromJsonBytes(jsonBytes); jsonParsed = true; }
+        return json;
+    }
+
+    // 需要脱离 Packet 长期保存负载时使用（深拷贝）
+    QByteArray ownedBin() const { return QByteArray(bin.constData(), bin.size()); }
+};
+
 QByteArray buildPacket(quint16 type,
                        const QJsonObject& json,
                        const QByteArray& bin = QByteArray());
 
-bool drainPackets(QByteArray& buffer, QVector<Packet>& out);
+QByteArray buildMediaPacket(quint16 type,
+                            const MediaHeader& mh,
+                            const QByteArray& bin);
+
+// 分片头（18B）；chunk 由调用方紧随其后发送
+QByteArray buildFragmentHeader(quint32 fragId, quint32 offset, quint32 total, int chunkLen);
+
+// 分片重组：feed 返回 true 时 whole 为一条完整的原始线上帧，可再交给 drainPackets
+class FragmentAssembler {
+public:
+    bool feed(const Packet& frag, QByteArray& whole);
+    void clear() { parts_.clear(); }
+private:
+    struct Part {
+        QByteArray buf;
+        quint64 order = 0;  // 开始拼装的先后，超出上限时丢最旧的
+    };
+    // 发送端每条车道最多同时交错一条分片消息；多出来的只可能是恶意或残留
+    static constexpr int kMaxPartials = LANE_COUNT;
+    QHash<quint32, Part> parts_;
+    quint64 nextOrder_ = 0;
+};
+
+// 媒体头转成旧版 JSON 头（给未协商 protoVer 的旧客户端/录制服务）
+QJsonObject mediaHeaderToJson(const MediaHeader& mh, const QString& roomId, const QString& sender);
+
+// parseJson=false：只切出 jsonBytes/raw，不构建 QJsonObject（转发路径用）
+bool drainPackets(QByteArray& buffer, QVector<Packet>& out, bool parseJson = true);
+
+// 不构建 QJsonObject，直接从 Compact JSON 顶层读取一个字符串字段；含转义时回退完整解析
+QString peekJsonString(const QByteArray& jsonBytes, const char* key);
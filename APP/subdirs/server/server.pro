@@ -11,6 +11,11 @@ INCLUDEPATH += $$PWD/src
 SOURCES += \
     src/main.cpp \
     src/roomhub.cpp \
+    src/transport.cpp \
+    src/epolltransport.cpp \
+    src/fanout.cpp \
+    src/metrics.cpp \
+    src/hotlog.cpp \
     src/udprelay.cpp \
     src/udpmedia_client.cpp \
     src/recorder.cpp \
@@ -19,6 +24,11 @@ SOURCES += \
 
 HEADERS += \
     src/roomhub.h \
+    src/transport.h \
+    src/epolltransport.h \
+    src/fanout.h \
+    src/metrics.h \
+    src/hotlog.h \
     src/udprelay.h \
     src/udpmedia_client.h \
     src/recorder.h \
@@ -0,0 +1,273 @@
+#include "epolltransport.h"
+#include "roomhub.h"
+
+#ifdef Q_OS_LINUX
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+EpollTransport::EpollTransport(RoomShard* shard) : QObject(shard), shard_(shard)
+{
+}
+
+EpollTransport::~EpollTransport()
+{
+    delete notifier_;
+#ifdef Q_OS_LINUX
+    if (listenFd_ >= 0) ::close(listenFd_);
+    if (epfd_ >= 0) ::close(epfd_);
+#endif
+    for (ClientCtx* c : graveyard_) {
+        delete c->out;
+        delete c;
+    }
+}
+
+bool EpollTransport::available()
+{
+#ifdef Q_OS_LINUX
+    return true;
+#else
+    return false;
+#endif
+}
+
+quintptr EpollTransport::peerId(const ClientCtx* c) const
+{
+    return quintptr(c->fd);
+}
+
+int EpollTransport::openListener(quint16 port, QString* error)
+{
+#ifdef Q_OS_LINUX
+    const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // 每个分片各绑一个同端口的监听 socket，内核按四元组哈希分配新连接
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        if (error) *error = QStringLiteral("SO_REUSEPORT: ") + QString::fromLocal8Bit(strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(fd, SOMAXCONN) < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    Q_UNUSED(port);
+    if (error) *error = QStringLiteral("epoll backend requires Linux");
+    return -1;
+#endif
+}
+
+void EpollTransport::start()
+{
+#ifdef Q_OS_LINUX
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0) {
+        qCritical() << "[hub] shard" << shard_->index() << "epoll_create1 failed:" << strerror(errno);
+        return;
+    }
+    if (listenFd_ >= 0) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = nullptr; // nullptr 标记监听 socket
+        ::epoll_ctl(epfd_, EPOLL_CTL_ADD, listenFd_, &ev);
+    }
+    notifier_ = new QSocketNotifier(epfd_, QSocketNotifier::Read, this);
+    connect(notifier_, &QSocketNotifier::activated, this, &EpollTransport::poll);
+#endif
+}
+
+bool EpollTransport::watch(ClientCtx* c)
+{
+#ifdef Q_OS_LINUX
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    return epfd_ >= 0 && ::epoll_ctl(epfd_, EPOLL_CTL_ADD, c->fd, &ev) == 0;
+#else
+    Q_UNUSED(c);
+    return false;
+#endif
+}
+
+void EpollTransport::adoptDescriptor(qintptr fd)
+{
+#ifdef Q_OS_LINUX
+    const int flags = ::fcntl(int(fd), F_GETFL, 0);
+    ::fcntl(int(fd), F_SETFL, flags | O_NONBLOCK);
+    auto* c = new ClientCtx;
+    c->fd = int(fd);
+    c->out = new OutQueue(c->fd, this);
+    if (!watch(c)) {
+        qWarning() << "[hub] shard" << shard_->index() << "epoll add failed:" << strerror(errno);
+        ::close(c->fd);
+        delete c->out;
+        delete c;
+        return;
+    }
+    shard_->connectionOpened(c);
+#else
+    Q_UNUSED(fd);
+#endif
+}
+
+void EpollTransport::acceptAll()
+{
+#ifdef Q_OS_LINUX
+    for (;;) {
+        const int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                qWarning() << "[hub] shard" << shard_->index() << "accept failed:" << strerror(errno);
+            }
+            return;
+        }
+        adoptDescriptor(fd);
+    }
+#endif
+}
+
+bool EpollTransport::attach(ClientCtx* c)
+{
+    c->out->setDriver(this);
+    if (!watch(c)) return false;
+    // 移交途中可能积压了出站数据（flush 标志也要复位），立即发一次
+    c->out->flush();
+    return true;
+}
+
+void EpollTransport::detach(ClientCtx* c, QThread* target)
+{
+#ifdef Q_OS_LINUX
+    if (epfd_ >= 0) ::epoll_ctl(epfd_, EPOLL_CTL_DEL, c->fd, nullptr);
+#endif
+    dirty_.remove(c->out);
+    c->out->moveToThread(target);
+}
+
+void EpollTransport::readPending(ClientCtx* c)
+{
+    // 对端已关闭的情况交给随后的 EPOLLRDHUP 处理
+    readAll(c);
+}
+
+bool EpollTransport::readAll(ClientCtx* c)
+{
+#ifdef Q_OS_LINUX
+    if (readBuf_.size() != kReadChunk) readBuf_.resize(kReadChunk);
+    for (;;) {
+        // 先读进复用缓冲再按实际字节数追加：连接缓冲不再带 64KB 空尾，
+        // 帧切片的 owner（SharedFrame/CachedFrame）只钉住真正收到的字节。
+        // 短读说明内核缓冲已空，边沿触发下新数据会再通知
+        const ssize_t n = ::read(c->fd, readBuf_.data(), kReadChunk);
+        if (n > 0) {
+            c->buffer.append(readBuf_.constData(), int(n));
+            if (n < kReadChunk) return true;
+            continue;
+        }
+        if (n == 0) return false;
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+#else
+    Q_UNUSED(c);
+    return false;
+#endif
+}
+
+void EpollTransport::poll()
+{
+#ifdef Q_OS_LINUX
+    inBatch_ = true;
+    epoll_event evs[kMaxEvents];
+    for (int round = 0; round < kMaxRounds; ++round) {
+        const int n = ::epoll_wait(epfd_, evs, kMaxEvents, 0);
+        for (int i = 0; i < n; ++i) {
+            if (!evs[i].data.ptr) { acceptAll(); continue; }
+            auto* c = static_cast<ClientCtx*>(evs[i].data.ptr);
+            const quint32 e = evs[i].events;
+            if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                const bool open = readAll(c);
+                if (!c->buffer.isEmpty()) shard_->bytesArrived(c);
+                if (!open) { hangup(c); continue; }
+            }
+            if (e & EPOLLOUT) c->out->flush();
+        }
+        if (n < kMaxEvents) break;
+    }
+    inBatch_ = false;
+    flushDirty();
+    for (ClientCtx* c : graveyard_) {
+        delete c->out;
+        delete c;
+    }
+    graveyard_.clear();
+#endif
+}
+
+void EpollTransport::requestFlush(OutQueue* q)
+{
+    dirty_.insert(q);
+    // 批处理中由 poll() 收尾统一 flush；批处理外（定时器、排队调用）投递一次
+    if (inBatch_ || flushPosted_) return;
+    flushPosted_ = true;
+    QMetaObject::invokeMethod(this, "flushDirty", Qt::QueuedConnection);
+}
+
+void EpollTransport::flushDirty()
+{
+    flushPosted_ = false;
+    QSet<OutQueue*> batch;
+    batch.swap(dirty_);
+    for (OutQueue* q : batch) q->flush();
+}
+
+void EpollTransport::hangup(ClientCtx* c)
+{
+    shard_->connectionClosed(c); // 分片移出房间后回调 destroy()
+}
+
+void EpollTransport::destroy(ClientCtx* c)
+{
+#ifdef Q_OS_LINUX
+    if (c->fd >= 0) {
+        if (epfd_ >= 0) ::epoll_ctl(epfd_, EPOLL_CTL_DEL, c->fd, nullptr);
+        ::close(c->fd);
+        c->fd = -1;
+    }
+#endif
+    if (c->out) {
+        dirty_.remove(c->out);
+        c->out->close();
+    }
+    // 本批后续事件可能还指向它，批处理结束后再释放
+    if (inBatch_) {
+        graveyard_.append(c);
+        return;
+    }
+    delete c->out;
+    delete c;
+}
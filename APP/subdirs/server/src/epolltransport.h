@@ -0,0 +1,63 @@
+#pragma once
+#include <QtCore>
+#include "transport.h"
+#include "fanout.h"
+
+// ===============================================
+// epoll 后端（仅 Linux）
+// - 每个分片一个 SO_REUSEPORT 监听 socket，由内核把新连接分到各分片，主线程不再 accept
+// - 分片的所有连接注册在同一个边沿触发 epoll 上；epoll fd 本身挂在分片事件循环的
+//   QSocketNotifier 上，定时器/排队调用照常工作
+// - 可读时直接 read() 进 ClientCtx::buffer 尾部，不经过 QTcpSocket 的内部缓冲
+// - OutQueue 的 flush 请求在一批事件处理完后统一执行（一批里多次入队只发一次 sendmsg）
+// ===============================================
+class EpollTransport : public QObject, public HubTransport, public OutDriver {
+    Q_OBJECT
+public:
+    explicit EpollTransport(RoomShard* shard);
+    ~EpollTransport();
+
+    // 平台是否支持；不支持时 RoomHub 退回 Qt 后端
+    static bool available();
+    // 在主线程创建 SO_REUSEPORT 监听 socket；失败返回 -1
+    static int openListener(quint16 port, QString* error);
+
+    // 需在分片线程启动前调用；transport 接管 fd
+    void setListenFd(int fd) { listenFd_ = fd; }
+
+    const char* name() const override { return "epoll"; }
+    void start() override;
+    void adoptDescriptor(qintptr fd) override;
+    bool attach(ClientCtx* c) override;
+    void detach(ClientCtx* c, QThread* target) override;
+    void readPending(ClientCtx* c) override;
+    void destroy(ClientCtx* c) override;
+    quintptr peerId(const ClientCtx* c) const override;
+
+    void requestFlush(OutQueue* q) override;
+
+private slots:
+    void poll();
+    void flushDirty();
+
+private:
+    bool watch(ClientCtx* c);
+    void acceptAll();
+    // 读到 EAGAIN 为止；返回 false 表示对端已关闭或出错
+    bool readAll(ClientCtx* c);
+    void hangup(ClientCtx* c);
+
+    RoomShard* shard_{nullptr};
+    int epfd_{-1};
+    int listenFd_{-1};
+    QSocketNotifier* notifier_{nullptr};
+    QSet<OutQueue*> dirty_;
+    bool inBatch_{false};
+    bool flushPosted_{false};
+    QVector<ClientCtx*> graveyard_; // 本批内关闭的连接，批处理结束后再删除
+    QByteArray readBuf_;            // 本分片线程复用的 read() 缓冲，只把读到的字节追加进连接缓冲
+
+    static constexpr int kMaxEvents = 256;
+    static constexpr int kMaxRounds = 4;          // 一次回调最多连取几批，避免饿死定时器
+    static constexpr int kReadChunk = 64 * 1024;  // 每次 read() 最多读多少
+};
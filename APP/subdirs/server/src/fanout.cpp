@@ -0,0 +1,329 @@
+#include "fanout.h"
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <string.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+// ========== SharedFrame ==========
+SharedFrame::SharedFrame(const QByteArray& bytes, const QByteArray& owner, const RoomMemStatsPtr& stats,
+                         qint64 ingressMs)
+    : bytes_(bytes), owner_(owner), stats_(stats), ingressMs_(ingressMs)
+{
+    if (!owner_.isEmpty() && bytes_.size() < kCopyBelow) {
+        bytes_ = QByteArray(bytes.constData(), bytes.size());
+        owner_.clear();
+    }
+    if (stats_) stats_->addShared(bytes_.size());
+}
+
+SharedFrame::~SharedFrame()
+{
+    if (stats_) stats_->addShared(-bytes_.size());
+}
+
+// ========== OutQueue ==========
+OutQueue::OutQueue(QTcpSocket* sock) : QObject(sock), sock_(sock), fd_(int(sock->socketDescriptor()))
+{
+    sock_->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+#ifdef Q_OS_UNIX
+    applySocketOptions(fd_);
+    notifier_ = new QSocketNotifier(fd_, QSocketNotifier::Write, this);
+    notifier_->setEnabled(false);
+    connect(notifier_, &QSocketNotifier::activated, this, &OutQueue::flush);
+#endif
+    connect(sock_, &QAbstractSocket::stateChanged, this, &OutQueue::onStateChanged);
+}
+
+OutQueue::OutQueue(int fd, OutDriver* driver) : fd_(fd), driver_(driver), open_(true)
+{
+#ifdef Q_OS_UNIX
+    int one = 1;
+    ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    applySocketOptions(fd_);
+#endif
+}
+
+void OutQueue::applySocketOptions(int fd)
+{
+#if defined(Q_OS_UNIX) && defined(TCP_NOTSENT_LOWAT)
+    // 内核里只留少量未发送数据，排队主要发生在本队列，优先级才能生效
+    int lowat = 64 * 1024;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#else
+    Q_UNUSED(fd);
+#endif
+}
+
+void OutQueue::close()
+{
+    open_ = false;
+    clear();
+}
+
+OutQueue::~OutQueue()
+{
+    clear();
+}
+
+const qint64 OutQueue::kLaneBudget[LANE_COUNT] = {
+    0,                 // LANE_CONTROL
+    256 * 1024,        // LANE_AUDIO：约 10 秒 PCM，再多已无实时意义
+    1 * 1024 * 1024,   // LANE_ANNOT
+    3 * 1024 * 1024,   // LANE_VIDEO
+    16 * 1024 * 1024,  // LANE_FILE
+};
+
+bool OutQueue::enqueue(const SharedFramePtr& frame, int lane, quint64 key)
+{
+    if (!frame || frame->size() <= 0) return false;
+    if (!connected()) return false;
+    if (lane < 0 || lane >= LANE_COUNT) lane = LANE_CONTROL;
+    if (!admit(frame, lane, key)) return true; // 已就地替换
+    if (kLaneBudget[lane] > 0 && lanePending_[lane] + frame->size() > kLaneBudget[lane]) {
+        ++drops_.dropped[lane];
+        return false;
+    }
+    Item it;
+    it.frame = frame;
+    it.key = key;
+    lanes_[lane].push_back(it);
+    pending_ += frame->size();
+    pendingHighWater_ = qMax(pendingHighWater_, pending_);
+    lanePending_[lane] += frame->size();
+    if (RoomMemStats* st = frame->stats()) st->addQueued(frame->size());
+    scheduleFlush();
+    return true;
+}
+
+bool OutQueue::enqueue(const QByteArray& bytes, int lane)
+{
+    return enqueue(SharedFramePtr(new SharedFrame(bytes, QByteArray(), RoomMemStatsPtr())), lane);
+}
+
+bool OutQueue::admit(const SharedFramePtr& frame, int lane, quint64 key)
+{
+    // 返回 false 表示新帧已替换旧帧，无需再入队
+    std::deque<Item>& q = lanes_[lane];
+    if (lane == LANE_VIDEO && key != 0) {
+        for (Item& it : q) {
+            if (it.key == key && it.staged == 0) {
+                replaceItem(it, lane, frame);
+                ++drops_.replaced;
+                return false;
+            }
+        }
+    }
+    if (lane == LANE_AUDIO) {
+        // 过期音频没有播放价值：丢最旧的、尚未开始发送的帧给新帧腾位置
+        auto it = q.begin();
+        while (kLaneBudget[lane] > 0 && lanePending_[lane] + frame->size() > kLaneBudget[lane] && it != q.end()) {
+            if (it->staged != 0) { ++it; continue; }
+            dropItem(q, it, lane);
+            it = q.begin();
+        }
+    }
+    return true;
+}
+
+void OutQueue::replaceItem(Item& it, int lane, const SharedFramePtr& frame)
+{
+    const qint64 delta = qint64(frame->size()) - it.frame->size();
+    if (RoomMemStats* st = it.frame->stats()) st->addQueued(-it.frame->size());
+    if (RoomMemStats* st = frame->stats()) st->addQueued(frame->size());
+    it.frame = frame;
+    pending_ += delta;
+    lanePending_[lane] += delta;
+}
+
+void OutQueue::dropItem(std::deque<Item>& q, std::deque<Item>::iterator it, int lane)
+{
+    const int size = it->frame->size();
+    if (RoomMemStats* st = it->frame->stats()) st->addQueued(-size);
+    pending_ -= size;
+    lanePending_[lane] -= size;
+    ++drops_.dropped[lane];
+    q.erase(it);
+}
+
+void OutQueue::scheduleFlush()
+{
+    // 推迟到本轮事件处理结束：同一次 readyRead 里产生的多帧合并成一次 sendmsg
+    if (flushScheduled_) return;
+    if (driver_) {
+        flushScheduled_ = true;
+        driver_->requestFlush(this);
+        return;
+    }
+    if (notifier_ && notifier_->isEnabled()) return; // 正在等可写通知
+    flushScheduled_ = true;
+    QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+}
+
+bool OutQueue::stageNext()
+{
+    // 从最高优先级的非空通道取下一个发送单元：小帧整帧，大帧一次一个分片
+    for (int lane = 0; lane < LANE_COUNT; ++lane) {
+        std::deque<Item>& q = lanes_[lane];
+        if (q.empty()) continue;
+        Item& it = q.front();
+        const int size = it.frame->size();
+
+        Unit u;
+        u.frame = it.frame;
+        u.from = it.staged;
+        if (it.staged == 0) u.patch = timingPatch(*it.frame);
+        // 已开始分片的帧必须分片发完：重新入会降了协议版本时，半截帧裸写会打乱接收端字节流
+        if ((fragment_ && size > kFragmentThreshold) || it.fragId != 0) {
+            if (it.fragId == 0) {
+                if (nextFragId_ == 0) nextFragId_ = 1; // 0 表示未分片
+                it.fragId = nextFragId_++;
+            }
+            u.len = qMin(kFragmentChunk, size - it.staged);
+            u.header = buildFragmentHeader(it.fragId, quint32(it.staged), quint32(size), u.len);
+        } else {
+            u.len = size - it.staged;
+        }
+        it.staged += u.len;
+        lanePending_[lane] -= u.len;
+        if (it.staged >= size) q.pop_front();
+
+        stagedBytes_ += u.header.size() + u.len;
+        staged_.push_back(u);
+        return true;
+    }
+    return false;
+}
+
+QByteArray OutQueue::timingPatch(const SharedFrame& frame)
+{
+    if (frame.ingressMs() == 0) return QByteArray();
+    const int off = mediaTimingOffset(frame.data(), frame.size());
+    if (off < 0) return QByteArray();
+    // 只拷贝帧头到扩展结束这几十字节，帧本体仍由所有接收者共享
+    QByteArray patch(frame.data(), off + kMediaTimingSize);
+    uchar* d = reinterpret_cast<uchar*>(patch.data());
+    const qint64 ts = qint64(qFromBigEndian<quint64>(d + 6 + 12));
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qToBigEndian<qint32>(qint32(frame.ingressMs() - ts), d + off);
+    qToBigEndian<qint32>(qint32(now - frame.ingressMs()), d + off + 4);
+    return patch;
+}
+
+void OutQueue::consume(qint64 n)
+{
+    while (n > 0 && !staged_.empty()) {
+        Unit& u = staged_.front();
+        const int total = u.header.size() + u.len;
+        const int take = int(qMin<qint64>(n, total - u.written));
+        // 只有帧本身的字节计入待发/内存统计，分片头不算
+        const int frameBefore = qMax(0, u.written - u.header.size());
+        u.written += take;
+        const int frameAfter = qMax(0, u.written - u.header.size());
+        const int done = frameAfter - frameBefore;
+        pending_ -= done;
+        if (RoomMemStats* st = u.frame->stats()) st->addQueued(-done);
+        stagedBytes_ -= take;
+        n -= take;
+        if (u.written >= total) staged_.pop_front();
+    }
+}
+
+void OutQueue::clear()
+{
+    for (const Unit& u : staged_) {
+        const int left = u.len - qMax(0, u.written - u.header.size());
+        if (RoomMemStats* st = u.frame->stats()) st->addQueued(-left);
+    }
+    staged_.clear();
+    stagedBytes_ = 0;
+    for (int lane = 0; lane < LANE_COUNT; ++lane) {
+        for (const Item& it : lanes_[lane]) {
+            if (RoomMemStats* st = it.frame->stats()) st->addQueued(-(it.frame->size() - it.staged));
+        }
+        lanes_[lane].clear();
+        lanePending_[lane] = 0;
+    }
+    pending_ = 0;
+}
+
+void OutQueue::flush()
+{
+    flushScheduled_ = false;
+    if (!connected()) { clear(); return; }
+
+#ifdef Q_OS_UNIX
+    const int fd = fd_;
+    struct iovec iov[kMaxIov];
+    for (;;) {
+        // 预排的字节少时才从通道补充，保证后到的高优先级帧最多等 kStageBytes
+        while (stagedBytes_ < kStageBytes && int(staged_.size()) * 2 < kMaxIov && stageNext()) {}
+        if (staged_.empty()) break;
+
+        int n = 0;
+        for (auto it = staged_.begin(); it != staged_.end() && n + 3 <= kMaxIov; ++it) {
+            const int hs = it->header.size();
+            if (it->written < hs) {
+                iov[n].iov_base = const_cast<char*>(it->header.constData() + it->written);
+                iov[n].iov_len  = size_t(hs - it->written);
+                ++n;
+            }
+            int off = qMax(0, it->written - hs);
+            const int ps = it->patch.size();
+            if (off < ps) {
+                iov[n].iov_base = const_cast<char*>(it->patch.constData() + off);
+                iov[n].iov_len  = size_t(ps - off);
+                ++n;
+                off = ps;
+            }
+            if (off < it->len) {
+                iov[n].iov_base = const_cast<char*>(it->frame->data() + it->from + off);
+                iov[n].iov_len  = size_t(it->len - off);
+                ++n;
+            }
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        const ssize_t w = ::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            // 对端已断开等：丢弃队列，断开由读侧 disconnected 处理
+            clear();
+            break;
+        }
+        consume(w);
+    }
+    if (notifier_) notifier_->setEnabled(!staged_.empty());
+#else
+    while (stageNext()) {}
+    for (const Unit& u : staged_) {
+        if (!u.header.isEmpty()) sock_->write(u.header.constData(), u.header.size());
+        if (!u.patch.isEmpty()) sock_->write(u.patch.constData(), u.patch.size());
+        sock_->write(u.frame->data() + u.from + u.patch.size(), u.len - u.patch.size());
+    }
+    clear();
+#endif
+}
+
+void OutQueue::onStateChanged(QAbstractSocket::SocketState st)
+{
+    if (st == QAbstractSocket::ConnectedState) return;
+    // 描述符即将关闭，之后可能被新连接复用：立即停止监听并释放所有共享帧
+    if (notifier_) {
+        notifier_->setEnabled(false);
+        notifier_->deleteLater();
+        notifier_ = nullptr;
+    }
+    clear();
+}
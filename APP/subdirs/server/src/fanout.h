@@ -0,0 +1,171 @@
+#pragma once
+#include <QtCore>
+#include <QtNetwork>
+#include <deque>
+#include "protocol.h"
+
+// ===============================================
+// 零拷贝扇出
+// - SharedFrame: 一份不可变的出站帧，所有订阅者队列共享同一块内存（引用计数），
+//   最后一个接收者发送完毕后释放
+// - OutQueue  : 单连接出站队列，绕过 QTcpSocket 写缓冲，直接在描述符上
+//   sendmsg(iovec[]) 批量发送；按 Lane 分优先级，大帧拆成 MSG_FRAGMENT 与音频交错
+// ===============================================
+
+// 房间级出站内存统计
+// - sharedBytes: 共享帧实际占用（每帧只计一次）
+// - queuedBytes: 各订阅者队列待发字节之和（即逐 socket 拷贝时会占用的内存）
+// 连接换分片时队列里的帧会随 socket 到另一个线程释放，所以计数用原子量
+struct RoomMemStats {
+    QAtomicInteger<qint64> sharedBytes{0};
+    QAtomicInteger<qint64> sharedHighWater{0};
+    QAtomicInteger<qint64> queuedBytes{0};
+    QAtomicInteger<qint64> queuedHighWater{0};
+
+    void addShared(qint64 n) { raise(sharedHighWater, sharedBytes.fetchAndAddOrdered(n) + n); }
+    void addQueued(qint64 n) { raise(queuedHighWater, queuedBytes.fetchAndAddOrdered(n) + n); }
+    void resetHighWater() { sharedHighWater.store(sharedBytes.load()); queuedHighWater.store(queuedBytes.load()); }
+
+private:
+    static void raise(QAtomicInteger<qint64>& hw, qint64 v) {
+        qint64 cur = hw.load();
+        while (v > cur && !hw.testAndSetOrdered(cur, v, cur)) {}
+    }
+};
+using RoomMemStatsPtr = QSharedPointer<RoomMemStats>;
+
+class SharedFrame {
+public:
+    // bytes 可以是 owner 的只读切片；owner 为空表示 bytes 自身持有存储。
+    // 小于 kCopyBelow 的切片直接拷一份，不让音频/控制这类小帧钉住整块接收缓冲
+    // ingressMs 非 0 且帧带媒体时间戳扩展时，出队时写入 hubInMs/hubQueueMs（见 OutQueue::stageNext）
+    SharedFrame(const QByteArray& bytes, const QByteArray& owner, const RoomMemStatsPtr& stats,
+                qint64 ingressMs = 0);
+    ~SharedFrame();
+
+    const char* data() const { return bytes_.constData(); }
+    int size() const { return bytes_.size(); }
+    RoomMemStats* stats() const { return stats_.data(); }
+    qint64 ingressMs() const { return ingressMs_; }
+
+    static constexpr int kCopyBelow = 4 * 1024;
+
+private:
+    Q_DISABLE_COPY(SharedFrame)
+    QByteArray bytes_;
+    QByteArray owner_;
+    RoomMemStatsPtr stats_;
+    qint64 ingressMs_ = 0;
+};
+using SharedFramePtr = QSharedPointer<const SharedFrame>;
+
+// 单个订阅者的丢帧计数
+// - dropped[lane]: 超出该通道预算被丢弃的帧数
+// - replaced     : 视频 latest-wins 被同源新帧替换的旧帧数
+struct OutDropStats {
+    quint64 dropped[LANE_COUNT] = {};
+    quint64 replaced = 0;
+
+    quint64 total() const {
+        quint64 n = replaced;
+        for (quint64 d : dropped) n += d;
+        return n;
+    }
+};
+
+class OutQueue;
+
+// 出站队列的调度方（epoll 后端）：flush 请求先登记，由分片事件循环在一批事件处理完后统一发送；
+// 可写通知来自 epoll 的 EPOLLOUT。Qt 后端不用它，走排队调用 + QSocketNotifier
+class OutDriver {
+public:
+    virtual ~OutDriver() {}
+    virtual void requestFlush(OutQueue* q) = 0;
+};
+
+class OutQueue : public QObject {
+    Q_OBJECT
+public:
+    // 以 socket 为 parent，随 socket 一起销毁
+    explicit OutQueue(QTcpSocket* sock);
+    // 裸描述符（epoll 后端）：不持有 fd，由后端负责关闭；连接断开时后端调用 close()
+    OutQueue(int fd, OutDriver* driver);
+    ~OutQueue();
+
+    // 按通道预算入队，被丢弃时返回 false
+    // key 非 0 的视频帧按 latest-wins 处理：替换队列中同 key 且尚未开始发送的旧帧
+    bool enqueue(const SharedFramePtr& frame, int lane, quint64 key = 0);
+    bool enqueue(const QByteArray& bytes, int lane = LANE_CONTROL); // 单播（ack/成员快照等）
+
+    // 对端协议版本 >= 3 时开启：超过 kFragmentThreshold 的帧按分片发送；已开始分片的帧不受切换影响
+    void setFragmentation(bool on) { fragment_ = on; }
+
+    qint64 bytesPending() const { return pending_; }
+    qint64 bytesPending(int lane) const { return lanePending_[lane]; }
+    qint64 bytesPendingHighWater() const { return pendingHighWater_; }
+    const OutDropStats& drops() const { return drops_; }
+
+    // 裸描述符模式：连接移交到另一个分片时换成目标分片的调度方
+    void setDriver(OutDriver* d) { driver_ = d; }
+    // 裸描述符模式：对端已断开，丢弃队列
+    void close();
+
+public slots:
+    void flush();
+
+private slots:
+    void onStateChanged(QAbstractSocket::SocketState st);
+
+private:
+    // 通道中等待发送的整帧；staged 为已切出去的字节数
+    struct Item {
+        SharedFramePtr frame;
+        int staged = 0;
+        quint32 fragId = 0;
+        quint64 key = 0;
+    };
+    // 已确定发送顺序的单元：可选分片头 + 帧的一段；单元一旦开始写就必须写完
+    // patch 非空时代替帧开头的同样长度字节发送（写入了本连接出队时刻的时间戳扩展）
+    struct Unit {
+        QByteArray header;
+        QByteArray patch;
+        SharedFramePtr frame;
+        int from = 0;
+        int len = 0;
+        int written = 0;
+    };
+
+    void scheduleFlush();
+    bool stageNext();
+    void consume(qint64 n);
+    bool admit(const SharedFramePtr& frame, int lane, quint64 key);
+    void replaceItem(Item& it, int lane, const SharedFramePtr& frame);
+    void dropItem(std::deque<Item>& q, std::deque<Item>::iterator it, int lane);
+    void clear();
+    bool connected() const { return sock_ ? sock_->state() == QAbstractSocket::ConnectedState : open_; }
+    void applySocketOptions(int fd);
+
+    QTcpSocket* sock_{nullptr};
+    int fd_{-1};
+    OutDriver* driver_{nullptr};
+    bool open_{false};
+    QSocketNotifier* notifier_{nullptr};
+    std::deque<Item> lanes_[LANE_COUNT];
+    std::deque<Unit> staged_;
+    qint64 stagedBytes_{0};
+    qint64 pending_{0};
+    qint64 pendingHighWater_{0};
+    qint64 lanePending_[LANE_COUNT] = {};
+    quint32 nextFragId_{1};
+    bool fragment_{false};
+    OutDropStats drops_;
+    bool flushScheduled_{false};
+
+    static QByteArray timingPatch(const SharedFrame& frame);
+
+    static constexpr int kMaxIov = 64;
+    // 一次 sendmsg 最多预排这么多字节；排得越少，新到的音频插队越及时
+    static constexpr int kStageBytes = 32 * 1024;
+    // 各通道未发送字节预算（0 = 不限）：控制消息不丢；音频丢最旧；视频 latest-wins 后丢新帧；标注/文件拒收新帧
+    static const qint64 kLaneBudget[LANE_COUNT];
+};
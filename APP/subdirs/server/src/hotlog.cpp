@@ -0,0 +1,198 @@
+#include "hotlog.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+HotLog& HotLog::instance()
+{
+    static HotLog log;
+    return log;
+}
+
+HotLog::HotLog()
+{
+    slots_ = new Slot[kCapacity];
+    for (int i = 0; i < kCapacity; ++i) slots_[i].seq.store(quint64(i));
+
+    // 默认：每包/每帧日志采样 + 限速，控制类只限速
+    setCategory(LOGCAT_HUB_VIDEO,   LOG_INFO, 50, 5);
+    setCategory(LOGCAT_HUB_CONTROL, LOG_INFO, 1, 50);
+    setCategory(LOGCAT_REC_TCP,     LOG_INFO, 50, 5);
+    setCategory(LOGCAT_REC_WRITE,   LOG_INFO, 1, 2);
+}
+
+HotLog::~HotLog()
+{
+    stop();
+    delete[] slots_;
+}
+
+const char* HotLog::categoryName(int cat)
+{
+    static const char* const kNames[LOGCAT_COUNT] = {
+        "hub.video", "hub.control", "rec.tcp", "rec.write"
+    };
+    return (cat >= 0 && cat < LOGCAT_COUNT) ? kNames[cat] : "?";
+}
+
+int HotLog::levelFromName(const QString& name)
+{
+    const QString n = name.trimmed().toLower();
+    if (n == "trace") return LOG_TRACE;
+    if (n == "debug") return LOG_DEBUG;
+    if (n == "info")  return LOG_INFO;
+    if (n == "warn")  return LOG_WARN;
+    if (n == "off")   return LOG_OFF;
+    return -1;
+}
+
+void HotLog::setCategory(int cat, int level, int sampleEvery, int maxPerSec)
+{
+    if (cat < 0 || cat >= LOGCAT_COUNT) return;
+    CatState& st = cats_[cat];
+    st.level.store(level);
+    st.sampleEvery.store(qMax(1, sampleEvery));
+    st.maxPerSec.store(qMax(0, maxPerSec));
+}
+
+bool HotLog::configure(const QString& spec)
+{
+    bool ok = true;
+    for (const QString& item : spec.split(',', QString::SkipEmptyParts)) {
+        const int eq = item.indexOf('=');
+        const QString name = item.left(eq).trimmed();
+        int cat = -1;
+        for (int i = 0; i < LOGCAT_COUNT; ++i) {
+            if (name == QLatin1String(categoryName(i))) { cat = i; break; }
+        }
+        const QStringList parts = item.mid(eq + 1).split(':');
+        const int level = levelFromName(parts.value(0));
+        if (eq <= 0 || cat < 0 || level < 0) { ok = false; continue; }
+        const CatState& cur = cats_[cat];
+        const int every = parts.size() > 1 ? parts.at(1).toInt() : cur.sampleEvery.load();
+        const int rate  = parts.size() > 2 ? parts.at(2).toInt() : cur.maxPerSec.load();
+        setCategory(cat, level, every, rate);
+    }
+    return ok;
+}
+
+bool HotLog::admit(int cat, int level)
+{
+    CatState& st = cats_[cat];
+    if (level < st.level.load()) return false;
+
+    const int every = st.sampleEvery.load();
+    if (every > 1 && st.seen.fetchAndAddRelaxed(1) % quint64(every) != 0) return false;
+
+    const int rate = st.maxPerSec.load();
+    if (rate > 0) {
+        const qint64 sec = QDateTime::currentMSecsSinceEpoch() / 1000;
+        qint64 w = st.windowSec.load();
+        if (w != sec && st.windowSec.testAndSetRelaxed(w, sec, w)) st.windowCount.store(0);
+        if (st.windowCount.fetchAndAddRelaxed(1) >= rate) {
+            st.suppressed.fetchAndAddRelaxed(1);
+            return false;
+        }
+    }
+    return true;
+}
+
+void HotLog::write(int cat, int level, const char* fmt, ...)
+{
+    // 抢占一个槽位：seq == pos 表示空闲；落后一圈说明缓冲已满
+    quint64 pos = head_.load();
+    Slot* s = nullptr;
+    for (;;) {
+        s = &slots_[pos & (kCapacity - 1)];
+        const qint64 diff = qint64(s->seq.loadAcquire()) - qint64(pos);
+        if (diff == 0) {
+            if (head_.testAndSetRelaxed(pos, pos + 1, pos)) break;
+        } else if (diff < 0) {
+            overflow_.fetchAndAddRelaxed(1);
+            return;
+        } else {
+            pos = head_.load();
+        }
+    }
+
+    Record& r = s->rec;
+    r.ms = QDateTime::currentMSecsSinceEpoch();
+    r.cat = quint8(cat);
+    r.level = quint8(level);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(r.text, kTextSize, fmt, ap);
+    va_end(ap);
+    s->seq.storeRelease(pos + 1);
+}
+
+bool HotLog::pop(Record& out)
+{
+    Slot& s = slots_[tail_ & (kCapacity - 1)];
+    if (s.seq.loadAcquire() != tail_ + 1) return false;
+    out = s.rec;
+    s.seq.storeRelease(tail_ + kCapacity);
+    ++tail_;
+    return true;
+}
+
+int HotLog::drain(FILE* f)
+{
+    static const char kLevelChar[] = { 'T', 'D', 'I', 'W' };
+    Record r;
+    int n = 0;
+    while (pop(r)) {
+        const QTime t = QDateTime::fromMSecsSinceEpoch(r.ms).time();
+        fprintf(f, "%02d:%02d:%02d.%03d %c [%s] %s\n",
+                t.hour(), t.minute(), t.second(), t.msec(),
+                kLevelChar[qMin<int>(r.level, LOG_WARN)], categoryName(r.cat), r.text);
+        ++n;
+    }
+    if (n > 0) fflush(f);
+    return n;
+}
+
+void HotLog::reportSuppressed(FILE* f)
+{
+    for (int i = 0; i < LOGCAT_COUNT; ++i) {
+        const quint64 n = cats_[i].suppressed.fetchAndStoreRelaxed(0);
+        if (n > 0) fprintf(f, "[log] %s: %llu records rate-limited\n", categoryName(i), (unsigned long long)n);
+    }
+    const quint64 lost = overflow_.fetchAndStoreRelaxed(0);
+    if (lost > 0) fprintf(f, "[log] ring full: %llu records dropped\n", (unsigned long long)lost);
+    fflush(f);
+}
+
+void HotLog::run()
+{
+    static constexpr int kIdleMs = 20;
+    static constexpr qint64 kReportMs = 10000;
+    qint64 lastReport = QDateTime::currentMSecsSinceEpoch();
+    while (!stop_.load()) {
+        if (drain(stderr) == 0) QThread::msleep(kIdleMs);
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        if (now - lastReport >= kReportMs) {
+            reportSuppressed(stderr);
+            lastReport = now;
+        }
+    }
+    drain(stderr);
+    reportSuppressed(stderr);
+}
+
+void HotLog::start()
+{
+    if (thread_) return;
+    stop_.store(0);
+    thread_ = QThread::create([this]{ run(); });
+    thread_->setObjectName(QStringLiteral("hotlog"));
+    thread_->start(QThread::LowPriority);
+}
+
+void HotLog::stop()
+{
+    if (!thread_) return;
+    stop_.store(1);
+    thread_->wait();
+    delete thread_;
+    thread_ = nullptr;
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <QtCore>
+
+// ===============================================
+// 热路径日志
+// - 按分类（Category）设置运行时级别、采样（每 N 条取 1 条）和每秒条数上限
+// - 通过检查的记录直接格式化进无锁环形缓冲（多生产者、单消费者），
+//   由后台线程批量写到 stderr；缓冲满时丢弃并计数，不阻塞调用方
+// - 低于 HOTLOG_MIN_LEVEL 的调用在编译期整个去掉（可在 .pro 里 DEFINES 覆盖）
+// 只用于每包/每帧的高频日志，普通事件仍用 qInfo/qWarning
+// ===============================================
+
+enum LogLevel {
+    LOG_TRACE = 0,
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_OFF
+};
+
+#ifndef HOTLOG_MIN_LEVEL
+#define HOTLOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+enum LogCategory {
+    LOGCAT_HUB_VIDEO = 0,   // 分片转发的每个视频包
+    LOGCAT_HUB_CONTROL,     // 设备控制转发
+    LOGCAT_REC_TCP,         // 录制收到的每个 TCP 视频帧
+    LOGCAT_REC_WRITE,       // 录制写帧进度
+    LOGCAT_COUNT
+};
+
+class HotLog {
+public:
+    static HotLog& instance();
+
+    // 分类当前是否放行这一条（级别 + 采样 + 限速），线程安全
+    bool admit(int cat, int level);
+    // 格式化进环形缓冲；仅在 admit 返回 true 后调用
+    void write(int cat, int level, const char* fmt, ...)
+#if defined(__GNUC__)
+        __attribute__((format(printf, 4, 5)))
+#endif
+        ;
+
+    // sampleEvery <= 1 不采样；maxPerSec <= 0 不限速
+    void setCategory(int cat, int level, int sampleEvery, int maxPerSec);
+    // 解析 "hub.video=debug:10:5,rec.tcp=off"（级别[:采样[:每秒上限]]），失败返回 false
+    bool configure(const QString& spec);
+
+    // 启动/停止后台写出线程；stop 会把缓冲里剩余的记录写完
+    void start();
+    void stop();
+
+    static const char* categoryName(int cat);
+    static int levelFromName(const QString& name);
+
+private:
+    HotLog();
+    ~HotLog();
+    Q_DISABLE_COPY(HotLog)
+
+    static constexpr int kTextSize = 232;
+    struct Record {
+        qint64 ms = 0;
+        quint8 cat = 0;
+        quint8 level = 0;
+        char text[kTextSize];
+    };
+    // Vyukov 有界队列：seq == pos 可写，seq == pos + 1 可读
+    struct Slot {
+        QAtomicInteger<quint64> seq;
+        Record rec;
+    };
+    struct CatState {
+        QAtomicInt level{LOG_INFO};
+        QAtomicInt sampleEvery{1};
+        QAtomicInt maxPerSec{0};
+        QAtomicInteger<quint64> seen{0};
+        QAtomicInteger<qint64> windowSec{0};
+        QAtomicInt windowCount{0};
+        QAtomicInteger<quint64> suppressed{0}; // 被限速丢掉的条数，由写出线程定期汇报
+    };
+
+    bool pop(Record& out);
+    int drain(FILE* f);
+    void reportSuppressed(FILE* f);
+    void run();
+
+    static constexpr int kCapacity = 4096; // 必须是 2 的幂
+    Slot* slots_{nullptr};
+    QAtomicInteger<quint64> head_{0};      // 生产者
+    quint64 tail_{0};                      // 仅写出线程访问
+    QAtomicInteger<quint64> overflow_{0};  // 缓冲满丢弃的条数
+    CatState cats_[LOGCAT_COUNT];
+    QThread* thread_{nullptr};
+    QAtomicInt stop_{0};
+};
+
+// 参数只在放行时才求值：HLOG(LOGCAT_HUB_VIDEO, LOG_DEBUG, "room=%s", qPrintable(id))
+#define HLOG(cat, level, ...)                                               \
+    do {                                                                    \
+        if ((level) >= HOTLOG_MIN_LEVEL && HotLog::instance().admit((cat), (level))) \
+            HotLog::instance().write((cat), (level), __VA_ARGS__);          \
+    } while (0)
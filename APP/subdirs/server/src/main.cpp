@@ -2,6 +2,7 @@
 #include "roomhub.h"
 #include "udprelay.h"
 #include "recorder.h"
+#include "hotlog.h"
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QSqlDatabase>
@@ -14,6 +15,8 @@
 #include <QDebug>
 #include <QTime>
 #include <QDateTime>
+#include <QCommandLineParser>
+#include <QThread>
 
 static const quint16 Port = 5555;
 static const char* DB_FILE = "users.db";
@@ -113,6 +116,11 @@ public:
         return true;
     }
 
+    // get_stats 的数据来源；均在主线程，任一可为空
+    void setStatsSources(RoomHub *hub, UdpRelay *udp, RecorderService *rec) {
+        m_hub = hub; m_udp = udp; m_rec = rec;
+    }
+
 private slots:
     void onNewConnection() {
         while (m_server->hasPendingConnections()) {
@@ -127,7 +135,7 @@ private slots:
                     if (pe.error != QJsonParseError::NoError || !doc.isObject()) {
                         reply = makeReply(false, "bad json");
                     } else {
-                        reply = handle(doc.object());
+                        reply = handle(doc.object(), isLocalPeer(sock->peerAddress()));
                     }
                     QByteArray out = QJsonDocument(reply).toJson(QJsonDocument::Compact) + "\n";
                     sock->write(out);
@@ -171,7 +179,14 @@ private:
         return q.next();
     }
 
-    QJsonObject handle(const QJsonObject &req) {
+    // 监听在所有网卡上；运行指标含各房间/用户流量，只回给本机
+    static bool isLocalPeer(const QHostAddress &addr) {
+        bool v4 = false;
+        const quint32 ip = addr.toIPv4Address(&v4); // 兼容 ::ffff:127.x 形式
+        return addr.isLoopback() || (v4 && (ip >> 24) == 127);
+    }
+
+    QJsonObject handle(const QJsonObject &req, bool localPeer) {
         const QString action = req.value("action").toString();
         if (action == "register" || action == "login") {
             const QString role = req.value("role").toString();
@@ -321,6 +336,15 @@ private:
                 files.append(o);
             }
             QJsonObject rep; rep["ok"] = true; rep["files"] = files; return rep;
+        } else if (action == "get_stats") {
+            if (!localPeer) return makeReply(false, "get_stats is only served to localhost");
+            // 运行指标：各分片在自己线程里生成快照，这里只做汇总
+            QJsonObject rep; rep["ok"] = true;
+            rep["ts"] = QDateTime::currentMSecsSinceEpoch();
+            if (m_hub) rep["hub"] = m_hub->collectStats();
+            if (m_udp) rep["udp"] = m_udp->stats();
+            if (m_rec) rep["recorder"] = m_rec->stats();
+            return rep;
         }
         return makeReply(false, "unknown action");
     }
@@ -366,6 +390,9 @@ private:
 
 private:
     QTcpServer *m_server = nullptr;
+    RoomHub *m_hub = nullptr;
+    UdpRelay *m_udp = nullptr;
+    RecorderService *m_rec = nullptr;
 };
 
 #include "main.moc"
@@ -376,11 +403,62 @@ int main(int argc, char** argv)
     QCoreApplication::setApplicationName("rt-meeting-server");
     QCoreApplication::setApplicationVersion("1.0");
 
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Realtime meeting server");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    QCommandLineOption shardsOpt(QStringList() << "s" << "shards",
+                                 "Number of RoomHub worker threads (default: CPU cores).",
+                                 "n", QString::number(QThread::idealThreadCount()));
+    parser.addOption(shardsOpt);
+    QCommandLineOption backendOpt(QStringList() << "b" << "backend",
+                                  "RoomHub network backend: qt (default) or epoll (Linux, SO_REUSEPORT per shard).",
+                                  "name", "qt");
+    parser.addOption(backendOpt);
+    QCommandLineOption portOpt(QStringList() << "p" << "port",
+                               "Media/signalling TCP port (UDP relay uses port + 1).",
+                               "port", "9000");
+    parser.addOption(portOpt);
+    QCommandLineOption udpWorkersOpt(QStringList() << "udp-workers",
+                                     "UDP relay worker threads, one SO_REUSEPORT socket each "
+                                     "(default: min(4, CPU cores) on Linux, 1 elsewhere).",
+                                     "n", "0");
+    parser.addOption(udpWorkersOpt);
+    QCommandLineOption udpDropOpt(QStringList() << "udp-drop",
+                                  "Testing: randomly drop this percentage of UDP relay output "
+                                  "(simulates a lossy link for FEC/NACK).",
+                                  "percent", "0");
+    parser.addOption(udpDropOpt);
+    QCommandLineOption udpDropBurstOpt(QStringList() << "udp-drop-burst",
+                                       "Testing: with --udp-drop, lose datagrams in bursts of this mean "
+                                       "length (Gilbert-Elliott on/off model; 1 = independent drops).",
+                                       "datagrams", "1");
+    parser.addOption(udpDropBurstOpt);
+    QCommandLineOption logOpt(QStringList() << "log",
+                              "Hot-path log categories, e.g. hub.video=debug:10:5,rec.tcp=off "
+                              "(level[:sample every N[:max per second]]).",
+                              "spec");
+    parser.addOption(logOpt);
+    parser.process(app);
+    const int shards = qMax(1, parser.value(shardsOpt).toInt());
+    const QString backendName = parser.value(backendOpt).toLower();
+    if (backendName != "qt" && backendName != "epoll") {
+        qCritical() << "Unknown backend" << backendName << "(expected qt or epoll)";
+        return 1;
+    }
+    const HubBackend backend = backendName == "epoll" ? HubBackend::Epoll : HubBackend::Qt;
+
+    // 每包/每帧日志走环形缓冲，由后台线程写出
+    if (parser.isSet(logOpt) && !HotLog::instance().configure(parser.value(logOpt))) {
+        qWarning() << "Ignoring bad --log entries in" << parser.value(logOpt);
+    }
+    HotLog::instance().start();
+
     // 随机数种子
     qsrand(QTime::currentTime().msec() ^ QDateTime::currentMSecsSinceEpoch());
 
     // 端口：TCP 用于信令/媒体，UDP 用于屏幕共享中继
-    const quint16 tcpPort = 9000;
+    const quint16 tcpPort = quint16(parser.value(portOpt).toUInt());
     const quint16 udpPort = tcpPort + 1;
 
     // 启动鉴权/工单/知识库查询服务
@@ -390,22 +468,26 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    // 信令/转发
-    RoomHub hub;
-    if (!hub.start(tcpPort)) {
-        return 1;
-    }
-
     // 屏幕共享 UDP 中继
-    UdpRelay udp;
+    UdpRelay udp(parser.value(udpWorkersOpt).toInt());
+    udp.setDropPercent(parser.value(udpDropOpt).toDouble(), parser.value(udpDropBurstOpt).toDouble());
     if (!udp.start(udpPort)) {
         return 1;
     }
 
-    // 录制服务
+    // 录制服务（主线程；分片通过排队调用投递）
     RecorderService recorder;
     recorder.init(/*udpPort*/ udpPort, /*kbRoot*/ QStringLiteral("knowledge"));
+
+    // 信令/转发：房间按 roomId 分到 shards 个工作线程
+    RoomHub hub(shards, backend);
     hub.setRecorder(&recorder);
+    if (!hub.start(tcpPort)) {
+        return 1;
+    }
+    auth.setStatsSources(&hub, &udp, &recorder);
 
-    return app.exec();
+    const int rc = app.exec();
+    HotLog::instance().stop();
+    return rc;
 }
@@ -0,0 +1,55 @@
+#include "metrics.h"
+
+int TrafficCounters::slotFor(quint16 type)
+{
+    switch (type & ~kMediaHdrFlag) {
+    case MSG_JOIN_WORKORDER: return SLOT_JOIN;
+    case MSG_TEXT:           return SLOT_TEXT;
+    case MSG_DEVICE_DATA:    return SLOT_DEVICE_DATA;
+    case MSG_VIDEO_FRAME:    return SLOT_VIDEO;
+    case MSG_AUDIO_FRAME:    return SLOT_AUDIO;
+    case MSG_CONTROL:        return SLOT_CONTROL;
+    case MSG_FILE:           return SLOT_FILE;
+    case MSG_FRAGMENT:       return SLOT_FRAGMENT;
+    case MSG_SUBSCRIBE:      return SLOT_SUBSCRIBE;
+    case MSG_CLOCK_SYNC:     return SLOT_CLOCK_SYNC;
+    case MSG_SERVER_EVENT:   return SLOT_SERVER_EVENT;
+    case MSG_DEVICE_CONTROL: return SLOT_DEVICE_CONTROL;
+    case MSG_ANNOT:          return SLOT_ANNOT;
+    default:                 return SLOT_OTHER;
+    }
+}
+
+const char* TrafficCounters::slotName(int slot)
+{
+    static const char* const kNames[SLOT_COUNT] = {
+        "join", "text", "device_data", "video", "audio", "control",
+        "file", "fragment", "subscribe", "clock_sync", "server_event", "device_control",
+        "annot", "other"
+    };
+    return (slot >= 0 && slot < SLOT_COUNT) ? kNames[slot] : "other";
+}
+
+void TrafficCounters::add(const TrafficCounters& o)
+{
+    for (int i = 0; i < SLOT_COUNT; ++i) {
+        pktsIn_[i]   += o.pktsIn_[i];
+        bytesIn_[i]  += o.bytesIn_[i];
+        pktsOut_[i]  += o.pktsOut_[i];
+        bytesOut_[i] += o.bytesOut_[i];
+    }
+}
+
+QJsonObject TrafficCounters::toJson() const
+{
+    QJsonObject in, out;
+    for (int i = 0; i < SLOT_COUNT; ++i) {
+        if (pktsIn_[i]) {
+            in.insert(slotName(i), QJsonObject{{"pkts", qint64(pktsIn_[i])}, {"bytes", qint64(bytesIn_[i])}});
+        }
+        if (pktsOut_[i]) {
+            out.insert(slotName(i), QJsonObject{{"pkts", qint64(pktsOut_[i])}, {"bytes", qint64(bytesOut_[i])}});
+        }
+    }
+    return QJsonObject{{"in", in}, {"out", out}};
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <QtCore>
+#include "protocol.h"
+
+// ===============================================
+// 运行指标
+// - 计数器归属单个线程（RoomShard / 主线程的 Recorder），热路径只做普通自增，
+//   不加锁、不用原子量；UdpRelay 各工作线程按接收批次原子累加一次，主线程直接读取
+// - 抓取时由各线程在自己的事件循环里生成快照（见 RoomHub::collectStats），再在
+//   AuthServer 的 get_stats 动作里汇总（只回给回环地址上的请求方）
+// ===============================================
+
+// 按 MsgType 统计的收发包数/字节数
+class TrafficCounters {
+public:
+    enum Slot {
+        SLOT_JOIN = 0, SLOT_TEXT, SLOT_DEVICE_DATA, SLOT_VIDEO, SLOT_AUDIO, SLOT_CONTROL,
+        SLOT_FILE, SLOT_FRAGMENT, SLOT_SUBSCRIBE, SLOT_CLOCK_SYNC, SLOT_SERVER_EVENT, SLOT_DEVICE_CONTROL,
+        SLOT_ANNOT, SLOT_OTHER, SLOT_COUNT
+    };
+
+    void countIn(quint16 type, qint64 bytes)  { const int s = slotFor(type); ++pktsIn_[s];  bytesIn_[s]  += quint64(bytes); }
+    void countOut(quint16 type, qint64 bytes) { const int s = slotFor(type); ++pktsOut_[s]; bytesOut_[s] += quint64(bytes); }
+    void add(const TrafficCounters& o);
+
+    // {"in":{"video":{"pkts":n,"bytes":n},...},"out":{...}}，只输出非零项
+    QJsonObject toJson() const;
+
+    static int slotFor(quint16 type);
+    static const char* slotName(int slot);
+
+private:
+    quint64 pktsIn_[SLOT_COUNT] = {};
+    quint64 bytesIn_[SLOT_COUNT] = {};
+    quint64 pktsOut_[SLOT_COUNT] = {};
+    quint64 bytesOut_[SLOT_COUNT] = {};
+};
@@ -1,4 +1,5 @@
 #include "recorder.h"
+#include "hotlog.h"
 #include <QImageReader>
 #include <QImageWriter>
 #include <QBuffer>
@@ -163,6 +164,7 @@ void RecorderStream::onTick()
         if (!ffmpegStarted_) return;
     }
 
+    QElapsedTimer et; et.start();
     QImage frame = compose(lastCam_, lastScreen_, baseSize_);
 
     if (annot_) {
@@ -172,6 +174,24 @@ void RecorderStream::onTick()
     }
 
     writeFrame(frame);
+
+    const qint64 ns = et.nsecsElapsed();
+    ++tickCount_;
+    tickNsTotal_ += ns;
+    tickNsMax_ = qMax(tickNsMax_, ns);
+}
+
+QJsonObject RecorderStream::stats() const
+{
+    return QJsonObject{
+        {"user", user_},
+        {"active", active_},
+        {"ffmpeg", ffmpegStarted_},
+        {"frames_written", writtenFrames_},
+        {"encode_failed", encodeFailed_},
+        {"tick_avg_us", tickCount_ > 0 ? double(tickNsTotal_) / tickCount_ / 1000.0 : 0.0},
+        {"tick_max_us", double(tickNsMax_) / 1000.0}
+    };
 }
 
 QImage RecorderStream::compose(const QImage& cam, const QImage& scr, const QSize& target)
@@ -222,6 +242,7 @@ void RecorderStream::writeFrame(const QImage& frame)
     w.setOptimizedWrite(true);
     if (!w.write(frame)) {
         qWarning() << "[rec] jpeg encode failed:" << w.errorString();
+        ++encodeFailed_;
         return;
     }
     buf.close();
@@ -230,7 +251,8 @@ void RecorderStream::writeFrame(const QImage& frame)
         ff_.waitForBytesWritten(10);
         ++writtenFrames_;
         if ((writtenFrames_ % 60) == 0) {
-            qInfo() << "[rec]" << roomId_ << user_ << "written frames=" << writtenFrames_;
+            HLOG(LOGCAT_REC_WRITE, LOG_INFO, "room=%s user=%s written frames=%d",
+                 qPrintable(roomId_), qPrintable(user_), writtenFrames_);
         }
     }
 }
@@ -246,7 +268,7 @@ RecorderRoom::RecorderRoom(const QString& roomId, quint16 udpPort, QObject* pare
     udp_.setIdentity(roomId_, QStringLiteral("__recorder__"));
 
     connect(&udp_, &UdpMediaClient::udpScreenFrame, this,
-            [this](const QString& sender, const QByteArray& jpeg, int, int, qint64){
+            [this](const QString& sender, const QByteArray& jpeg, int, int, qint64, quint32 fid){
         QBuffer buf(const_cast<QByteArray*>(&jpeg));
         buf.open(QIODevice::ReadOnly);
         QImageReader r(&buf, "jpeg");
@@ -256,11 +278,24 @@ RecorderRoom::RecorderRoom(const QString& roomId, quint16 udpPort, QObject* pare
         ensureStream(sender);
         streams_[sender]->onScreenFrame(img);
         screenBack_[sender] = img;
+        screenFid_[sender] = fid;
+    });
+
+    connect(&udp_, &UdpMediaClient::udpCameraFrame, this,
+            [this](const QString& sender, const QByteArray& jpeg, int, int, qint64){
+        QBuffer buf(const_cast<QByteArray*>(&jpeg));
+        buf.open(QIODevice::ReadOnly);
+        QImageReader r(&buf, "jpeg");
+        r.setAutoTransform(true);
+        QImage img = r.read().convertToFormat(QImage::Format_RGB32);
+        if (img.isNull()) return;
+        ensureStream(sender);
+        streams_[sender]->onCameraFrame(img);
     });
 
     connect(&udp_, &UdpMediaClient::udpScreenDeltaFrame, this,
-            [this](const QString& sender, const QByteArray& blob, int w, int h, qint64){
-        QImage composed = parseDeltaIntoBack(sender, blob, w, h);
+            [this](const QString& sender, const QByteArray& blob, int w, int h, qint64, quint32 fid){
+        QImage composed = parseDeltaIntoBack(sender, blob, w, h, fid);
         if (composed.isNull()) return;
         ensureStream(sender);
         streams_[sender]->onScreenFrame(composed);
@@ -294,7 +329,8 @@ void RecorderRoom::onTcpPacket(const Packet& p)
         const QString media  = p.json.value("media").toString("camera");
         if (sender.isEmpty()) return;
 
-        qInfo() << "[rec][tcp]" << roomId_ << "recv" << media << "frame from" << sender << "bytes=" << p.bin.size();
+        HLOG(LOGCAT_REC_TCP, LOG_INFO, "room=%s recv %s frame from %s bytes=%d",
+             qPrintable(roomId_), qPrintable(media), qPrintable(sender), p.bin.size());
 
         QBuffer buf(const_cast<QByteArray*>(&p.bin));
         buf.open(QIODevice::ReadOnly);
@@ -316,6 +352,7 @@ void RecorderRoom::onTcpPacket(const Packet& p)
         if (media == "screen") {
             streams_[sender]->onScreenFrame(img);
             screenBack_[sender] = img;
+            screenFid_[sender] = 0; // TCP 帧不在 UDP 帧号序列里，之后的增量帧需要新的关键帧
         } else {
             streams_[sender]->onCameraFrame(img);
         }
@@ -387,34 +424,52 @@ void RecorderRoom::handleAnnot(const QJsonObject& j)
     m->applyEvent(j);
 }
 
-QImage RecorderRoom::parseDeltaIntoBack(const QString& sender, const QByteArray& blob, int w, int h)
+QImage RecorderRoom::parseDeltaIntoBack(const QString& sender, const QByteArray& blob, int w, int h, quint32 fid)
 {
+    QDataStream ds(blob); ds.setByteOrder(QDataStream::BigEndian);
+    quint32 magic=0, baseFid=0; quint16 rectCount=0; ds >> magic >> baseFid >> rectCount;
+    if (magic != 0x44533032) return QImage(); // 'DS02'
     QImage& back = screenBack_[sender];
-    if (back.isNull() || back.size() != QSize(w, h)) {
-        back = QImage(w, h, QImage::Format_RGB32);
-        back.fill(Qt::black);
+    const quint32 have = screenFid_.value(sender, 0);
+    if (have == 0 || baseFid != have || back.size() != QSize(w, h)) {
+        screenFid_[sender] = 0;
+        udp_.requestKeyframe(sender);
+        return QImage();
     }
-    QDataStream ds(blob); ds.setByteOrder(QDataStream::BigEndian);
-    quint32 magic=0; quint16 rectCount=0; ds >> magic >> rectCount;
-    if (magic != 0x44533031) return QImage();
     for (int i = 0; i < rectCount; ++i) {
         quint16 x=0,y=0,rw=0,rh=0; quint32 clen=0;
         ds >> x >> y >> rw >> rh >> clen;
-        if (ds.status()!=QDataStream::Ok) return QImage();
-        if (int(ds.device()->bytesAvailable()) < int(clen)) return QImage();
+        if (ds.status()!=QDataStream::Ok || int(ds.device()->bytesAvailable()) < int(clen)) {
+            screenFid_[sender] = 0;
+            udp_.requestKeyframe(sender);
+            return QImage();
+        }
         QByteArray comp; comp.resize(int(clen));
         ds.readRawData(comp.data(), clen);
         QByteArray raw = qUncompress(comp);
         if (raw.size() != int(rw) * int(rh) * 4) continue;
+        if (x + rw > w || y + rh > h) continue;
         const char* src = raw.constData();
         for (int row = 0; row < rh; ++row) {
             uchar* dst = back.scanLine(y + row) + x * 4;
             memcpy(dst, src + row * rw * 4, rw * 4);
         }
     }
+    screenFid_[sender] = fid;
     return back;
 }
 
+QJsonObject RecorderRoom::stats() const
+{
+    QJsonArray streams;
+    for (const RecorderStream* st : streams_) streams.append(st->stats());
+    return QJsonObject{
+        {"roomId", roomId_},
+        {"members", currentMembers_.size()},
+        {"streams", streams}
+    };
+}
+
 // ========== RecorderService ==========
 RecorderService::RecorderService(QObject* parent) : QObject(parent) {}
 
@@ -449,6 +504,13 @@ void RecorderService::onServerEventMembers(const QString& roomId, const QStringL
     }
 }
 
+QJsonObject RecorderService::stats() const
+{
+    QJsonArray rooms;
+    for (const RecorderRoom* r : rooms_) rooms.append(r->stats());
+    return QJsonObject{{"rooms", rooms}};
+}
+
 void RecorderService::onPacketTCP(const QString& roomId, const Packet& p)
 {
     RecorderRoom* room = rooms_.value(roomId, nullptr);
@@ -25,6 +25,9 @@ public:
     bool isActive() const { return active_; }
     QString outputPath() const { return outPath_; }
 
+    // 指标：已写帧数、合成+编码耗时、编码失败次数
+    QJsonObject stats() const;
+
 private slots:
     void onTick();
 
@@ -46,6 +49,10 @@ private:
     bool active_{false};
     bool ffmpegStarted_{false};
     int  writtenFrames_{0};
+    int  encodeFailed_{0};
+    qint64 tickCount_{0};     // 实际合成过的 tick 数
+    qint64 tickNsTotal_{0};   // onTick 合成+叠加标注+编码累计耗时
+    qint64 tickNsMax_{0};
     AnnotModel* annot_{nullptr};
     QSize baseSize_{1280,720};
 };
@@ -62,10 +69,13 @@ public:
     bool isEmpty() const { return currentMembers_.isEmpty(); }
     void finalizeAndClose();
 
+    QJsonObject stats() const;
+
 private:
     void ensureStream(const QString& user);
     void handleAnnot(const QJsonObject& j);
-    QImage parseDeltaIntoBack(const QString& sender, const QByteArray& blob, int w, int h);
+    // 基准帧不符（丢了中间帧）或解析失败时返回空图，背板作废并请求关键帧
+    QImage parseDeltaIntoBack(const QString& sender, const QByteArray& blob, int w, int h, quint32 fid);
 
     QString roomId_;
     QString outDir_;
@@ -73,6 +83,7 @@ private:
     QHash<QString, RecorderStream*> streams_;
     QHash<QString, AnnotModel*> annotByUser_;
     QHash<QString, QImage> screenBack_;
+    QHash<QString, quint32> screenFid_; // 背板对应的 UDP 帧号；0 = 不可信，等关键帧
 
     UdpMediaClient udp_;
     quint16 udpPort_{0};
@@ -89,6 +100,9 @@ public:
     void onServerEventMembers(const QString& roomId, const QStringList& members);
     void onPacketTCP(const QString& roomId, const Packet& p);
 
+    // 指标快照（主线程调用）
+    QJsonObject stats() const;
+
 private:
     QString kbRoot_;
     quint16 udpPort_{0};
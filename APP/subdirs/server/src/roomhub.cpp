@@ -1,93 +1,292 @@
 #include "roomhub.h"
 #include "recorder.h"
+#include "hotlog.h"
+#include "epolltransport.h"
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
 
-RoomHub::RoomHub(QObject* parent) : QObject(parent) {}
+// 给协议版本 2~5 的接收者：去掉媒体时间戳扩展重新打包
+static QByteArray withoutTiming(quint16 type, MediaHeader mh, const QByteArray& bin)
+{
+    mh.flags &= quint8(~kMediaFlagTiming);
+    return buildMediaPacket(type, mh, bin);
+}
+
+// ========== RoomHub ==========
+RoomHub::RoomHub(int shards, HubBackend backend, QObject* parent) : QObject(parent), backend_(backend)
+{
+    if (shards <= 0) shards = qMax(1, QThread::idealThreadCount());
+    if (backend_ == HubBackend::Epoll && !EpollTransport::available()) {
+        qWarning() << "[hub] epoll backend not available on this platform, using qt";
+        backend_ = HubBackend::Qt;
+    }
+    for (int i = 0; i < shards; ++i) {
+        auto* t = new QThread(this);
+        t->setObjectName(QStringLiteral("hub-shard-%1").arg(i));
+        auto* s = new RoomShard(this, i, backend_);
+        s->moveToThread(t);
+        connect(t, &QThread::started, s, &RoomShard::onThreadStarted);
+        connect(t, &QThread::finished, s, &QObject::deleteLater);
+        shards_.push_back(s);
+        threads_.push_back(t);
+    }
+}
+
+RoomHub::~RoomHub()
+{
+    server_.close();
+    for (QThread* t : threads_) t->quit();
+    for (QThread* t : threads_) t->wait();
+}
 
 bool RoomHub::start(quint16 port) {
-    connect(&server_, &QTcpServer::newConnection, this, &RoomHub::onNewConnection);
-    if (!server_.listen(QHostAddress::Any, port)) {
+    if (backend_ == HubBackend::Epoll) {
+        // 每个分片一个同端口监听 socket，线程启动前交给分片
+        QVector<int> fds;
+        for (int i = 0; i < shards_.size(); ++i) {
+            QString err;
+            const int fd = EpollTransport::openListener(port, &err);
+            if (fd < 0) {
+                qWarning() << "Listen failed on port" << port << ":" << err;
+                for (int f : fds) ::close(f);
+                return false;
+            }
+            fds.push_back(fd);
+        }
+        for (int i = 0; i < shards_.size(); ++i) shards_.at(i)->setListenFd(fds.at(i));
+    } else if (!server_.listen(QHostAddress::Any, port)) {
         qWarning() << "Listen failed on port" << port << ":" << server_.errorString();
         return false;
     }
-    qInfo() << "Server listening on" << server_.serverAddress().toString() << ":" << port;
+    for (QThread* t : threads_) t->start();
+    qInfo() << "Server listening on port" << port << "shards=" << shards_.size()
+            << "backend=" << shards_.first()->transport()->name();
     return true;
 }
 
-void RoomHub::onNewConnection() {
-    while (server_.hasPendingConnections()) {
-        QTcpSocket* sock = server_.nextPendingConnection();
-        auto* ctx = new ClientCtx;
-        ctx->sock = sock;
-        clients_.insert(sock, ctx);
-        connect(sock, &QTcpSocket::readyRead, this, &RoomHub::onReadyRead);
-        connect(sock, &QTcpSocket::disconnected, this, &RoomHub::onDisconnected);
+void RoomHub::setRecorder(RecorderService* r) {
+    // 需在 start() 之前调用：分片线程启动后只读
+    for (RoomShard* s : shards_) s->setRecorder(r);
+}
+
+RoomShard* RoomHub::shardFor(const QString& roomId) const {
+    return shards_.at(int(qHash(roomId) % uint(shards_.size())));
+}
+
+QJsonObject RoomHub::collectStats() const {
+    QJsonArray shards;
+    for (int i = 0; i < shards_.size(); ++i) {
+        if (!threads_.at(i)->isRunning()) continue;
+        RoomShard* s = shards_.at(i);
+        QJsonObject st;
+        QMetaObject::invokeMethod(s, [s, &st]{ st = s->stats(); }, Qt::BlockingQueuedConnection);
+        shards.append(st);
     }
+    return QJsonObject{{"shards", shards}};
 }
 
-void RoomHub::onDisconnected() {
-    auto* sock = qobject_cast<QTcpSocket*>(sender());
-    if (!sock) return;
-    auto it = clients_.find(sock);
-    if (it == clients_.end()) return;
-    ClientCtx* c = it.value();
+void RoomHub::Listener::incomingConnection(qintptr fd) {
+    hub_->dispatch(fd);
+}
 
-    const QString oldRoom = c->roomId;
-    if (!oldRoom.isEmpty()) {
-        auto range = rooms_.equal_range(oldRoom);
-        for (auto i = range.first; i != range.second; ) {
-            if (i.value() == sock) i = rooms_.erase(i);
-            else ++i;
-        }
-        broadcastRoomMembers(oldRoom, "leave", c->user);
+void RoomHub::dispatch(qintptr fd) {
+    // 入会前还不知道房间，先轮询分配；入会时再移交给房间所属分片
+    RoomShard* s = shards_.at(nextShard_);
+    nextShard_ = (nextShard_ + 1) % shards_.size();
+    QMetaObject::invokeMethod(s, [s, fd]{ s->adoptDescriptor(fd); }, Qt::QueuedConnection);
+}
+
+// ========== RoomShard ==========
+RoomShard::RoomShard(RoomHub* hub, int index, HubBackend backend) : hub_(hub), index_(index)
+{
+    if (backend == HubBackend::Epoll) transport_ = new EpollTransport(this);
+    else                              transport_ = new QtTransport(this);
+    memStatsTimer_ = new QTimer(this);
+    memStatsTimer_->setInterval(10000);
+    connect(memStatsTimer_, &QTimer::timeout, this, &RoomShard::onMemStatsTick);
+}
+
+RoomShard::~RoomShard()
+{
+    qDeleteAll(rooms_);
+    for (ClientCtx* c : clients_) transport_->destroy(c);
+}
+
+void RoomShard::onThreadStarted() {
+    transport_->start();
+    memStatsTimer_->start();
+}
+
+void RoomShard::setListenFd(int fd) {
+    if (auto* ep = dynamic_cast<EpollTransport*>(transport_)) ep->setListenFd(fd);
+}
+
+void RoomShard::adoptDescriptor(qintptr fd) {
+    transport_->adoptDescriptor(fd);
+}
+
+void RoomShard::adoptClient(ClientCtx* c) {
+    // 连接已由原分片迁移到本线程
+    if (!transport_->attach(c)) {
+        transport_->destroy(c);
+        return;
     }
+    clients_.insert(c);
+    transport_->readPending(c);
+    processBuffer(c);
+}
 
-    clients_.erase(it);
-    sock->deleteLater();
-    delete c;
+void RoomShard::connectionOpened(ClientCtx* c) {
+    clients_.insert(c);
 }
 
-void RoomHub::onReadyRead() {
-    auto* sock = qobject_cast<QTcpSocket*>(sender());
-    if (!sock) return;
-    auto it = clients_.find(sock);
-    if (it == clients_.end()) return;
-    ClientCtx* c = it.value();
+void RoomShard::connectionClosed(ClientCtx* c) {
+    if (!clients_.remove(c)) return;
+    leaveRoom(c);
+    transport_->destroy(c);
+}
+
+void RoomShard::bytesArrived(ClientCtx* c) {
+    if (c->movingTo) return; // 移交途中：字节留给目标分片处理
+    processBuffer(c);
+}
 
-    c->buffer.append(sock->readAll());
+void RoomShard::processBuffer(ClientCtx* c) {
     QVector<Packet> pkts;
-    if (drainPackets(c->buffer, pkts)) {
-        for (const Packet& p : pkts) handlePacket(c, p);
+    if (!drainPackets(c->buffer, pkts, /*parseJson*/false)) return;
+    for (int i = 0; i < pkts.size(); ++i) {
+        Packet& p = pkts[i];
+        if (p.type != MSG_FRAGMENT) {
+            if (RoomShard* target = ownerForJoin(p)) {
+                // 入会包及其后的字节都交给目标分片，按原顺序重新解析；
+                // 流量由目标分片解析时再计，这里不计避免重复
+                QByteArray rest;
+                for (int k = i; k < pkts.size(); ++k) rest.append(pkts[k].raw.constData(), pkts[k].raw.size());
+                rest.append(c->buffer);
+                handOff(c, target, rest);
+                return;
+            }
+        }
+        c->traffic.countIn(p.type, p.raw.size());
+        total_.countIn(p.type, p.raw.size());
+        if (p.type != MSG_FRAGMENT) {
+            handlePacket(c, p);
+            continue;
+        }
+        // 分片拼完后按普通线上帧再解析一次
+        QByteArray whole;
+        if (!c->frags.feed(p, whole)) continue;
+        QVector<Packet> inner;
+        if (!drainPackets(whole, inner, /*parseJson*/false)) continue;
+        for (Packet& q : inner) {
+            if (q.type == MSG_FRAGMENT) continue;
+            if (ownerForJoin(q)) continue; // 入会包很小不会分片，出现即视为异常
+            handlePacket(c, q);
+        }
     }
 }
 
-void RoomHub::handlePacket(ClientCtx* c, const Packet& p) {
+RoomShard* RoomShard::ownerForJoin(Packet& p) {
+    if (p.type != MSG_JOIN_WORKORDER) return nullptr;
+    const QString roomId = p.ensureJson().value("roomId").toString();
+    if (roomId.isEmpty()) return nullptr;
+    RoomShard* owner = hub_->shardFor(roomId);
+    return owner == this ? nullptr : owner;
+}
+
+void RoomShard::handOff(ClientCtx* c, RoomShard* target, const QByteArray& unprocessed) {
+    // 换房间：先在本分片离开旧房间，之后不再向它广播
+    leaveRoom(c);
+    c->buffer = unprocessed;
+    c->movingTo = target;
+    // 当前仍在 socket 的 readyRead 回调里，moveToThread 推迟到回到事件循环后再做
+    QMetaObject::invokeMethod(this, [this, c]{ finishHandOff(c); }, Qt::QueuedConnection);
+}
+
+void RoomShard::finishHandOff(ClientCtx* c) {
+    if (!clients_.contains(c) || !c->movingTo) return; // 移交前已断开
+    RoomShard* target = c->movingTo;
+    clients_.remove(c);
+    c->movingTo = nullptr;
+    ++handoffs_;
+    transport_->detach(c, target->thread());
+    QMetaObject::invokeMethod(target, [target, c]{ target->adoptClient(c); }, Qt::QueuedConnection);
+}
+
+void RoomShard::handlePacket(ClientCtx* c, Packet& p) {
     if (p.type == MSG_JOIN_WORKORDER) {
-        const QString roomId = p.json.value("roomId").toString();
-        const QString user   = p.json.value("user").toString();
+        const QJsonObject& j = p.ensureJson();
+        const QString roomId = j.value("roomId").toString();
+        const QString user   = j.value("user").toString();
         if (roomId.isEmpty()) {
             QJsonObject j{{"code",400},{"message","roomId required"}};
-            c->sock->write(buildPacket(MSG_SERVER_EVENT, j));
+            sendTo(c, buildPacket(MSG_SERVER_EVENT, j));
             return;
         }
-        c->user = user;
-        joinRoom(c, roomId);
+        const JoinResult jr = joinRoom(c, roomId, user); // 同分片内换房间时先以旧用户名广播 leave
+        c->protoVer = qBound(1, j.value("protoVer").toInt(1), kProtoVersion);
+        if (c->streamId == 0) c->streamId = hub_->allocStreamId();
+        c->out->setFragmentation(c->protoVer >= 3);
+
+        QJsonObject ack{{"code",0},{"message","joined"},{"roomId",roomId},
+                        {"protoVer",c->protoVer},{"streamId",static_cast<qint64>(c->streamId)},
+                        {"backend",QString::fromLatin1(transport_->name())}};
+        sendTo(c, buildPacket(MSG_SERVER_EVENT, ack));
+
+        // 成员变化时广播新快照（入会者自己也在房间内）；重复入会只补发缓存的快照
+        Room* room = roomOf(c);
+        if (jr != JoinResult::Same) broadcastRoomMembers(room, "join", c->user);
+        else                        sendTo(c, room->snapshot);
+        // 快照之后补发各发送者的最近一帧（客户端先从快照拿到 streamId -> 用户映射）；
+        // 同房间改名时客户端已有这些帧，不再重发
+        if (jr == JoinResult::Entered) replayLastFrames(room, c);
+        return;
+    }
 
-        QJsonObject ack{{"code",0},{"message","joined"},{"roomId",roomId}};
-        c->sock->write(buildPacket(MSG_SERVER_EVENT, ack));
+    if (p.type == MSG_SUBSCRIBE) {
+        applySubscription(c, p.ensureJson());
+        return;
+    }
 
-        sendRoomMembersTo(c->sock, roomId, "snapshot", c->user);
-        broadcastRoomMembers(roomId, "join", c->user);
+    if (p.type == MSG_CLOCK_SYNC) {
+        // 原样带回 t0；收到即回复，t1 == t2，往返时间全部计入网络
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        QJsonObject j{{"t0", p.ensureJson().value("t0")}, {"t1", now}, {"t2", now}};
+        sendTo(c, buildPacket(MSG_CLOCK_SYNC, j));
         return;
     }
 
-    if (c->roomId.isEmpty()) {
+    Room* room = roomOf(c);
+    if (!room) {
         QJsonObject j{{"code",403},{"message","join a room first"}};
-        c->sock->write(buildPacket(MSG_SERVER_EVENT, j));
+        sendTo(c, buildPacket(MSG_SERVER_EVENT, j));
         return;
     }
+    room->traffic.countIn(p.type, p.raw.size());
 
-    // 录制服务同步 TCP 包（视频帧、标注等）
-    if (recorder_) recorder_->onPacketTCP(c->roomId, p);
+    if (p.hasMedia) {
+        // 媒体头只允许协商过的客户端用于音视频帧，且 streamId 必须是自己的
+        if (c->protoVer < 2 || p.media.streamId != c->streamId ||
+            (p.type != MSG_VIDEO_FRAME && p.type != MSG_AUDIO_FRAME)) {
+            return;
+        }
+    }
+
+    // 摄像头联播帧所在层；非联播帧为 -1
+    const int layer = (p.hasMedia && p.type == MSG_VIDEO_FRAME && p.media.kind == MEDIA_CAMERA &&
+                       (p.media.flags & kMediaFlagSimulcast) && p.media.layer < LAYER_COUNT)
+                      ? int(p.media.layer) : -1;
+
+    // 录制服务同步 TCP 包（只关心视频帧、标注，仅此时才解析 JSON；联播只录最高层）
+    if (recorder_ && (p.type == MSG_VIDEO_FRAME || p.type == MSG_ANNOT) && (layer < 0 || layer == LAYER_FULL)) {
+        if (p.hasMedia) p.json = mediaHeaderToJson(p.media, c->roomId, c->user);
+        else            p.ensureJson();
+        RecorderService* rec = recorder_;
+        const QString roomId = c->roomId;
+        const Packet pkt = p;
+        QMetaObject::invokeMethod(rec, [rec, roomId, pkt]{ rec->onPacketTCP(roomId, pkt); }, Qt::QueuedConnection);
+    }
 
     if (p.type == MSG_TEXT ||
         p.type == MSG_DEVICE_DATA ||
@@ -98,102 +297,423 @@ void RoomHub::handlePacket(ClientCtx* c, const Packet& p) {
         p.type == MSG_FILE ||
         p.type == MSG_DEVICE_CONTROL)  // 新增：设备控制广播
     {
+        quint64 videoKey = 0;
         if (p.type == MSG_VIDEO_FRAME) {
-            const QString sender = p.json.value("sender").toString();
-            const QString media  = p.json.value("media").toString("camera");
-            qInfo() << "[hub]" << "video pkt"
-                    << "room=" << c->roomId
-                    << "sender=" << sender
-                    << "media=" << media
-                    << "bytes=" << p.bin.size();
+            QString media = p.hasMedia ? (p.media.kind == MEDIA_SCREEN ? QStringLiteral("screen") : QString())
+                                       : peekJsonString(p.jsonBytes, "media");
+            if (media.isEmpty()) media = QStringLiteral("camera");
+            // 同一发送者同一路媒体：新帧替换订阅者队列里还没发出去的旧帧
+            videoKey = (quint64(c->streamId) << 8) | (media == QLatin1String("screen") ? MEDIA_SCREEN : MEDIA_CAMERA);
+            HLOG(LOGCAT_HUB_VIDEO, LOG_INFO, "room=%s sender=%s media=%s bytes=%d",
+                 qPrintable(c->roomId),
+                 qPrintable(p.hasMedia ? c->user : peekJsonString(p.jsonBytes, "sender")),
+                 qPrintable(media), p.bin.size());
         } else if (p.type == MSG_DEVICE_CONTROL) {
-            qInfo() << "[hub][device_control]"
-                    << "room="   << c->roomId
-                    << "sender=" << p.json.value("sender").toString()
-                    << "device=" << p.json.value("device").toString()
-                    << "cmd="    << p.json.value("command").toString();
+            HLOG(LOGCAT_HUB_CONTROL, LOG_INFO, "room=%s sender=%s device=%s cmd=%s",
+                 qPrintable(c->roomId),
+                 qPrintable(peekJsonString(p.jsonBytes, "sender")),
+                 qPrintable(peekJsonString(p.jsonBytes, "device")),
+                 qPrintable(peekJsonString(p.jsonBytes, "command")));
         }
 
-        QByteArray raw = buildPacket(p.type, p.json, p.bin);
-        const bool isVideo = (p.type == MSG_VIDEO_FRAME);
-        broadcastToRoom(c->roomId, raw, c->sock, isVideo);
+        if (videoKey) cacheLastFrame(room, c, p, videoKey, layer);
+
+        // 原样转发线上字节，不再重新序列化 JSON / 拷贝负载
+        if (!p.hasMedia) {
+            broadcastToRoom(room, p.raw, p.store, c, Audience::All, videoKey, layer);
+            return;
+        }
+        if (!(p.media.flags & kMediaFlagTiming)) {
+            broadcastToRoom(room, p.raw, p.store, c, Audience::MediaHdr, videoKey, layer);
+        } else {
+            broadcastToRoom(room, p.raw, p.store, c, Audience::Timed, videoKey, layer);
+            if (hasAudience(room, c, Audience::Untimed)) {
+                broadcastToRoom(room, withoutTiming(p.type, p.media, p.bin), QByteArray(), c,
+                                Audience::Untimed, videoKey, layer);
+            }
+        }
+        if (hasAudience(room, c, Audience::Legacy)) {
+            // 旧客户端：转成 JSON 头，所有旧客户端共享这一份
+            const QByteArray legacy = buildPacket(p.type, mediaHeaderToJson(p.media, c->roomId, c->user), p.bin);
+            broadcastToRoom(room, legacy, QByteArray(), c, Audience::Legacy, videoKey, layer);
+        }
         return;
     }
 
     QJsonObject j{{"code",404},{"message",QString("unknown type %1").arg(p.type)}};
-    c->sock->write(buildPacket(MSG_SERVER_EVENT, j));
+    sendTo(c, buildPacket(MSG_SERVER_EVENT, j));
 }
 
-void RoomHub::joinRoom(ClientCtx* c, const QString& roomId) {
-    if (!c->roomId.isEmpty()) {
-        auto range = rooms_.equal_range(c->roomId);
-        for (auto i = range.first; i != range.second; ) {
-            if (i.value() == c->sock) i = rooms_.erase(i);
-            else ++i;
-        }
+RoomShard::JoinResult RoomShard::joinRoom(ClientCtx* c, const QString& roomId, const QString& user) {
+    Room* cur = roomOf(c);
+    if (cur && cur->roomId == roomId) {
+        if (c->user == user) return JoinResult::Same; // 重复入会同一房间
+        // 同房间改名：只更新成员名
+        if (--cur->users[memberName(c)] <= 0) cur->users.remove(memberName(c));
+        c->user = user;
+        ++cur->users[memberName(c)];
+        return JoinResult::Renamed;
+    }
+    leaveRoom(c);
+    c->user = user;
+
+    quint32& key = roomKeys_[roomId];
+    if (key == 0) {
+        key = nextRoomKey_++;
+        auto* r = new Room;
+        r->key = key;
+        r->roomId = roomId;
+        r->mem = RoomMemStatsPtr::create();
+        rooms_.insert(key, r);
     }
+    Room* r = rooms_.value(key);
+    r->members.append(c);
+    ++r->users[memberName(c)];
+    c->roomKey = key;
     c->roomId = roomId;
-    rooms_.insert(roomId, c->sock);
+    return JoinResult::Entered;
 }
 
-void RoomHub::broadcastToRoom(const QString& roomId,
+void RoomShard::leaveRoom(ClientCtx* c) {
+    Room* r = roomOf(c);
+    if (!r) return;
+    r->members.removeOne(c);
+    if (--r->users[memberName(c)] <= 0) r->users.remove(memberName(c));
+    dropLastFrames(r, c->streamId);
+    c->roomKey = 0;
+    c->roomId.clear();
+    broadcastRoomMembers(r, "leave", c->user);
+    if (r->members.isEmpty()) {
+        roomKeys_.remove(r->roomId);
+        rooms_.remove(r->key);
+        delete r;
+    }
+}
+
+QString RoomShard::memberName(const ClientCtx* c) const {
+    if (!c->user.isEmpty()) return c->user;
+    return QString("peer-%1").arg(transport_->peerId(c));
+}
+
+void RoomShard::cacheLastFrame(Room* room, const ClientCtx* c, const Packet& p, quint64 videoKey, int layer) {
+    const quint64 key = (videoKey << 2) | quint64(layer < 0 ? LAYER_FULL : layer);
+    const qint64 nowMs = QDateTime::currentMSecsSinceEpoch();
+    auto it = room->lastFrames.find(key);
+    if (it != room->lastFrames.end()) room->lastFrameBytes -= it->pinnedBytes();
+    else it = room->lastFrames.insert(key, CachedFrame());
+
+    // 不拷贝：与转发共用接收缓冲，大多数帧在被同源新帧替换前没有入会者需要它
+    CachedFrame& f = it.value();
+    f.raw = p.raw;
+    f.owner = p.store;
+    f.hasMedia = p.hasMedia;
+    f.media = p.media;
+    f.binOffset = p.bin.isEmpty() ? p.raw.size() : int(p.bin.constData() - p.raw.constData());
+    f.sender = c->user;
+    f.streamId = c->streamId;
+    f.layer = layer;
+    f.ms = nowMs;
+    room->lastFrameBytes += f.pinnedBytes();
+    if (room->lastFrameBytes <= kLastFrameBudget) return;
+
+    // 超预算：先丢过期帧，再把钉着接收缓冲的帧复制出来，仍放不下就不缓存这一帧
+    pruneLastFrames(room, nowMs);
+    if (room->lastFrameBytes > kLastFrameBudget) detachLastFrames(room);
+    if (room->lastFrameBytes > kLastFrameBudget) {
+        // 放不下：旧帧也不留，免得入会者看到明显过时的画面
+        it = room->lastFrames.find(key);
+        if (it != room->lastFrames.end()) {
+            room->lastFrameBytes -= it->pinnedBytes();
+            room->lastFrames.erase(it);
+        }
+    }
+}
+
+void RoomShard::detachLastFrames(Room* room) {
+    for (auto it = room->lastFrames.begin(); it != room->lastFrames.end(); ++it) {
+        room->lastFrameBytes -= it->pinnedBytes();
+        it->detach();
+        room->lastFrameBytes += it->pinnedBytes();
+    }
+}
+
+void RoomShard::replayLastFrames(Room* room, ClientCtx* c) {
+    if (room->lastFrames.isEmpty() || !c->out) return;
+    const qint64 nowMs = QDateTime::currentMSecsSinceEpoch();
+    // 每路视频只补一帧：联播取不高于入会者默认层的最高层，都高于默认层时取最低层
+    const int wantLayer = c->defaultLayer;
+    auto better = [wantLayer](const CachedFrame& a, const CachedFrame& b) {
+        const bool aOk = a.layer <= wantLayer, bOk = b.layer <= wantLayer;
+        if (aOk != bOk) return aOk;
+        return aOk ? a.layer > b.layer : a.layer < b.layer;
+    };
+    QHash<quint64, CachedFrame*> pick; // videoKey -> 要补发的帧
+    for (auto it = room->lastFrames.begin(); it != room->lastFrames.end(); ++it) {
+        CachedFrame& f = it.value();
+        if (f.streamId == c->streamId || nowMs - f.ms > kLastFrameMaxAgeMs) continue;
+        CachedFrame*& best = pick[it.key() >> 2];
+        if (!best || better(f, *best)) best = &f;
+    }
+    for (auto it = pick.cbegin(); it != pick.cend(); ++it) {
+        CachedFrame& f = *it.value();
+        const bool timed = f.hasMedia && (f.media.flags & kMediaFlagTiming);
+        QByteArray wire;
+        if (f.hasMedia && c->protoVer < 2) {
+            const QByteArray bin = f.raw.mid(f.binOffset);
+            wire = buildPacket(MSG_VIDEO_FRAME, mediaHeaderToJson(f.media, room->roomId, f.sender), bin);
+        } else if (timed) {
+            // 时间戳扩展记的是原帧过 hub 的时刻，补发帧最多晚了 kLastFrameMaxAgeMs，
+            // 不去掉的话会把这段等待算进接收端的延迟直方图
+            wire = withoutTiming(MSG_VIDEO_FRAME, f.media, f.raw.mid(f.binOffset));
+        } else {
+            // 确实有入会者要它了：复制一次，之后的入会者共用这份
+            room->lastFrameBytes -= f.pinnedBytes();
+            f.detach();
+            room->lastFrameBytes += f.pinnedBytes();
+            wire = f.raw;
+        }
+        SharedFramePtr frame(new SharedFrame(wire, QByteArray(), room->mem));
+        const quint16 type = wireType(wire);
+        if (!c->out->enqueue(frame, LANE_VIDEO, it.key())) continue;
+        c->traffic.countOut(type, frame->size());
+        room->traffic.countOut(type, frame->size());
+        total_.countOut(type, frame->size());
+    }
+}
+
+void RoomShard::dropLastFrames(Room* room, quint32 streamId) {
+    for (auto it = room->lastFrames.begin(); it != room->lastFrames.end();) {
+        if (it->streamId != streamId) { ++it; continue; }
+        room->lastFrameBytes -= it->pinnedBytes();
+        it = room->lastFrames.erase(it);
+    }
+}
+
+void RoomShard::pruneLastFrames(Room* room, qint64 nowMs) {
+    for (auto it = room->lastFrames.begin(); it != room->lastFrames.end();) {
+        if (nowMs - it->ms <= kLastFrameMaxAgeMs) { ++it; continue; }
+        room->lastFrameBytes -= it->pinnedBytes();
+        it = room->lastFrames.erase(it);
+    }
+}
+
+void RoomShard::broadcastToRoom(Room* room,
                               const QByteArray& packet,
-                              QTcpSocket* except,
-                              bool dropVideoIfBacklog) {
-    auto range = rooms_.equal_range(roomId);
-    for (auto i = range.first; i != range.second; ++i) {
-        QTcpSocket* s = i.value();
-        if (s == except) continue;
-        if (dropVideoIfBacklog && s->bytesToWrite() > kBacklogDropThreshold) {
-            continue;
+                              const QByteArray& owner,
+                              ClientCtx* except,
+                              Audience audience,
+                              quint64 videoKey,
+                              int layer) {
+    if (!room) return;
+    SharedFramePtr frame; // 首个接收者出现时才创建
+    const quint16 type = wireType(packet);
+    const int lane = laneForType(quint16(type & ~kMediaHdrFlag));
+    const ClientCtx* from = videoKey ? except : nullptr;
+    const int kind = int(videoKey & 0xff);
+    const qint64 nowMs = from ? QDateTime::currentMSecsSinceEpoch() : 0;
+    for (ClientCtx* c : room->members) {
+        if (c == except || !c->out || !inAudience(c, audience)) continue;
+        if (from && !admitVideo(c, from->user, kind, layer, nowMs)) continue;
+        if (!frame) {
+            // 带时间戳扩展的帧记下入口时刻，各接收者出队时再写入（帧本体仍共享）
+            const qint64 ingressMs = mediaTimingOffset(packet.constData(), packet.size()) >= 0
+                                   ? QDateTime::currentMSecsSinceEpoch() : 0;
+            frame = SharedFramePtr(new SharedFrame(packet, owner, room->mem, ingressMs));
         }
-        s->write(packet);
+        if (!c->out->enqueue(frame, lane, videoKey)) continue;
+        c->traffic.countOut(type, packet.size());
+        room->traffic.countOut(type, packet.size());
+        total_.countOut(type, packet.size());
     }
 }
 
-QStringList RoomHub::listMembers(const QString& roomId) const {
-    QStringList members;
-    auto range = rooms_.equal_range(roomId);
-    for (auto i = range.first; i != range.second; ++i) {
-        QTcpSocket* s = i.value();
-        if (!clients_.contains(s)) continue;
-        auto* c = clients_.value(s);
-        if (!c->user.isEmpty()) members << c->user;
-        else members << QString("peer-%1").arg(reinterpret_cast<quintptr>(s));
+void RoomShard::applySubscription(ClientCtx* c, const QJsonObject& j) {
+    // 整体替换：客户端每次发送完整的订阅表；保留已有条目的 lastMs，避免切换瞬间突发
+    QHash<QString, VideoSub> subs;
+    for (const QJsonValue& v : j.value("subs").toArray()) {
+        const QJsonObject o = v.toObject();
+        const QString sender = o.value("sender").toString();
+        if (sender.isEmpty()) continue;
+        VideoSub s = c->subs.value(sender);
+        s.maxFps[MEDIA_CAMERA] = o.value("camera").toInt(-1);
+        s.maxFps[MEDIA_SCREEN] = o.value("screen").toInt(-1);
+        s.layer = qBound(int(LAYER_THUMB), o.value("layer").toInt(LAYER_FULL), int(LAYER_FULL));
+        s.curLayer = qMin(s.curLayer, s.layer);
+        subs.insert(sender, s);
     }
-    members.removeDuplicates();
-    members.sort();
-    return members;
+    c->subs.swap(subs);
+    c->defaultFps = j.value("defaultFps").toInt(-1);
+    c->defaultLayer = qBound(int(LAYER_THUMB), j.value("defaultLayer").toInt(LAYER_FULL), int(LAYER_FULL));
 }
 
-void RoomHub::broadcastRoomMembers(const QString& roomId, const QString& event, const QString& whoChanged) {
-    QJsonObject j{
-        {"code", 0},
-        {"kind", "room"},
-        {"event", event},
-        {"roomId", roomId},
-        {"who", whoChanged},
-        {"members", QJsonArray::fromStringList(listMembers(roomId))},
-        {"ts", QDateTime::currentMSecsSinceEpoch()}
+bool RoomShard::admitVideo(ClientCtx* rx, const QString& sender, int kind, int layer, qint64 nowMs) {
+    if (kind != MEDIA_CAMERA && kind != MEDIA_SCREEN) return true;
+    auto it = rx->subs.find(sender);
+    if (it == rx->subs.end()) {
+        if (rx->defaultFps < 0 && layer < 0) return true;
+        VideoSub s;
+        s.maxFps[MEDIA_CAMERA] = s.maxFps[MEDIA_SCREEN] = rx->defaultFps;
+        s.layer = s.curLayer = rx->defaultLayer;
+        it = rx->subs.insert(sender, s);
+    }
+    VideoSub& s = it.value();
+    if (layer >= 0 && !selectLayer(rx, s, layer, nowMs)) return false;
+    const int fps = s.maxFps[kind];
+    if (fps < 0) return true;
+    if (fps == 0) return false;
+    // 留 10% 余量：源帧率贴着上限时不至于被隔帧丢弃
+    if (s.lastMs[kind] != 0 && nowMs - s.lastMs[kind] < 900 / fps) return false;
+    s.lastMs[kind] = nowMs;
+    return true;
+}
+
+bool RoomShard::selectLayer(ClientCtx* rx, VideoSub& s, int layer, qint64 nowMs) {
+    // 每帧按该接收者视频通道积压调整实际转发层：积压大降一层，积压清空后逐层回升到订阅层
+    const qint64 backlog = rx->out ? rx->out->bytesPending(LANE_VIDEO) : 0;
+    if (nowMs - s.layerSwitchMs >= kLayerSwitchMs) {
+        if (backlog > kLayerDownBacklog && s.curLayer > LAYER_THUMB) {
+            --s.curLayer;
+            s.layerSwitchMs = nowMs;
+        } else if (backlog < kLayerUpBacklog && s.curLayer < s.layer) {
+            ++s.curLayer;
+            s.layerSwitchMs = nowMs;
+        }
+    }
+    if (s.curLayer > s.layer) s.curLayer = s.layer;
+    return layer == s.curLayer;
+}
+
+bool RoomShard::inAudience(const ClientCtx* c, Audience a) {
+    switch (a) {
+    case Audience::MediaHdr: return c->protoVer >= 2;
+    case Audience::Timed:    return c->protoVer >= kTimingProtoVersion;
+    case Audience::Untimed:  return c->protoVer >= 2 && c->protoVer < kTimingProtoVersion;
+    case Audience::Legacy:   return c->protoVer < 2;
+    default:                 return true;
+    }
+}
+
+bool RoomShard::hasAudience(const Room* room, const ClientCtx* except, Audience a) const {
+    for (const ClientCtx* c : room->members) {
+        if (c != except && inAudience(c, a)) return true;
+    }
+    return false;
+}
+
+void RoomShard::sendTo(ClientCtx* c, const QByteArray& packet) {
+    if (!c || !c->out || !c->out->enqueue(packet)) return;
+    c->traffic.countOut(wireType(packet), packet.size());
+    total_.countOut(wireType(packet), packet.size());
+}
+
+QJsonObject RoomShard::stats() const {
+    QJsonArray rooms;
+    for (const Room* r : rooms_) {
+        rooms.append(QJsonObject{
+            {"roomId",  r->roomId},
+            {"members", r->members.size()},
+            {"version", static_cast<qint64>(r->version)},
+            {"traffic", r->traffic.toJson()},
+            {"mem_shared_bytes", r->mem->sharedBytes.load()},
+            {"mem_queued_bytes", r->mem->queuedBytes.load()},
+            {"last_frames", r->lastFrames.size()},
+            {"last_frame_bytes", r->lastFrameBytes}
+        });
+    }
+    QJsonArray conns;
+    for (const ClientCtx* c : clients_) {
+        QJsonObject o{
+            {"user", c->user},
+            {"room", c->roomId},
+            {"protoVer", c->protoVer},
+            {"traffic", c->traffic.toJson()}
+        };
+        if (c->out) {
+            const OutDropStats& d = c->out->drops();
+            o.insert("queue_bytes", c->out->bytesPending());
+            o.insert("queue_hwm", c->out->bytesPendingHighWater());
+            o.insert("drops", QJsonObject{
+                {"video_replaced", qint64(d.replaced)},
+                {"video", qint64(d.dropped[LANE_VIDEO])},
+                {"audio", qint64(d.dropped[LANE_AUDIO])},
+                {"annot", qint64(d.dropped[LANE_ANNOT])},
+                {"file",  qint64(d.dropped[LANE_FILE])}
+            });
+        }
+        conns.append(o);
+    }
+    return QJsonObject{
+        {"shard", index_},
+        {"backend", QString::fromLatin1(transport_->name())},
+        {"handoffs", qint64(handoffs_)},
+        {"traffic", total_.toJson()},
+        {"rooms", rooms},
+        {"connections", conns}
     };
-    QByteArray pkt = buildPacket(MSG_SERVER_EVENT, j);
+}
 
-    // 通知录制服务最新成员
-    if (recorder_) recorder_->onServerEventMembers(roomId, listMembers(roomId));
+void RoomShard::onMemStatsTick() {
+    // 每个周期输出一次出站内存高水位：shared 为共享帧实际占用，
+    // perSocketCopy 为逐 socket 拷贝时需要的内存，两者之差即扇出节省量
+    const qint64 nowMs = QDateTime::currentMSecsSinceEpoch();
+    for (Room* r : rooms_) {
+        pruneLastFrames(r, nowMs);
+        RoomMemStats* st = r->mem.data();
+        if (st->sharedHighWater.load() > 0) {
+            qInfo() << "[hub][mem]" << "shard=" << index_ << "room=" << r->roomId
+                    << "shared_hwm=" << st->sharedHighWater.load()
+                    << "perSocketCopy_hwm=" << st->queuedHighWater.load();
+        }
+        st->resetHighWater();
+    }
 
-    broadcastToRoom(roomId, pkt, nullptr, false);
+    // 各订阅者丢帧计数（累计值，只输出有丢帧的连接）
+    for (ClientCtx* c : clients_) {
+        if (!c->out) continue;
+        const OutDropStats& d = c->out->drops();
+        if (d.total() == 0) continue;
+        qInfo() << "[hub][drops]" << "room=" << c->roomId << "user=" << c->user
+                << "video_replaced=" << d.replaced
+                << "video=" << d.dropped[LANE_VIDEO]
+                << "audio=" << d.dropped[LANE_AUDIO]
+                << "annot=" << d.dropped[LANE_ANNOT]
+                << "file="  << d.dropped[LANE_FILE];
+    }
 }
 
-void RoomHub::sendRoomMembersTo(QTcpSocket* target, const QString& roomId, const QString& event, const QString& whoChanged) {
-    if (!target) return;
+QJsonObject RoomShard::listStreams(const Room* room) const {
+    // user -> streamId，供客户端解析二进制媒体头里的发送者
+    QJsonObject streams;
+    for (const ClientCtx* c : room->members) {
+        if (c->user.isEmpty()) continue;
+        streams.insert(c->user, static_cast<qint64>(c->streamId));
+    }
+    return streams;
+}
+
+void RoomShard::broadcastRoomMembers(Room* room, const QString& event, const QString& whoChanged) {
+    const QStringList members = room->users.keys(); // QMap 已按名字有序、去重
+    ++room->version;
     QJsonObject j{
         {"code", 0},
         {"kind", "room"},
         {"event", event},
-        {"roomId", roomId},
+        {"roomId", room->roomId},
         {"who", whoChanged},
-        {"members", QJsonArray::fromStringList(listMembers(roomId))},
+        {"version", static_cast<qint64>(room->version)},
+        {"members", QJsonArray::fromStringList(members)},
+        {"streams", listStreams(room)},
         {"ts", QDateTime::currentMSecsSinceEpoch()}
     };
-    target->write(buildPacket(MSG_SERVER_EVENT, j));
+    room->snapshot = buildPacket(MSG_SERVER_EVENT, j);
+
+    // 通知录制服务最新成员
+    if (recorder_) {
+        RecorderService* rec = recorder_;
+        const QString roomId = room->roomId;
+        QMetaObject::invokeMethod(rec, [rec, roomId, members]{ rec->onServerEventMembers(roomId, members); },
+                                  Qt::QueuedConnection);
+    }
+
+    broadcastToRoom(room, room->snapshot);
 }
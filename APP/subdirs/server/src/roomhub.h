@@ -2,47 +2,230 @@
 #include <QtCore>
 #include <QtNetwork>
 #include "protocol.h"
+#include "fanout.h"
+#include "metrics.h"
+#include "transport.h"
 
 class RecorderService; // 前向声明
+class RoomHub;
+class RoomShard;
+
+// 接收者对某个发送者的视频订阅：按 MediaKind（camera/screen）给出帧率上限
+// maxFps < 0 不限，0 不收；lastMs 为上次放行时间
+// layer 为想要的摄像头联播层，curLayer 为按该接收者积压情况实际转发的层（<= layer）
+struct VideoSub {
+    int maxFps[2] = {-1, -1};
+    qint64 lastMs[2] = {0, 0};
+    int layer = LAYER_FULL;
+    int curLayer = LAYER_FULL;
+    qint64 layerSwitchMs = 0;
+};
 
 struct ClientCtx {
-    QTcpSocket* sock = nullptr;
+    QTcpSocket* sock = nullptr; // Qt 后端
+    int fd = -1;                // epoll 后端
     QString user;
-    QString roomId;
+    QString roomId;          // 仅用于日志/录制；路由用 roomKey
+    quint32 roomKey = 0;     // 分片内驻留的房间 id，0 = 未入会
     QByteArray buffer;
+    OutQueue* out = nullptr; // 出站队列（socket 的子对象）
+    int protoVer = 1;        // 入会时协商的协议版本（>=2 支持二进制媒体头）
+    quint32 streamId = 0;    // 服务器分配的数字发送者 id
+    FragmentAssembler frags; // 入站分片重组（协议版本 >= 3）
+    RoomShard* movingTo = nullptr; // 非空：正在移交给该分片，暂停处理入站数据
+    QHash<QString, VideoSub> subs; // sender -> 订阅（MSG_SUBSCRIBE）
+    int defaultFps = -1;           // 未列出的发送者使用的帧率上限
+    int defaultLayer = LAYER_FULL; // 未列出的发送者使用的联播层
+    TrafficCounters traffic;       // 本连接收发统计
 };
 
-class RoomHub : public QObject {
+// 迟到者快速起播：房间内每个发送者每路视频（联播按层）的最近一帧
+// 新成员入会后紧跟成员快照补发，首帧不必等发送者的下一帧
+struct CachedFrame {
+    QByteArray raw;          // 线上字节：平时是接收缓冲的切片（零拷贝），补发或预算紧张时才复制
+    QByteArray owner;        // raw 所在的接收缓冲；复制后为空
+    bool hasMedia = false;   // 媒体头格式：旧客户端补发时转成 JSON 版
+    MediaHeader media;
+    int binOffset = 0;       // 负载在线上帧内的偏移
+    QString sender;
+    quint32 streamId = 0;
+    int layer = -1;          // 联播层；非联播帧为 -1
+    qint64 ms = 0;           // 缓存时间
+
+    // 计入预算的占用：未复制时按钉住的整块接收缓冲算
+    qint64 pinnedBytes() const { return owner.isEmpty() ? raw.size() : owner.size(); }
+    // 复制成自持存储，放开接收缓冲
+    void detach() {
+        if (owner.isEmpty()) return;
+        raw = QByteArray(raw.constData(), raw.size());
+        owner.clear();
+    }
+};
+
+// 房间：成员表 + 按版本缓存的成员快照包
+// - members 按入会顺序保存连接，广播直接遍历，不再按 QString 查哈希
+// - users 为有序去重的成员名（名字 -> 连接数），即快照里的 members 数组
+// - snapshot 为当前版本序列化好的 MSG_SERVER_EVENT，仅在成员变化时重建
+struct Room {
+    quint32 key = 0;
+    QString roomId;
+    QVector<ClientCtx*> members;
+    QMap<QString, int> users;
+    quint64 version = 0;
+    QByteArray snapshot;
+    RoomMemStatsPtr mem; // 出站内存统计（在途帧持有引用，房间删除后仍可安全释放）
+    TrafficCounters traffic;
+    QHash<quint64, CachedFrame> lastFrames; // (videoKey << 2) | 层 -> 最近一帧
+    qint64 lastFrameBytes = 0;              // lastFrames 占用，受 kLastFrameBudget 约束
+};
+
+// ===============================================
+// 分片：每个 RoomShard 跑在自己的线程/事件循环里，独占一部分房间
+// - 新连接按轮询交给某个分片；收到 MSG_JOIN_WORKORDER 后若房间属于别的分片，
+//   连同未处理的字节一起把 socket 移交过去（moveToThread）
+// - 房间到分片的映射只由 roomId 决定，各分片之间不共享房间状态
+// - 连接的收发由 HubTransport 后端负责（Qt / epoll），分片只处理包和房间
+// ===============================================
+class RoomShard : public QObject {
     Q_OBJECT
 public:
-    explicit RoomHub(QObject* parent=nullptr);
-    bool start(quint16 port);
+    RoomShard(RoomHub* hub, int index, HubBackend backend);
+    ~RoomShard();
 
-    // 注入录制服务
+    int index() const { return index_; }
+    HubTransport* transport() const { return transport_; }
+
+    // 注入录制服务（录制服务在主线程，调用一律排队投递）
     void setRecorder(RecorderService* r) { recorder_ = r; }
+    // epoll 后端：本分片的 SO_REUSEPORT 监听 socket，需在线程启动前设置
+    void setListenFd(int fd);
+
+    // 以下两个入口只能在本分片线程内调用（由 RoomHub 排队投递）
+    void adoptDescriptor(qintptr fd);
+    void adoptClient(ClientCtx* c);
+
+    // 后端回调（本分片线程内）：新连接、c->buffer 有新字节、对端断开
+    void connectionOpened(ClientCtx* c);
+    void bytesArrived(ClientCtx* c);
+    void connectionClosed(ClientCtx* c);
+
+    // 指标快照：只能在本分片线程内调用
+    QJsonObject stats() const;
+
+public slots:
+    void onThreadStarted();
 
 private slots:
-    void onNewConnection();
-    void onReadyRead();
-    void onDisconnected();
+    void onMemStatsTick();
 
 private:
-    QTcpServer server_;
-    QHash<QTcpSocket*, ClientCtx*> clients_;
-    QMultiHash<QString, QTcpSocket*> rooms_; // roomId -> sockets
+    RoomHub* hub_{nullptr};
+    int index_{0};
+    HubTransport* transport_{nullptr}; // 分片的子对象
+    QSet<ClientCtx*> clients_;
+    QHash<QString, quint32> roomKeys_; // roomId -> 驻留 id（仅入会时查一次）
+    QHash<quint32, Room*> rooms_;      // 驻留 id -> 房间
+    quint32 nextRoomKey_{1};
+    TrafficCounters total_;   // 本分片累计（含已断开的连接）
+    quint64 handoffs_{0};     // 移交给其他分片的连接数
+    QTimer* memStatsTimer_{nullptr};
+
+    // 广播对象：媒体头格式只发给协商过 protoVer>=2 的客户端，旧客户端收 JSON 版；
+    // 带时间戳扩展的媒体帧只发给 protoVer>=6 的客户端，2~5 收去掉扩展的版本
+    enum class Audience { All, MediaHdr, Timed, Untimed, Legacy };
+    static bool inAudience(const ClientCtx* c, Audience a);
 
-    static constexpr qint64 kBacklogDropThreshold = 3 * 1024 * 1024; // 3MB
+    void processBuffer(ClientCtx* c);
+    void handlePacket(ClientCtx* c, Packet& p);
+    void applySubscription(ClientCtx* c, const QJsonObject& j);
+    // layer < 0 表示非联播帧
+    bool admitVideo(ClientCtx* rx, const QString& sender, int kind, int layer, qint64 nowMs);
+    bool selectLayer(ClientCtx* rx, VideoSub& s, int layer, qint64 nowMs);
+    // 入会包指向别的分片的房间时返回目标分片
+    RoomShard* ownerForJoin(Packet& p);
+    void handOff(ClientCtx* c, RoomShard* target, const QByteArray& unprocessed);
+    void finishHandOff(ClientCtx* c);
+    Room* roomOf(const ClientCtx* c) const { return c->roomKey ? rooms_.value(c->roomKey, nullptr) : nullptr; }
+    // 入会结果：重复入会、同房间改名（快照变化）、进入新房间（快照变化且需补发最近帧）
+    enum class JoinResult { Same, Renamed, Entered };
+    JoinResult joinRoom(ClientCtx* c, const QString& roomId, const QString& user);
+    void leaveRoom(ClientCtx* c);
+    QString memberName(const ClientCtx* c) const;
 
-    void handlePacket(ClientCtx* c, const Packet& p);
-    void joinRoom(ClientCtx* c, const QString& roomId);
-    void broadcastToRoom(const QString& roomId,
+    // 最近一帧缓存：发送时更新、入会时补发、发送者离开或过期时清理
+    void cacheLastFrame(Room* room, const ClientCtx* c, const Packet& p, quint64 videoKey, int layer);
+    void replayLastFrames(Room* room, ClientCtx* c);
+    void dropLastFrames(Room* room, quint32 streamId);
+    void pruneLastFrames(Room* room, qint64 nowMs);
+    // 把仍钉着接收缓冲的缓存帧复制出来，腾出预算
+    void detachLastFrames(Room* room);
+
+    // packet 可以是 owner 的切片；整帧只入队一份共享内存，所有接收者引用同一块
+    // 背压由各订阅者 OutQueue 的通道预算处理；videoKey 标识同一路视频，用于 latest-wins，
+    // 非 0 时还按接收者的订阅（发送者 = except 对应的连接）过滤；layer >= 0 为联播帧所在层
+    void broadcastToRoom(Room* room,
                          const QByteArray& packet,
-                         QTcpSocket* except = nullptr,
-                         bool dropVideoIfBacklog = false);
+                         const QByteArray& owner = QByteArray(),
+                         ClientCtx* except = nullptr,
+                         Audience audience = Audience::All,
+                         quint64 videoKey = 0,
+                         int layer = -1);
+    bool hasAudience(const Room* room, const ClientCtx* except, Audience a) const;
+    void sendTo(ClientCtx* c, const QByteArray& packet);
+
+    QJsonObject listStreams(const Room* room) const;
+    // 成员变化：版本号 +1、重建快照包、广播给房间并通知录制服务
+    void broadcastRoomMembers(Room* room, const QString& event, const QString& whoChanged);
 
-    QStringList listMembers(const QString& roomId) const;
-    void broadcastRoomMembers(const QString& roomId, const QString& event, const QString& whoChanged);
-    void sendRoomMembersTo(QTcpSocket* target, const QString& roomId, const QString& event, const QString& whoChanged);
+    // 联播选层的积压阈值（该接收者视频通道未发送字节）：超过上限降一层，低于下限才回升
+    static constexpr qint64 kLayerDownBacklog = 1024 * 1024;
+    static constexpr qint64 kLayerUpBacklog   = 256 * 1024;
+    static constexpr qint64 kLayerSwitchMs    = 1000; // 两次切层的最小间隔
+
+    // 每个房间最近一帧缓存的字节上限；超过该时长没有新帧的条目不再补发（发送者已关摄像头/停止共享）
+    static constexpr qint64 kLastFrameBudget  = 4 * 1024 * 1024;
+    static constexpr qint64 kLastFrameMaxAgeMs = 3000;
 
     RecorderService* recorder_{nullptr};
 };
+
+// 对外的 hub：监听端口、持有分片线程，并按 roomId 决定房间归属
+class RoomHub : public QObject {
+    Q_OBJECT
+public:
+    // shards <= 0 时取 CPU 核数；平台不支持 epoll 时退回 Qt 后端
+    explicit RoomHub(int shards = 0, HubBackend backend = HubBackend::Qt, QObject* parent = nullptr);
+    ~RoomHub();
+
+    bool start(quint16 port);
+    HubBackend backend() const { return backend_; }
+    void setRecorder(RecorderService* r);
+
+    int shardCount() const { return shards_.size(); }
+    // 线程安全：分片列表启动后不再变化
+    RoomShard* shardFor(const QString& roomId) const;
+    quint32 allocStreamId() { return quint32(nextStreamId_.fetchAndAddOrdered(1)); }
+
+    // 依次在各分片线程里生成快照并汇总；在主线程调用（阻塞等待各分片）
+    QJsonObject collectStats() const;
+
+private:
+    // 接受的描述符直接投递给分片，由分片线程创建 QTcpSocket
+    class Listener : public QTcpServer {
+    public:
+        explicit Listener(RoomHub* hub) : hub_(hub) {}
+    protected:
+        void incomingConnection(qintptr fd) override;
+    private:
+        RoomHub* hub_;
+    };
+
+    void dispatch(qintptr fd);
+
+    Listener server_{this}; // 仅 Qt 后端；epoll 后端由各分片自己监听
+    HubBackend backend_{HubBackend::Qt};
+    QVector<RoomShard*> shards_;
+    QVector<QThread*> threads_;
+    int nextShard_{0};
+    QAtomicInteger<quint32> nextStreamId_{1};
+};
@@ -0,0 +1,86 @@
+#include "transport.h"
+#include "roomhub.h"
+
+// ========== QtTransport ==========
+QtTransport::QtTransport(RoomShard* shard) : QObject(shard), shard_(shard)
+{
+}
+
+QtTransport::~QtTransport()
+{
+    for (QTcpSocket* sock : bySock_.keys()) delete sock;
+}
+
+void QtTransport::adoptDescriptor(qintptr fd)
+{
+    auto* sock = new QTcpSocket;
+    if (!sock->setSocketDescriptor(fd)) {
+        qWarning() << "[hub] shard" << shard_->index() << "adopt failed:" << sock->errorString();
+        delete sock;
+        return;
+    }
+    auto* c = new ClientCtx;
+    c->sock = sock;
+    c->out = new OutQueue(sock);
+    watch(c);
+    shard_->connectionOpened(c);
+}
+
+void QtTransport::watch(ClientCtx* c)
+{
+    bySock_.insert(c->sock, c);
+    connect(c->sock, &QTcpSocket::readyRead, this, &QtTransport::onReadyRead);
+    connect(c->sock, &QTcpSocket::disconnected, this, &QtTransport::onDisconnected);
+}
+
+bool QtTransport::attach(ClientCtx* c)
+{
+    // socket 已由原分片 moveToThread 到本线程
+    if (c->sock->state() != QAbstractSocket::ConnectedState) return false;
+    watch(c);
+    return true;
+}
+
+void QtTransport::detach(ClientCtx* c, QThread* target)
+{
+    bySock_.remove(c->sock);
+    c->sock->disconnect(this);
+    c->sock->moveToThread(target); // OutQueue 作为子对象一并迁移
+}
+
+void QtTransport::readPending(ClientCtx* c)
+{
+    c->buffer.append(c->sock->readAll());
+}
+
+void QtTransport::destroy(ClientCtx* c)
+{
+    if (c->sock) {
+        bySock_.remove(c->sock);
+        c->sock->disconnect(this);
+        c->sock->deleteLater();
+    }
+    delete c;
+}
+
+quintptr QtTransport::peerId(const ClientCtx* c) const
+{
+    return reinterpret_cast<quintptr>(c->sock);
+}
+
+void QtTransport::onReadyRead()
+{
+    auto* sock = qobject_cast<QTcpSocket*>(sender());
+    ClientCtx* c = bySock_.value(sock, nullptr);
+    if (!c) return;
+    c->buffer.append(sock->readAll());
+    shard_->bytesArrived(c);
+}
+
+void QtTransport::onDisconnected()
+{
+    auto* sock = qobject_cast<QTcpSocket*>(sender());
+    ClientCtx* c = bySock_.value(sock, nullptr);
+    if (!c) return;
+    shard_->connectionClosed(c);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <QtCore>
+#include <QtNetwork>
+
+struct ClientCtx;
+class RoomShard;
+
+// 启动时选择的网络后端
+enum class HubBackend {
+    Qt,     // QTcpServer 接入 + 每连接 QTcpSocket（默认，跨平台）
+    Epoll   // Linux：每分片 SO_REUSEPORT 监听 + 边沿触发 epoll，裸 fd 读写
+};
+
+// ===============================================
+// 分片网络后端接口
+// - 只负责接入连接、把字节读进 ClientCtx::buffer、管理连接生命周期
+// - 房间/包语义全部留在 RoomShard：后端通过 connectionOpened / bytesArrived /
+//   connectionClosed 回调分片，分片之后的处理与后端无关
+// - 所有方法只在所属分片线程内调用
+// ===============================================
+class HubTransport {
+public:
+    virtual ~HubTransport() {}
+
+    virtual const char* name() const = 0;
+    // 分片线程启动后调用
+    virtual void start() = 0;
+    // 接管一个已 accept 的描述符（RoomHub 轮询分配）
+    virtual void adoptDescriptor(qintptr fd) = 0;
+    // 接管从别的分片移交来的连接；返回 false 表示连接已断开
+    virtual bool attach(ClientCtx* c) = 0;
+    // 移交前：停止在本分片收发，迁移到目标线程
+    virtual void detach(ClientCtx* c, QThread* target) = 0;
+    // 把底层已到达的字节追加进 c->buffer（接管移交连接后补读）
+    virtual void readPending(ClientCtx* c) = 0;
+    // 释放连接（关闭底层 socket、删除 ClientCtx）；调用方已把它从房间移除
+    virtual void destroy(ClientCtx* c) = 0;
+    // 日志/成员名用的连接标识
+    virtual quintptr peerId(const ClientCtx* c) const = 0;
+};
+
+// Qt 后端：与原实现一致，socket 信号驱动
+class QtTransport : public QObject, public HubTransport {
+    Q_OBJECT
+public:
+    explicit QtTransport(RoomShard* shard);
+    ~QtTransport();
+
+    const char* name() const override { return "qt"; }
+    void start() override {}
+    void adoptDescriptor(qintptr fd) override;
+    bool attach(ClientCtx* c) override;
+    void detach(ClientCtx* c, QThread* target) override;
+    void readPending(ClientCtx* c) override;
+    void destroy(ClientCtx* c) override;
+    quintptr peerId(const ClientCtx* c) const override;
+
+private slots:
+    void onReadyRead();
+    void onDisconnected();
+
+private:
+    void watch(ClientCtx* c);
+
+    RoomShard* shard_{nullptr};
+    QHash<QTcpSocket*, ClientCtx*> bySock_;
+};
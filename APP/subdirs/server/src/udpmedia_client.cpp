@@ -20,6 +20,7 @@ void UdpMediaClient::configureServer(const QString& host, quint16 port) {
 }
 
 void UdpMediaClient::setIdentity(const QString& roomId, const QString& user) {
+    if (roomId != roomId_ || user != user_) resetStreams();
     roomId_ = roomId;
     user_ = user;
     if (serverPort_ != 0) sendRegister();
@@ -30,7 +31,41 @@ void UdpMediaClient::setIdentity(const QString& roomId, const QString& user) {
 void UdpMediaClient::stop() {
     heartbeat_.stop();
     cleanup_.stop();
+    resetStreams();
+}
+
+void UdpMediaClient::resetStreams() {
+    streamNames_.clear();
     reassem_.clear();
+    keyReqMs_.clear();
+    camAssem_.clear();
+    camShown_.clear();
+}
+
+void UdpMediaClient::requestKeyframe(const QString& sender) {
+    if (serverPort_ == 0) return;
+    const quint32 stream = streamNames_.key(sender, 0);
+    if (stream == 0) { requestRoster(); return; }
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64& last = keyReqMs_[stream];
+    if (now - last < kKeyRequestMs) return;
+    last = now;
+    QByteArray d(kHeaderSize + 8, Qt::Uninitialized);
+    uchar* p = reinterpret_cast<uchar*>(d.data());
+    qToBigEndian<quint32>(kMagic, p);
+    p[4] = kVersion;
+    p[5] = kKeyRequest;
+    qToBigEndian<quint16>(0, p + 6);
+    qToBigEndian<quint32>(stream, p + 8);
+    qToBigEndian<quint32>(0, p + 12); // reporter 由中继按来源地址填成录制端的流 id
+    sock_.writeDatagram(d, serverAddr_, serverPort_);
+}
+
+void UdpMediaClient::requestRoster() {
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (now - lastRosterAskMs_ < 1000 || serverPort_ == 0 || roomId_.isEmpty() || user_.isEmpty()) return;
+    lastRosterAskMs_ = now;
+    sendRegister();
 }
 
 void UdpMediaClient::sendRegister() {
@@ -42,11 +77,19 @@ QByteArray UdpMediaClient::buildRegister(const QString& roomId, const QString& u
     QByteArray d;
     QDataStream ds(&d, QIODevice::WriteOnly);
     ds.setByteOrder(QDataStream::BigEndian);
-    ds << (quint32)kMagic << (quint8)2 /*ver*/ << (quint8)1 /*type*/ << (quint16)0;
+    ds << (quint32)kMagic << (quint8)kVersion << (quint8)kRegister << (quint16)0;
     ds << roomId << user;
     return d;
 }
 
+qint64 UdpMediaClient::unwrapTs(quint32 lo, qint64 nearMs) {
+    const qint64 span = qint64(1) << 32;
+    qint64 t = (nearMs & ~(span - 1)) | qint64(lo);
+    if (t - nearMs > span / 2) t -= span;
+    else if (nearMs - t > span / 2) t += span;
+    return t;
+}
+
 void UdpMediaClient::onHeartbeat() {
     if (serverPort_ == 0 || roomId_.isEmpty() || user_.isEmpty()) return;
     sendRegister();
@@ -54,11 +97,14 @@ void UdpMediaClient::onHeartbeat() {
 
 void UdpMediaClient::onCleanup() {
     const qint64 now = QDateTime::currentMSecsSinceEpoch();
-    QStringList rm;
-    for (auto it = reassem_.begin(); it != reassem_.end(); ++it) {
-        if (now - it->startMs > 2000) rm << it.key();
+    for (auto it = reassem_.begin(); it != reassem_.end();) {
+        if (now - it->startMs > 2000) it = reassem_.erase(it);
+        else ++it;
+    }
+    for (auto it = camAssem_.begin(); it != camAssem_.end();) {
+        if (now - it->startMs > 1000) it = camAssem_.erase(it);
+        else ++it;
     }
-    for (const auto& k : rm) reassem_.remove(k);
 }
 
 void UdpMediaClient::onReadyRead() {
@@ -72,49 +118,86 @@ void UdpMediaClient::onReadyRead() {
 }
 
 void UdpMediaClient::parseDatagram(const QByteArray& dgram, const QHostAddress&, quint16) {
-    QDataStream ds(dgram);
-    ds.setByteOrder(QDataStream::BigEndian);
-    quint32 magic=0; quint8 ver=0; quint8 type=0; quint16 reserved=0;
-    ds >> magic >> ver >> type >> reserved;
-    if (magic != kMagic || (ver != 1 && ver != 2)) return;
-
-    if (type == 2) {
-        QString room, sender;
-        quint32 fid=0; quint16 idx=0, cnt=0; quint16 w=0, h=0; quint64 ts=0; quint32 len=0;
-        quint8 codec = 0;
-        ds >> room >> sender >> fid >> idx >> cnt;
-        if (ver >= 2) ds >> codec;
-        ds >> w >> h >> ts >> len;
-        if (roomId_.isEmpty() || room != roomId_) return;
-        if (ds.status() != QDataStream::Ok || int(dgram.size()) < ds.device()->pos() + (qint64)len) return;
-
-        QByteArray payload; payload.resize(int(len));
-        ds.readRawData(payload.data(), len);
-
-        const QString key = sender + '|' + QString::number(fid);
-        auto& as = reassem_[key];
-        if (as.startMs == 0) {
-            as.startMs = QDateTime::currentMSecsSinceEpoch();
-            as.codec = codec;
-            as.chunkCnt = cnt;
-            as.w = w; as.h = h; as.ts = (qint64)ts;
-            as.parts.resize(cnt);
-            as.received = 0;
-        }
-        if (idx < as.parts.size() && as.parts[int(idx)].isEmpty()) {
-            as.parts[int(idx)] = std::move(payload);
-            as.received++;
+    if (dgram.size() < kHeaderSize) return;
+    const uchar* p = reinterpret_cast<const uchar*>(dgram.constData());
+    if (qFromBigEndian<quint32>(p) != kMagic || p[4] != kVersion) return;
+    const quint8 type = p[5];
+    if (type == kRoster) { parseRoster(dgram); return; }
+    if (type != kChunk || dgram.size() < kChunkHeaderSize) return;
+    if (qFromBigEndian<quint16>(p + 6) & kFlagParity) return; // 录制端不做 FEC 恢复，缺片的帧直接丢
+
+    const quint32 stream = qFromBigEndian<quint32>(p + 8);
+    const quint32 fid = qFromBigEndian<quint32>(p + 12);
+    const quint16 idx = qFromBigEndian<quint16>(p + 16);
+    const quint16 cnt = qFromBigEndian<quint16>(p + 18);
+    if (cnt == 0 || idx >= cnt) return;
+
+    const bool camera = p[20] == CAMERA;
+    if (camera && camShown_.contains(stream)) {
+        // 已写过更新的摄像头帧；帧号大幅倒退是对端重新编号
+        const qint32 behind = qint32(camShown_.value(stream) - fid);
+        if (behind >= 0 && behind < 1000) return;
+    }
+    const quint64 key = (quint64(stream) << 32) | fid;
+    QHash<quint64, Assembly>& frames = camera ? camAssem_ : reassem_;
+    auto& as = frames[key];
+    if (as.startMs == 0) {
+        as.startMs = QDateTime::currentMSecsSinceEpoch();
+        as.stream = stream;
+        as.codec = p[20];
+        as.chunkCnt = cnt;
+        as.w = qFromBigEndian<quint16>(p + 21);
+        as.h = qFromBigEndian<quint16>(p + 23);
+        as.ts = unwrapTs(qFromBigEndian<quint32>(p + 25), as.startMs);
+        as.parts.resize(cnt);
+        as.received = 0;
+    }
+    if (idx < as.parts.size() && as.parts[int(idx)].isEmpty()) {
+        as.parts[int(idx)] = dgram.mid(kChunkHeaderSize);
+        as.received++;
+    }
+    if (as.received == as.chunkCnt) {
+        const QString sender = streamNames_.value(stream);
+        if (sender.isEmpty()) {
+            requestRoster();
+            frames.remove(key);
+            return;
         }
-        if (as.received == as.chunkCnt) {
-            QByteArray blob;
-            blob.reserve(int(as.chunkCnt) * 1000);
-            for (int i = 0; i < as.chunkCnt; ++i) blob.append(as.parts[i]);
-            if (as.codec == 1 /*DELTA*/) {
-                emit udpScreenDeltaFrame(sender, blob, as.w, as.h, as.ts);
-            } else {
-                emit udpScreenFrame(sender, blob, as.w, as.h, as.ts);
+        QByteArray blob;
+        blob.reserve(int(as.chunkCnt) * kChunkPayload);
+        for (int i = 0; i < as.chunkCnt; ++i) blob.append(as.parts[i]);
+        if (camera) {
+            // 这一帧写入后，同一发送者更旧的残帧不再有用
+            camShown_.insert(stream, fid);
+            const int w = as.w, h = as.h;
+            const qint64 ts = as.ts;
+            for (auto it = camAssem_.begin(); it != camAssem_.end();) {
+                if (it->stream == stream && qint32(quint32(it.key()) - fid) <= 0) it = camAssem_.erase(it);
+                else ++it;
             }
-            reassem_.remove(key);
+            emit udpCameraFrame(sender, blob, w, h, ts);
+            return;
         }
+        if (as.codec == DELTA) {
+            emit udpScreenDeltaFrame(sender, blob, as.w, as.h, as.ts, fid);
+        } else {
+            emit udpScreenFrame(sender, blob, as.w, as.h, as.ts, fid);
+        }
+        reassem_.remove(key);
+    }
+}
+
+void UdpMediaClient::parseRoster(const QByteArray& dgram) {
+    QDataStream ds(dgram);
+    ds.setByteOrder(QDataStream::BigEndian);
+    ds.skipRawData(kHeaderSize);
+    quint16 n = 0;
+    ds >> n;
+    for (int i = 0; i < n; ++i) {
+        quint32 stream = 0;
+        QString user;
+        ds >> stream >> user;
+        if (ds.status() != QDataStream::Ok) return;
+        streamNames_.insert(stream, user);
     }
 }
@@ -3,20 +3,27 @@
 #include <QtNetwork>
 #include <algorithm>
 
+// 录制端的屏幕共享 UDP 接收（格式见 udprelay.h，v3）：只注册、收成员表、按 (流 id, 帧号) 重组；
+// 增量帧缺基准时可经中继向发送端请求关键帧
 class UdpMediaClient : public QObject {
     Q_OBJECT
 public:
-    enum Codec : quint8 { JPEG = 0, DELTA = 1 };
+    enum Codec : quint8 { JPEG = 0, DELTA = 1, CAMERA = 2 };
 
     explicit UdpMediaClient(QObject* parent=nullptr);
 
     void configureServer(const QString& host, quint16 port);
     void setIdentity(const QString& roomId, const QString& user);
     void stop();
+    // 请 sender 立即发一个关键帧（同一发送者限频）
+    void requestKeyframe(const QString& sender);
 
 signals:
-    void udpScreenFrame(const QString& sender, QByteArray jpeg, int w, int h, qint64 ts);
-    void udpScreenDeltaFrame(const QString& sender, QByteArray blob, int w, int h, qint64 ts);
+    // fid 为发送端帧号，增量帧的基准帧号即引用它
+    void udpScreenFrame(const QString& sender, QByteArray jpeg, int w, int h, qint64 ts, quint32 fid);
+    void udpScreenDeltaFrame(const QString& sender, QByteArray blob, int w, int h, qint64 ts, quint32 fid);
+    // 摄像头：只交付比上一次更新的完整帧
+    void udpCameraFrame(const QString& sender, QByteArray jpeg, int w, int h, qint64 ts);
 
 private slots:
     void onReadyRead();
@@ -25,6 +32,7 @@ private slots:
 
 private:
     struct Assembly {
+        quint32 stream = 0;
         quint8  codec = 0;
         int     w=0, h=0;
         int     chunkCnt=0;
@@ -36,8 +44,12 @@ private:
 
     void sendRegister();
     void parseDatagram(const QByteArray& dgram, const QHostAddress& from, quint16 port);
+    void parseRoster(const QByteArray& dgram);
+    void requestRoster();
+    void resetStreams();
 
     static QByteArray buildRegister(const QString& roomId, const QString& user);
+    static qint64 unwrapTs(quint32 lo, qint64 nearMs);
 
     QUdpSocket sock_;
     QHostAddress serverAddr_{QHostAddress::LocalHost};
@@ -46,8 +58,16 @@ private:
     QString user_;
     QTimer heartbeat_;
     QTimer cleanup_;
-    quint32 frameSeq_{0};
-    QHash<QString, Assembly> reassem_;
-    enum { kChunkPayload = 1200 };
+    QHash<quint32, QString> streamNames_; // 流 id -> 用户名
+    qint64 lastRosterAskMs_{0};
+    QHash<quint64, Assembly> reassem_;  // (流 id << 32 | 帧号) -> 重组进度
+    QHash<quint32, qint64> keyReqMs_;   // 流 id -> 上次请求关键帧的时间
+    QHash<quint64, Assembly> camAssem_; // 摄像头帧独立编号，与屏幕帧分开重组
+    QHash<quint32, quint32> camShown_;  // 流 id -> 已交付的最新摄像头帧号
+    enum { kChunkPayload = 1200, kKeyRequestMs = 500 };
     static constexpr quint32 kMagic = 0x55444D31;
+    enum : quint8 { kVersion = 3 };
+    enum : quint8 { kRegister = 1, kChunk = 2, kRoster = 4, kKeyRequest = 8 };
+    enum : quint16 { kFlagParity = 0x0002 };
+    enum { kHeaderSize = 8, kChunkHeaderSize = 29 };
 };
@@ -1,86 +1,1011 @@
 #include "udprelay.h"
 
-UdpRelay::UdpRelay(QObject* parent) : QObject(parent)
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+namespace {
+// 按 QDataStream（大端）格式读数据报头部，不拷贝
+struct WireReader {
+    WireReader(const char* d, int len)
+        : p(reinterpret_cast<const uchar*>(d)), end(p + len) {}
+
+    bool need(quint32 n) {
+        if (ok && quint32(end - p) < n) ok = false;
+        return ok;
+    }
+    quint8 u8() {
+        if (!need(1)) return 0;
+        return *p++;
+    }
+    quint16 u16() {
+        if (!need(2)) return 0;
+        const quint16 v = qFromBigEndian<quint16>(p);
+        p += 2;
+        return v;
+    }
+    quint32 u32() {
+        if (!need(4)) return 0;
+        const quint32 v = qFromBigEndian<quint32>(p);
+        p += 4;
+        return v;
+    }
+    // QString：u32 字节数（0xFFFFFFFF 为空串）+ UTF-16BE；返回指向接收缓冲的切片
+    QByteArray str() {
+        const quint32 n = u32();
+        if (!ok || n == 0xFFFFFFFFu) return QByteArray();
+        if (!need(n)) return QByteArray();
+        const QByteArray s = QByteArray::fromRawData(reinterpret_cast<const char*>(p), int(n));
+        p += n;
+        return s;
+    }
+
+    const uchar* p;
+    const uchar* end;
+    bool ok = true;
+};
+
+// 切片转成独立的 QByteArray（存入哈希表前必须拷贝）
+QByteArray detached(const QByteArray& raw)
+{
+    return QByteArray(raw.constData(), raw.size());
+}
+
+void appendU16(QByteArray& d, quint16 v)
+{
+    uchar b[2];
+    qToBigEndian(v, b);
+    d.append(reinterpret_cast<const char*>(b), 2);
+}
+
+void appendU32(QByteArray& d, quint32 v)
+{
+    uchar b[4];
+    qToBigEndian(v, b);
+    d.append(reinterpret_cast<const char*>(b), 4);
+}
+
+QByteArray controlHeader(quint8 type, int reserve)
+{
+    QByteArray d;
+    d.reserve(RelayDatagram::kHeaderSize + reserve);
+    appendU32(d, RelayDatagram::kMagic);
+    d.append(char(RelayDatagram::kVersion));
+    d.append(char(type));
+    appendU16(d, 0);
+    return d;
+}
+
+// 注册应答 / 未知流：公共头 + 流 id
+QByteArray streamDatagram(quint8 type, quint32 stream)
+{
+    QByteArray d = controlHeader(type, 4);
+    appendU32(d, stream);
+    return d;
+}
+
+// 成员表：流 id + QDataStream 编码的用户名，按 kRosterBytes 切成多个数据报
+QVector<QByteArray> rosterDatagrams(const QHash<QByteArray, RelayTable::Peer>& peers)
+{
+    static const int kRosterBytes = 1200;
+    QVector<QByteArray> out;
+    QByteArray d;
+    quint16 n = 0;
+    auto flush = [&] {
+        if (n == 0) return;
+        qToBigEndian(n, reinterpret_cast<uchar*>(d.data()) + RelayDatagram::kHeaderSize);
+        out.append(d);
+        n = 0;
+    };
+    for (auto it = peers.cbegin(); it != peers.cend(); ++it) {
+        if (n > 0 && d.size() + 8 + it.key().size() > kRosterBytes) flush();
+        if (n == 0) {
+            d = controlHeader(RelayDatagram::kRoster, kRosterBytes);
+            appendU16(d, 0);
+        }
+        appendU32(d, it->stream);
+        appendU32(d, quint32(it.key().size()));
+        d.append(it.key());
+        ++n;
+    }
+    flush();
+    return out;
+}
+}
+
+// ========== RelayDest / RelayTable ==========
+RelayDest RelayDest::make(const RelayAddr& a, quint32 stream)
+{
+    RelayDest d;
+    d.addr = a;
+    d.stream = stream;
+#ifdef Q_OS_UNIX
+    memset(&d.sa, 0, sizeof(d.sa));
+    d.sa.sin_family = AF_INET;
+    d.sa.sin_port = htons(a.port);
+    d.sa.sin_addr.s_addr = htonl(a.ip);
+#endif
+    return d;
+}
+
+quint32 RelayTable::allocId()
+{
+    // 0 保留为“未注册”；回绕后跳过仍在使用的流 id
+    do {
+        ++nextId_;
+    } while (nextId_ == 0 || routes.contains(nextId_));
+    return nextId_;
+}
+
+void RelayTable::rebuild(Room& r, qint64 now)
+{
+    auto dests = QSharedPointer<QVector<RelayDest>>::create();
+    dests->reserve(r.peers.size());
+    for (auto it = r.peers.cbegin(); it != r.peers.cend(); ++it) {
+        if (now - it->lastSeen <= kPeerStaleMs) dests->append(RelayDest::make(it->addr, it->stream));
+    }
+    r.dests = dests;
+    for (auto it = r.peers.cbegin(); it != r.peers.cend(); ++it) {
+        Route& rt = routes[it->stream];
+        rt.room = r.id;
+        rt.owner = it->addr;
+        rt.dests = r.dests;
+    }
+}
+
+bool RelayDatagram::parse(const char* d, int len, RelayDatagram& out)
+{
+    WireReader r(d, len);
+    const quint32 magic = r.u32();
+    out.ver = r.u8();
+    out.type = r.u8();
+    out.flags = r.u16();
+    // v1/v2 按字符串路由的分片不再支持：客户端与中继需同时升级
+    if (!r.ok || magic != kMagic || out.ver != kVersion) return false;
+    if (out.type == kRegister) {
+        out.room = r.str();
+        out.user = r.str();
+    } else if (out.type == kChunk) {
+        out.stream = r.u32();
+        out.fid = r.u32();
+        out.idx = r.u16();
+        out.cnt = r.u16();
+        out.codec = r.u8();
+        r.need(kChunkHeaderSize - kHeaderSize - 13); // w, h, ts
+    } else if (out.type == kAudio) {
+        out.stream = r.u32();
+        out.fid = r.u32(); // seq
+        r.need(kAudioHeaderSize - kHeaderSize - 8); // ts, codec
+    } else if (out.type == kReport || out.type == kKeyRequest) {
+        out.stream = r.u32();
+        out.reporter = r.u32();
+    } else if (out.type == kNack) {
+        out.stream = r.u32();
+        out.fid = r.u32();
+        out.nackCount = r.u16();
+        if (r.need(quint32(out.nackCount) * 2)) out.nackIdx = r.p;
+    }
+    return r.ok;
+}
+
+// ========== UdpRelayWorker ==========
+UdpRelayWorker::UdpRelayWorker(UdpRelay* relay, RelayTable* table, int index)
+    : relay_(relay), table_(table), index_(index), slots_(size_t(kBatch))
+{
+    outs_.reserve(size_t(kSendBatch));
+}
+
+UdpRelayWorker::~UdpRelayWorker()
+{
+#ifdef Q_OS_UNIX
+    delete notifier_;
+    if (fd_ >= 0) ::close(fd_);
+#else
+    delete sock_;
+#endif
+}
+
+bool UdpRelayWorker::open(quint16 port, bool reusePort, QString* error)
+{
+#ifdef Q_OS_UNIX
+    fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd_ < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+    ::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL, 0) | O_NONBLOCK);
+    ::fcntl(fd_, F_SETFD, FD_CLOEXEC);
+    int one = 1;
+    ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+    if (reusePort && ::setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        if (error) *error = QStringLiteral("SO_REUSEPORT: ") + QString::fromLocal8Bit(strerror(errno));
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+#else
+    Q_UNUSED(reusePort);
+#endif
+    // 突发（关键帧 x 接收者数）时靠内核缓冲兜底；实际上限受 net.core.[rw]mem_max 限制
+    int buf = kSocketBuf;
+    ::setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+    ::setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (::bind(fd_, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    return true;
+#else
+    Q_UNUSED(reusePort);
+    // 非 Unix：QUdpSocket 在主线程创建并绑定，随后移到工作线程
+    sock_ = new QUdpSocket;
+    if (!sock_->bind(QHostAddress::AnyIPv4, port, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
+        if (error) *error = sock_->errorString();
+        delete sock_;
+        sock_ = nullptr;
+        return false;
+    }
+    sock_->moveToThread(thread());
+    return true;
+#endif
+}
+
+void UdpRelayWorker::onThreadStarted()
+{
+#ifdef Q_OS_UNIX
+    notifier_ = new QSocketNotifier(fd_, QSocketNotifier::Read);
+    connect(notifier_, &QSocketNotifier::activated, this, &UdpRelayWorker::onReadable);
+#else
+    connect(sock_, &QUdpSocket::readyRead, this, &UdpRelayWorker::onReadable);
+#endif
+    cleanup_ = new QTimer(this);
+    cleanup_->setInterval(5000);
+    connect(cleanup_, &QTimer::timeout, this, &UdpRelayWorker::onCleanup);
+    cleanup_->start();
+    replayTimer_ = new QTimer(this);
+    replayTimer_->setTimerType(Qt::PreciseTimer);
+    replayTimer_->setInterval(kReplayTickMs);
+    connect(replayTimer_, &QTimer::timeout, this, &UdpRelayWorker::onReplayTick);
+}
+
+int UdpRelayWorker::recvBatch()
+{
+    counters_.recvCalls.fetchAndAddRelaxed(1);
+#if defined(Q_OS_LINUX)
+    mmsghdr msgs[kBatch];
+    iovec iov[kBatch];
+    sockaddr_in from[kBatch];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < kBatch; ++i) {
+        iov[i].iov_base = slots_[size_t(i)].data;
+        iov[i].iov_len = sizeof(Slot::data);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+    }
+    int n;
+    do {
+        n = ::recvmmsg(fd_, msgs, kBatch, MSG_DONTWAIT, nullptr);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return 0;
+    for (int i = 0; i < n; ++i) {
+        Slot& s = slots_[size_t(i)];
+        s.len = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? -1 : int(msgs[i].msg_len);
+        s.from.ip = ntohl(from[i].sin_addr.s_addr);
+        s.from.port = ntohs(from[i].sin_port);
+    }
+    return n;
+#elif defined(Q_OS_UNIX)
+    int n = 0;
+    while (n < kBatch) {
+        Slot& s = slots_[size_t(n)];
+        sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        const ssize_t r = ::recvfrom(fd_, s.data, sizeof(s.data), MSG_DONTWAIT,
+                                     reinterpret_cast<sockaddr*>(&from), &fromLen);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        // 填满缓冲的数据报按截断处理
+        s.len = r >= ssize_t(sizeof(s.data)) ? -1 : int(r);
+        s.from.ip = ntohl(from.sin_addr.s_addr);
+        s.from.port = ntohs(from.sin_port);
+        ++n;
+    }
+    return n;
+#else
+    int n = 0;
+    while (n < kBatch && sock_->hasPendingDatagrams()) {
+        Slot& s = slots_[size_t(n)];
+        const qint64 size = sock_->pendingDatagramSize();
+        QHostAddress from;
+        quint16 port = 0;
+        const qint64 r = sock_->readDatagram(s.data, sizeof(s.data), &from, &port);
+        if (r < 0) break;
+        s.len = size > qint64(sizeof(s.data)) ? -1 : int(r);
+        s.from.ip = from.toIPv4Address();
+        s.from.port = port;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+void UdpRelayWorker::setDropRate(double rate, double burst)
 {
+    rate = qMin(rate, 1.0);
+    dropRng_ ^= quint32(index_ + 1) * 0x85EBCA6Bu;
+    dropBad_ = false;
+    dropLeaveThreshold_ = 0;
+    if (rate <= 0.0) { dropThreshold_ = 0; return; }
+    if (burst <= 1.0 || rate >= 1.0) {
+        dropThreshold_ = quint32(rate * 4294967295.0);
+        return;
+    }
+    // Gilbert–Elliott（坏状态全丢）：坏->好 概率 1/burst，好->坏 概率 rate/(burst*(1-rate))，
+    // 稳态下坏状态占比即 rate，平均丢包率不变，只是丢包成串
+    const double leave = 1.0 / burst;
+    const double enter = qMin(1.0, rate * leave / (1.0 - rate));
+    dropThreshold_ = qMax(1u, quint32(enter * 4294967295.0));
+    dropLeaveThreshold_ = qMax(1u, quint32(leave * 4294967295.0));
+}
+
+int UdpRelayWorker::sendBatch(const Out* outs, int n, quint64* bytes)
+{
+    QVarLengthArray<Out, kBatch> kept;
+    if (dropThreshold_) {
+        // 丢包注入：xorshift32，按数据报独立随机丢弃；成串模式下每个数据报先转移状态，坏状态丢弃
+        for (int k = 0; k < n; ++k) {
+            dropRng_ ^= dropRng_ << 13;
+            dropRng_ ^= dropRng_ >> 17;
+            dropRng_ ^= dropRng_ << 5;
+            if (!dropLeaveThreshold_) {
+                if (dropRng_ >= dropThreshold_) kept.append(outs[k]);
+                continue;
+            }
+            if (dropBad_) dropBad_ = dropRng_ >= dropLeaveThreshold_;
+            else          dropBad_ = dropRng_ < dropThreshold_;
+            if (!dropBad_) kept.append(outs[k]);
+        }
+        if (kept.size() < n) counters_.injectedDrops.fetchAndAddRelaxed(quint64(n - kept.size()));
+        outs = kept.constData();
+        n = kept.size();
+    }
+    int sent = 0;
+    quint64 failed = 0;
+#if defined(Q_OS_LINUX)
+    mmsghdr msgs[kSendBatch];
+    iovec iov[kSendBatch];
+    int done = 0;
+    while (done < n) {
+        const int m = qMin(n - done, int(kSendBatch));
+        memset(msgs, 0, sizeof(mmsghdr) * size_t(m));
+        for (int k = 0; k < m; ++k) {
+            const Out& o = outs[done + k];
+            iov[k].iov_base = const_cast<char*>(o.data);
+            iov[k].iov_len = size_t(o.len);
+            msgs[k].msg_hdr.msg_iov = &iov[k];
+            msgs[k].msg_hdr.msg_iovlen = 1;
+            msgs[k].msg_hdr.msg_name = const_cast<sockaddr_in*>(&o.dest->sa);
+            msgs[k].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+        const int r = ::sendmmsg(fd_, msgs, unsigned(m), MSG_DONTWAIT);
+        counters_.sendCalls.fetchAndAddRelaxed(1);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // 发送缓冲已满：UDP 直接丢弃本批剩余
+                failed += quint64(n - done);
+                break;
+            }
+            // 首个数据报出错（如对端 ICMP 不可达）：跳过它，继续发其余的
+            ++failed;
+            ++done;
+            continue;
+        }
+        for (int k = 0; k < r; ++k) *bytes += quint64(outs[done + k].len);
+        sent += r;
+        done += r;
+    }
+#elif defined(Q_OS_UNIX)
+    for (int k = 0; k < n; ++k) {
+        const Out& o = outs[k];
+        ssize_t r;
+        do {
+            r = ::sendto(fd_, o.data, size_t(o.len), MSG_DONTWAIT,
+                         reinterpret_cast<const sockaddr*>(&o.dest->sa), sizeof(sockaddr_in));
+        } while (r < 0 && errno == EINTR);
+        counters_.sendCalls.fetchAndAddRelaxed(1);
+        if (r < 0) { ++failed; continue; }
+        ++sent;
+        *bytes += quint64(o.len);
+    }
+#else
+    for (int k = 0; k < n; ++k) {
+        const Out& o = outs[k];
+        counters_.sendCalls.fetchAndAddRelaxed(1);
+        if (sock_->writeDatagram(o.data, o.len, QHostAddress(o.dest->addr.ip), o.dest->addr.port) < 0) {
+            ++failed;
+            continue;
+        }
+        ++sent;
+        *bytes += quint64(o.len);
+    }
+#endif
+    if (failed) counters_.sendFailed.fetchAndAddRelaxed(failed);
+    return sent;
+}
+
+void UdpRelayWorker::onReadable()
+{
+    for (int round = 0; round < kMaxRounds; ++round) {
+        const int n = recvBatch();
+        if (n <= 0) break;
+        processBatch(n);
+        if (n < kBatch) break;
+    }
+}
+
+void UdpRelayWorker::processBatch(int n)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    quint64 rxBytes = 0, bad = 0, noRoute = 0, reports = 0, keyRequests = 0, audio = 0;
+    QVector<Register> regs;
+    QVector<Reply> replies;
+    QVector<RelayNack> nacks;
+    // 目的地数组在发送完成前保持引用，注册/清理线程可同时换上新数组
+    QVarLengthArray<RelayDestList, kBatch> held;
+    outs_.clear();
+    {
+        QReadLocker lk(&table_->lock);
+        for (int i = 0; i < n; ++i) {
+            const Slot& s = slots_[size_t(i)];
+            if (s.len < 0) { ++bad; continue; }
+            rxBytes += quint64(s.len);
+            RelayDatagram dg;
+            if (!RelayDatagram::parse(s.data, s.len, dg)) { ++bad; continue; }
+            if (dg.type == RelayDatagram::kRegister) {
+                regs.append(Register{detached(dg.room), detached(dg.user), s.from});
+                continue;
+            }
+            if (dg.type == RelayDatagram::kNack) {
+                // 只接受同房间（在该流的目的地数组里）的接收者来要重传
+                auto it = table_->routes.constFind(dg.stream);
+                if (it == table_->routes.constEnd() || !it->dests) continue;
+                const RelayDest* to = nullptr;
+                for (const RelayDest& d : *it->dests) {
+                    if (d.addr == s.from && d.stream != dg.stream) { to = &d; break; }
+                }
+                if (!to) continue;
+                RelayNack nk;
+                nk.stream = dg.stream;
+                nk.fid = dg.fid;
+                nk.dest = *to;
+                const int nackCount = qMin(int(dg.nackCount), int(kMaxNackIdx));
+                nk.idx.reserve(nackCount);
+                for (int k = 0; k < nackCount; ++k) nk.idx.append(qFromBigEndian<quint16>(dg.nackIdx + 2 * k));
+                nacks.append(nk);
+                continue;
+            }
+            if (dg.type == RelayDatagram::kReport || dg.type == RelayDatagram::kKeyRequest) {
+                // 接收报告/关键帧请求转给发送者本人；reporter 改写成中继确认过的流 id
+                auto it = table_->routes.constFind(dg.stream);
+                if (it == table_->routes.constEnd() || !it->dests) continue;
+                const RelayDest* from = nullptr;
+                for (const RelayDest& d : *it->dests) {
+                    if (d.addr == s.from && d.stream != dg.stream) { from = &d; break; }
+                }
+                if (!from) continue;
+                QByteArray d(s.data, s.len);
+                qToBigEndian<quint32>(from->stream, reinterpret_cast<uchar*>(d.data()) + RelayDatagram::kHeaderSize + 4);
+                replies.append(Reply{RelayDest::make(it->owner, dg.stream), d});
+                if (dg.type == RelayDatagram::kReport) ++reports;
+                else ++keyRequests;
+                continue;
+            }
+            if (dg.type != RelayDatagram::kChunk && dg.type != RelayDatagram::kAudio) continue;
+
+            // video chunk / audio - 按流 id 找到房间的目的地数组，转发给其他用户
+            auto it = table_->routes.constFind(dg.stream);
+            if (it == table_->routes.constEnd() || it->owner != s.from) {
+                ++noRoute;
+                // 中继重启或注册已过期：提示发送端立即重新注册（每批对同一来源只回一次）
+                bool told = false;
+                for (const Reply& r : replies) told = told || r.dest.addr == s.from;
+                if (!told) {
+                    replies.append(Reply{RelayDest::make(s.from),
+                                         streamDatagram(RelayDatagram::kUnknownStream, dg.stream)});
+                }
+                continue;
+            }
+            // 校验片只对本帧有用，音频与摄像头帧过时即无用（下一帧就能替代）：都不进关键帧链和重传缓存
+            if (dg.type == RelayDatagram::kAudio) ++audio;
+            else if (!(dg.flags & RelayDatagram::kFlagParity) && dg.codec != kCodecCamera)
+                cacheChunk(it->room, dg, s.data, s.len, now);
+            const RelayDestList& dests = it->dests;
+            if (!dests || dests->isEmpty()) continue;
+            if (held.isEmpty() || held.last() != dests) held.append(dests);
+            for (const RelayDest& d : *dests) {
+                if (d.stream == dg.stream) continue;
+                outs_.push_back(Out{s.data, s.len, &d});
+            }
+        }
+    }
+
+    quint64 sentBytes = 0;
+    const int sent = outs_.empty() ? 0 : sendBatch(outs_.data(), int(outs_.size()), &sentBytes);
+
+    counters_.rxDatagrams.fetchAndAddRelaxed(quint64(n));
+    counters_.rxBytes.fetchAndAddRelaxed(rxBytes);
+    if (bad) counters_.badHeader.fetchAndAddRelaxed(bad);
+    if (noRoute) counters_.noRoute.fetchAndAddRelaxed(noRoute);
+    if (reports) counters_.reports.fetchAndAddRelaxed(reports);
+    if (keyRequests) counters_.keyRequests.fetchAndAddRelaxed(keyRequests);
+    if (audio) counters_.audio.fetchAndAddRelaxed(audio);
+    if (sent) {
+        counters_.forwarded.fetchAndAddRelaxed(quint64(sent));
+        counters_.forwardedBytes.fetchAndAddRelaxed(sentBytes);
+    }
+    sendReplies(replies);
+    if (!nacks.isEmpty()) {
+        counters_.nacks.fetchAndAddRelaxed(quint64(nacks.size()));
+        for (const RelayNack& nk : nacks) {
+            if (!serveNack(nk)) relay_->forwardNack(this, nk);
+        }
+    }
+    if (!regs.isEmpty()) handleRegisters(regs);
+}
+
+void UdpRelayWorker::handleRegisters(const QVector<Register>& regs)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    struct Fresh {
+        quint32 room;
+        quint32 stream;
+        RelayAddr addr;
+    };
+    QVector<Fresh> fresh;
+    QVector<Reply> replies;
+    {
+        QWriteLocker lk(&table_->lock);
+        for (const Register& r : regs) {
+            RelayTable::Room& room = table_->rooms[r.room];
+            if (room.id == 0) room.id = table_->allocId();
+            auto pit = room.peers.find(r.user);
+            const bool isNew = pit == room.peers.end();
+            // 心跳式的重复注册只刷新时间；新接收者（或地址变化）才重建目的地数组并补发缓存的关键帧链
+            const bool isFresh = isNew || pit->addr != r.addr;
+            const bool wasStale = !isFresh && now - pit->lastSeen > RelayTable::kPeerStaleMs;
+            RelayTable::Peer p = isNew ? RelayTable::Peer() : *pit;
+            if (p.stream == 0) p.stream = table_->allocId();
+            p.addr = r.addr;
+            p.lastSeen = now;
+            room.peers.insert(r.user, p);
+            if (isFresh || wasStale) table_->rebuild(room, now);
+
+            // 每次注册都回应答与完整成员表，心跳顺带补上丢失的应答/成员表
+            const RelayDest self = RelayDest::make(r.addr, p.stream);
+            replies.append(Reply{self, streamDatagram(RelayDatagram::kRegisterAck, p.stream)});
+            for (const QByteArray& d : rosterDatagrams(room.peers)) replies.append(Reply{self, d});
+            if (isNew && room.dests) {
+                // 新成员：把它的流 id 告诉房间里其他人
+                QHash<QByteArray, RelayTable::Peer> one;
+                one.insert(r.user, p);
+                const QVector<QByteArray> announce = rosterDatagrams(one);
+                for (const RelayDest& d : *room.dests) {
+                    if (d.stream == p.stream) continue;
+                    for (const QByteArray& a : announce) replies.append(Reply{d, a});
+                }
+            }
+            if (isFresh) fresh.append(Fresh{room.id, p.stream, r.addr});
+        }
+    }
+    counters_.registers.fetchAndAddRelaxed(quint64(regs.size()));
+    sendReplies(replies);
+    for (const Fresh& f : fresh) relay_->requestReplay(f.room, f.stream, f.addr);
+}
+
+void UdpRelayWorker::sendReplies(const QVector<Reply>& replies)
+{
+    if (replies.isEmpty()) return;
+    outs_.clear();
+    for (const Reply& r : replies) outs_.push_back(Out{r.data.constData(), r.data.size(), &r.dest});
+    quint64 bytes = 0;
+    sendBatch(outs_.data(), int(outs_.size()), &bytes);
+}
+
+void UdpRelayWorker::onCleanup()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QReadLocker lk(&table_->lock);
+    // 停止共享或已离开的发送者：释放关键帧缓存
+    for (auto it = keyCache_.begin(); it != keyCache_.end();) {
+        RoomCache& rc = it.value();
+        for (auto sit = rc.senders.begin(); sit != rc.senders.end();) {
+            auto rt = table_->routes.constFind(sit.key());
+            const bool alive = rt != table_->routes.constEnd() && rt->room == it.key();
+            if (alive && now - sit->lastMs <= kCacheMaxAgeMs) { ++sit; continue; }
+            rc.bytes -= sit->bytes;
+            cacheBytes_.fetchAndAddRelaxed(-sit->bytes);
+            sit = rc.senders.erase(sit);
+        }
+        if (rc.senders.isEmpty()) it = keyCache_.erase(it);
+        else ++it;
+    }
+    for (auto it = rtx_.begin(); it != rtx_.end();) {
+        trimRetransmit(it.value(), now);
+        if (it->frames.isEmpty()) it = rtx_.erase(it);
+        else ++it;
+    }
+}
+
+void UdpRelayWorker::cacheChunk(quint32 room, const RelayDatagram& dg, const char* data, int len, qint64 now)
+{
+    // 关键帧链与重传缓存共用同一份拷贝
+    const QByteArray d(data, len);
+    cacheForRetransmit(dg, d, now);
+
+    RoomCache& rc = keyCache_[room];
+    KeyCache& kc = rc.senders[dg.stream];
+
+    const qint64 before = kc.bytes;
+    const bool keyChunk = dg.codec == kCodecJpeg;
+    if (keyChunk && (!kc.haveKey || dg.fid != kc.keyFid)) {
+        // 新关键帧：之前的增量链作废
+        rc.bytes -= kc.bytes;
+        kc.datagrams.clear();
+        kc.bytes = 0;
+        kc.keyFid = dg.fid;
+        kc.lastFid = dg.fid;
+        kc.deltaFrames = 0;
+        kc.haveKey = true;
+        kc.full = false;
+    }
+    kc.lastMs = now;
+    if (kc.haveKey && !kc.full && !keyChunk && dg.fid != kc.lastFid) {
+        kc.lastFid = dg.fid;
+        if (++kc.deltaFrames > kMaxChainFrames) {
+            // 链太长：补发它比让发送端出一个新关键帧更贵，停止追加，新接收者改为请求关键帧
+            counters_.cacheFull.fetchAndAddRelaxed(1);
+            kc.full = true;
+        }
+    }
+    if (kc.haveKey && !kc.full) { // 没有关键帧打底的增量帧无法单独解码
+        if (rc.bytes + len > kRoomCacheBytes) {
+            counters_.cacheFull.fetchAndAddRelaxed(1);
+            if (keyChunk) {
+                // 关键帧本身放不下：整条链作废
+                rc.bytes -= kc.bytes;
+                kc.datagrams.clear();
+                kc.bytes = 0;
+                kc.haveKey = false;
+            } else {
+                kc.full = true;
+            }
+        } else {
+            kc.datagrams.append(d);
+            kc.bytes += len;
+            rc.bytes += len;
+        }
+    }
+    if (kc.bytes != before) cacheBytes_.fetchAndAddRelaxed(kc.bytes - before);
+}
+
+void UdpRelayWorker::cacheForRetransmit(const RelayDatagram& dg, const QByteArray& d, qint64 now)
+{
+    if (dg.cnt == 0 || dg.idx >= dg.cnt) return;
+    RtxStream& rs = rtx_[dg.stream];
+    RtxFrame* f = nullptr;
+    for (int i = rs.frames.size() - 1; i >= 0; --i) {
+        if (rs.frames[i].fid == dg.fid) { f = &rs.frames[i]; break; }
+    }
+    if (!f) {
+        // 乱序到达的旧帧不再建缓存
+        if (!rs.frames.isEmpty() && qint32(dg.fid - rs.frames.last().fid) < 0) return;
+        rs.frames.append(RtxFrame());
+        f = &rs.frames.last();
+        f->fid = dg.fid;
+        f->ms = now;
+        f->chunks.resize(dg.cnt);
+    }
+    if (dg.idx >= f->chunks.size() || !f->chunks.at(dg.idx).isEmpty()) return;
+    f->chunks[dg.idx] = d;
+    f->bytes += d.size();
+    rs.bytes += d.size();
+    rtxBytes_.fetchAndAddRelaxed(d.size());
+    trimRetransmit(rs, now);
+}
+
+void UdpRelayWorker::trimRetransmit(RtxStream& rs, qint64 now)
+{
+    while (!rs.frames.isEmpty()
+           && (now - rs.frames.first().ms > kRtxMaxAgeMs || rs.bytes > kRtxStreamBytes)) {
+        rs.bytes -= rs.frames.first().bytes;
+        rtxBytes_.fetchAndAddRelaxed(-rs.frames.first().bytes);
+        rs.frames.removeFirst();
+    }
+}
+
+bool UdpRelayWorker::serveNack(const RelayNack& n)
+{
+    auto it = rtx_.constFind(n.stream);
+    if (it == rtx_.constEnd()) return false;
+    const RtxFrame* f = nullptr;
+    for (const RtxFrame& fr : it->frames) {
+        if (fr.fid == n.fid) { f = &fr; break; }
+    }
+    quint64 miss = 0;
+    outs_.clear();
+    if (!f) {
+        miss = quint64(qMax(1, n.idx.size()));
+    } else if (n.idx.isEmpty()) {
+        // 整帧丢失：接收端不知道片数，有多少补多少
+        for (const QByteArray& c : f->chunks) {
+            if (c.isEmpty()) ++miss;
+            else outs_.push_back(Out{c.constData(), c.size(), &n.dest});
+        }
+    } else {
+        for (quint16 idx : n.idx) {
+            if (idx < f->chunks.size() && !f->chunks.at(idx).isEmpty()) {
+                const QByteArray& c = f->chunks.at(idx);
+                outs_.push_back(Out{c.constData(), c.size(), &n.dest});
+            } else {
+                ++miss;
+            }
+        }
+    }
+    if (!outs_.empty()) {
+        quint64 bytes = 0;
+        const int sent = sendBatch(outs_.data(), int(outs_.size()), &bytes);
+        counters_.rtxSent.fetchAndAddRelaxed(quint64(sent));
+    }
+    if (miss) counters_.rtxMiss.fetchAndAddRelaxed(miss);
+    return true;
+}
+
+void UdpRelayWorker::replayTo(quint32 room, quint32 stream, const RelayAddr& addr)
+{
+    auto it = keyCache_.constFind(room);
+    if (it == keyCache_.constEnd()) return;
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    ReplayJob job;
+    job.dest = RelayDest::make(addr, stream);
+    QVector<Reply> keyReqs;
+    {
+        QReadLocker lk(&table_->lock);
+        for (auto sit = it->senders.cbegin(); sit != it->senders.cend(); ++sit) {
+            if (sit.key() == stream || !sit->haveKey || now - sit->lastMs > kCacheMaxAgeMs) continue;
+            if (!sit->full) {
+                job.datagrams += sit->datagrams;
+                continue;
+            }
+            // 链被截断：补发的半截链接收端也解不出来，替它向发送者要一个新关键帧
+            auto rt = table_->routes.constFind(sit.key());
+            if (rt == table_->routes.constEnd()) continue;
+            QByteArray d = controlHeader(RelayDatagram::kKeyRequest, 8);
+            appendU32(d, sit.key());
+            appendU32(d, stream);
+            keyReqs.append(Reply{RelayDest::make(rt->owner, sit.key()), d});
+        }
+    }
+    if (!keyReqs.isEmpty()) {
+        counters_.keyRequests.fetchAndAddRelaxed(quint64(keyReqs.size()));
+        sendReplies(keyReqs);
+    }
+    // 同一接收者重新注册（换了地址/端口）：旧的补发作废
+    for (int i = replays_.size() - 1; i >= 0; --i) {
+        if (replays_.at(i).dest.stream == stream) replays_.remove(i);
+    }
+    if (job.datagrams.isEmpty()) return;
+    replays_.append(job);
+    if (!replayTimer_->isActive()) replayTimer_->start();
+    onReplayTick();
+}
+
+void UdpRelayWorker::onReplayTick()
+{
+    // 按节拍分批补发，整条关键帧链不会一次灌满接收者的下行与路由器缓冲
+    quint64 sentAll = 0, bytesAll = 0;
+    for (int i = replays_.size() - 1; i >= 0; --i) {
+        ReplayJob& job = replays_[i];
+        outs_.clear();
+        const int end = qMin(job.next + kReplayPerTick, job.datagrams.size());
+        for (int k = job.next; k < end; ++k) {
+            const QByteArray& d = job.datagrams.at(k);
+            outs_.push_back(Out{d.constData(), d.size(), &job.dest});
+        }
+        quint64 bytes = 0;
+        sentAll += quint64(sendBatch(outs_.data(), int(outs_.size()), &bytes));
+        bytesAll += bytes;
+        job.next = end;
+        if (job.next >= job.datagrams.size()) replays_.remove(i);
+    }
+    counters_.cacheReplayed.fetchAndAddRelaxed(sentAll);
+    counters_.forwardedBytes.fetchAndAddRelaxed(bytesAll);
+    if (replays_.isEmpty()) replayTimer_->stop();
+}
+
+// ========== UdpRelay ==========
+UdpRelay::UdpRelay(int workers, QObject* parent) : QObject(parent)
+{
+#ifdef Q_OS_LINUX
+    // SO_REUSEPORT 按来源四元组分流只在 Linux 上成立；其他平台只开一个工作线程
+    if (workers <= 0) workers = qBound(1, QThread::idealThreadCount(), 4);
+#else
+    if (workers > 1) qWarning() << "[UDP] multiple relay workers need Linux SO_REUSEPORT, using 1";
+    workers = 1;
+#endif
+    wantWorkers_ = workers;
     cleanup_.setInterval(5000);
     connect(&cleanup_, &QTimer::timeout, this, &UdpRelay::onCleanup);
 }
 
+UdpRelay::~UdpRelay()
+{
+    for (QThread* t : threads_) t->quit();
+    for (QThread* t : threads_) t->wait();
+}
+
 bool UdpRelay::start(quint16 port)
 {
-    if (!sock_.bind(QHostAddress::AnyIPv4, port, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
-        qWarning() << "[UDP] bind failed on" << port << sock_.errorString();
-        return false;
+    for (int i = 0; i < wantWorkers_; ++i) {
+        auto* t = new QThread(this);
+        t->setObjectName(QStringLiteral("udp-relay-%1").arg(i));
+        auto* w = new UdpRelayWorker(this, &table_, i);
+        w->moveToThread(t);
+        w->setDropRate(dropPercent_ / 100.0, dropBurst_);
+        QString err;
+        if (!w->open(port, wantWorkers_ > 1, &err)) {
+            qWarning() << "[UDP] bind failed on" << port << err;
+            delete w;
+            delete t;
+            for (UdpRelayWorker* o : workers_) delete o;
+            qDeleteAll(threads_);
+            workers_.clear();
+            threads_.clear();
+            return false;
+        }
+        connect(t, &QThread::started, w, &UdpRelayWorker::onThreadStarted);
+        connect(t, &QThread::finished, w, &QObject::deleteLater);
+        workers_.push_back(w);
+        threads_.push_back(t);
     }
     port_ = port;
-    connect(&sock_, &QUdpSocket::readyRead, this, &UdpRelay::onReadyRead);
+    for (QThread* t : threads_) t->start();
     cleanup_.start();
-    qInfo() << "[UDP] relay listening on" << port_;
+    qInfo() << "[UDP] relay listening on" << port_ << "workers=" << workers_.size();
+    if (dropPercent_ > 0) {
+        qWarning() << "[UDP] dropping" << dropPercent_ << "% of outgoing datagrams (loss injection)";
+        if (dropBurst_ > 1.0) qWarning() << "[UDP] loss comes in bursts, mean length" << dropBurst_ << "datagrams";
+    }
     return true;
 }
 
-bool UdpRelay::parseHeader(QDataStream& ds, quint8& ver, quint8& type)
+void UdpRelay::requestReplay(quint32 room, quint32 stream, const RelayAddr& addr)
 {
-    ds.setByteOrder(QDataStream::BigEndian);
-    quint32 magic=0; quint16 reserved=0;
-    ds >> magic >> ver >> type >> reserved;
-    if (ds.status()!=QDataStream::Ok) return false;
-    if (magic != kMagic) return false;
-    if (ver != 1 && ver != 2) return false; // 兼容 v1/v2
-    return true;
+    // 每个工作线程只缓存落在自己 socket 上的发送者，补发要问遍所有工作线程
+    for (UdpRelayWorker* w : workers_) {
+        QMetaObject::invokeMethod(w, [w, room, stream, addr]{ w->replayTo(room, stream, addr); },
+                                  Qt::QueuedConnection);
+    }
 }
 
-void UdpRelay::onReadyRead()
-{
-    while (sock_.hasPendingDatagrams()) {
-        QByteArray d;
-        d.resize(int(sock_.pendingDatagramSize()));
-        QHostAddress from; quint16 port=0;
-        sock_.readDatagram(d.data(), d.size(), &from, &port);
-
-        QDataStream ds(d);
-        quint8 ver=0, type=0;
-        if (!parseHeader(ds, ver, type)) continue;
-
-        if (type == 1) {
-            // register
-            QString room, user;
-            ds >> room >> user;
-            if (ds.status()!=QDataStream::Ok) continue;
-            auto& m = rooms_[room];
-            Peer p; p.addr = from; p.port = port; p.lastSeen = QDateTime::currentMSecsSinceEpoch();
-            m.insert(user, p);
-        } else if (type == 2) {
-            // video chunk - 转发给房间内其他用户
-            QString room, sender;
-            ds >> room >> sender;
-            if (ds.status()!=QDataStream::Ok) continue;
-
-            const auto now = QDateTime::currentMSecsSinceEpoch();
-            auto it = rooms_.find(room);
-            if (it != rooms_.end()) {
-                for (auto pit = it->begin(); pit != it->end(); ++pit) {
-                    const Peer& peer = pit.value();
-                    if (now - peer.lastSeen > 10000) continue;
-                    if (peer.addr == from && peer.port == port) continue;
-                    sock_.writeDatagram(d, peer.addr, peer.port);
-                }
-            }
-        }
+void UdpRelay::forwardNack(const UdpRelayWorker* from, const RelayNack& n)
+{
+    // 发送者的分片落在别的 socket 上：让其他工作线程各自查自己的重传缓存
+    for (UdpRelayWorker* w : workers_) {
+        if (w == from) continue;
+        QMetaObject::invokeMethod(w, [w, n]{ w->serveNack(n); }, Qt::QueuedConnection);
     }
 }
 
 void UdpRelay::onCleanup()
 {
     const qint64 now = QDateTime::currentMSecsSinceEpoch();
-    QStringList emptyRooms;
-    for (auto it = rooms_.begin(); it != rooms_.end(); ++it) {
-        QStringList rmUsers;
-        for (auto pit = it->begin(); pit != it->end(); ++pit) {
-            if (now - pit->lastSeen > 15000) rmUsers << pit.key();
+    quint64 stale = 0;
+    QWriteLocker lk(&table_.lock);
+    for (auto it = table_.rooms.begin(); it != table_.rooms.end();) {
+        auto& peers = it->peers;
+        for (auto pit = peers.begin(); pit != peers.end();) {
+            if (now - pit->lastSeen > RelayTable::kPeerExpireMs) {
+                table_.routes.remove(pit->stream);
+                pit = peers.erase(pit);
+                ++stale;
+            } else {
+                ++pit;
+            }
         }
-        for (const auto& u : rmUsers) it->remove(u);
-        if (it->isEmpty()) emptyRooms << it.key();
+        if (peers.isEmpty()) {
+            it = table_.rooms.erase(it);
+            continue;
+        }
+        // 顺带把超过 kPeerStaleMs 未注册的接收者移出目的地数组
+        table_.rebuild(*it, now);
+        ++it;
+    }
+    if (stale) stalePeers_.fetchAndAddRelaxed(stale);
+}
+
+QJsonObject UdpRelay::stats() const
+{
+    int rooms = 0, peers = 0, streams = 0;
+    {
+        QReadLocker lk(&table_.lock);
+        rooms = table_.rooms.size();
+        streams = table_.routes.size();
+        for (auto it = table_.rooms.cbegin(); it != table_.rooms.cend(); ++it) peers += it->peers.size();
+    }
+    quint64 rxDatagrams = 0, rxBytes = 0, recvCalls = 0, sendCalls = 0, badHeader = 0, registers = 0;
+    quint64 forwarded = 0, forwardedBytes = 0, sendFailed = 0, noRoute = 0, cacheReplayed = 0, cacheFull = 0;
+    quint64 nacks = 0, rtxSent = 0, rtxMiss = 0, reports = 0, keyRequests = 0, audio = 0, injectedDrops = 0;
+    qint64 cacheBytes = 0, rtxBytes = 0;
+    for (const UdpRelayWorker* w : workers_) {
+        const RelayCounters& c = w->counters();
+        rxDatagrams    += c.rxDatagrams.load();
+        rxBytes        += c.rxBytes.load();
+        recvCalls      += c.recvCalls.load();
+        sendCalls      += c.sendCalls.load();
+        badHeader      += c.badHeader.load();
+        registers      += c.registers.load();
+        forwarded      += c.forwarded.load();
+        forwardedBytes += c.forwardedBytes.load();
+        sendFailed     += c.sendFailed.load();
+        noRoute        += c.noRoute.load();
+        cacheReplayed  += c.cacheReplayed.load();
+        cacheFull      += c.cacheFull.load();
+        nacks          += c.nacks.load();
+        rtxSent        += c.rtxSent.load();
+        rtxMiss        += c.rtxMiss.load();
+        reports        += c.reports.load();
+        keyRequests    += c.keyRequests.load();
+        audio          += c.audio.load();
+        injectedDrops  += c.injectedDrops.load();
+        cacheBytes     += w->cacheBytes();
+        rtxBytes       += w->rtxBytes();
     }
-    for (const auto& k : emptyRooms) rooms_.remove(k);
+    return QJsonObject{
+        {"workers", workers_.size()},
+        {"rooms", rooms},
+        {"peers", peers},
+        {"streams", streams},
+        {"rx_datagrams", qint64(rxDatagrams)},
+        {"rx_bytes", qint64(rxBytes)},
+        {"recv_calls", qint64(recvCalls)},
+        {"send_calls", qint64(sendCalls)},
+        {"bad_header", qint64(badHeader)},
+        {"registers", qint64(registers)},
+        {"forwarded", qint64(forwarded)},
+        {"forwarded_bytes", qint64(forwardedBytes)},
+        {"send_failed", qint64(sendFailed)},
+        {"no_route", qint64(noRoute)},
+        {"stale_peers", qint64(stalePeers_.load())},
+        {"keycache_bytes", cacheBytes},
+        {"keycache_replayed", qint64(cacheReplayed)},
+        {"keycache_full", qint64(cacheFull)},
+        {"nacks", qint64(nacks)},
+        {"rtx_sent", qint64(rtxSent)},
+        {"rtx_miss", qint64(rtxMiss)},
+        {"rtx_bytes", rtxBytes},
+        {"reports", qint64(reports)},
+        {"key_requests", qint64(keyRequests)},
+        {"audio", qint64(audio)},
+        {"injected_drops", qint64(injectedDrops)}
+    };
 }
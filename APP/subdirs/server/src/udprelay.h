@@ -1,33 +1,322 @@
 #pragma once
 #include <QtCore>
 #include <QtNetwork>
+#ifdef Q_OS_UNIX
+#include <netinet/in.h>
+#endif
+#include <vector>
+
+// ===============================================
+// 屏幕共享 UDP 中继
+// - Linux：N 个绑定同一端口的 SO_REUSEPORT socket，各由一个工作线程用 recvmmsg/sendmmsg
+//   批量收发；内核按来源四元组分流，同一发送者的数据报总落在同一个工作线程
+// - 其他 Unix：单个工作线程，recvfrom/sendto；非 Unix 退回 QUdpSocket
+// - 注册时为每个 (房间, 用户) 分配 32 位流 id；分片只带流 id，中继按整数查路由，
+//   路由直接指向房间预先算好的接收者目的地址数组（RelayTable），热路径不碰字符串
+//
+// 数据报格式（v3，大端）：
+//   公共头 8B：magic u32 | ver u8 | type u8 | flags u16
+//   type 1 注册      客户端 -> 中继：room QString | user QString（QDataStream 编码）
+//   type 2 屏幕分片  双向：stream u32 | fid u32 | idx u16 | cnt u16 | codec u8 | w u16 | h u16 |
+//                    ts u32（毫秒低 32 位）| payload；固定 29B 头
+//   type 3 注册应答  中继 -> 客户端：stream u32
+//   type 4 成员表    中继 -> 客户端：n u16 | n x (stream u32 | user QString)
+//   type 5 未知流    中继 -> 发送端：stream u32（路由已失效，请立即重新注册）
+//   type 6 NACK      接收端 -> 中继：stream u32 | fid u32 | n u16 | n x idx u16（n = 0 表示整帧）
+//                    中继从重传缓存里把原分片只补发给请求者，发送端不参与
+//   type 7 接收报告  接收端 -> 中继 -> 发送端：stream u32（被报告的发送者）| reporter u32 |
+//                    loss u16（千分比）| jitter u16（ms）| rate u32（实收 kbps）| delay u16（ms，0xFFFF 未知）
+//                    后续字段按长度向后兼容；中继只校验房间并改写 reporter，其余原样转发
+//   type 8 关键帧请求 接收端 -> 中继 -> 发送端：stream u32 | reporter u32（同 type 7 校验与改写）
+//                    接收端缺了增量帧的基准帧时发出，发送端立即补一个关键帧；
+//                    新接收者注册而中继缓存的关键帧链已被截断时，由中继代它发出
+//   type 9 音频帧    双向：stream u32 | seq u32（与 TCP MSG_AUDIO_FRAME 共用序号）| ts u32 | codec u8 | payload；
+//                    固定 21B 头，一帧 20ms；按分片同样路由，但不进关键帧链和重传缓存（晚到的音频没用）
+//   type 2 的 codec：0 关键帧 JPEG | 1 增量帧 DS02 | 2 摄像头 JPEG（独立帧号序列，只按帧取舍，中继不缓存）
+//   flags 0x0001：ts 为服务器时钟；0x0002：校验片（type 2，见 UdpMediaClient 的 FEC），中继不缓存
+// ===============================================
+
+class UdpRelay;
+
+// IPv4 端点（主机字节序）
+struct RelayAddr {
+    quint32 ip = 0;
+    quint16 port = 0;
+    bool operator==(const RelayAddr& o) const { return ip == o.ip && port == o.port; }
+    bool operator!=(const RelayAddr& o) const { return !(*this == o); }
+};
+
+// 预先算好的转发目的地
+struct RelayDest {
+    RelayAddr addr;
+    quint32 stream = 0; // 该接收者自己的流 id，用于跳过发送者本人
+#ifdef Q_OS_UNIX
+    sockaddr_in sa;
+#endif
+    static RelayDest make(const RelayAddr& a, quint32 stream = 0);
+};
+using RelayDestList = QSharedPointer<const QVector<RelayDest>>;
+
+// 所有工作线程共享的房间表：读多写少，转发按接收批次加一次读锁，注册/清理加写锁
+// 房间/用户键为注册包里 QDataStream 编码的 roomId / user 原始字节（不含长度前缀）
+struct RelayTable {
+    struct Peer {
+        RelayAddr addr;
+        quint32 stream = 0;
+        qint64 lastSeen = 0;
+    };
+    struct Room {
+        quint32 id = 0;
+        QHash<QByteArray, Peer> peers;
+        RelayDestList dests; // 未超时的接收者；只整体替换，持有者可在锁外继续使用旧数组
+    };
+    // 流 id -> 转发路由
+    struct Route {
+        quint32 room = 0;
+        RelayAddr owner;     // 只接受注册地址发来的分片
+        RelayDestList dests;
+    };
+
+    mutable QReadWriteLock lock;
+    QHash<QByteArray, Room> rooms;
+    QHash<quint32, Route> routes;
+
+    // 以下在写锁内调用
+    quint32 allocId();
+    // 按 lastSeen 重建目的地数组，并同步到房间内各流的路由
+    void rebuild(Room& r, qint64 now);
+
+    static constexpr qint64 kPeerStaleMs  = 10000; // 超过该时长未注册不再转发给它
+    static constexpr qint64 kPeerExpireMs = 15000; // 超过该时长从房间移除
+
+private:
+    quint32 nextId_ = 0;
+};
+
+// 数据报头部视图；room/user 为接收缓冲的只读切片
+struct RelayDatagram {
+    quint8  ver = 0;
+    quint8  type = 0;
+    quint16 flags = 0;
+    QByteArray room;   // type 1
+    QByteArray user;   // type 1
+    quint32 stream = 0; // type 2 / 9
+    quint32 fid = 0;
+    quint16 idx = 0, cnt = 0;
+    quint8  codec = 0;
+    quint32 reporter = 0;           // type 7 / 8
+    quint16 nackCount = 0;          // type 6：缺失分片数
+    const uchar* nackIdx = nullptr; // type 6：缺失分片序号（大端 u16 数组，指向接收缓冲）
+
+    static bool parse(const char* d, int len, RelayDatagram& out);
+
+    static constexpr quint32 kMagic = 0x55444D31; // 'UDM1'
+    enum : quint8 { kVersion = 3 };
+    enum : quint8 { kRegister = 1, kChunk = 2, kRegisterAck = 3, kRoster = 4, kUnknownStream = 5,
+                    kNack = 6, kReport = 7, kKeyRequest = 8, kAudio = 9 };
+    enum : quint16 { kFlagParity = 0x0002 };
+    static constexpr int kHeaderSize = 8;
+    static constexpr int kChunkHeaderSize = 29;
+    static constexpr int kAudioHeaderSize = 21;
+};
+
+// 各工作线程的累计计数：热路径先记在批次局部变量里，批次结束后原子累加一次
+struct RelayCounters {
+    QAtomicInteger<quint64> rxDatagrams{0};
+    QAtomicInteger<quint64> rxBytes{0};
+    QAtomicInteger<quint64> recvCalls{0};     // recvmmsg/recvfrom 调用次数
+    QAtomicInteger<quint64> sendCalls{0};     // sendmmsg/sendto 调用次数
+    QAtomicInteger<quint64> badHeader{0};
+    QAtomicInteger<quint64> registers{0};
+    QAtomicInteger<quint64> forwarded{0};     // 成功转发的数据报（按接收者计）
+    QAtomicInteger<quint64> forwardedBytes{0};
+    QAtomicInteger<quint64> sendFailed{0};    // 内核发送缓冲满等
+    QAtomicInteger<quint64> noRoute{0};       // 流 id 未注册或来源地址不符
+    QAtomicInteger<quint64> cacheReplayed{0}; // 新接收者注册时补发的缓存数据报
+    QAtomicInteger<quint64> cacheFull{0};     // 房间缓存达上限或增量帧过多，关键帧链被截断的次数
+    QAtomicInteger<quint64> nacks{0};         // 收到的有效 NACK
+    QAtomicInteger<quint64> rtxSent{0};       // 按 NACK 补发的分片
+    QAtomicInteger<quint64> rtxMiss{0};       // NACK 要的分片已不在缓存里
+    QAtomicInteger<quint64> reports{0};       // 转给发送端的接收报告
+    QAtomicInteger<quint64> keyRequests{0};   // 转给发送端的关键帧请求（含链不完整时中继替新接收者发的）
+    QAtomicInteger<quint64> audio{0};         // 收到的音频帧
+    QAtomicInteger<quint64> injectedDrops{0}; // 丢包注入（--udp-drop）丢掉的数据报
+};
+
+// 一条待处理的 NACK：请求者已在房间内校验过
+struct RelayNack {
+    quint32 stream = 0;
+    quint32 fid = 0;
+    QVector<quint16> idx; // 空 = 整帧
+    RelayDest dest;
+};
+
+// 单个工作线程：一个 socket、一个收发批次、本线程收到的发送者的关键帧缓存与重传缓存
+class UdpRelayWorker : public QObject {
+    Q_OBJECT
+public:
+    UdpRelayWorker(UdpRelay* relay, RelayTable* table, int index);
+    ~UdpRelayWorker();
+
+    // 主线程、线程启动前调用
+    bool open(quint16 port, bool reusePort, QString* error);
+    // 测试用：随机丢弃该比例（0~1）的出向数据报，模拟有损链路；
+    // burst > 1 时按 Gilbert–Elliott 两状态模型成串丢弃，平均串长为 burst
+    void setDropRate(double rate, double burst = 1.0);
+    const RelayCounters& counters() const { return counters_; }
+    qint64 cacheBytes() const { return cacheBytes_.load(); }
+
+    qint64 rtxBytes() const { return rtxBytes_.load(); }
+
+    // 以下在本工作线程内调用
+    void replayTo(quint32 room, quint32 stream, const RelayAddr& addr);
+    // 该流的分片不在本线程（发送者落在别的 socket 上）时返回 false
+    bool serveNack(const RelayNack& n);
+
+public slots:
+    void onThreadStarted();
+
+private slots:
+    void onReadable();
+    void onCleanup();
+    void onReplayTick();
+
+private:
+    struct Slot {
+        char data[2048];
+        int len = 0;       // < 0 表示截断，丢弃
+        RelayAddr from;
+    };
+    // 待发送：数据 + 目的地（目的地数组由调用方在发送期间持有）
+    struct Out {
+        const char* data;
+        int len;
+        const RelayDest* dest;
+    };
+    // 迟到者快速起播：最近一个屏幕关键帧及其后的增量帧（原始数据报，按到达顺序）
+    struct KeyCache {
+        quint32 keyFid = 0;
+        quint32 lastFid = 0;
+        int deltaFrames = 0;         // 链上的增量帧数
+        bool haveKey = false;
+        bool full = false;           // 房间上限已满或增量帧过多：链已不完整，新接收者改为请求关键帧
+        QVector<QByteArray> datagrams;
+        qint64 bytes = 0;
+        qint64 lastMs = 0;
+    };
+    struct RoomCache {
+        QHash<quint32, KeyCache> senders; // 流 id -> 缓存
+        qint64 bytes = 0;
+    };
+    // 重传缓存：每个发送者最近 kRtxMaxAgeMs 内的帧，按帧号升序
+    struct RtxFrame {
+        quint32 fid = 0;
+        qint64 ms = 0;
+        qint64 bytes = 0;
+        QVector<QByteArray> chunks; // 按 idx
+    };
+    struct RtxStream {
+        QVector<RtxFrame> frames;
+        qint64 bytes = 0;
+    };
+    // 排队中的补发：按节拍分批发给一个新接收者，不一次灌进它的下行
+    struct ReplayJob {
+        RelayDest dest;
+        QVector<QByteArray> datagrams; // 与 KeyCache 隐式共享
+        int next = 0;
+    };
+    struct Register {
+        QByteArray room;
+        QByteArray user;
+        RelayAddr addr;
+    };
+    // 锁内生成、锁外发送的控制数据报（注册应答、成员表、未知流）
+    struct Reply {
+        RelayDest dest;
+        QByteArray data;
+    };
+
+    int recvBatch();
+    int sendBatch(const Out* outs, int n, quint64* bytes);
+    void processBatch(int n);
+    void handleRegisters(const QVector<Register>& regs);
+    void sendReplies(const QVector<Reply>& replies);
+    void cacheChunk(quint32 room, const RelayDatagram& dg, const char* data, int len, qint64 now);
+    void cacheForRetransmit(const RelayDatagram& dg, const QByteArray& d, qint64 now);
+    void trimRetransmit(RtxStream& rs, qint64 now);
+
+    UdpRelay* relay_{nullptr};
+    RelayTable* table_{nullptr};
+    int index_{0};
+#ifdef Q_OS_UNIX
+    int fd_{-1};
+    QSocketNotifier* notifier_{nullptr};
+#else
+    QUdpSocket* sock_{nullptr};
+#endif
+    QTimer* cleanup_{nullptr};
+    std::vector<Slot> slots_;
+    std::vector<Out> outs_;
+    QHash<quint32, RoomCache> keyCache_; // 房间 id -> 各发送者缓存
+    QTimer* replayTimer_{nullptr};
+    QVector<ReplayJob> replays_;
+    QAtomicInteger<qint64> cacheBytes_{0};
+    QHash<quint32, RtxStream> rtx_;      // 流 id -> 重传缓存
+    QAtomicInteger<qint64> rtxBytes_{0};
+    quint32 dropThreshold_{0};           // 0 = 不注入丢包；成串模式下为 好->坏 的转移阈值
+    quint32 dropLeaveThreshold_{0};      // 0 = 独立丢包；否则为 坏->好 的转移阈值
+    bool dropBad_{false};                // 成串模式：当前处于丢包状态
+    quint32 dropRng_{0x9E3779B9u};
+    RelayCounters counters_;
+
+    static constexpr int kBatch       = 64;   // 一次 recvmmsg 最多收多少个
+    static constexpr int kSendBatch   = 256;  // 一次 sendmmsg 最多发多少个
+    static constexpr int kMaxRounds   = 8;    // 一次可读回调最多连收几批，避免饿死定时器
+    static constexpr int kSocketBuf   = 4 * 1024 * 1024;
+    static constexpr quint8  kCodecJpeg = 0;       // 关键帧；1 为增量帧（DS02）
+    static constexpr quint8  kCodecCamera = 2;     // 摄像头帧：帧号与屏幕帧各自编号，不能进同一个缓存
+    static constexpr qint64  kRoomCacheBytes = 8 * 1024 * 1024;
+    static constexpr qint64  kCacheMaxAgeMs = 3000; // 超过该时长没有新数据的发送者视为已停止共享
+    static constexpr int     kMaxChainFrames = 60;  // 关键帧后最多缓存几个增量帧；关键帧间隔长达 10~30s，再多不如请求新关键帧
+    static constexpr int     kReplayTickMs = 5;
+    static constexpr int     kReplayPerTick = 8;    // 每个接收者每拍补发几个数据报（约 15 Mbit/s）
+    static constexpr qint64  kRtxMaxAgeMs = 1000;   // 超过该时长的帧接收端早已放弃，不再补发
+    static constexpr qint64  kRtxStreamBytes = 4 * 1024 * 1024;
+    static constexpr int     kMaxNackIdx = 512;
+};
 
 class UdpRelay : public QObject {
     Q_OBJECT
 public:
-    explicit UdpRelay(QObject* parent=nullptr);
+    // workers <= 0：Linux 上取 min(4, CPU 核数)，其他平台 1
+    explicit UdpRelay(int workers = 0, QObject* parent=nullptr);
+    ~UdpRelay();
 
     bool start(quint16 port);
+    // 测试用：出向数据报按该百分比随机丢弃；burst > 1 时成串丢弃（平均串长）。需在 start() 之前调用
+    void setDropPercent(double percent, double burst = 1.0) { dropPercent_ = percent; dropBurst_ = burst; }
     quint16 port() const { return port_; }
+    int workers() const { return workers_.size(); }
+
+    // 指标快照（主线程调用）
+    QJsonObject stats() const;
+
+    // 工作线程调用：新接收者注册后让所有工作线程补发各自缓存的关键帧链（链不完整的改为请求关键帧）
+    void requestReplay(quint32 room, quint32 stream, const RelayAddr& addr);
+    // 工作线程调用：本线程没有该流的重传缓存，转给其他工作线程
+    void forwardNack(const UdpRelayWorker* from, const RelayNack& n);
 
 private slots:
-    void onReadyRead();
     void onCleanup();
 
 private:
-    struct Peer {
-        QHostAddress addr;
-        quint16 port=0;
-        qint64 lastSeen=0;
-    };
-    // roomId -> user -> Peer
-    QHash<QString, QHash<QString, Peer>> rooms_;
-    QUdpSocket sock_;
+    RelayTable table_;
+    QVector<UdpRelayWorker*> workers_;
+    QVector<QThread*> threads_;
+    int wantWorkers_{1};
+    double dropPercent_{0.0};
+    double dropBurst_{1.0};
     quint16 port_{0};
     QTimer cleanup_;
-
-    // 统一的头部解析：三个参数（引用）
-    static bool parseHeader(QDataStream& ds, quint8& ver, quint8& type);
-
-    static constexpr quint32 kMagic = 0x55444D31; // 'UDM1'
+    QAtomicInteger<quint64> stalePeers_{0}; // 超时被移出房间的接收者
 };